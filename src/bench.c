@@ -0,0 +1,1297 @@
+/* JACK MIDI LOOPER
+Copyright (C) 2014  Joshua Otto
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+/* Offline benchmark for the engine.  Drives engine_process (control input
+   and every loop_process_callback) against the stub libjack with synthetic
+   MIDI, so the numbers are repeatable without a JACK server.  See `make bench`. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <jack/jack.h>
+#include <jack/midiport.h>
+
+#include "capture_ring.h"
+#include "control_action_table.h"
+#include "control_dispatch.h"
+#include "dsp_stats.h"
+#include "engine.h"
+#include "journal.h"
+#include "loop.h"
+#include "rt_log.h"
+#include "segment_pool.h"
+#include "midi_file.h"
+#include "session.h"
+#include "stub_jack.h"
+#include "trace.h"
+#include "transport_grid.h"
+
+#define NOTE_ON 0x90
+#define CONTROL_CHANGE 0xB0
+
+// Every loop gets its own control note, so this is as many as can be mapped.
+#define BENCH_MAX_LOOPS ( 16 * 128 )
+
+/* The bench cycles far faster than real time, so the journal's rings need
+   room for a good many more cycles between drains than JACK would run. */
+#define BENCH_JOURNAL_RECORDS ( 64 * 1024 )
+
+// The looper's defaults, which the bench raises to however many loops are active.
+#define BENCH_POOL_LOW_WATERMARK 16
+#define BENCH_POOL_HIGH_WATERMARK 64
+
+/* A tempo whose beat isn't a whole number of frames at 48 kHz, so grid points
+   have to be rounded. */
+#define BENCH_QUANTIZE_BPM 130.0
+
+// Grid points may be rounded to the nearest frame, but no further than that.
+#define BENCH_QUANTIZE_MAX_ERROR 1.0
+
+/* ----------------------------------------------------
+   Allocation counting - the bench links with
+   -Wl,--wrap for each of these.
+   ---------------------------------------------------- */
+
+void *__real_malloc( size_t size );
+void *__real_calloc( size_t count, size_t size );
+void *__real_realloc( void *pointer, size_t size );
+
+struct AllocationCounts {
+    unsigned long total;
+    unsigned long long bytes;
+    unsigned long in_process; // Made by the process callback itself, or the engine's workers.
+};
+
+static struct AllocationCounts allocation_counts = { 0, 0, 0 };
+
+// The stub runs the process callback on the driving thread, between these.
+static pthread_t process_thread;
+static int in_process = 0;
+
+static void count_allocation( size_t size )
+{
+    __atomic_add_fetch( &allocation_counts.total, 1, __ATOMIC_RELAXED );
+    __atomic_add_fetch( &allocation_counts.bytes, size, __ATOMIC_RELAXED );
+    if(
+        __atomic_load_n( &in_process, __ATOMIC_RELAXED )
+        && ( pthread_equal( pthread_self(), process_thread ) || stub_jack_is_client_thread() )
+    ) {
+        __atomic_add_fetch( &allocation_counts.in_process, 1, __ATOMIC_RELAXED );
+    }
+}
+
+static void read_allocation_counts( struct AllocationCounts *counts )
+{
+    counts->total = __atomic_load_n( &allocation_counts.total, __ATOMIC_RELAXED );
+    counts->bytes = __atomic_load_n( &allocation_counts.bytes, __ATOMIC_RELAXED );
+    counts->in_process = __atomic_load_n( &allocation_counts.in_process, __ATOMIC_RELAXED );
+}
+
+void *__wrap_malloc( size_t size )
+{
+    count_allocation( size );
+    return __real_malloc( size );
+}
+
+void *__wrap_calloc( size_t count, size_t size )
+{
+    count_allocation( count * size );
+    return __real_calloc( count, size );
+}
+
+void *__wrap_realloc( void *pointer, size_t size )
+{
+    count_allocation( size );
+    return __real_realloc( pointer, size );
+}
+
+/* ----------------------------------------------------
+   Setup
+   ---------------------------------------------------- */
+
+struct BenchOptions {
+    int loops;
+    int active;        // Loops getting any input or toggles, the rest sit idle.
+    int sweep;         // Times loop counts from 1 up to this instead, if set.
+    int events;        // Per loop per cycle.
+    int toggle_cycles; // Cycles between recording toggles, 0 for never.
+    int cycles;
+    int warmup_cycles;
+    int midi_through;
+    int lookups;       // Runs the dispatch microbenchmark instead, if set.
+    int quantize_takes; // Runs the quantize check over this many takes instead, if set.
+    int workers;       // See engine_set_workers.
+    int check_workers; // Compares the output with workers against none instead, if set.
+    int shared_input;  // Active loops all take the same input from the shared input bus.
+    int shared_output; // Every loop plays into the shared output bus instead of its own port.
+    const char *session_path; // Saves the loops there after the run and loads them back, if set.
+    const char *import_path;  // Writes a MIDI file there after the run and imports it, if set.
+    const char *journal_path; // Journals the run there, then recovers the loops from it, if set.
+    jack_nframes_t buffer_size;
+    jack_nframes_t sample_rate;
+};
+
+struct Bench {
+    jack_client_t *client;
+    Engine engine;
+    SegmentPool segment_pool;
+    ControlActionTable action_table;
+    Journal journal;
+
+    Loop *loops;
+    jack_port_t **inputs;
+    jack_port_t **outputs;
+    jack_port_t *control_input;
+    jack_port_t *shared_input;
+    jack_port_t *shared_output;
+
+    int workers; // Actually started, which may be fewer than asked for.
+    unsigned long rt_errors;
+};
+
+static int process( jack_nframes_t nframes, void *arg )
+{
+    return engine_process( arg, nframes );
+}
+
+static int name_loop( unsigned int loop_id, char *name_out, size_t size, void *user_data )
+{
+    snprintf( name_out, size, "with id %u", loop_id );
+    return 0;
+}
+
+static void count_rt_error( const char *message, void *user_data )
+{
+    struct Bench *bench = user_data;
+    __atomic_add_fetch( &bench->rt_errors, 1, __ATOMIC_RELAXED );
+}
+
+static int bench_setup( struct Bench *bench, const struct BenchOptions *options )
+{
+    bench->client = stub_jack_client_new( options->sample_rate, options->buffer_size );
+    bench->engine = engine_new( bench->client );
+    if( bench->engine == NULL ) {
+        return -10;
+    }
+    jack_set_process_callback( bench->client, process, bench->engine );
+    bench->workers = engine_set_workers( bench->engine, options->workers, 1 );
+
+    /* Every active loop is toggled in the same cycle, so their takes all
+       need a new segment in the same cycle too, with the allocator thread
+       getting no chance in between. */
+    int burst = options->active > BENCH_POOL_LOW_WATERMARK ? options->active : BENCH_POOL_LOW_WATERMARK;
+    bench->segment_pool = segment_pool_new( burst, BENCH_POOL_HIGH_WATERMARK + burst );
+    if( bench->segment_pool == NULL ) {
+        return -20;
+    }
+
+    bench->action_table = control_action_table_new( NULL );
+    bench->control_input = stub_jack_port_by_name( bench->client, "control input" );
+    bench->shared_input = stub_jack_port_by_name( bench->client, "shared input" );
+    bench->shared_output = stub_jack_port_by_name( bench->client, "shared output" );
+
+    bench->journal = NULL;
+    if( options->journal_path ) {
+        unlink( options->journal_path );
+        bench->journal = journal_new( options->journal_path, options->sample_rate, BENCH_JOURNAL_RECORDS );
+        if( bench->journal == NULL ) {
+            return -25;
+        }
+    }
+
+    bench->loops = malloc( options->loops * sizeof( Loop ) );
+    bench->inputs = malloc( options->loops * sizeof( jack_port_t * ) );
+    bench->outputs = malloc( options->loops * sizeof( jack_port_t * ) );
+
+    for( int i = 0; i < options->loops; i++ ) {
+        char name[32], port_name[64];
+        sprintf( name, "%d", i );
+
+        int status = loop_new(
+            &bench->loops[i],
+            bench->client,
+            strdup( name ),
+            options->midi_through,
+            1,
+            bench->segment_pool,
+            0
+        );
+        if( status != 0 ) {
+            return -30;
+        }
+        if( bench->journal ) {
+            loop_set_journal( bench->loops[i], journal_ring_new( bench->journal, loop_get_id( bench->loops[i] ) ) );
+        }
+
+        control_action_table_insert(
+            bench->action_table,
+            i / 128,
+            TYPE_NOTE_ON,
+            i % 128,
+            bench->loops[i],
+            LOOP_CONTROL_FUNC_TOGGLE_RECORDING
+        );
+
+        if( options->shared_input && i < options->active ) {
+            loop_set_input_source( bench->loops[i], INPUT_BUS_ALL_CHANNELS );
+        }
+        if( options->shared_output ) {
+            loop_set_output_target( bench->loops[i], OUTPUT_BUS_KEEP_CHANNEL );
+        }
+
+        sprintf( port_name, "loop_%s_input", name );
+        bench->inputs[i] = stub_jack_port_by_name( bench->client, port_name );
+        sprintf( port_name, "loop_%s_output", name );
+        bench->outputs[i] = stub_jack_port_by_name( bench->client, port_name );
+    }
+
+    if( bench->journal ) {
+        journal_log_loops( bench->journal, bench->loops, options->loops );
+    }
+
+    // The engine owns what it's given.
+    Loop *published = malloc( options->loops * sizeof( Loop ) );
+    memcpy( published, bench->loops, options->loops * sizeof( Loop ) );
+    engine_publish(
+        bench->engine,
+        published,
+        options->loops,
+        control_dispatch_build( bench->action_table )
+    );
+
+    bench->rt_errors = 0;
+    rt_log_start_drain( name_loop, count_rt_error, bench );
+    return 0;
+}
+
+static void bench_teardown( struct Bench *bench, const struct BenchOptions *options )
+{
+    rt_log_stop_drain();
+    engine_free( bench->engine );
+
+    // Unlinks itself from the loops, so it has to go first.
+    control_action_table_free( bench->action_table );
+
+    for( int i = 0; i < options->loops; i++ ) {
+        free( (char *) loop_get_name( bench->loops[i] ) );
+        loop_free( bench->loops[i] );
+    }
+    free( bench->loops );
+    free( bench->inputs );
+    free( bench->outputs );
+
+    segment_pool_free( bench->segment_pool );
+    stub_jack_client_free( bench->client );
+    journal_free( bench->journal );
+}
+
+/* ----------------------------------------------------
+   Driving
+   ---------------------------------------------------- */
+
+// Fills the ports for one cycle, returning the number of events queued.
+static unsigned long queue_cycle_input( struct Bench *bench, const struct BenchOptions *options, int cycle )
+{
+    unsigned long queued = 0;
+
+    if( options->toggle_cycles && cycle % options->toggle_cycles == 0 ) {
+        for( int i = 0; i < options->active; i++ ) {
+            jack_midi_data_t toggle[3] = { NOTE_ON | ( i / 128 ), i % 128, 100 };
+            queued += stub_jack_port_push_event( bench->control_input, 0, toggle, 3 ) == 0;
+        }
+    }
+
+    /* Spread evenly over the cycle, with the value changing so nothing is
+       constant.  Every active loop gets the same input, either a copy of it
+       on its own port or all of them the one on the shared input. */
+    jack_nframes_t spacing = options->buffer_size / ( options->events + 1 );
+    int ports = options->shared_input ? 1 : options->active;
+    for( int i = 0; i < ports; i++ ) {
+        jack_port_t *port = options->shared_input ? bench->shared_input : bench->inputs[i];
+        for( int k = 0; k < options->events; k++ ) {
+            jack_midi_data_t message[3] = { CONTROL_CHANGE, 1, ( cycle + k ) & 0x7f };
+            queued += stub_jack_port_push_event( port, ( k + 1 ) * spacing, message, 3 ) == 0;
+        }
+    }
+
+    return queued;
+}
+
+static unsigned long count_cycle_output( struct Bench *bench, const struct BenchOptions *options )
+{
+    if( options->shared_output ) {
+        return jack_midi_get_event_count( bench->shared_output );
+    }
+
+    unsigned long written = 0;
+    for( int i = 0; i < options->loops; i++ ) {
+        written += jack_midi_get_event_count( bench->outputs[i] );
+    }
+    return written;
+}
+
+struct EngineRun {
+    uint64_t elapsed; // Measured cycles only.
+    unsigned long events_in;
+    unsigned long events_out;
+    struct AllocationCounts run_start;
+    struct AllocationCounts run_end;
+};
+
+static void drive_engine( struct Bench *bench, const struct BenchOptions *options, struct EngineRun *run )
+{
+    unsigned long events_in = 0, events_out = 0;
+    uint64_t elapsed = 0;
+    struct AllocationCounts run_start, run_end;
+
+    process_thread = pthread_self();
+    read_allocation_counts( &run_start );
+
+    // Warmup cycles get the first takes recorded and the caches warm.
+    for( int cycle = 0; cycle < options->warmup_cycles + options->cycles; cycle++ ) {
+        int measured = cycle >= options->warmup_cycles;
+        if( cycle == options->warmup_cycles ) {
+            read_allocation_counts( &run_start );
+        }
+
+        stub_jack_begin_cycle( bench->client );
+        unsigned long queued = queue_cycle_input( bench, options, cycle );
+
+        __atomic_store_n( &in_process, 1, __ATOMIC_RELAXED );
+        uint64_t start = dsp_stats_clock();
+
+        stub_jack_run_cycle( bench->client );
+
+        uint64_t end = dsp_stats_clock();
+        __atomic_store_n( &in_process, 0, __ATOMIC_RELAXED );
+
+        if( measured ) {
+            elapsed += end - start;
+            events_in += queued;
+            events_out += count_cycle_output( bench, options );
+        }
+    }
+
+    read_allocation_counts( &run_end );
+
+    run->elapsed = elapsed;
+    run->events_in = events_in;
+    run->events_out = events_out;
+    run->run_start = run_start;
+    run->run_end = run_end;
+}
+
+static void run_engine_benchmark( struct Bench *bench, const struct BenchOptions *options )
+{
+    printf(
+        "%d loops (%d active%s%s), %d workers, %d events/loop/cycle, toggling every %d cycles, through %s, %u frames at %u Hz\n",
+        options->loops,
+        options->active,
+        options->shared_input ? ", on the shared input" : "",
+        options->shared_output ? ", all on the shared output" : "",
+        bench->workers,
+        options->events,
+        options->toggle_cycles,
+        options->midi_through ? "on" : "off",
+        options->buffer_size,
+        options->sample_rate
+    );
+
+    struct EngineRun run;
+    drive_engine( bench, options, &run );
+    uint64_t elapsed = run.elapsed;
+    unsigned long events_in = run.events_in, events_out = run.events_out;
+    struct AllocationCounts run_start = run.run_start, run_end = run.run_end;
+
+    struct EngineDspSummary summary;
+    engine_get_dsp_summary( bench->engine, &summary );
+
+    /* As JACK would count it for this client alone - the stub has no graph,
+       so the per-port cost on JACK's side of things isn't in here. */
+    double period_ns = 1e9 * options->buffer_size / options->sample_rate;
+    printf(
+        "%d cycles: %.1f ns/cycle (%.2f%% DSP load, p99 %u ns over the last %d), %.2f ns/event (%lu in, %lu out)\n",
+        options->cycles,
+        (double) elapsed / options->cycles,
+        100.0 * elapsed / options->cycles / period_ns,
+        summary.cycle.p99,
+        DSP_STATS_WINDOW,
+        events_in + events_out ? (double) elapsed / ( events_in + events_out ) : 0.0,
+        events_in,
+        events_out
+    );
+    // The total includes the segment allocator thread refilling the pool.
+    printf(
+        "allocations: %lu in the process callback, %lu in total (%llu bytes), pool at %zu segments\n",
+        run_end.in_process - run_start.in_process,
+        run_end.total - run_start.total,
+        run_end.bytes - run_start.bytes,
+        segment_pool_available( bench->segment_pool )
+    );
+}
+
+/* Cycle cost against the number of loops, doubling each time, with the
+   same number of them active throughout - so what's left is the cost of
+   getting past the idle ones. */
+static int run_sweep_benchmark( const struct BenchOptions *options )
+{
+    double active_ns = 0.0;
+    for( int loops = options->active; loops <= options->sweep; loops *= 2 ) {
+        struct BenchOptions sweep_options = *options;
+        sweep_options.loops = loops;
+
+        struct Bench bench;
+        if( bench_setup( &bench, &sweep_options ) != 0 ) {
+            fprintf( stderr, "Bench setup failed at %d loops.\n", loops );
+            return -1;
+        }
+
+        if( loops == options->active ) {
+            printf(
+                "%d active loops, %d workers, %d events/loop/cycle, through %s, %u frames at %u Hz\n"
+                "%8s %14s %14s %10s\n",
+                options->active,
+                bench.workers,
+                options->events,
+                options->midi_through ? "on" : "off",
+                options->buffer_size,
+                options->sample_rate,
+                "loops", "ns/cycle", "ns/idle loop", "p99 ns"
+            );
+        }
+
+        struct EngineRun run;
+        drive_engine( &bench, &sweep_options, &run );
+        struct EngineDspSummary summary;
+        engine_get_dsp_summary( bench.engine, &summary );
+        bench_teardown( &bench, &sweep_options );
+
+        double cycle_ns = (double) run.elapsed / options->cycles;
+        if( loops == options->active ) {
+            active_ns = cycle_ns;
+        }
+        printf(
+            "%8d %14.1f %14.2f %10u\n",
+            loops,
+            cycle_ns,
+            loops > options->active ? ( cycle_ns - active_ns ) / ( loops - options->active ) : 0.0,
+            summary.cycle.p99
+        );
+    }
+
+    return 0;
+}
+
+// Everything every loop played this cycle, by loop index, since ids differ from one setup to the next.
+static uint64_t hash_cycle_output( struct Bench *bench, const struct BenchOptions *options )
+{
+    uint64_t hash = trace_hash_port( 0, 0, jack_port_get_buffer( bench->shared_output, options->buffer_size ) );
+    for( int i = 0; i < options->loops; i++ ) {
+        hash = trace_hash_port( hash, i + 1, jack_port_get_buffer( bench->outputs[i], options->buffer_size ) );
+    }
+    return hash;
+}
+
+/* Toggles each loop on a period of its own, so that takes come out at
+   different lengths and a master and its slave sometimes end theirs in the
+   same cycle, which is when the order they're processed in shows. */
+static void queue_staggered_toggles( struct Bench *bench, const struct BenchOptions *options, int cycle )
+{
+    if( options->toggle_cycles == 0 ) {
+        return;
+    }
+    for( int i = 0; i < options->active; i++ ) {
+        int period = options->toggle_cycles / 2 + options->toggle_cycles * ( i % 3 ) / 4;
+        if( period && cycle % period == 0 ) {
+            jack_midi_data_t toggle[3] = { NOTE_ON | ( i / 128 ), i % 128, 100 };
+            stub_jack_port_push_event( bench->control_input, ( i * 7 ) % options->buffer_size, toggle, 3 );
+        }
+    }
+}
+
+/* Plays the same input through the loops with no workers and then with
+   options->workers, three loops in every four synced in chains, and
+   compares what they played cycle by cycle.  Returns non-zero if any cycle
+   differs, or fewer workers started than asked for. */
+static int run_worker_check( const struct BenchOptions *options )
+{
+    int cycles = options->warmup_cycles + options->cycles;
+    uint64_t *hashes[2] = { malloc( cycles * sizeof( uint64_t ) ), malloc( cycles * sizeof( uint64_t ) ) };
+    int started = 0;
+    int masters = ( options->loops + 3 ) / 4;
+
+    for( int run = 0; run < 2; run++ ) {
+        struct BenchOptions run_options = *options;
+        run_options.workers = run ? options->workers : 0;
+        run_options.toggle_cycles = 0;
+
+        struct Bench bench;
+        if( bench_setup( &bench, &run_options ) != 0 ) {
+            fprintf( stderr, "Bench setup failed.\n" );
+            return -1;
+        }
+        if( run ) {
+            started = bench.workers;
+        }
+
+        /* Chains of slaves, each a quarter of the loops away from its master
+           so that the two land in different chunks. */
+        for( int i = 0; i < options->loops; i++ ) {
+            loop_set_sync_master( bench.loops[i], i >= masters ? bench.loops[i - masters] : NULL );
+        }
+        Loop *published = malloc( options->loops * sizeof( Loop ) );
+        memcpy( published, bench.loops, options->loops * sizeof( Loop ) );
+        engine_publish( bench.engine, published, options->loops, control_dispatch_build( bench.action_table ) );
+
+        for( int cycle = 0; cycle < cycles; cycle++ ) {
+            stub_jack_begin_cycle( bench.client );
+            queue_cycle_input( &bench, &run_options, cycle );
+            queue_staggered_toggles( &bench, options, cycle );
+            stub_jack_run_cycle( bench.client );
+            hashes[run][cycle] = hash_cycle_output( &bench, &run_options );
+        }
+
+        bench_teardown( &bench, &run_options );
+    }
+
+    int first = -1, differing = 0;
+    for( int cycle = 0; cycle < cycles; cycle++ ) {
+        if( hashes[0][cycle] != hashes[1][cycle] ) {
+            first = first < 0 ? cycle : first;
+            differing++;
+        }
+    }
+    free( hashes[0] );
+    free( hashes[1] );
+
+    printf( "%d loops, %d of them synced, on %d workers against none over %d cycles: ", options->loops, options->loops - masters, started, cycles );
+    if( differing ) {
+        printf( "%d cycles played differently, the first being %d\n", differing, first );
+    } else {
+        printf( "played the same\n" );
+    }
+    return differing != 0 || started != options->workers;
+}
+
+// How far frame is from the nearest exact beat, with the bar line on transport frame 0.
+static double beat_error( uint64_t frame, double frames_per_beat )
+{
+    uint64_t beat = (uint64_t) ( frame / frames_per_beat + 0.5 );
+    double error = frame - beat * frames_per_beat;
+    return error < 0 ? -error : error;
+}
+
+/* One cycle of the quantize check.  Every cycle starts with a controller
+   message on the loop's input that says which cycle it is, so the first
+   one in a take gives away the frame the take started on. */
+static void run_quantize_cycle(
+        jack_client_t *client,
+        Engine engine,
+        Loop loop,
+        uint64_t cycle,
+        int command,
+        jack_nframes_t offset
+    ) {
+
+    stub_jack_begin_cycle( client );
+    jack_midi_data_t marker[3] = { CONTROL_CHANGE, ( cycle >> 7 ) & 0x7f, cycle & 0x7f };
+    stub_jack_port_push_event( loop_get_input_port( loop ), 0, marker, 3 );
+    if( command >= 0 ) {
+        jack_nframes_t frame = jack_last_frame_time( client ) + offset;
+        engine_queue_command( engine, loop_get_id( loop ), command, jack_frames_to_time( client, frame ) );
+    }
+    stub_jack_run_cycle( client );
+}
+
+/* Records takes of random lengths, started and ended at random frames, with
+   the loop quantized to the beat and the transport rolling at a tempo whose
+   beat isn't a whole number of frames.  Every take has to start and end
+   within BENCH_QUANTIZE_MAX_ERROR of an exact beat, however far into the run
+   it is.  Returns non-zero if any doesn't. */
+static int run_quantize_check( const struct BenchOptions *options )
+{
+    jack_client_t *client = stub_jack_client_new( options->sample_rate, options->buffer_size );
+    Engine engine = engine_new( client );
+    SegmentPool pool = segment_pool_new( 16, 64 );
+    Loop loop;
+    if( engine == NULL || pool == NULL || loop_new( &loop, client, "quantize", 0, 1, pool, 0 ) != 0 ) {
+        fprintf( stderr, "Quantize check setup failed.\n" );
+        return -1;
+    }
+    jack_set_process_callback( client, process, engine );
+
+    loop_set_quantize( loop, QUANTIZE_BEAT );
+    Loop *published = malloc( sizeof( Loop ) );
+    published[0] = loop;
+    engine_publish( engine, published, 1, NULL );
+
+    // Rolling from frame 0, which is where the engine's frame clock starts too.
+    jack_position_t position;
+    memset( &position, 0, sizeof( position ) );
+    position.valid = JackPositionBBT;
+    position.beats_per_minute = BENCH_QUANTIZE_BPM;
+    position.beats_per_bar = 4;
+    position.beat_type = 4;
+    position.ticks_per_beat = 1920;
+    stub_jack_set_transport( client, JackTransportRolling, &position );
+
+    double frames_per_beat = 60.0 * options->sample_rate / BENCH_QUANTIZE_BPM;
+    int beat_cycles = (int) ( frames_per_beat / options->buffer_size ) + 2;
+
+    size_t capacity = 4 * 1024;
+    struct PackedMidiMessage *events = malloc( capacity * sizeof( struct PackedMidiMessage ) );
+
+    // Start, end, then stop playing it, each once the last has surely happened.
+    static const int commands[3] = {
+        ENGINE_COMMAND_TOGGLE_RECORDING,
+        ENGINE_COMMAND_TOGGLE_RECORDING,
+        ENGINE_COMMAND_STOP
+    };
+
+    unsigned int seed = 1;
+    uint64_t cycle = 0;
+    double worst_start = 0.0, worst_end = 0.0;
+    int failed = 0, unchecked = 0;
+    for( int take = 0; take < options->quantize_takes; take++ ) {
+        for( int step = 0; step < 3; step++ ) {
+            int wait = beat_cycles + rand_r( &seed ) % 200;
+            for( int i = 0; i < wait; i++ ) {
+                run_quantize_cycle( client, engine, loop, cycle++, -1, 0 );
+            }
+
+            if( step == 2 ) {
+                struct LoopTake info;
+                size_t count = loop_copy_take( loop, events, capacity, &info );
+                if( count == 0 || count > capacity || events[0].status != CONTROL_CHANGE ) {
+                    unchecked++;
+                } else {
+                    // The latest cycle the marker could be from.
+                    uint64_t marked = ( events[0].data[0] << 7 ) | events[0].data[1];
+                    uint64_t marked_cycle = cycle - ( ( cycle - marked ) & 0x3fff );
+                    uint64_t start = marked_cycle * options->buffer_size - events[0].delta;
+                    double start_error = beat_error( start, frames_per_beat );
+                    double end_error = beat_error( start + info.length, frames_per_beat );
+
+                    worst_start = start_error > worst_start ? start_error : worst_start;
+                    worst_end = end_error > worst_end ? end_error : worst_end;
+                    failed += start_error > BENCH_QUANTIZE_MAX_ERROR || end_error > BENCH_QUANTIZE_MAX_ERROR;
+                }
+            }
+
+            jack_nframes_t offset = rand_r( &seed ) % options->buffer_size;
+            run_quantize_cycle( client, engine, loop, cycle++, commands[step], offset );
+        }
+    }
+
+    printf(
+        "quantize: %d takes on the beat at %.0f bpm over %.1f s, worst start %.3f frames and end %.3f frames"
+        " from an exact beat, %d off by more than %.0f, %d not checked\n",
+        options->quantize_takes,
+        BENCH_QUANTIZE_BPM,
+        (double) cycle * options->buffer_size / options->sample_rate,
+        worst_start,
+        worst_end,
+        failed,
+        BENCH_QUANTIZE_MAX_ERROR,
+        unchecked
+    );
+
+    free( events );
+    engine_free( engine );
+    loop_free( loop );
+    segment_pool_free( pool );
+    stub_jack_client_free( client );
+
+    return failed || unchecked;
+}
+
+/* ----------------------------------------------------
+   Dispatch microbenchmark
+   ---------------------------------------------------- */
+
+static unsigned long actions_run = 0;
+
+static void count_action( Loop loop, uint64_t frame )
+{
+    actions_run++;
+}
+
+#define LOOKUP_KEY_COUNT 4096
+
+// Between cold batches, enough is touched to push the tables out of cache.
+#define EVICTION_BYTES ( 16 * 1024 * 1024 )
+#define COLD_BATCH_LOOKUPS 8
+
+struct LookupKey {
+    unsigned char channel;
+    enum MidiControlType type;
+    unsigned char value;
+};
+
+typedef void (*LookupFunc)( void *table, const struct LookupKey *key );
+
+static void table_lookup( void *table, const struct LookupKey *key )
+{
+    control_action_table_invoke( table, key->channel, key->type, key->value, 0 );
+}
+
+static void dispatch_lookup( void *table, const struct LookupKey *key )
+{
+    control_dispatch_invoke( table, key->channel, key->type, key->value, 0 );
+}
+
+// Hot: back to back.  Cold: a few at a time, as from a process cycle, with the cache flushed in between.
+static void time_lookups(
+        const struct BenchOptions *options,
+        const struct LookupKey *keys,
+        LookupFunc lookup,
+        void *table,
+        unsigned char *eviction,
+        double *hot_ns,
+        double *cold_ns
+    ) {
+
+    uint64_t start = dsp_stats_clock();
+    for( int i = 0; i < options->lookups; i++ ) {
+        lookup( table, &( keys[i % LOOKUP_KEY_COUNT] ) );
+    }
+    *hot_ns = (double) ( dsp_stats_clock() - start ) / options->lookups;
+
+    int batches = options->lookups / COLD_BATCH_LOOKUPS / 1000 + 1;
+    uint64_t elapsed = 0;
+    for( int batch = 0; batch < batches; batch++ ) {
+        for( size_t i = 0; i < EVICTION_BYTES; i += 64 ) {
+            eviction[i]++;
+        }
+
+        start = dsp_stats_clock();
+        for( int i = 0; i < COLD_BATCH_LOOKUPS; i++ ) {
+            lookup( table, &( keys[( batch * COLD_BATCH_LOOKUPS + i ) % LOOKUP_KEY_COUNT] ) );
+        }
+        elapsed += dsp_stats_clock() - start;
+    }
+    *cold_ns = (double) elapsed / ( batches * COLD_BATCH_LOOKUPS );
+}
+
+// Times control_dispatch_invoke against the editable table it's built from.
+static void run_dispatch_benchmark( struct Bench *bench, const struct BenchOptions *options )
+{
+    ControlActionTable table = control_action_table_new( NULL );
+    for( int i = 0; i < options->loops; i++ ) {
+        control_action_table_insert( table, i / 128, TYPE_NOTE_ON, i % 128, bench->loops[i], count_action );
+    }
+    ControlDispatch dispatch = control_dispatch_build( table );
+
+    /* Keys anywhere in the space, so most miss - as most control input would.
+       A fixed seed keeps runs comparable. */
+    static struct LookupKey keys[LOOKUP_KEY_COUNT];
+    uint32_t seed = 2463534242u;
+    for( int i = 0; i < LOOKUP_KEY_COUNT; i++ ) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        keys[i].channel = seed & 0xf;
+        keys[i].type = ( seed >> 4 ) & 0x3;
+        keys[i].value = ( seed >> 8 ) & 0x7f;
+    }
+
+    unsigned char *eviction = calloc( EVICTION_BYTES, 1 );
+    double table_hot, table_cold, dispatch_hot, dispatch_cold;
+
+    actions_run = 0;
+    time_lookups( options, keys, table_lookup, table, eviction, &table_hot, &table_cold );
+    unsigned long table_actions = actions_run;
+
+    actions_run = 0;
+    time_lookups( options, keys, dispatch_lookup, dispatch, eviction, &dispatch_hot, &dispatch_cold );
+
+    printf(
+        "%d mappings, %d lookups (%lu and %lu actions run)\n"
+        "  table:    %.2f ns/lookup hot, %.2f ns/lookup cold\n"
+        "  dispatch: %.2f ns/lookup hot, %.2f ns/lookup cold\n",
+        control_dispatch_mapping_count( dispatch ),
+        options->lookups,
+        table_actions,
+        actions_run,
+        table_hot,
+        table_cold,
+        dispatch_hot,
+        dispatch_cold
+    );
+
+    free( eviction );
+    control_dispatch_free( dispatch );
+    control_action_table_free( table );
+}
+
+static size_t count_take_events( Loop *loops, int loop_count )
+{
+    size_t events = 0;
+    for( int i = 0; i < loop_count; i++ ) {
+        struct LoopBufferStats stats;
+        loop_get_buffer_stats( loops[i], &stats );
+        events += stats.events;
+    }
+    return events;
+}
+
+/* Saves whatever the run left in the loops, while the engine's still
+   publishing them, then loads it into a client of its own.  Takes still
+   being recorded aren't saved, so only the loaded events are counted. */
+static void run_session_benchmark( struct Bench *bench, const struct BenchOptions *options )
+{
+    uint64_t start = dsp_stats_clock();
+    int saved = session_save(
+        options->session_path,
+        bench->loops,
+        options->loops,
+        bench->action_table,
+        options->sample_rate
+    );
+    uint64_t save_ns = dsp_stats_clock() - start;
+    if( saved != 0 ) {
+        return;
+    }
+
+    jack_client_t *client = stub_jack_client_new( options->sample_rate, options->buffer_size );
+    ControlActionTable table = control_action_table_new( NULL );
+    Loop *loops;
+    int loop_count;
+
+    start = dsp_stats_clock();
+    int loaded = session_load(
+        options->session_path,
+        client,
+        bench->segment_pool,
+        0,
+        table,
+        options->sample_rate,
+        &loops,
+        &loop_count
+    );
+    uint64_t load_ns = dsp_stats_clock() - start;
+
+    if( loaded == 0 ) {
+        printf(
+            "session: %d loops saved in %.2f ms, %d loops with %zu events loaded in %.2f ms\n",
+            options->loops,
+            save_ns / 1e6,
+            loop_count,
+            count_take_events( loops, loop_count ),
+            load_ns / 1e6
+        );
+    }
+
+    control_action_table_free( table );
+    if( loaded == 0 ) {
+        for( int i = 0; i < loop_count; i++ ) {
+            free( (char *) loop_get_name( loops[i] ) );
+            loop_free( loops[i] );
+        }
+        free( loops );
+    }
+    stub_jack_client_free( client );
+}
+
+// Written out and read back in by the import benchmark.
+#define BENCH_IMPORT_EVENTS 100000
+#define BENCH_IMPORT_SPACING 100
+
+struct BenchImport {
+    LoopBuffer take;
+    jack_nframes_t length;
+    int result;
+    int done;
+};
+
+static void bench_imported(
+        const char *loop_name,
+        const char *path,
+        LoopBuffer take,
+        jack_nframes_t length,
+        int result,
+        void *user_data
+    ) {
+
+    struct BenchImport *import = user_data;
+    import->take = take;
+    import->length = length;
+    import->result = result;
+    __atomic_store_n( &import->done, 1, __ATOMIC_RELEASE );
+}
+
+// One more cycle of the run, with its input, counted against the process callback.
+static void run_cycle( struct Bench *bench, const struct BenchOptions *options, int cycle )
+{
+    stub_jack_begin_cycle( bench->client );
+    queue_cycle_input( bench, options, cycle );
+    __atomic_store_n( &in_process, 1, __ATOMIC_RELAXED );
+    stub_jack_run_cycle( bench->client );
+    __atomic_store_n( &in_process, 0, __ATOMIC_RELAXED );
+}
+
+/* Writes a file of BENCH_IMPORT_EVENTS notes, then has it read into a take
+   for the first loop on the importer's thread while the engine carries on
+   cycling, as it would under JACK, and swapped in. */
+static void run_import_benchmark( struct Bench *bench, const struct BenchOptions *options )
+{
+    struct PackedMidiMessage *events = malloc( BENCH_IMPORT_EVENTS * sizeof( struct PackedMidiMessage ) );
+    for( int i = 0; i < BENCH_IMPORT_EVENTS; i++ ) {
+        events[i].delta = i ? BENCH_IMPORT_SPACING : 0;
+        events[i].status = i % 2 ? 0x80 : 0x90;
+        events[i].data[0] = 36 + ( i / 2 ) % 48;
+        events[i].data[1] = i % 2 ? 0 : 100;
+        events[i].reserved = 0;
+    }
+
+    uint64_t start = dsp_stats_clock();
+    int written = midi_file_write(
+        options->import_path,
+        events,
+        BENCH_IMPORT_EVENTS,
+        BENCH_IMPORT_EVENTS * BENCH_IMPORT_SPACING,
+        options->sample_rate,
+        MIDI_FILE_DEFAULT_BPM
+    );
+    uint64_t write_ns = dsp_stats_clock() - start;
+    free( events );
+    if( written != 0 ) {
+        fprintf( stderr, "Could not write %s (code %d).\n", options->import_path, written );
+        return;
+    }
+
+    struct BenchImport import = { NULL, 0, 0, 0 };
+    MidiFileImporter importer = midi_file_importer_new(
+        bench->segment_pool,
+        0,
+        options->sample_rate,
+        bench_imported,
+        &import
+    );
+    if( importer == NULL ) {
+        return;
+    }
+
+    struct AllocationCounts before, after;
+    process_thread = pthread_self();
+    read_allocation_counts( &before );
+
+    int cycle = options->warmup_cycles + options->cycles;
+    int read_cycles = 0, swap_cycles = 0;
+    start = dsp_stats_clock();
+    midi_file_importer_queue( importer, loop_get_name( bench->loops[0] ), options->import_path );
+    while( !__atomic_load_n( &import.done, __ATOMIC_ACQUIRE ) ) {
+        run_cycle( bench, options, cycle++ );
+        read_cycles++;
+    }
+    uint64_t read_ns = dsp_stats_clock() - start;
+
+    if( import.take && loop_offer_take( bench->loops[0], &import.take, import.length ) == 0 ) {
+        Loop *published = malloc( options->loops * sizeof( Loop ) );
+        memcpy( published, bench->loops, options->loops * sizeof( Loop ) );
+        engine_publish( bench->engine, published, options->loops, control_dispatch_build( bench->action_table ) );
+
+        // A loop that's recording hangs on to it until the take's done.
+        struct LoopBufferStats stats;
+        do {
+            run_cycle( bench, options, cycle++ );
+            swap_cycles++;
+            loop_get_buffer_stats( bench->loops[0], &stats );
+        } while( stats.events != BENCH_IMPORT_EVENTS && swap_cycles < 2 * options->toggle_cycles + 2 );
+    }
+    read_allocation_counts( &after );
+
+    if( import.result == 0 ) {
+        printf(
+            "import: %d events written in %.2f ms, read in %.2f ms over %d cycles, swapped in after %d, %lu allocations in the process callback\n",
+            BENCH_IMPORT_EVENTS,
+            write_ns / 1e6,
+            read_ns / 1e6,
+            read_cycles,
+            swap_cycles,
+            after.in_process - before.in_process
+        );
+    } else {
+        fprintf( stderr, "Could not import %s (code %d).\n", options->import_path, import.result );
+    }
+
+    midi_file_importer_free( importer );
+    loop_buffer_free( import.take );
+}
+
+// Like the looper's copy_loop_take.
+static struct PackedMidiMessage *copy_take( Loop loop, size_t *count, struct LoopTake *take )
+{
+    size_t capacity = LOOP_BUFFER_SEGMENT_EVENTS;
+    for( ;; ) {
+        struct PackedMidiMessage *events = malloc( capacity * sizeof( struct PackedMidiMessage ) );
+        *count = loop_copy_take( loop, events, capacity, take );
+        if( *count <= capacity ) {
+            return events;
+        }
+        free( events );
+        capacity = *count + LOOP_BUFFER_SEGMENT_EVENTS;
+    }
+}
+
+// Whether two loops have the same take, as far as a session would save it.
+static int same_take( Loop a, Loop b )
+{
+    size_t a_count, b_count;
+    struct LoopTake a_take, b_take;
+    struct PackedMidiMessage *a_events = copy_take( a, &a_count, &a_take );
+    struct PackedMidiMessage *b_events = copy_take( b, &b_count, &b_take );
+
+    int same = a_count == b_count
+        && a_take.length == b_take.length
+        && a_take.sync_offset == b_take.sync_offset
+        && memcmp( a_events, b_events, a_count * sizeof( struct PackedMidiMessage ) ) == 0;
+
+    free( a_events );
+    free( b_events );
+    return same;
+}
+
+/* What it cost to get the run onto disk, and whether the loops can be got
+   back from it: every take that was finished should come back as it was. */
+static void run_journal_benchmark( struct Bench *bench, const struct BenchOptions *options )
+{
+    journal_sync( bench->journal );
+    struct JournalStats stats;
+    journal_get_stats( bench->journal, &stats );
+
+    double write_s = ( stats.write_ns + stats.sync_ns ) / 1e9;
+    printf(
+        "journal: %llu records (%.1f MB in %llu blocks) written at %.1f MB/s, %.0f records/s, %llu syncs at %.2f ms, %llu dropped\n",
+        (unsigned long long) stats.records,
+        stats.bytes / 1e6,
+        (unsigned long long) stats.blocks,
+        write_s > 0 ? stats.bytes / 1e6 / write_s : 0.0,
+        write_s > 0 ? stats.records / write_s : 0.0,
+        (unsigned long long) stats.syncs,
+        stats.syncs ? stats.sync_ns / 1e6 / stats.syncs : 0.0,
+        (unsigned long long) stats.dropped
+    );
+
+    jack_client_t *client = stub_jack_client_new( options->sample_rate, options->buffer_size );
+    Loop *loops;
+    int loop_count;
+    struct JournalRecovery recovery;
+
+    uint64_t start = dsp_stats_clock();
+    int recovered = journal_recover(
+        options->journal_path,
+        0,
+        client,
+        bench->segment_pool,
+        0,
+        &loops,
+        &loop_count,
+        &recovery
+    );
+    uint64_t recover_ns = dsp_stats_clock() - start;
+
+    if( recovered == 0 ) {
+        // Takes still being recorded come back as far as they got, so there's nothing to compare.
+        int finished = 0, matching = 0;
+        for( int i = 0; i < options->loops && i < loop_count; i++ ) {
+            size_t count;
+            struct LoopTake take;
+            free( copy_take( bench->loops[i], &count, &take ) );
+            if( take.length > 0 ) {
+                finished++;
+                matching += same_take( bench->loops[i], loops[i] );
+            }
+        }
+
+        printf(
+            "recovery: %d loops from %llu records in %.2f ms, %d of %d finished takes as they were\n",
+            loop_count,
+            (unsigned long long) recovery.records,
+            recover_ns / 1e6,
+            matching,
+            finished
+        );
+
+        for( int i = 0; i < loop_count; i++ ) {
+            free( (char *) loop_get_name( loops[i] ) );
+            loop_free( loops[i] );
+        }
+        free( loops );
+    }
+    stub_jack_client_free( client );
+}
+
+static void usage( const char *program )
+{
+    fprintf(
+        stderr,
+        "Usage: %s [-l loops] [-a active loops] [-e events per loop per cycle] [-t toggle every n cycles]\n"
+        "          [-c cycles] [-w warmup cycles] [-n (no MIDI through)] [-b buffer size] [-r sample rate]\n"
+        "          [-m dispatch lookups, instead of running the engine]\n"
+        "          [-q takes to check quantize on, instead of running the engine]\n"
+        "          [-s sweep loop counts from the active ones up to this, doubling]\n"
+        "          [-j engine worker threads, however many CPUs there are]\n"
+        "          [-d (check the workers play the same as none, instead of timing them)]\n"
+        "          [-i (active loops on the shared input)]\n"
+        "          [-o (all loops on the shared output)] [-f session file to save and load after the run]\n"
+        "          [-x MIDI file to write and import into the first loop after the run]\n"
+        "          [-J journal to write during the run and recover the loops from]\n",
+        program
+    );
+}
+
+int main( int argc, char *argv[] )
+{
+    struct BenchOptions options = {
+        .loops = 16,
+        .active = -1,
+        .sweep = 0,
+        .events = 4,
+        .toggle_cycles = 200,
+        .cycles = 20000,
+        .warmup_cycles = 500,
+        .midi_through = 1,
+        .lookups = 0,
+        .quantize_takes = 0,
+        .workers = 0,
+        .check_workers = 0,
+        .shared_input = 0,
+        .shared_output = 0,
+        .session_path = NULL,
+        .import_path = NULL,
+        .journal_path = NULL,
+        .buffer_size = 256,
+        .sample_rate = 48000
+    };
+
+    int opt;
+    while( ( opt = getopt( argc, argv, "l:a:e:t:c:w:nb:r:m:q:s:j:diof:x:J:" ) ) != -1 ) {
+        switch( opt ) {
+            case 'l': options.loops = atoi( optarg ); break;
+            case 'a': options.active = atoi( optarg ); break;
+            case 's': options.sweep = atoi( optarg ); break;
+            case 'e': options.events = atoi( optarg ); break;
+            case 't': options.toggle_cycles = atoi( optarg ); break;
+            case 'c': options.cycles = atoi( optarg ); break;
+            case 'w': options.warmup_cycles = atoi( optarg ); break;
+            case 'n': options.midi_through = 0; break;
+            case 'b': options.buffer_size = strtoul( optarg, NULL, 10 ); break;
+            case 'r': options.sample_rate = strtoul( optarg, NULL, 10 ); break;
+            case 'm': options.lookups = atoi( optarg ); break;
+            case 'q': options.quantize_takes = atoi( optarg ); break;
+            case 'j': options.workers = atoi( optarg ); break;
+            case 'd': options.check_workers = 1; break;
+            case 'i': options.shared_input = 1; break;
+            case 'o': options.shared_output = 1; break;
+            case 'f': options.session_path = optarg; break;
+            case 'x': options.import_path = optarg; break;
+            case 'J': options.journal_path = optarg; break;
+            default: usage( argv[0] ); return 1;
+        }
+    }
+
+    // Everything's active unless it's a sweep, which starts from one active loop.
+    if( options.active < 0 ) {
+        options.active = options.sweep ? 1 : options.loops;
+    }
+
+    if(
+        options.loops < 1 || options.loops > BENCH_MAX_LOOPS
+        || options.active < 1 || options.active > ( options.sweep ? options.sweep : options.loops )
+        || options.sweep < 0 || options.sweep > BENCH_MAX_LOOPS
+        || options.events < 0 || options.toggle_cycles < 0
+        || options.cycles < 1 || options.warmup_cycles < 0
+        || options.buffer_size == 0 || options.sample_rate == 0
+        || options.lookups < 0 || options.quantize_takes < 0
+        || options.workers < 0 || options.workers > ENGINE_MAX_WORKERS
+    ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    if( rt_log_init() != 0 ) {
+        fprintf( stderr, "Could not create the RT error log.\n" );
+        return 1;
+    }
+
+    // As the looper would be run for this many loops.
+    if( capture_ring_init( CAPTURE_RING_DEFAULT_MESSAGES, options.loops ) != 0 ) {
+        fprintf( stderr, "Could not start the capture thread.\n" );
+        rt_log_close();
+        return 1;
+    }
+
+    if( options.sweep ) {
+        int status = run_sweep_benchmark( &options );
+        capture_ring_close();
+        rt_log_close();
+        return status != 0;
+    }
+
+    if( options.check_workers ) {
+        int status = run_worker_check( &options );
+        capture_ring_close();
+        rt_log_close();
+        return status != 0;
+    }
+
+    if( options.quantize_takes ) {
+        int status = run_quantize_check( &options );
+        capture_ring_close();
+        rt_log_close();
+        return status != 0;
+    }
+
+    struct Bench bench;
+    if( bench_setup( &bench, &options ) != 0 ) {
+        fprintf( stderr, "Bench setup failed.\n" );
+        return 1;
+    }
+
+    if( options.lookups ) {
+        run_dispatch_benchmark( &bench, &options );
+    } else {
+        run_engine_benchmark( &bench, &options );
+        if( options.session_path ) {
+            run_session_benchmark( &bench, &options );
+        }
+        if( options.import_path ) {
+            run_import_benchmark( &bench, &options );
+        }
+        if( options.journal_path ) {
+            run_journal_benchmark( &bench, &options );
+        }
+    }
+
+    bench_teardown( &bench, &options );
+
+    // Only complete once the drain thread has stopped.
+    if( bench.rt_errors ) {
+        printf( "%lu RT errors, see above\n", bench.rt_errors );
+    }
+    capture_ring_close();
+    rt_log_close();
+
+    return 0;
+}
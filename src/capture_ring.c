@@ -0,0 +1,437 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "capture_ring.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// How often the capture thread looks again while waiting for the end of a span.
+#define CAPTURE_POLL_NS 1000000
+
+enum CaptureStatus {
+    CAPTURE_IDLE = 0,   // The process thread may make a request.
+    CAPTURE_REQUESTED,  // The capture thread is on it.
+    CAPTURE_READY       // The process thread may collect the take.
+};
+
+// 16 bytes, since the process thread writes one for every message in.
+struct CapturedMessage {
+    uint64_t frame;
+    unsigned char data[3];
+    unsigned char len;
+};
+
+struct capture_ring_type {
+    // mask + 1 of them.  The process thread is the only writer.
+    struct CapturedMessage *messages;
+    uint64_t mask;
+    long slot; // In the capture thread's block, or -1 if they're our own.
+    uint64_t written; // Messages ever pushed; the one at n is at messages[n & mask].
+    uint64_t filled;  // As of capture_ring_mark.
+
+    // Only written by whichever thread status hands them to.
+    int status;
+    uint64_t start;
+    uint64_t end;
+    LoopBuffer take;
+    unsigned int failed;
+
+    struct capture_ring_type *next; // Among the capture thread's rings.
+};
+
+/* One thread serves every ring, woken by a request on any of them and then
+   looking over them all, so it costs the same however many loops there are. */
+static struct {
+    // Held while the rings are looked over, so one can't be freed under the thread.
+    pthread_mutex_t lock;
+    struct capture_ring_type *rings;
+
+    size_t capacity; // Messages in each ring, a power of two.
+
+    // locked_rings rings' worth of messages in one block, handed out a ring at a time.
+    struct CapturedMessage *locked;
+    size_t locked_rings;
+    unsigned char *slot_taken;
+
+    sem_t requested;
+    pthread_t thread;
+    int running;
+    int quit;
+} capture;
+
+static void *capture_thread( void *arg );
+
+// Whole pages, so that unlocking them can't unlock anyone else's memory.
+static size_t messages_size( size_t count )
+{
+    size_t page = sysconf( _SC_PAGESIZE );
+    return ( count * sizeof( struct CapturedMessage ) + page - 1 ) / page * page;
+}
+
+/* The process thread writes every message in straight into the ring, so
+   every page of it has to be there already: written once, then locked. */
+static struct CapturedMessage *allocate_messages( size_t count )
+{
+    size_t size = messages_size( count );
+    void *messages;
+    if( posix_memalign( &messages, sysconf( _SC_PAGESIZE ), size ) != 0 ) {
+        return NULL;
+    }
+    memset( messages, 0, size );
+    if( mlock( messages, size ) != 0 ) {
+        fprintf( stderr, "Could not lock %zu bytes of input history in memory.\n", size );
+    }
+    return messages;
+}
+
+static void free_messages( struct CapturedMessage *messages, size_t count )
+{
+    if( messages ) {
+        munlock( messages, messages_size( count ) );
+        free( messages );
+    }
+}
+
+int capture_ring_init( size_t messages, size_t locked_rings )
+{
+    capture.capacity = 1;
+    while( capture.capacity < messages ) {
+        capture.capacity *= 2;
+    }
+    capture.rings = NULL;
+    capture.locked = NULL;
+    capture.locked_rings = locked_rings;
+    capture.slot_taken = NULL;
+    capture.quit = 0;
+
+    if( locked_rings ) {
+        capture.locked = allocate_messages( locked_rings * capture.capacity );
+        capture.slot_taken = calloc( locked_rings, 1 );
+        if( capture.locked == NULL || capture.slot_taken == NULL ) {
+            free_messages( capture.locked, locked_rings * capture.capacity );
+            free( capture.slot_taken );
+            return -1;
+        }
+    }
+
+    pthread_mutex_init( &capture.lock, NULL );
+    sem_init( &capture.requested, 0, 0 );
+    if( pthread_create( &capture.thread, NULL, capture_thread, NULL ) != 0 ) {
+        fprintf( stderr, "Could not start the capture thread.\n" );
+        sem_destroy( &capture.requested );
+        pthread_mutex_destroy( &capture.lock );
+        free_messages( capture.locked, locked_rings * capture.capacity );
+        free( capture.slot_taken );
+        return -1;
+    }
+
+    capture.running = 1;
+    return 0;
+}
+
+size_t capture_ring_capacity( void )
+{
+    return capture.capacity;
+}
+
+// Every ring has to have been freed by now.
+void capture_ring_close( void )
+{
+    if( capture.running ) {
+        __atomic_store_n( &capture.quit, 1, __ATOMIC_RELEASE );
+        sem_post( &capture.requested );
+        pthread_join( capture.thread, NULL );
+        capture.running = 0;
+
+        sem_destroy( &capture.requested );
+        pthread_mutex_destroy( &capture.lock );
+        free_messages( capture.locked, capture.locked_rings * capture.capacity );
+        free( capture.slot_taken );
+    }
+}
+
+struct capture_ring_type *capture_ring_new( SegmentPool pool, size_t max_segments )
+{
+    if( !capture.running ) {
+        return NULL;
+    }
+
+    struct capture_ring_type *this = malloc( sizeof( *this ) );
+    if( this == NULL ) {
+        return NULL;
+    }
+
+    this->written = 0;
+    this->filled = 0;
+    this->status = CAPTURE_IDLE;
+    this->start = 0;
+    this->end = 0;
+    this->failed = 0;
+    this->messages = NULL;
+    this->mask = capture.capacity - 1;
+    this->slot = -1;
+
+    this->take = loop_buffer_init( pool, max_segments );
+    if( !loop_buffer_is_valid( this->take ) ) {
+        free( this );
+        return NULL;
+    }
+
+    pthread_mutex_lock( &capture.lock );
+
+    for( size_t i = 0; i < capture.locked_rings; i++ ) {
+        if( !capture.slot_taken[i] ) {
+            capture.slot_taken[i] = 1;
+            this->slot = i;
+            this->messages = &( capture.locked[i * capture.capacity] );
+            break;
+        }
+    }
+
+    if( this->messages == NULL ) {
+        this->messages = allocate_messages( capture.capacity );
+        if( this->messages == NULL ) {
+            pthread_mutex_unlock( &capture.lock );
+            loop_buffer_free( this->take );
+            free( this );
+            return NULL;
+        }
+    }
+
+    this->next = capture.rings;
+    capture.rings = this;
+
+    pthread_mutex_unlock( &capture.lock );
+
+    return this;
+}
+
+void capture_ring_free( struct capture_ring_type *this )
+{
+    if( this ) {
+        // Waits out a copy, if the capture thread is in the middle of one.
+        pthread_mutex_lock( &capture.lock );
+
+        struct capture_ring_type **link = &capture.rings;
+        while( *link != this ) {
+            link = &( *link )->next;
+        }
+        *link = this->next;
+
+        if( this->slot >= 0 ) {
+            capture.slot_taken[this->slot] = 0;
+        } else {
+            free_messages( this->messages, this->mask + 1 );
+        }
+
+        pthread_mutex_unlock( &capture.lock );
+
+        loop_buffer_free( this->take );
+        free( this );
+    }
+}
+
+void capture_ring_push( struct capture_ring_type *this, uint64_t frame, const struct MidiMessage *message )
+{
+    struct CapturedMessage *captured = &( this->messages[this->written & this->mask] );
+    captured->frame = frame;
+    captured->data[0] = message->data[0];
+    captured->data[1] = message->data[1];
+    captured->data[2] = message->data[2];
+    captured->len = message->len;
+    __atomic_store_n( &this->written, this->written + 1, __ATOMIC_RELEASE );
+}
+
+void capture_ring_mark( struct capture_ring_type *this, uint64_t frame )
+{
+    __atomic_store_n( &this->filled, frame, __ATOMIC_RELEASE );
+}
+
+int capture_ring_request( struct capture_ring_type *this, uint64_t start, uint64_t end )
+{
+    if( __atomic_load_n( &this->status, __ATOMIC_ACQUIRE ) != CAPTURE_IDLE ) {
+        return -1;
+    }
+
+    this->start = start;
+    this->end = end;
+    __atomic_store_n( &this->status, CAPTURE_REQUESTED, __ATOMIC_RELEASE );
+    sem_post( &capture.requested ); // Async-signal-safe, so fine for RT.
+    return 0;
+}
+
+int capture_ring_collect(
+        struct capture_ring_type *this,
+        LoopBuffer *take,
+        uint64_t *start,
+        jack_nframes_t *length
+    ) {
+
+    if( __atomic_load_n( &this->status, __ATOMIC_ACQUIRE ) != CAPTURE_READY ) {
+        return 0;
+    }
+
+    if( take ) {
+        LoopBuffer swap = *take;
+        *take = this->take;
+        this->take = swap;
+        *start = this->start;
+        *length = this->end - this->start;
+    }
+
+    __atomic_store_n( &this->status, CAPTURE_IDLE, __ATOMIC_RELEASE );
+    return take != NULL;
+}
+
+int capture_ring_ready( struct capture_ring_type *this )
+{
+    return __atomic_load_n( &this->status, __ATOMIC_ACQUIRE ) == CAPTURE_READY;
+}
+
+int capture_ring_busy( struct capture_ring_type *this )
+{
+    return __atomic_load_n( &this->status, __ATOMIC_ACQUIRE ) != CAPTURE_IDLE;
+}
+
+int capture_ring_copying( struct capture_ring_type *this )
+{
+    return __atomic_load_n( &this->status, __ATOMIC_ACQUIRE ) == CAPTURE_REQUESTED
+        && __atomic_load_n( &this->filled, __ATOMIC_ACQUIRE ) >= this->end;
+}
+
+unsigned int capture_ring_failed( struct capture_ring_type *this )
+{
+    return __atomic_load_n( &this->failed, __ATOMIC_RELAXED );
+}
+
+// The first message in [low, high) that's at or after frame.
+static uint64_t find( struct capture_ring_type *this, uint64_t low, uint64_t high, uint64_t frame )
+{
+    while( low < high ) {
+        uint64_t middle = low + ( high - low ) / 2;
+        if( this->messages[middle & this->mask].frame < frame ) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Copies the requested span into the take once it's all in, returning non-zero if it can't.
+static int copy_span( struct capture_ring_type *this )
+{
+    uint64_t written = __atomic_load_n( &this->written, __ATOMIC_ACQUIRE );
+    uint64_t oldest = written > this->mask ? written - this->mask - 1 : 0;
+    uint64_t first = find( this, oldest, written, this->start );
+    uint64_t last = find( this, first, written, this->end );
+
+    // Whatever came in just before the oldest message we still have is gone.
+    if( first == oldest && oldest > 0 ) {
+        return -2;
+    }
+
+    LoopBuffer take = this->take;
+    loop_buffer_reset_write( take );
+    if( loop_buffer_reserve( take, last - first ) != 0 ) {
+        return -3;
+    }
+
+    for( uint64_t n = first; n < last; n++ ) {
+        struct CapturedMessage *captured = &( this->messages[n & this->mask] );
+        struct MidiMessage message = {
+            .time = captured->frame - this->start,
+            .len = captured->len,
+            .data = { captured->data[0], captured->data[1], captured->data[2] }
+        };
+        loop_buffer_push( take, &message );
+    }
+
+    // The process thread may have lapped us while we were copying.
+    if( __atomic_load_n( &this->written, __ATOMIC_ACQUIRE ) - first > this->mask ) {
+        return -2;
+    }
+
+    return 0;
+}
+
+// Returns non-zero if some ring's request is still waiting for the end of its span.
+static int serve_requests( void )
+{
+    int waiting = 0;
+
+    pthread_mutex_lock( &capture.lock );
+
+    for( struct capture_ring_type *ring = capture.rings; ring; ring = ring->next ) {
+        if( __atomic_load_n( &ring->status, __ATOMIC_ACQUIRE ) != CAPTURE_REQUESTED ) {
+            continue;
+        }
+
+        if( __atomic_load_n( &ring->filled, __ATOMIC_ACQUIRE ) < ring->end ) {
+            waiting = 1;
+        } else if( copy_span( ring ) == 0 ) {
+            __atomic_store_n( &ring->status, CAPTURE_READY, __ATOMIC_RELEASE );
+        } else {
+            __atomic_add_fetch( &ring->failed, 1, __ATOMIC_RELAXED );
+            __atomic_store_n( &ring->status, CAPTURE_IDLE, __ATOMIC_RELEASE );
+        }
+    }
+
+    pthread_mutex_unlock( &capture.lock );
+
+    return waiting;
+}
+
+static void *capture_thread( void *arg )
+{
+    int waiting = 0;
+
+    for( ;; ) {
+        if( waiting ) {
+            struct timespec poll;
+            clock_gettime( CLOCK_REALTIME, &poll );
+            poll.tv_nsec += CAPTURE_POLL_NS;
+            if( poll.tv_nsec >= 1000000000 ) {
+                poll.tv_sec++;
+                poll.tv_nsec -= 1000000000;
+            }
+            while( sem_timedwait( &capture.requested, &poll ) != 0 && errno == EINTR ) {
+            }
+        } else {
+            sem_wait( &capture.requested );
+        }
+
+        if( __atomic_load_n( &capture.quit, __ATOMIC_ACQUIRE ) ) {
+            break;
+        }
+
+        waiting = serve_requests();
+    }
+
+    return NULL;
+}
@@ -0,0 +1,82 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+   
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+
+#ifndef CAPTURE_RING_H
+#define CAPTURE_RING_H
+
+#include <stdint.h>
+
+#include "loop_buffer.h"
+#include "midi_message.h"
+#include "segment_pool.h"
+
+/* A loop's recent input, whatever state it's in, stamped with the engine's
+   frame clock.  A span of it can be asked for as a take: one capture thread,
+   shared by every ring, finds the span's ends by binary search and copies it
+   out into a loop buffer, so the process thread only ever asks and later
+   collects. */
+typedef struct capture_ring_type *CaptureRing;
+
+// Enough for four seconds of input at 1024 messages a second.
+#define CAPTURE_RING_DEFAULT_MESSAGES 4096
+
+/* Not RT.  Starts the capture thread, with every ring holding the last
+   messages messages of input (rounded up to a power of two), however long
+   ago they came in.  Locks room in memory for the rings of locked_rings
+   loops in one block; rings past that many get memory of their own, locked
+   as they're made. */
+int capture_ring_init( size_t messages, size_t locked_rings );
+void capture_ring_close( void );
+
+// Messages each ring holds, once capture_ring_init has rounded them up.
+size_t capture_ring_capacity( void );
+
+// Not RT.  Fails without capture_ring_init.
+CaptureRing capture_ring_new( SegmentPool pool, size_t max_segments );
+void capture_ring_free( CaptureRing this );
+
+// RT.  Oldest messages are overwritten once the ring is full.
+void capture_ring_push( CaptureRing this, uint64_t frame, const struct MidiMessage *message );
+
+// RT.  Everything before frame has been pushed.
+void capture_ring_mark( CaptureRing this, uint64_t frame );
+
+/* RT.  Asks for the messages in [start, end) as a take starting at start.
+   end may still be to come.  Returns non-zero if a request is already in
+   hand, which is then left as it is. */
+int capture_ring_request( CaptureRing this, uint64_t start, uint64_t end );
+
+/* RT.  Once the take is ready, swaps it for *take (which the ring reuses for
+   the next one) and returns 1, with the span it came from.  Passing a NULL
+   take throws it away instead. */
+int capture_ring_collect( CaptureRing this, LoopBuffer *take, uint64_t *start, jack_nframes_t *length );
+
+// RT.  Whether a take is waiting to be collected.
+int capture_ring_ready( CaptureRing this );
+
+// RT.  Whether there's a request in hand, so the ring still needs marking.
+int capture_ring_busy( CaptureRing this );
+
+/* Whether the capture thread has everything the request asked for and is
+   still copying it out.  Only means anything between process callbacks. */
+int capture_ring_copying( CaptureRing this );
+
+// Requests that couldn't be met, because the ring had moved on or the take didn't fit.
+unsigned int capture_ring_failed( CaptureRing this );
+
+#endif
@@ -16,41 +16,151 @@
    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
 
 #include <assert.h>
-#include <sys/mman.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "control_action_table.h"
 #include "loop.h"
 
 #define CONTROL_ACTION_TABLE_COUNT 8192
-#define CONTROL_ACTION_TABLE_SIZE (8192*(sizeof(struct ControlActionListNode *)))
 
+// Nodes are carved out of slabs of this many, rather than malloc'd one by one.
+#define NODE_SLAB_COUNT 64
+
+/* Every node is on two lists: its bucket's, and its loop's (see
+   loop_get_mapping_list), so that either can be unlinked in constant time.
+   The prev pointers point at whatever points at the node.  The process
+   callback never sees these - see control_dispatch_build. */
 struct ControlActionListNode {
     Loop loop;
     LoopControlFunc action;
     struct ControlActionListNode *next;
+    struct ControlActionListNode **prev;
+
+    unsigned int key; // The bucket.
+    struct ControlActionListNode *loop_next;
+    struct ControlActionListNode **loop_prev;
+};
+
+struct NodeSlab {
+    struct NodeSlab *next;
+    struct ControlActionListNode nodes[NODE_SLAB_COUNT];
 };
 
 struct control_action_table_type {
     ChangeNotificationHandler table_change_handler;
     struct ControlActionListNode **table;
+
+    struct NodeSlab *slabs;
+    struct ControlActionListNode *free_nodes; // Linked through next.
 };
 
 ControlActionTable control_action_table_new( ChangeNotificationHandler handler )
 {
     struct control_action_table_type *new_table;
-    new_table = malloc( sizeof( new_table ) );
+    new_table = malloc( sizeof( *new_table ) );
     new_table->table_change_handler = handler;
+    new_table->slabs = NULL;
+    new_table->free_nodes = NULL;
     new_table->table = calloc(
         CONTROL_ACTION_TABLE_COUNT,
         sizeof( struct ControlActionListNode * )
     );
-    if( mlock( new_table->table, CONTROL_ACTION_TABLE_SIZE ) != 0 ) {
-        fprintf( stderr, "Unable to mlock MIDI mapping table\n" );
-    }
     return new_table;
 }
 
+static struct ControlActionListNode *node_alloc( ControlActionTable this )
+{
+    if( this->free_nodes == NULL ) {
+        struct NodeSlab *slab = calloc( 1, sizeof( *slab ) );
+        if( slab == NULL ) {
+            return NULL;
+        }
+
+        slab->next = this->slabs;
+        this->slabs = slab;
+        for( int i = 0; i < NODE_SLAB_COUNT; i++ ) {
+            slab->nodes[i].next = this->free_nodes;
+            this->free_nodes = &( slab->nodes[i] );
+        }
+    }
+
+    struct ControlActionListNode *node = this->free_nodes;
+    this->free_nodes = node->next;
+    return node;
+}
+
+static void node_release( ControlActionTable this, struct ControlActionListNode *node )
+{
+    node->next = this->free_nodes;
+    this->free_nodes = node;
+}
+
+// Links the node in at the head of its bucket and of its loop's list.
+static void node_link( struct ControlActionListNode **bucket, struct ControlActionListNode *node )
+{
+    node->next = *bucket;
+    node->prev = bucket;
+    if( *bucket ) {
+        (*bucket)->prev = &( node->next );
+    }
+    *bucket = node;
+
+    struct ControlActionListNode **loop_list = loop_get_mapping_list( node->loop );
+    node->loop_next = *loop_list;
+    node->loop_prev = loop_list;
+    if( *loop_list ) {
+        (*loop_list)->loop_prev = &( node->loop_next );
+    }
+    *loop_list = node;
+}
+
+// Unlinks the node from both of its lists and returns it to the pool.
+static void node_remove( ControlActionTable this, struct ControlActionListNode *node )
+{
+    *( node->prev ) = node->next;
+    if( node->next ) {
+        node->next->prev = node->prev;
+    }
+
+    *( node->loop_prev ) = node->loop_next;
+    if( node->loop_next ) {
+        node->loop_next->loop_prev = node->loop_prev;
+    }
+
+    node_release( this, node );
+}
+
+// Tables that nobody watches, like the one a session is loaded into, have no handler.
+static void notify_change(
+        ControlActionTable this,
+        enum TableChange change,
+        unsigned char midi_channel,
+        enum MidiControlType midi_type,
+        unsigned char midi_value,
+        Loop loop,
+        LoopControlFunc control_func
+    ) {
+    if( this->table_change_handler ) {
+        this->table_change_handler(
+            change,
+            midi_channel,
+            midi_type,
+            midi_value,
+            loop,
+            control_func
+        );
+    }
+}
+
+static unsigned int midi_key(
+        unsigned char midi_channel,
+        enum MidiControlType midi_type,
+        unsigned char midi_value
+    ) {
+    // Basically a direct hash.
+    return ( midi_channel << 9 ) | ( midi_type << 7 ) | midi_value;
+}
+
 // These functions are particularly speed critical, so the duplication is worth it.
 static struct ControlActionListNode **midi_lookup_reference(
         ControlActionTable this,
@@ -58,8 +168,7 @@ static struct ControlActionListNode **midi_lookup_reference(
         enum MidiControlType midi_type,
         unsigned char midi_value
     ) {
-    // Basically a direct hash. 
-    unsigned int hash_key = ( midi_channel << 9 ) | ( midi_type << 7 ) | midi_value;
+    unsigned int hash_key = midi_key( midi_channel, midi_type, midi_value );
     assert( hash_key >= 0 && hash_key < CONTROL_ACTION_TABLE_COUNT );
     return &( this->table[hash_key] );
 }
@@ -100,16 +209,22 @@ void control_action_table_insert(
         this, midi_channel, midi_type, midi_value, loop, control_func
     );
 
-    struct ControlActionListNode *new_action = malloc( sizeof( *new_action ) );
+    struct ControlActionListNode *new_action = node_alloc( this );
+    if( new_action == NULL ) {
+        fprintf( stderr, "Unable to allocate MIDI mapping\n" );
+        return;
+    }
     new_action->loop = loop;
     new_action->action = control_func;
-    
-    struct ControlActionListNode **action_list =
-        midi_lookup_reference( this, midi_channel, midi_type, midi_value );
-    new_action->next = *action_list;
-    *action_list = new_action;
+    new_action->key = midi_key( midi_channel, midi_type, midi_value );
+
+    node_link(
+        midi_lookup_reference( this, midi_channel, midi_type, midi_value ),
+        new_action
+    );
 
-    this->table_change_handler(
+    notify_change(
+        this,
         ACTION_ADD,
         midi_channel,
         midi_type,
@@ -132,13 +247,14 @@ void control_action_table_remove(
         midi_lookup_reference( this, midi_channel, midi_type, midi_value );
 
     // Should only ever remove one, but keeps going to squash inconsistencies.
-    while( *list != NULL ) {
-        if( (*list)->action == control_func && (*list)->loop == loop ) {
-            struct ControlActionListNode *temp = (*list)->next;
-            free( *list );
-            *list = temp;
+    struct ControlActionListNode *node = *list;
+    while( node != NULL ) {
+        struct ControlActionListNode *next = node->next;
+        if( node->action == control_func && node->loop == loop ) {
+            node_remove( this, node );
 
-            this->table_change_handler(
+            notify_change(
+                this,
                 ACTION_REMOVE,
                 midi_channel,
                 midi_type,
@@ -146,68 +262,49 @@ void control_action_table_remove(
                 loop,
                 control_func
             );
-        } else {
-            list = &( (*list)->next );   
         }
+        node = next;
     }
 }
 
-typedef int (*RemovalPredicate)( unsigned int, struct ControlActionListNode *, void *user_data );
-static void conditional_mapping_removal(
-        ControlActionTable this,
-        RemovalPredicate pred,
-        void *user_data
-    ) {
+// Tells the handler about the node, then removes it.
+static void notify_and_remove( ControlActionTable this, struct ControlActionListNode *node )
+{
+    unsigned char midi_channel, midi_value;
+    enum MidiControlType midi_type;
+    derive_midi_values( node->key, &midi_channel, &midi_type, &midi_value );
 
-    for( unsigned int i = 0; i < CONTROL_ACTION_TABLE_COUNT; i++ ) {
-        struct ControlActionListNode **list = &( this->table[i] );
-        while( *list != NULL ) {
-            if( pred( i, *list, user_data ) ) {
-                unsigned char midi_channel, midi_value;
-                enum MidiControlType midi_type;
-                derive_midi_values( i, &midi_channel, &midi_type, &midi_value );
-
-                this->table_change_handler(
-                    ACTION_REMOVE,
-                    midi_channel,
-                    midi_type,
-                    midi_value,
-                    (*list)->loop,
-                    (*list)->action
-                );
-
-                struct ControlActionListNode *temp = (*list)->next;
-                free( *list );
-                *list = temp;
-            } else {
-                list = &( (*list)->next );   
-            }
-        }
-    }
-}
+    notify_change(
+        this,
+        ACTION_REMOVE,
+        midi_channel,
+        midi_type,
+        midi_value,
+        node->loop,
+        node->action
+    );
 
-int trivial_removal_predicate( unsigned int not_used, struct ControlActionListNode *node, void *user_data )
-{
-    return 1;
+    node_remove( this, node );
 }
 
 void control_action_table_clear_mappings( ControlActionTable this )
 {
-    conditional_mapping_removal( this, trivial_removal_predicate, NULL );
-}
-
-int loop_removal_predicate( unsigned int not_used, struct ControlActionListNode *node, void *user_data )
-{
-    Loop target = user_data;
-    return node->loop == target;
+    for( unsigned int i = 0; i < CONTROL_ACTION_TABLE_COUNT; i++ ) {
+        while( this->table[i] != NULL ) {
+            notify_and_remove( this, this->table[i] );
+        }
+    }
 }
 
-// SLOW
 void control_action_table_remove_loop_mappings(
         ControlActionTable this,
         Loop loop
     ) {
-    conditional_mapping_removal( this, loop_removal_predicate, loop );
+
+    struct ControlActionListNode **loop_list = loop_get_mapping_list( loop );
+    while( *loop_list != NULL ) {
+        notify_and_remove( this, *loop_list );
+    }
 }
 
 void control_action_table_invoke(
@@ -215,14 +312,14 @@ void control_action_table_invoke(
         unsigned char midi_channel,
         enum MidiControlType midi_type,
         unsigned char midi_value,
-        jack_nframes_t time
+        uint64_t frame
     ) {
 
     struct ControlActionListNode *list =
         midi_lookup( this, midi_channel, midi_type, midi_value );
 
     while( list != NULL ) {
-        list->action( list->loop, time );
+        list->action( list->loop, frame );
         list = list->next;
     }
 }
@@ -262,8 +359,11 @@ void control_action_table_foreach_mapping(
 void control_action_table_free( ControlActionTable this )
 {
     control_action_table_clear_mappings( this );
-    munlock( this->table, CONTROL_ACTION_TABLE_SIZE );
+    while( this->slabs ) {
+        struct NodeSlab *next = this->slabs->next;
+        free( this->slabs );
+        this->slabs = next;
+    }
     free( this->table );
     free( this );
 }
-
@@ -22,9 +22,12 @@
 
 #define LOOP_CONTROL_FUNC_TOGGLE_PLAYBACK loop_toggle_playback
 #define LOOP_CONTROL_FUNC_TOGGLE_RECORDING loop_toggle_recording
+#define LOOP_CONTROL_FUNC_TOGGLE_OVERDUB loop_toggle_overdub
+#define LOOP_CONTROL_FUNC_TOGGLE_REPLACE loop_toggle_replace
+#define LOOP_CONTROL_FUNC_CAPTURE loop_capture
 
 typedef struct control_action_table_type *ControlActionTable;
-typedef void (*LoopControlFunc)( Loop loop, jack_nframes_t time );
+typedef void (*LoopControlFunc)( Loop loop, uint64_t frame );
 
 enum MidiControlType {
     TYPE_NOTE_ON = 0x0
@@ -48,6 +51,7 @@ typedef void (*ChangeNotificationHandler)(
 );
 
 ControlActionTable control_action_table_new( ChangeNotificationHandler handler );
+// Before any loop still mapped in it, since the loops point back at the table.
 void control_action_table_free( ControlActionTable this );
 
 void control_action_table_insert(
@@ -70,6 +74,7 @@ void control_action_table_remove(
 
 void control_action_table_clear_mappings( ControlActionTable this );
 
+// Proportional to the number of mappings the loop has, not the size of the table.
 void control_action_table_remove_loop_mappings(
     ControlActionTable this,
     Loop loop
@@ -80,7 +85,7 @@ void control_action_table_invoke(
     unsigned char midi_channel,
     enum MidiControlType midi_type,
     unsigned char midi_value,
-    jack_nframes_t time
+    uint64_t frame
 );
 
 void control_action_table_foreach_mapping(
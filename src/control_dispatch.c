@@ -0,0 +1,205 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#include "control_dispatch.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define CONTROL_DISPATCH_RANGE_COUNT ( CONTROL_DISPATCH_TYPE_COUNT * 16 )
+
+// Ranges shorter than this get scanned rather than binary searched.
+#define LINEAR_SEARCH_LIMIT 8
+
+struct DispatchRange {
+    uint32_t begin;
+    uint32_t end;
+};
+
+struct DispatchEntry {
+    Loop loop;
+    LoopControlFunc action;
+};
+
+struct control_dispatch_type {
+    // Both point further into this block: count values, then count entries in the same order.
+    uint16_t *values;
+    struct DispatchEntry *entries;
+
+    struct DispatchRange ranges[CONTROL_DISPATCH_RANGE_COUNT];
+
+    size_t size; // Of the whole block, for munlock.
+    int count;
+};
+
+// Where the process callback's range for a message is.
+static unsigned int range_index( unsigned int midi_type, unsigned char midi_channel )
+{
+    return ( midi_type << 4 ) | ( midi_channel & 0xf );
+}
+
+struct PendingMapping {
+    unsigned int range;
+    uint16_t value;
+    int order; // Keeps the table's order for mappings on the same message.
+    struct DispatchEntry entry;
+};
+
+struct PendingMappings {
+    struct PendingMapping *mappings;
+    int count;
+};
+
+static void count_mapping(
+        unsigned char midi_channel,
+        enum MidiControlType midi_type,
+        unsigned char midi_value,
+        Loop loop,
+        LoopControlFunc action,
+        void *user_data
+    ) {
+
+    ( *(int *) user_data )++;
+}
+
+static void collect_mapping(
+        unsigned char midi_channel,
+        enum MidiControlType midi_type,
+        unsigned char midi_value,
+        Loop loop,
+        LoopControlFunc action,
+        void *user_data
+    ) {
+
+    struct PendingMappings *pending = user_data;
+    struct PendingMapping *mapping = &( pending->mappings[pending->count] );
+
+    mapping->range = range_index( midi_type, midi_channel );
+    mapping->value = midi_value;
+    mapping->order = pending->count++;
+    mapping->entry.loop = loop;
+    mapping->entry.action = action;
+}
+
+static int compare_pending( const void *a, const void *b )
+{
+    const struct PendingMapping *x = a, *y = b;
+    if( x->range != y->range ) {
+        return x->range < y->range ? -1 : 1;
+    }
+    if( x->value != y->value ) {
+        return x->value < y->value ? -1 : 1;
+    }
+    return ( x->order > y->order ) - ( x->order < y->order );
+}
+
+ControlDispatch control_dispatch_build( ControlActionTable table )
+{
+    int count = 0;
+    control_action_table_foreach_mapping( table, count_mapping, &count );
+
+    // Values first, since they're what the lookup touches.
+    size_t values_offset = sizeof( struct control_dispatch_type );
+    size_t entries_offset = values_offset + count * sizeof( uint16_t );
+    entries_offset = ( entries_offset + sizeof( void * ) - 1 ) & ~( sizeof( void * ) - 1 );
+    size_t size = entries_offset + count * sizeof( struct DispatchEntry );
+
+    struct PendingMappings pending = {
+        .mappings = malloc( ( count ? count : 1 ) * sizeof( struct PendingMapping ) ),
+        .count = 0
+    };
+    struct control_dispatch_type *this = calloc( 1, size );
+    if( this == NULL || pending.mappings == NULL ) {
+        free( pending.mappings );
+        free( this );
+        return NULL;
+    }
+
+    this->size = size;
+    this->values = (uint16_t *) ( (char *) this + values_offset );
+    this->entries = (struct DispatchEntry *) ( (char *) this + entries_offset );
+
+    control_action_table_foreach_mapping( table, collect_mapping, &pending );
+    this->count = pending.count;
+    qsort( pending.mappings, pending.count, sizeof( struct PendingMapping ), compare_pending );
+
+    for( int i = 0; i < pending.count; i++ ) {
+        struct PendingMapping *mapping = &( pending.mappings[i] );
+        struct DispatchRange *range = &( this->ranges[mapping->range] );
+
+        if( range->begin == range->end ) {
+            range->begin = i;
+        }
+        range->end = i + 1;
+
+        this->values[i] = mapping->value;
+        this->entries[i] = mapping->entry;
+    }
+
+    free( pending.mappings );
+    mlock( this, size );
+    return this;
+}
+
+void control_dispatch_free( ControlDispatch this )
+{
+    if( this ) {
+        munlock( this, this->size );
+        free( this );
+    }
+}
+
+int control_dispatch_mapping_count( ControlDispatch this )
+{
+    return this->count;
+}
+
+int control_dispatch_invoke(
+        ControlDispatch this,
+        unsigned char midi_channel,
+        unsigned int midi_type,
+        uint16_t midi_value,
+        uint64_t frame
+    ) {
+
+    if( midi_type >= CONTROL_DISPATCH_TYPE_COUNT ) {
+        return 0;
+    }
+
+    const struct DispatchRange *range = &( this->ranges[range_index( midi_type, midi_channel )] );
+    unsigned int low = range->begin, high = range->end;
+
+    // Narrows [low, high) down to the first value that isn't below midi_value.
+    while( high - low > LINEAR_SEARCH_LIMIT ) {
+        unsigned int middle = low + ( high - low ) / 2;
+        if( this->values[middle] < midi_value ) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    while( low < range->end && this->values[low] < midi_value ) {
+        low++;
+    }
+
+    int run = 0;
+    for( ; low < range->end && this->values[low] == midi_value; low++, run++ ) {
+        this->entries[low].action( this->entries[low].loop, frame );
+    }
+    return run;
+}
@@ -0,0 +1,53 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#ifndef CONTROL_DISPATCH_H
+#define CONTROL_DISPATCH_H
+
+#include <stdint.h>
+
+#include <jack/jack.h>
+
+#include "control_action_table.h"
+
+/* The process callback's read-only view of a control action table.  All of
+   the mappings live in one contiguous block: a range per (type, channel)
+   indexing a sorted run of values, with the (loop, action) pairs stored
+   alongside.  Rather than editing it, build a new one whenever the table
+   changes. */
+
+typedef struct control_dispatch_type *ControlDispatch;
+
+/* Room for message types beyond enum MidiControlType.  Each one only costs
+   another 16 ranges, and values are 16 bits so that pitch bend fits. */
+#define CONTROL_DISPATCH_TYPE_COUNT 8
+
+// Not RT.
+ControlDispatch control_dispatch_build( ControlActionTable table );
+void control_dispatch_free( ControlDispatch this );
+int control_dispatch_mapping_count( ControlDispatch this );
+
+// RT.  Runs every action mapped to the message, in table order, returning how many ran.
+int control_dispatch_invoke(
+    ControlDispatch this,
+    unsigned char midi_channel,
+    unsigned int midi_type,
+    uint16_t midi_value,
+    uint64_t frame
+);
+
+#endif
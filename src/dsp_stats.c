@@ -0,0 +1,79 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "dsp_stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+void dsp_stats_init( struct DspStats *stats )
+{
+    memset( stats, 0, sizeof( *stats ) );
+}
+
+uint64_t dsp_stats_clock( void )
+{
+    // Served from the vDSO on Linux, so no system call.
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void dsp_stats_record( struct DspStats *stats, uint64_t ns )
+{
+    stats->samples[stats->next] = ns > UINT32_MAX ? UINT32_MAX : (uint32_t) ns;
+    stats->next = ( stats->next + 1 ) % DSP_STATS_WINDOW;
+    if( stats->count < DSP_STATS_WINDOW ) {
+        stats->count++;
+    }
+}
+
+static int compare_samples( const void *a, const void *b )
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return ( x > y ) - ( x < y );
+}
+
+void dsp_stats_summarize( const struct DspStats *stats, struct DspSummary *summary )
+{
+    uint32_t sorted[DSP_STATS_WINDOW];
+    unsigned int count = stats->count;
+
+    memcpy( sorted, stats->samples, sizeof( sorted ) );
+    summary->overruns = stats->overruns;
+    summary->shed = stats->shed;
+
+    if( count == 0 ) {
+        summary->min = summary->mean = summary->p99 = 0;
+        return;
+    }
+
+    // Until the window fills, the valid samples are the ones at the front.
+    qsort( sorted, count, sizeof( sorted[0] ), compare_samples );
+
+    uint64_t total = 0;
+    for( unsigned int i = 0; i < count; i++ ) {
+        total += sorted[i];
+    }
+
+    summary->min = sorted[0];
+    summary->mean = total / count;
+    summary->p99 = sorted[( count * 99 ) / 100];
+}
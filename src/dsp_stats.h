@@ -0,0 +1,55 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#ifndef DSP_STATS_H
+#define DSP_STATS_H
+
+#include <stdint.h>
+
+// Cycles the rolling statistics cover.
+#define DSP_STATS_WINDOW 256
+
+/* Processing cost of something (a loop, a whole cycle) over its last
+   DSP_STATS_WINDOW cycles.  Only the process thread writes it; readers get a
+   summary that may be a cycle or so stale, which is fine for statistics. */
+struct DspStats {
+    uint32_t samples[DSP_STATS_WINDOW]; // Nanoseconds.
+    unsigned int next;
+    unsigned int count;
+
+    unsigned int overruns; // Cycles over budget that were pinned on this.
+    unsigned int shed;     // Cycles this ran with recording and through bypassed.
+};
+
+struct DspSummary {
+    uint32_t min;
+    uint32_t mean;
+    uint32_t p99;
+    unsigned int overruns;
+    unsigned int shed;
+};
+
+void dsp_stats_init( struct DspStats *stats );
+
+// RT.  A cheap monotonic clock, in nanoseconds.
+uint64_t dsp_stats_clock( void );
+void dsp_stats_record( struct DspStats *stats, uint64_t ns );
+
+// Not RT.
+void dsp_stats_summarize( const struct DspStats *stats, struct DspSummary *summary );
+
+#endif
@@ -0,0 +1,1057 @@
+/* JACK MIDI LOOPER
+Copyright (C) 2014  Joshua Otto
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "engine.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <jack/jack.h>
+#include <jack/midiport.h>
+#include <jack/ringbuffer.h>
+
+#include "control_action_table.h"
+#include "control_dispatch.h"
+#include "debug.h"
+#include "dsp_stats.h"
+#include "input_bus.h"
+#include "loop.h"
+#include "midi_message.h"
+#include "output_bus.h"
+#include "rt_log.h"
+#include "trace.h"
+#include "transport_grid.h"
+
+#define NOTE_OFF 0x80
+#define NOTE_ON 0x90
+#define CONTROL_CHANGE 0xB0
+
+// How long engine_publish sleeps between checks on the process thread.
+#define PUBLISH_POLL_INTERVAL_NS 500000
+
+// Commands not yet taken by the process thread.  More than this and they're refused.
+#define ENGINE_QUEUED_COMMANDS 256
+
+struct EngineCommand {
+    enum EngineCommandType type;
+    unsigned int loop_id;
+    int immediate;
+    jack_nframes_t frame; // Absolute.
+};
+
+/* What the process callback reads for every loop every cycle, kept in one
+   array so that getting past the idle ones doesn't touch the loops at all.
+   A loop's own state, schedule and read cursor stay in the Loop: they have
+   to outlive any one snapshot, and other threads read them there. */
+struct EngineLoop {
+    Loop loop;
+    unsigned int id;
+    int input_source; // As of publishing - see loop_set_input_source.
+    jack_port_t *input;
+    jack_port_t *output;
+
+    /* NULL unless the loop's on the shared output.  Its own port then only
+       needs clearing once, to get rid of whatever it last played there. */
+    struct OutputBusStage *stage;
+    int clear_output;
+};
+
+#define IDLE_WORD_BITS 64
+
+/* Loops are handed out to the workers (and the process thread) this many at
+   a time, so each claim is worth the compare and swap it costs. */
+#define ENGINE_WORKER_CHUNK 8
+
+// All that fits the claim word, see EngineCycle.  Any more and the loops are processed serially.
+#define ENGINE_MAX_CHUNKS 0xffff
+
+// How long the process thread spins on the barrier before it starts yielding.
+#define ENGINE_BARRIER_SPINS 4096
+
+// What a chunk of loops cost, merged on the process thread after the barrier.
+struct EngineChunk {
+    Loop costliest;
+    uint64_t costliest_ns;
+};
+
+// Everything the process callback needs, immutable once published apart from idle and chunks.
+struct EngineSnapshot {
+    struct EngineLoop *loops;
+    int loop_count;
+    int free_running; // The loops before the first one synced to another.
+    ControlDispatch dispatch;
+    int bus_subscribers; // Loops on the shared input, which is only decoded if there are any.
+
+    // RT only, one of each for every loop on the shared output, in loop order.
+    struct OutputBusStage *stages;
+    int stage_count;
+    uint64_t *merge_heap;
+    struct MidiMessage *stage_messages; // What the stages point into.
+
+    /* RT only.  A bit per loop, set once it's idle (see loop_is_idle), so
+       that it can skip any cycle with no input until something wakes it.
+       Neighbouring loops may be processed on different threads, hence the
+       atomic read-modify-writes. */
+    uint64_t *idle;
+
+    // RT only, one per ENGINE_WORKER_CHUNK free running loops.
+    struct EngineChunk *chunks;
+    int chunk_count;
+
+    unsigned int generation; // Counts publishes, for the trace.
+};
+
+/* The loop processing half of a cycle, as handed to the workers.  Only the
+   process thread writes it, and only before handing it out. */
+struct EngineCycle {
+    struct EngineSnapshot *snapshot;
+    jack_nframes_t nframes;
+    uint64_t frame;
+    uint64_t start; // dsp_stats_clock.
+    uint64_t shed_ns;
+
+    // Set by whichever thread starts shedding first, and from then on seen by the others.
+    int shed;
+
+    /* The cycle's generation in the top 32 bits, then its chunk count and
+       the next chunk to be claimed in 16 bits each.  Chunks are claimed by
+       compare and swap on the whole word, so a worker that wakes late can
+       only ever claim chunks of the cycle that's running. */
+    uint64_t claim;
+    int chunks_done;
+};
+
+struct engine_type {
+    jack_client_t *jack_client;
+    jack_port_t *control_input;
+    InputBus input_bus;
+    OutputBus output_bus;
+
+    // Only ever swapped as a whole, with __atomic builtins.
+    struct EngineSnapshot *snapshot;
+
+    /* Incremented on the way into and out of every process cycle, so it's odd
+       exactly when the process thread might be holding a snapshot. */
+    unsigned int cycle_sequence;
+
+    pthread_mutex_t publish_lock; // Serializes publishers, never taken in RT.
+    unsigned int generation;
+
+    // Cost accounting - see engine_set_dsp_budget.
+    jack_nframes_t sample_rate;
+    jack_nframes_t period_frames;
+    uint64_t period_ns;
+    unsigned int budget_percent;
+    unsigned int shed_percent;
+    struct DspStats cycle_stats;
+
+    /* Single producer, consumed at the top of engine_process.  Commands due
+       in a later cycle go straight on to their loop's state schedule. */
+    jack_ringbuffer_t *commands;
+    jack_nframes_t max_command_lateness;
+
+    /* RT only: jack_last_frame_time widened to 64 bits, so that it never
+       wraps while anything is scheduled against it. */
+    uint64_t frame_clock;
+    jack_nframes_t frame_clock_low;
+
+    // RT only, and what the loops quantize against.
+    struct TransportGrid transport_grid;
+
+    // See engine_set_workers.
+    jack_native_thread_t workers[ENGINE_MAX_WORKERS];
+    int worker_count;
+    int workers_quit;
+    sem_t worker_wake;
+    struct EngineCycle cycle;
+
+    // See engine_set_trace.  RT only once it's set.
+    Trace trace;
+    unsigned int traced_generation;
+    int traced;
+};
+
+static void *worker_thread( void *arg );
+
+static void snapshot_free( struct EngineSnapshot *snapshot )
+{
+    if( snapshot ) {
+        free( snapshot->loops );
+        free( snapshot->idle );
+        free( snapshot->chunks );
+        free( snapshot->stages );
+        free( snapshot->merge_heap );
+        if( snapshot->stage_messages ) {
+            munlock(
+                snapshot->stage_messages,
+                snapshot->stage_count * OUTPUT_BUS_STAGE_MESSAGES * sizeof( struct MidiMessage )
+            );
+        }
+        free( snapshot->stage_messages );
+        control_dispatch_free( snapshot->dispatch );
+        free( snapshot );
+    }
+}
+
+Engine engine_new( jack_client_t *jack_client )
+{
+    struct engine_type *this = malloc( sizeof( *this ) );
+    if( this == NULL ) {
+        return NULL;
+    }
+
+    this->jack_client = jack_client;
+    this->snapshot = NULL;
+    this->cycle_sequence = 0;
+    this->generation = 0;
+    this->trace = NULL;
+    this->traced_generation = 0;
+    this->traced = 0;
+
+    this->sample_rate = jack_get_sample_rate( jack_client );
+    this->period_frames = jack_get_buffer_size( jack_client );
+    this->period_ns = (uint64_t) this->period_frames * 1000000000ULL / this->sample_rate;
+    this->budget_percent = ENGINE_DEFAULT_BUDGET_PERCENT;
+    this->shed_percent = 0;
+    dsp_stats_init( &this->cycle_stats );
+
+    this->max_command_lateness = this->period_frames;
+    this->frame_clock_low = jack_last_frame_time( jack_client );
+    this->frame_clock = this->frame_clock_low;
+    transport_grid_init( &this->transport_grid );
+    this->worker_count = 0;
+    this->workers_quit = 0;
+    memset( &this->cycle, 0, sizeof( this->cycle ) );
+    this->commands = jack_ringbuffer_create( ENGINE_QUEUED_COMMANDS * sizeof( struct EngineCommand ) );
+    if( this->commands == NULL ) {
+        fprintf( stderr, "Could not create the engine command queue.\n" );
+        free( this );
+        return NULL;
+    }
+    jack_ringbuffer_mlock( this->commands );
+
+    if( pthread_mutex_init( &this->publish_lock, NULL ) != 0 ) {
+        fprintf( stderr, "Engine publish mutex init failed.\n" );
+        jack_ringbuffer_free( this->commands );
+        free( this );
+        return NULL;
+    }
+
+    if( sem_init( &this->worker_wake, 0, 0 ) != 0 ) {
+        fprintf( stderr, "Engine worker semaphore init failed.\n" );
+        pthread_mutex_destroy( &this->publish_lock );
+        jack_ringbuffer_free( this->commands );
+        free( this );
+        return NULL;
+    }
+
+    this->control_input = jack_port_register(
+        jack_client,
+        "control input",
+        JACK_DEFAULT_MIDI_TYPE,
+        JackPortIsInput,
+        0
+    );
+
+    if( this->control_input == NULL ) {
+        fprintf( stderr, "Could not register JACK control input port.\n" );
+        sem_destroy( &this->worker_wake );
+        pthread_mutex_destroy( &this->publish_lock );
+        jack_ringbuffer_free( this->commands );
+        free( this );
+        return NULL;
+    }
+
+    this->input_bus = input_bus_new( jack_client, "shared input" );
+    this->output_bus = output_bus_new( jack_client, "shared output" );
+    if( this->input_bus == NULL || this->output_bus == NULL ) {
+        input_bus_free( this->input_bus );
+        output_bus_free( this->output_bus );
+        jack_port_unregister( jack_client, this->control_input );
+        sem_destroy( &this->worker_wake );
+        pthread_mutex_destroy( &this->publish_lock );
+        jack_ringbuffer_free( this->commands );
+        free( this );
+        return NULL;
+    }
+
+    return this;
+}
+
+void engine_free( Engine this )
+{
+    if( this ) {
+        engine_set_workers( this, 0, 0 );
+
+        // Unhooks the process callback from the last snapshot before freeing it.
+        engine_publish( this, NULL, 0, NULL );
+        jack_port_unregister( this->jack_client, this->control_input );
+        input_bus_free( this->input_bus );
+        output_bus_free( this->output_bus );
+        sem_destroy( &this->worker_wake );
+        pthread_mutex_destroy( &this->publish_lock );
+        jack_ringbuffer_free( this->commands );
+        free( this );
+    }
+}
+
+// Where a loop goes in a snapshot.
+struct PublishOrder {
+    Loop loop;
+    int depth; // How many masters it's synced through.
+    int priority;
+    int index; // As handed over, which breaks ties.
+};
+
+/* Free running loops first, then every loop after whatever it's synced to,
+   and within that, highest priority first, so that shedding starts from the
+   back. */
+static int compare_order( const void *a, const void *b )
+{
+    const struct PublishOrder *x = a, *y = b;
+    if( x->depth != y->depth ) {
+        return x->depth - y->depth;
+    }
+    if( x->priority != y->priority ) {
+        return ( y->priority > x->priority ) - ( y->priority < x->priority );
+    }
+    return x->index - y->index;
+}
+
+// Loops can be synced round in a circle, so no deeper than there are loops.
+static int sync_depth( Loop loop, int loop_count )
+{
+    int depth = 0;
+    for( Loop master = loop_get_sync_master( loop ); master && depth < loop_count; master = loop_get_sync_master( master ) ) {
+        depth++;
+    }
+    return depth;
+}
+
+static void order_loops( Loop *loops, int loop_count, int *free_running )
+{
+    struct PublishOrder *order = malloc( ( loop_count ? loop_count : 1 ) * sizeof( struct PublishOrder ) );
+    *free_running = 0;
+    for( int i = 0; i < loop_count; i++ ) {
+        order[i].loop = loops[i];
+        order[i].depth = sync_depth( loops[i], loop_count );
+        order[i].priority = loop_get_priority( loops[i] );
+        order[i].index = i;
+        *free_running += order[i].depth == 0;
+    }
+
+    qsort( order, loop_count, sizeof( struct PublishOrder ), compare_order );
+    for( int i = 0; i < loop_count; i++ ) {
+        loops[i] = order[i].loop;
+    }
+    free( order );
+}
+
+void engine_publish(
+        Engine this,
+        Loop *loops,
+        int loop_count,
+        ControlDispatch dispatch
+    ) {
+
+    struct EngineSnapshot *next = NULL;
+    if( loops != NULL || dispatch != NULL ) {
+        int free_running = 0;
+        if( loops != NULL ) {
+            order_loops( loops, loop_count, &free_running );
+        }
+
+        next = malloc( sizeof( *next ) );
+        next->loops = malloc( ( loop_count ? loop_count : 1 ) * sizeof( struct EngineLoop ) );
+        next->idle = calloc( loop_count / IDLE_WORD_BITS + 1, sizeof( uint64_t ) );
+        next->chunk_count = ( free_running + ENGINE_WORKER_CHUNK - 1 ) / ENGINE_WORKER_CHUNK;
+        next->chunks = calloc( next->chunk_count + 1, sizeof( struct EngineChunk ) );
+        next->loop_count = loop_count;
+        next->free_running = free_running;
+        next->dispatch = dispatch;
+        next->bus_subscribers = 0;
+        next->stage_count = 0;
+        for( int i = 0; i < loop_count; i++ ) {
+            next->stage_count += loop_get_output_target( loops[i] ) != LOOP_OUTPUT_PORT;
+        }
+        next->stages = calloc( next->stage_count + 1, sizeof( struct OutputBusStage ) );
+        next->merge_heap = calloc( next->stage_count + 1, sizeof( uint64_t ) );
+        next->stage_messages = NULL;
+        if( next->stage_count ) {
+            size_t size = next->stage_count * OUTPUT_BUS_STAGE_MESSAGES * sizeof( struct MidiMessage );
+            next->stage_messages = calloc( 1, size );
+            mlock( next->stage_messages, size );
+        }
+        int stage = 0;
+
+        for( int i = 0; i < loop_count; i++ ) {
+            loop_set_transport_grid( loops[i], &this->transport_grid );
+            next->loops[i].loop = loops[i];
+            next->loops[i].id = loop_get_id( loops[i] );
+            next->loops[i].input_source = loop_get_input_source( loops[i] );
+            next->bus_subscribers += next->loops[i].input_source != LOOP_INPUT_PORT;
+
+            int output_target = loop_get_output_target( loops[i] );
+            next->loops[i].stage = NULL;
+            next->loops[i].clear_output = 0;
+            if( output_target != LOOP_OUTPUT_PORT ) {
+                struct OutputBusStage *bus_stage = &( next->stages[stage] );
+                bus_stage->messages = &( next->stage_messages[stage * OUTPUT_BUS_STAGE_MESSAGES] );
+                bus_stage->count = 0;
+                bus_stage->channel = output_target;
+                next->loops[i].stage = bus_stage;
+                next->loops[i].clear_output = 1;
+                stage++;
+            }
+            next->loops[i].input = loop_get_input_port( loops[i] );
+            next->loops[i].output = loop_get_output_port( loops[i] );
+        }
+        free( loops );
+    }
+
+    pthread_mutex_lock( &this->publish_lock );
+
+    // Never 0, which is what no snapshot at all counts as.
+    if( next ) {
+        next->generation = ++this->generation ? this->generation : ++this->generation;
+    }
+
+    struct EngineSnapshot *previous =
+        __atomic_exchange_n( &this->snapshot, next, __ATOMIC_SEQ_CST );
+
+    /* If the process thread is mid-cycle it may have loaded the previous
+       snapshot before the exchange, so wait for that cycle to finish.  Any
+       cycle that starts after the exchange can only see the new one. */
+    unsigned int sequence = __atomic_load_n( &this->cycle_sequence, __ATOMIC_SEQ_CST );
+    if( sequence & 1 ) {
+        struct timespec poll_interval = { 0, PUBLISH_POLL_INTERVAL_NS };
+        while( __atomic_load_n( &this->cycle_sequence, __ATOMIC_SEQ_CST ) == sequence ) {
+            nanosleep( &poll_interval, NULL );
+        }
+    }
+
+    pthread_mutex_unlock( &this->publish_lock );
+
+    snapshot_free( previous );
+}
+
+void engine_set_dsp_budget( Engine this, unsigned int budget_percent, unsigned int shed_percent )
+{
+    __atomic_store_n( &this->budget_percent, budget_percent, __ATOMIC_RELAXED );
+    __atomic_store_n( &this->shed_percent, shed_percent, __ATOMIC_RELAXED );
+}
+
+void engine_get_dsp_summary( Engine this, struct EngineDspSummary *summary )
+{
+    dsp_stats_summarize( &this->cycle_stats, &summary->cycle );
+    summary->period_ns = __atomic_load_n( &this->period_ns, __ATOMIC_RELAXED );
+    summary->budget_percent = __atomic_load_n( &this->budget_percent, __ATOMIC_RELAXED );
+    summary->shed_percent = __atomic_load_n( &this->shed_percent, __ATOMIC_RELAXED );
+}
+
+int engine_queue_command(
+        Engine this,
+        unsigned int loop_id,
+        enum EngineCommandType type,
+        jack_time_t when
+    ) {
+
+    struct EngineCommand command = {
+        .type = type,
+        .loop_id = loop_id,
+        .immediate = when == ENGINE_COMMAND_NOW,
+        .frame = when == ENGINE_COMMAND_NOW ? 0 : jack_time_to_frames( this->jack_client, when )
+    };
+
+    if( jack_ringbuffer_write_space( this->commands ) < sizeof( command ) ) {
+        return -10;
+    }
+
+    jack_ringbuffer_write( this->commands, (char *) &command, sizeof( command ) );
+    return 0;
+}
+
+void engine_set_trace( Engine this, Trace trace )
+{
+    this->trace = trace;
+}
+
+void engine_set_max_command_lateness( Engine this, jack_nframes_t frames )
+{
+    __atomic_store_n( &this->max_command_lateness, frames, __ATOMIC_RELAXED );
+}
+
+int engine_set_workers( Engine this, int count, int oversubscribe )
+{
+    long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    if( count > ENGINE_MAX_WORKERS ) {
+        count = ENGINE_MAX_WORKERS;
+    }
+    if( !oversubscribe && cpus > 0 && count > cpus - 1 ) {
+        count = cpus - 1;
+    }
+    if( count < 0 ) {
+        count = 0;
+    }
+
+    // The process thread never waits on a worker, only on chunks they've claimed, so they can go any time.
+    int running = __atomic_load_n( &this->worker_count, __ATOMIC_RELAXED );
+    if( running ) {
+        __atomic_store_n( &this->worker_count, 0, __ATOMIC_RELAXED );
+        __atomic_store_n( &this->workers_quit, 1, __ATOMIC_RELEASE );
+        for( int i = 0; i < running; i++ ) {
+            sem_post( &this->worker_wake );
+        }
+        for( int i = 0; i < running; i++ ) {
+            jack_client_stop_thread( this->jack_client, this->workers[i] );
+        }
+
+        // Wake-ups nobody was left to take.
+        while( sem_trywait( &this->worker_wake ) == 0 ) {
+        }
+        __atomic_store_n( &this->workers_quit, 0, __ATOMIC_RELEASE );
+    }
+
+    // At the process thread's priority, so a worker is never what holds a cycle up.
+    int started = 0;
+    for( ; started < count; started++ ) {
+        if( jack_client_create_thread(
+                this->jack_client,
+                &this->workers[started],
+                jack_client_real_time_priority( this->jack_client ),
+                jack_is_realtime( this->jack_client ),
+                worker_thread,
+                this
+            ) != 0 ) {
+            fprintf( stderr, "Could only start %d of %d engine workers.\n", started, count );
+            break;
+        }
+    }
+    __atomic_store_n( &this->worker_count, started, __ATOMIC_RELEASE );
+    return started;
+}
+
+static int is_idle( struct EngineSnapshot *snapshot, int index )
+{
+    uint64_t word = __atomic_load_n( &snapshot->idle[index / IDLE_WORD_BITS], __ATOMIC_RELAXED );
+    return ( word >> ( index % IDLE_WORD_BITS ) ) & 1;
+}
+
+static void set_idle( struct EngineSnapshot *snapshot, int index, int idle )
+{
+    uint64_t bit = (uint64_t) 1 << ( index % IDLE_WORD_BITS );
+    uint64_t *word = &( snapshot->idle[index / IDLE_WORD_BITS] );
+
+    // Not worth the locked instruction when the bit's already right, which it mostly is.
+    if( ( ( __atomic_load_n( word, __ATOMIC_RELAXED ) & bit ) != 0 ) == ( idle != 0 ) ) {
+        return;
+    }
+    if( idle ) {
+        __atomic_fetch_or( word, bit, __ATOMIC_RELAXED );
+    } else {
+        __atomic_fetch_and( word, ~bit, __ATOMIC_RELAXED );
+    }
+}
+
+static void run_command( struct EngineSnapshot *snapshot, const struct EngineCommand *command, uint64_t frame )
+{
+    // The loop may have been deleted since, in which case there's nothing to do.
+    for( int i = 0; i < snapshot->loop_count; i++ ) {
+        if( snapshot->loops[i].id != command->loop_id ) {
+            continue;
+        }
+
+        Loop loop = snapshot->loops[i].loop;
+        set_idle( snapshot, i, 0 );
+
+        switch( command->type ) {
+            case ENGINE_COMMAND_TOGGLE_PLAYBACK: loop_toggle_playback( loop, frame ); break;
+            case ENGINE_COMMAND_TOGGLE_RECORDING: loop_toggle_recording( loop, frame ); break;
+            case ENGINE_COMMAND_STOP: loop_stop( loop, frame ); break;
+            case ENGINE_COMMAND_TOGGLE_OVERDUB: loop_toggle_overdub( loop, frame ); break;
+            case ENGINE_COMMAND_TOGGLE_REPLACE: loop_toggle_replace( loop, frame ); break;
+            case ENGINE_COMMAND_CAPTURE: loop_capture( loop, frame ); break;
+        }
+        return;
+    }
+}
+
+/* Hands count queued commands to their loops, which hold on to them until
+   they're due, tracing them if trace isn't NULL.  Command frames are only 32
+   bits, so they're taken relative to the cycle - anything within 2^31
+   frames either way. */
+static void process_commands(
+        Engine this,
+        struct EngineSnapshot *snapshot,
+        uint64_t cycle_frame,
+        size_t count,
+        Trace trace
+    ) {
+
+    jack_nframes_t max_lateness = __atomic_load_n( &this->max_command_lateness, __ATOMIC_RELAXED );
+
+    struct EngineCommand command;
+    for( size_t i = 0; i < count; i++ ) {
+        jack_ringbuffer_read( this->commands, (char *) &command, sizeof( command ) );
+
+        int32_t offset = command.immediate ? 0 : (int32_t) ( command.frame - (jack_nframes_t) cycle_frame );
+        if( offset < 0 ) {
+            if( (uint32_t) -offset > max_lateness ) {
+                rt_log( RT_LOG_COMMAND_LATE, command.loop_id, 0, -offset );
+                continue;
+            }
+            offset = 0;
+        }
+
+        if( trace ) {
+            trace_command( trace, command.loop_id, command.type, cycle_frame + offset );
+        }
+        run_command( snapshot, &command, cycle_frame + offset );
+    }
+}
+
+/* Starts the cycle's trace with everything from outside it's about to
+   see.  Returns non-zero if the trace hasn't room for it. */
+static int begin_trace(
+        Engine this,
+        struct EngineSnapshot *snapshot,
+        jack_nframes_t nframes,
+        uint64_t cycle_frame,
+        size_t commands,
+        int transport_moved
+    ) {
+
+    Trace trace = this->trace;
+    void *control = jack_port_get_buffer( this->control_input, nframes );
+    void *shared = jack_port_get_buffer( input_bus_get_port( this->input_bus ), nframes );
+    int loop_count = snapshot ? snapshot->loop_count : 0;
+
+    size_t bytes = trace_cycle_bytes( commands ) + trace_port_bytes( control ) + trace_port_bytes( shared );
+    for( int i = 0; i < loop_count; i++ ) {
+        bytes += trace_port_bytes( jack_port_get_buffer( snapshot->loops[i].input, nframes ) );
+    }
+    if( trace_begin_cycle( trace, cycle_frame, nframes, bytes ) != 0 ) {
+        return -1;
+    }
+
+    unsigned int generation = snapshot ? snapshot->generation : 0;
+    if( generation != this->traced_generation ) {
+        trace_snapshot( trace, generation );
+        this->traced_generation = generation;
+    }
+
+    // The grid only moves when the transport does something unexpected, so that's all a replay needs.
+    if( transport_moved || !this->traced ) {
+        jack_position_t position;
+        jack_transport_state_t state = jack_transport_query( this->jack_client, &position );
+        trace_transport( trace, state, &position );
+    }
+    this->traced = 1;
+
+    trace_port( trace, TRACE_CONTROL_INPUT, 0, control );
+    trace_port( trace, TRACE_SHARED_INPUT, 0, shared );
+    for( int i = 0; i < loop_count; i++ ) {
+        trace_port( trace, TRACE_LOOP_INPUT, snapshot->loops[i].id, jack_port_get_buffer( snapshot->loops[i].input, nframes ) );
+    }
+    return 0;
+}
+
+// What the cycle played, for a replay to check itself against.
+static uint64_t hash_outputs( Engine this, struct EngineSnapshot *snapshot, jack_nframes_t nframes )
+{
+    uint64_t hash = trace_hash_port( 0, 0, jack_port_get_buffer( output_bus_get_port( this->output_bus ), nframes ) );
+    for( int i = 0; snapshot && i < snapshot->loop_count; i++ ) {
+        hash = trace_hash_port( hash, snapshot->loops[i].id, jack_port_get_buffer( snapshot->loops[i].output, nframes ) );
+    }
+    return hash;
+}
+
+static void process_control_input(
+        Engine this,
+        struct EngineSnapshot *snapshot,
+        jack_nframes_t nframes,
+        uint64_t cycle_frame
+    ) {
+
+    int events;
+    void *control_port_buffer;
+
+    control_port_buffer = jack_port_get_buffer( this->control_input, nframes );
+    if ( control_port_buffer == NULL) {
+        rt_log( RT_LOG_CONTROL_BUFFER, RT_LOG_NO_LOOP, 0, 0 );
+        return;
+    }
+
+    events = jack_midi_get_event_count( control_port_buffer );
+
+    int i;
+    for ( i = 0; i < events; i++ ) {
+        struct MidiMessage rev;
+
+        int read_message_result = midi_message_from_port_buffer( &rev, control_port_buffer, i );
+        if( read_message_result != 0 ) {
+            rt_log(
+                read_message_result < 0 ? RT_LOG_EVENT_GET_FAILED : RT_LOG_SYSEX_IGNORED,
+                RT_LOG_NO_LOOP,
+                0,
+                i
+            );
+            continue;
+        }
+        unsigned char midi_channel, midi_value;
+        enum MidiControlType midi_type;
+        unsigned char message_type = rev.data[0] & 0xf0;
+        if(
+            message_type == NOTE_ON
+            || message_type == NOTE_OFF
+            || message_type == CONTROL_CHANGE
+        ) {
+            midi_value = rev.data[1];
+            midi_channel = rev.data[0] & 0xf;
+
+            switch( message_type ) {
+                case NOTE_ON: midi_type = TYPE_NOTE_ON; break;
+                case NOTE_OFF: midi_type = TYPE_NOTE_OFF; break;
+                case CONTROL_CHANGE: midi_type = rev.data[2] > 63 ? TYPE_CC_ON : TYPE_CC_OFF; break;
+                default:
+                    // shut gcc up
+                    midi_type = TYPE_NOTE_ON;
+                    assert( 0 );
+                    break;
+            }
+
+            DEBUGGING_MESSAGE( "control %u %d %u\n", midi_channel, midi_type, midi_value );
+            int run = control_dispatch_invoke(
+                snapshot->dispatch,
+                midi_channel,
+                midi_type,
+                midi_value,
+                cycle_frame + rev.time
+            );
+
+            // Controls are rare enough that waking everything beats finding out which loops.
+            if( run ) {
+                memset( snapshot->idle, 0, ( snapshot->loop_count / IDLE_WORD_BITS + 1 ) * sizeof( uint64_t ) );
+            }
+        }
+    }
+}
+
+/* Loops [ first, last ) of the cycle, on whichever thread claimed them.
+   loop_start carries on from the thread's last chunk, if it had one. */
+static void process_loops(
+        Engine this,
+        int first,
+        int last,
+        uint64_t *loop_start,
+        struct EngineChunk *cost
+    ) {
+
+    struct EngineCycle *cycle = &this->cycle;
+    struct EngineSnapshot *snapshot = cycle->snapshot;
+    jack_nframes_t nframes = cycle->nframes;
+
+    for( int i = first; i < last; i++ ) {
+        struct EngineLoop *record = &( snapshot->loops[i] );
+
+        struct InputBusMessages bus_messages, *bus_input = NULL;
+        if( record->input_source != LOOP_INPUT_PORT ) {
+            input_bus_messages( this->input_bus, record->input_source, &bus_messages );
+            bus_input = &bus_messages;
+        }
+
+        if( record->clear_output ) {
+            void *output = jack_port_get_buffer( record->output, nframes );
+            if( output != NULL ) {
+                jack_midi_clear_buffer( output );
+            }
+            record->clear_output = 0;
+        }
+
+        /* Its output still has to be cleared, unless it's on the shared
+           output.  Skipped loops go on the next one's time, rather than
+           reading the clock for each. */
+        if( is_idle( snapshot, i ) ) {
+            int quiet;
+            if( bus_input ) {
+                quiet = bus_input->count == 0;
+            } else {
+                void *input = jack_port_get_buffer( record->input, nframes );
+                quiet = input != NULL && jack_midi_get_event_count( input ) == 0;
+            }
+
+            if( quiet && record->stage ) {
+                continue;
+            }
+            void *output = quiet ? jack_port_get_buffer( record->output, nframes ) : NULL;
+            if( output != NULL ) {
+                jack_midi_clear_buffer( output );
+                continue;
+            }
+        }
+
+        Loop loop = record->loop;
+        struct DspStats *stats = loop_get_dsp_stats( loop );
+
+        /* Loops are claimed in priority order, so once anyone starts
+           shedding everyone keeps going. */
+        int shed = __atomic_load_n( &cycle->shed, __ATOMIC_RELAXED );
+        if( !shed && cycle->shed_ns && *loop_start - cycle->start > cycle->shed_ns ) {
+            shed = 1;
+            __atomic_store_n( &cycle->shed, 1, __ATOMIC_RELAXED );
+        }
+        if( shed ) {
+            stats->shed++;
+        }
+
+        loop_process_callback( loop, nframes, cycle->frame, shed, bus_input, record->stage );
+        set_idle( snapshot, i, loop_is_idle( loop ) );
+
+        uint64_t loop_end = dsp_stats_clock();
+        dsp_stats_record( stats, loop_end - *loop_start );
+        if( loop_end - *loop_start > cost->costliest_ns ) {
+            cost->costliest_ns = loop_end - *loop_start;
+            cost->costliest = loop;
+        }
+        *loop_start = loop_end;
+    }
+}
+
+// Claims and processes chunks of the running cycle until there are none left.
+static void process_chunks( Engine this )
+{
+    uint64_t loop_start = 0;
+    int started = 0;
+
+    uint64_t claim = __atomic_load_n( &this->cycle.claim, __ATOMIC_ACQUIRE );
+    for( ;; ) {
+        unsigned int chunk = claim & 0xffff, chunk_count = ( claim >> 16 ) & 0xffff;
+        if( chunk >= chunk_count ) {
+            return;
+        }
+        if( !__atomic_compare_exchange_n(
+                &this->cycle.claim,
+                &claim,
+                claim + 1,
+                0,
+                __ATOMIC_ACQUIRE,
+                __ATOMIC_ACQUIRE
+            ) ) {
+            continue;
+        }
+
+        // Only now is the cycle certain to be the one claim was read from.
+        if( !started ) {
+            loop_start = dsp_stats_clock();
+            started = 1;
+        }
+
+        struct EngineSnapshot *snapshot = this->cycle.snapshot;
+        struct EngineChunk *cost = &( snapshot->chunks[chunk] );
+        int first = chunk * ENGINE_WORKER_CHUNK;
+        int last = first + ENGINE_WORKER_CHUNK < snapshot->free_running
+            ? first + ENGINE_WORKER_CHUNK
+            : snapshot->free_running;
+
+        cost->costliest = NULL;
+        cost->costliest_ns = 0;
+        process_loops( this, first, last, &loop_start, cost );
+
+        __atomic_add_fetch( &this->cycle.chunks_done, 1, __ATOMIC_RELEASE );
+        claim = __atomic_load_n( &this->cycle.claim, __ATOMIC_ACQUIRE );
+    }
+}
+
+static void *worker_thread( void *arg )
+{
+    Engine this = arg;
+
+    for( ;; ) {
+        sem_wait( &this->worker_wake );
+        if( __atomic_load_n( &this->workers_quit, __ATOMIC_ACQUIRE ) ) {
+            break;
+        }
+        process_chunks( this );
+    }
+
+    return NULL;
+}
+
+/* Every loop, the free running ones split between the process thread and
+   any workers, then the synced ones on the process thread, in the same
+   order as without workers.  Returns the costliest of them. */
+static Loop process_all_loops( Engine this, uint64_t *costliest_ns )
+{
+    struct EngineCycle *cycle = &this->cycle;
+    struct EngineSnapshot *snapshot = cycle->snapshot;
+    int workers = __atomic_load_n( &this->worker_count, __ATOMIC_ACQUIRE );
+
+    // Nothing to split, so no claiming either.
+    if( workers == 0 || snapshot->chunk_count < 2 || snapshot->chunk_count > ENGINE_MAX_CHUNKS ) {
+        struct EngineChunk cost = { NULL, 0 };
+        uint64_t loop_start = dsp_stats_clock();
+        process_loops( this, 0, snapshot->loop_count, &loop_start, &cost );
+        *costliest_ns = cost.costliest_ns;
+        return cost.costliest;
+    }
+
+    uint64_t generation = ( __atomic_load_n( &cycle->claim, __ATOMIC_RELAXED ) >> 32 ) + 1;
+    cycle->chunks_done = 0;
+    __atomic_store_n(
+        &cycle->claim,
+        generation << 32 | (uint64_t) snapshot->chunk_count << 16,
+        __ATOMIC_RELEASE
+    );
+
+    int wake = workers < snapshot->chunk_count - 1 ? workers : snapshot->chunk_count - 1;
+    for( int i = 0; i < wake; i++ ) {
+        sem_post( &this->worker_wake ); // Async-signal-safe, so fine for RT.
+    }
+
+    process_chunks( this );
+
+    /* The barrier: workers may still be finishing chunks they claimed.  If
+       one of them was preempted, it may need this CPU to get them done. */
+    for( int spins = 0; __atomic_load_n( &cycle->chunks_done, __ATOMIC_ACQUIRE ) < snapshot->chunk_count; spins++ ) {
+        if( spins >= ENGINE_BARRIER_SPINS ) {
+            sched_yield();
+        }
+    }
+
+    // Only now is every master done with the cycle.
+    struct EngineChunk cost = { NULL, 0 };
+    uint64_t loop_start = dsp_stats_clock();
+    process_loops( this, snapshot->free_running, snapshot->loop_count, &loop_start, &cost );
+
+    for( int i = 0; i < snapshot->chunk_count; i++ ) {
+        if( snapshot->chunks[i].costliest_ns > cost.costliest_ns ) {
+            cost = snapshot->chunks[i];
+        }
+    }
+    *costliest_ns = cost.costliest_ns;
+    return cost.costliest;
+}
+
+int engine_process( Engine this, jack_nframes_t nframes )
+{
+    uint64_t cycle_start = dsp_stats_clock();
+
+    __atomic_add_fetch( &this->cycle_sequence, 1, __ATOMIC_SEQ_CST );
+
+    jack_nframes_t last_frame_time = jack_last_frame_time( this->jack_client );
+    this->frame_clock += (jack_nframes_t) ( last_frame_time - this->frame_clock_low );
+    this->frame_clock_low = last_frame_time;
+    uint64_t cycle_frame = this->frame_clock;
+    int transport_moved = transport_grid_update( &this->transport_grid, this->jack_client, nframes, cycle_frame );
+
+    rt_log_begin_cycle( last_frame_time );
+
+    // nframes is the buffer size, so this catches buffer size changes too.
+    if( nframes != this->period_frames ) {
+        this->period_frames = nframes;
+        __atomic_store_n(
+            &this->period_ns,
+            (uint64_t) nframes * 1000000000ULL / this->sample_rate,
+            __ATOMIC_RELAXED
+        );
+    }
+
+    uint64_t budget_ns =
+        this->period_ns * __atomic_load_n( &this->budget_percent, __ATOMIC_RELAXED ) / 100;
+    uint64_t shed_ns =
+        this->period_ns * __atomic_load_n( &this->shed_percent, __ATOMIC_RELAXED ) / 100;
+
+    Loop costliest = NULL;
+    uint64_t costliest_ns = 0;
+    int shed = 0;
+
+    struct EngineSnapshot *snapshot = __atomic_load_n( &this->snapshot, __ATOMIC_SEQ_CST );
+
+    // Only what's queued by now, so that the trace knows how much room they take.
+    size_t commands = jack_ringbuffer_read_space( this->commands ) / sizeof( struct EngineCommand );
+
+    // Left out whole if there's no room for it.
+    Trace trace = this->trace;
+    if( trace && begin_trace( this, snapshot, nframes, cycle_frame, commands, transport_moved ) != 0 ) {
+        trace = NULL;
+    }
+
+    if( snapshot ) {
+        process_commands( this, snapshot, cycle_frame, commands, trace );
+
+        if( snapshot->dispatch ) {
+            process_control_input( this, snapshot, nframes, cycle_frame );
+        }
+
+        // Once for every loop on it, before any of them can run.
+        if( snapshot->bus_subscribers ) {
+            input_bus_decode( this->input_bus, nframes, RT_LOG_SHARED_INPUT );
+        }
+
+        // Control input and commands stay serial, so every loop sees them before it runs.
+        this->cycle.snapshot = snapshot;
+        this->cycle.nframes = nframes;
+        this->cycle.frame = cycle_frame;
+        this->cycle.start = cycle_start;
+        this->cycle.shed_ns = shed_ns;
+        this->cycle.shed = 0;
+
+        costliest = process_all_loops( this, &costliest_ns );
+        shed = __atomic_load_n( &this->cycle.shed, __ATOMIC_RELAXED );
+    }
+
+    // Clears the port even with nothing on it, like any other output.
+    output_bus_merge(
+        this->output_bus,
+        snapshot ? snapshot->stages : NULL,
+        snapshot ? snapshot->stage_count : 0,
+        snapshot ? snapshot->merge_heap : NULL,
+        nframes,
+        RT_LOG_SHARED_OUTPUT
+    );
+
+    uint64_t cycle_ns = dsp_stats_clock() - cycle_start;
+    dsp_stats_record( &this->cycle_stats, cycle_ns );
+    if( shed ) {
+        this->cycle_stats.shed++;
+    }
+
+    // Pinned on whichever loop cost the most this cycle, if any.
+    if( budget_ns && cycle_ns > budget_ns ) {
+        this->cycle_stats.overruns++;
+        if( costliest ) {
+            loop_get_dsp_stats( costliest )->overruns++;
+        }
+    }
+
+    if( trace ) {
+        trace_end_cycle( trace, cycle_ns, hash_outputs( this, snapshot, nframes ), shed );
+    }
+
+    __atomic_add_fetch( &this->cycle_sequence, 1, __ATOMIC_RELEASE );
+    return 0;
+}
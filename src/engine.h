@@ -0,0 +1,126 @@
+/* JACK MIDI LOOPER
+Copyright (C) 2014  Joshua Otto
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <jack/jack.h>
+
+#include <stdint.h>
+
+#include "control_dispatch.h"
+#include "dsp_stats.h"
+#include "loop.h"
+#include "trace.h"
+
+// Percent of the period a cycle may take before it counts as an overrun.
+#define ENGINE_DEFAULT_BUDGET_PERCENT 80
+
+#define ENGINE_MAX_WORKERS 16
+
+enum EngineCommandType {
+    ENGINE_COMMAND_TOGGLE_PLAYBACK = 0
+    , ENGINE_COMMAND_TOGGLE_RECORDING
+    , ENGINE_COMMAND_STOP
+    , ENGINE_COMMAND_TOGGLE_OVERDUB
+    , ENGINE_COMMAND_TOGGLE_REPLACE
+    , ENGINE_COMMAND_CAPTURE
+};
+
+// Commands due for immediate execution.
+#define ENGINE_COMMAND_NOW 0
+
+struct EngineDspSummary {
+    struct DspSummary cycle; // overruns and shed count whole cycles.
+    uint64_t period_ns;
+    unsigned int budget_percent;
+    unsigned int shed_percent;
+};
+
+typedef struct engine_type *Engine;
+
+/* Registers the control input and the shared input and output ports (see
+   loop_set_input_source and loop_set_output_target), so it must be called
+   before jack_activate. */
+Engine engine_new( jack_client_t *jack_client );
+void engine_free( Engine this );
+
+/* Publishes a new set of loops and mappings to the process callback.  The
+   engine takes ownership of both the loops array and the dispatch table (see
+   control_dispatch_build), but not of the loops themselves.  Blocks until the
+   process callback can no longer be using the previously published set, so
+   once this returns any loop that was left out of the new set may safely be
+   freed.  The loops are processed in descending order of loop_get_priority, as
+   of this call, loops synced to another (see loop_set_sync_master) coming
+   after the rest, so changing a loop's master calls for publishing again.
+   They take their input from wherever loop_get_input_source said
+   then too and send their output to loop_get_output_target, and quantize against this engine's transport.  Never call it
+   from the process callback. */
+void engine_publish(
+    Engine this,
+    Loop *loops,
+    int loop_count,
+    ControlDispatch dispatch
+);
+
+/* Cycles taking longer than budget_percent of the period count as overruns,
+   and are blamed on the costliest loop that cycle.  Once a cycle has taken
+   shed_percent of the period, the remaining (lowest priority) loops are
+   processed with recording and through bypassed; 0 turns shedding off. */
+void engine_set_dsp_budget( Engine this, unsigned int budget_percent, unsigned int shed_percent );
+void engine_get_dsp_summary( Engine this, struct EngineDspSummary *summary );
+
+/* Not RT.  Starts count worker threads (replacing any already running) at
+   the process thread's priority, and from then on each cycle's loops are
+   split between them and the process thread, a few at a time in priority
+   order, with engine_process waiting for the last of them before it
+   returns.  Control input and commands are still handled serially first.
+   0, the default, processes everything on the process thread.  Unless
+   oversubscribe is set, there's never more than one worker per CPU besides
+   the process thread's, since a worker sharing a CPU could only hold the
+   cycle up.  Returns how many were started.
+
+   Loops synced to another are processed after the rest, on the process
+   thread alone and masters first, so a slave always sees its master as of
+   this cycle and the output doesn't depend on how loops were shared out. */
+int engine_set_workers( Engine this, int count, int oversubscribe );
+
+/* Queues a transport command for the loop with the given id (see
+   loop_get_id), to run at the start of the next cycle, or at the frame
+   matching when (in jack_get_time microseconds) if it isn't
+   ENGINE_COMMAND_NOW.  Lock-free, but only one thread may queue commands.
+   Returns non-zero if the queue is full. */
+int engine_queue_command(
+    Engine this,
+    unsigned int loop_id,
+    enum EngineCommandType type,
+    jack_time_t when
+);
+
+/* Timed commands arriving after their frame still run at the start of the
+   cycle if they're at most this late, and are dropped otherwise. */
+void engine_set_max_command_lateness( Engine this, jack_nframes_t frames );
+
+/* Not RT, and only before jack_activate.  Records everything from outside
+   that reaches the process callback into trace, from its first cycle on
+   (see trace.h).  The trace has to outlive the engine's last cycle. */
+void engine_set_trace( Engine this, Trace trace );
+
+// The process callback proper.
+int engine_process( Engine this, jack_nframes_t nframes );
+
+#endif
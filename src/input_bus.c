@@ -0,0 +1,167 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#include "input_bus.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <jack/midiport.h>
+
+#include "rt_log.h"
+
+#define INPUT_BUS_CHANNELS 16
+
+struct input_bus_type {
+    jack_client_t *jack_client;
+    jack_port_t *port;
+
+    /* Both mlocked, INPUT_BUS_MESSAGES apiece.  by_channel holds the same
+       messages as all, grouped by channel but still in time order within
+       each, with channel c's at [ channel_start[c], channel_start[c + 1] ). */
+    struct MidiMessage *all;
+    struct MidiMessage *by_channel;
+    int count;
+    int channel_start[INPUT_BUS_CHANNELS + 1];
+};
+
+// The channel of a channel message, or -1.
+static int message_channel( const struct MidiMessage *message )
+{
+    return message->data[0] < 0xf0 ? message->data[0] & 0xf : -1;
+}
+
+InputBus input_bus_new( jack_client_t *jack_client, const char *port_name )
+{
+    struct input_bus_type *this = calloc( 1, sizeof( *this ) );
+    if( this == NULL ) {
+        return NULL;
+    }
+
+    this->jack_client = jack_client;
+    this->all = calloc( INPUT_BUS_MESSAGES, sizeof( struct MidiMessage ) );
+    this->by_channel = calloc( INPUT_BUS_MESSAGES, sizeof( struct MidiMessage ) );
+    if( this->all == NULL || this->by_channel == NULL ) {
+        fprintf( stderr, "Could not allocate the %s buffers.\n", port_name );
+        input_bus_free( this );
+        return NULL;
+    }
+    mlock( this->all, INPUT_BUS_MESSAGES * sizeof( struct MidiMessage ) );
+    mlock( this->by_channel, INPUT_BUS_MESSAGES * sizeof( struct MidiMessage ) );
+
+    this->port = jack_port_register(
+        jack_client,
+        port_name,
+        JACK_DEFAULT_MIDI_TYPE,
+        JackPortIsInput,
+        0
+    );
+    if( this->port == NULL ) {
+        fprintf( stderr, "Could not register JACK %s port.\n", port_name );
+        input_bus_free( this );
+        return NULL;
+    }
+
+    return this;
+}
+
+jack_port_t *input_bus_get_port( InputBus this )
+{
+    return this->port;
+}
+
+void input_bus_free( InputBus this )
+{
+    if( this ) {
+        if( this->port ) {
+            jack_port_unregister( this->jack_client, this->port );
+        }
+        if( this->all ) {
+            munlock( this->all, INPUT_BUS_MESSAGES * sizeof( struct MidiMessage ) );
+        }
+        if( this->by_channel ) {
+            munlock( this->by_channel, INPUT_BUS_MESSAGES * sizeof( struct MidiMessage ) );
+        }
+        free( this->all );
+        free( this->by_channel );
+        free( this );
+    }
+}
+
+void input_bus_decode( InputBus this, jack_nframes_t nframes, unsigned int log_id )
+{
+    int channel_count[INPUT_BUS_CHANNELS] = { 0 };
+    this->count = 0;
+
+    void *port_buffer = jack_port_get_buffer( this->port, nframes );
+    if( port_buffer == NULL ) {
+        rt_log( RT_LOG_INPUT_BUFFER, log_id, 0, 0 );
+    } else {
+        int events = jack_midi_get_event_count( port_buffer );
+        for( int i = 0; i < events; i++ ) {
+            if( this->count == INPUT_BUS_MESSAGES ) {
+                rt_log( RT_LOG_INPUT_DROPPED, log_id, 0, events - i );
+                break;
+            }
+
+            struct MidiMessage *message = &( this->all[this->count] );
+            int read_message_result = midi_message_from_port_buffer( message, port_buffer, i );
+            if( read_message_result != 0 ) {
+                rt_log(
+                    read_message_result < 0 ? RT_LOG_EVENT_GET_FAILED : RT_LOG_SYSEX_IGNORED,
+                    log_id,
+                    0,
+                    i
+                );
+                continue;
+            }
+
+            int channel = message_channel( message );
+            if( channel >= 0 ) {
+                channel_count[channel]++;
+            }
+            this->count++;
+        }
+    }
+
+    // A counting sort, which keeps each channel's messages in order.
+    int next[INPUT_BUS_CHANNELS];
+    this->channel_start[0] = 0;
+    for( int c = 0; c < INPUT_BUS_CHANNELS; c++ ) {
+        next[c] = this->channel_start[c];
+        this->channel_start[c + 1] = this->channel_start[c] + channel_count[c];
+    }
+    for( int i = 0; i < this->count; i++ ) {
+        int channel = message_channel( &( this->all[i] ) );
+        if( channel >= 0 ) {
+            this->by_channel[next[channel]++] = this->all[i];
+        }
+    }
+}
+
+void input_bus_messages( InputBus this, int channel, struct InputBusMessages *messages )
+{
+    if( channel < 0 || channel >= INPUT_BUS_CHANNELS ) {
+        messages->messages = this->all;
+        messages->count = this->count;
+    } else {
+        messages->messages = &( this->by_channel[this->channel_start[channel]] );
+        messages->count = this->channel_start[channel + 1] - this->channel_start[channel];
+    }
+}
@@ -0,0 +1,57 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#ifndef INPUT_BUS_H
+#define INPUT_BUS_H
+
+#include <jack/jack.h>
+
+#include "midi_message.h"
+
+// Every message on the bus, rather than those on one channel.
+#define INPUT_BUS_ALL_CHANNELS -1
+
+// Most messages decoded in a cycle.  Any more are dropped.
+#define INPUT_BUS_MESSAGES 4096
+
+/* A shared input port, decoded once a cycle into arrays any number of loops
+   can read, so that one source feeding many loops costs one JACK connection
+   and one decode per event rather than one of each per loop. */
+typedef struct input_bus_type *InputBus;
+
+// A cycle's worth of messages, in time order.  Valid until the next decode.
+struct InputBusMessages {
+    const struct MidiMessage *messages;
+    int count;
+};
+
+// Registers the port, so the same rules as for any other port apply.
+InputBus input_bus_new( jack_client_t *jack_client, const char *port_name );
+void input_bus_free( InputBus this );
+
+jack_port_t *input_bus_get_port( InputBus this );
+
+/* RT.  Decodes the cycle's input.  Anything that can't be decoded is
+   logged against log_id and left out, as for a loop's own port. */
+void input_bus_decode( InputBus this, jack_nframes_t nframes, unsigned int log_id );
+
+/* RT, and from any number of threads once the decode is done.  channel is
+   0-15 or INPUT_BUS_ALL_CHANNELS; channel messages are the only ones with a
+   channel, so anything else is only in the latter. */
+void input_bus_messages( InputBus this, int channel, struct InputBusMessages *messages );
+
+#endif
@@ -0,0 +1,1269 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC 0x4c4e524aU // "JRNL", little-endian.
+
+// Drained records are gathered up to this much before they're written.
+#define JOURNAL_BATCH_BYTES ( 256 * 1024 )
+
+/* The file is nothing but blocks, each a header and then size bytes of
+   whatever its type says, always a multiple of 8.  A run starts with a
+   JOURNAL_BLOCK_START, numbered 0, and the blocks after it count up. */
+enum JournalBlockType {
+    JOURNAL_BLOCK_START = 1, // struct JournalStart.
+    JOURNAL_BLOCK_RECORDS,   // One ring's struct JournalRecords, in order.
+    JOURNAL_BLOCK_LOOPS,     // struct JournalLoops.
+    JOURNAL_BLOCK_TAKE       // struct JournalTake.
+};
+
+struct JournalBlock {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t sequence;
+    uint32_t loop_id;  // Of the records or take.
+    uint32_t size;
+    uint32_t checksum; // CRC-32 of the header, with this 0, and then the rest.
+    uint32_t reserved;
+};
+
+struct JournalStart {
+    uint32_t version;
+    uint32_t sample_rate;
+};
+
+// Followed by count struct JournalLoops, then their names, each ending in a NUL.
+struct JournalLoops {
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct JournalLoop {
+    uint32_t id;
+    uint32_t sync_master; // Its id, or 0.
+    uint32_t name_offset; // From the start of the names.
+    int32_t midi_through;
+    int32_t playback_after_recording;
+    int32_t priority;
+    int32_t quantize;
+    int32_t input_source;
+    int32_t output_target;
+    int32_t reserved;
+};
+
+// Followed by count packed messages.
+struct JournalTake {
+    uint32_t snapshot; // An enum JournalSnapshot.
+    uint32_t length;
+    uint32_t sync_offset;
+    uint32_t reserved;
+    uint64_t count;
+};
+
+#define CACHE_LINE 64
+
+struct journal_ring_type {
+    // capacity of them, mlocked.  Whichever thread's processing the loop writes.
+    struct JournalRecord *records;
+    size_t capacity;
+    size_t mask;
+
+    // The pushing side, kept off the journal thread's cache line.
+    uint64_t written;
+    uint64_t read_seen; // As of the last time the ring looked full.
+    uint64_t dropped;
+    char padding[CACHE_LINE];
+
+    // The journal thread's side.
+    uint64_t read;
+    uint64_t reported; // Of those dropped, what's been reported.
+    Journal journal;
+    unsigned int loop_id;
+
+    // Under the journal's lock.
+    int released;
+    struct journal_ring_type *next;
+};
+
+struct journal_type {
+    int fd;
+    size_t ring_records;
+
+    // Covers the file, the rings list, the batch and the stats.
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct journal_ring_type *rings;
+    uint64_t sequence;
+    char *batch;
+    size_t batched;
+    int unsynced; // Written since the last sync.
+    uint64_t dropped; // By rings since freed.
+    struct JournalStats stats;
+
+    pthread_t thread;
+    int quit;
+};
+
+static void *journal_thread( void *arg );
+
+/* ----------------------------------------------------
+   Checksums
+   ---------------------------------------------------- */
+
+/* Slicing by 8: eight tables, so the CRC goes a word at a time rather than
+   a byte, since it's most of what the journal's thread spends its time on. */
+static uint32_t crc_tables[8][256];
+static pthread_once_t crc_tables_once = PTHREAD_ONCE_INIT;
+
+static void build_crc_tables( void )
+{
+    for( uint32_t i = 0; i < 256; i++ ) {
+        uint32_t crc = i;
+        for( int bit = 0; bit < 8; bit++ ) {
+            crc = crc & 1 ? ( crc >> 1 ) ^ 0xedb88320U : crc >> 1;
+        }
+        crc_tables[0][i] = crc;
+    }
+    for( uint32_t i = 0; i < 256; i++ ) {
+        for( int k = 1; k < 8; k++ ) {
+            crc_tables[k][i] = ( crc_tables[k - 1][i] >> 8 ) ^ crc_tables[0][crc_tables[k - 1][i] & 0xff];
+        }
+    }
+}
+
+// CRC-32, as zlib has it, carried on from crc (0 to start).
+static uint32_t crc32_update( uint32_t crc, const void *data, size_t size )
+{
+    const unsigned char *bytes = data;
+    crc = ~crc;
+
+    for( ; size >= 8; size -= 8, bytes += 8 ) {
+        uint32_t low = crc ^ ( bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t) bytes[3] << 24 );
+        uint32_t high = bytes[4] | bytes[5] << 8 | bytes[6] << 16 | (uint32_t) bytes[7] << 24;
+        crc = crc_tables[7][low & 0xff] ^ crc_tables[6][( low >> 8 ) & 0xff]
+            ^ crc_tables[5][( low >> 16 ) & 0xff] ^ crc_tables[4][low >> 24]
+            ^ crc_tables[3][high & 0xff] ^ crc_tables[2][( high >> 8 ) & 0xff]
+            ^ crc_tables[1][( high >> 16 ) & 0xff] ^ crc_tables[0][high >> 24];
+    }
+    for( size_t i = 0; i < size; i++ ) {
+        crc = crc_tables[0][( crc ^ bytes[i] ) & 0xff] ^ ( crc >> 8 );
+    }
+
+    return ~crc;
+}
+
+/* ----------------------------------------------------
+   Writing
+   ---------------------------------------------------- */
+
+static uint64_t clock_ns( void )
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int write_all( int fd, const void *data, size_t size )
+{
+    const char *bytes = data;
+    while( size > 0 ) {
+        ssize_t written = write( fd, bytes, size );
+        if( written < 0 ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return 0;
+}
+
+static int flush_locked( Journal this )
+{
+    if( this->batched == 0 ) {
+        return 0;
+    }
+
+    uint64_t start = clock_ns();
+    int result = write_all( this->fd, this->batch, this->batched );
+    this->stats.write_ns += clock_ns() - start;
+    this->stats.bytes += this->batched;
+    this->batched = 0;
+    this->unsynced = 1;
+    if( result != 0 ) {
+        fprintf( stderr, "Could not write to the journal.\n" );
+    }
+    return result;
+}
+
+// One piece of what follows a block's header.
+struct BlockPart {
+    const void *data;
+    size_t size;
+};
+
+static void seal_block( struct JournalBlock *block, const struct BlockPart *parts, int part_count )
+{
+    block->checksum = 0;
+    uint32_t crc = crc32_update( 0, block, sizeof( *block ) );
+    for( int i = 0; i < part_count; i++ ) {
+        crc = crc32_update( crc, parts[i].data, parts[i].size );
+    }
+    block->checksum = crc;
+}
+
+static void init_block( Journal this, struct JournalBlock *block, uint32_t type, uint32_t loop_id, size_t size )
+{
+    block->magic = JOURNAL_MAGIC;
+    block->type = type;
+    block->sequence = this->sequence++;
+    block->loop_id = loop_id;
+    block->size = size;
+    block->reserved = 0;
+}
+
+// Writes a block straight out, behind whatever's batched.
+static int write_block_locked(
+        Journal this,
+        uint32_t type,
+        uint32_t loop_id,
+        const struct BlockPart *parts,
+        int part_count
+    ) {
+
+    if( flush_locked( this ) != 0 ) {
+        return -10;
+    }
+
+    size_t size = 0;
+    for( int i = 0; i < part_count; i++ ) {
+        size += parts[i].size;
+    }
+
+    struct JournalBlock block;
+    init_block( this, &block, type, loop_id, size );
+    seal_block( &block, parts, part_count );
+
+    uint64_t start = clock_ns();
+    int result = write_all( this->fd, &block, sizeof( block ) );
+    for( int i = 0; i < part_count && result == 0; i++ ) {
+        result = write_all( this->fd, parts[i].data, parts[i].size );
+    }
+    this->stats.write_ns += clock_ns() - start;
+    this->stats.bytes += sizeof( block ) + size;
+    this->stats.blocks++;
+    this->unsynced = 1;
+
+    if( result != 0 ) {
+        fprintf( stderr, "Could not write to the journal.\n" );
+        return -20;
+    }
+    return 0;
+}
+
+// Moves up to count records from the ring into a block on the end of the batch.
+static void batch_records_locked( Journal this, struct journal_ring_type *ring, size_t count )
+{
+    struct JournalBlock *block = (struct JournalBlock *) ( this->batch + this->batched );
+    struct JournalRecord *records = (struct JournalRecord *) ( block + 1 );
+
+    size_t first = ring->read & ring->mask;
+    size_t before_wrap = ring->capacity - first < count ? ring->capacity - first : count;
+    memcpy( records, &( ring->records[first] ), before_wrap * sizeof( struct JournalRecord ) );
+    memcpy( records + before_wrap, ring->records, ( count - before_wrap ) * sizeof( struct JournalRecord ) );
+    __atomic_store_n( &ring->read, ring->read + count, __ATOMIC_RELEASE );
+
+    struct BlockPart part = { records, count * sizeof( struct JournalRecord ) };
+    init_block( this, block, JOURNAL_BLOCK_RECORDS, ring->loop_id, part.size );
+    seal_block( block, &part, 1 );
+
+    this->batched += sizeof( *block ) + part.size;
+    this->stats.records += count;
+    this->stats.blocks++;
+}
+
+static void free_ring( struct journal_ring_type *ring )
+{
+    munlock( ring->records, ring->capacity * sizeof( struct JournalRecord ) );
+    free( ring->records );
+    free( ring );
+}
+
+// Everything in the rings so far goes out, and the released ones that are empty go.
+static void drain_locked( Journal this )
+{
+    struct journal_ring_type **link = &this->rings;
+    while( *link ) {
+        struct journal_ring_type *ring = *link;
+        int released = ring->released;
+
+        uint64_t written = __atomic_load_n( &ring->written, __ATOMIC_ACQUIRE );
+        while( ring->read < written ) {
+            size_t room = ( JOURNAL_BATCH_BYTES - this->batched ) / sizeof( struct JournalRecord );
+            if( room < 2 ) {
+                flush_locked( this );
+                continue;
+            }
+
+            // A header's worth of the room goes on the header.
+            size_t count = written - ring->read;
+            if( count > room - 2 ) {
+                count = room - 2;
+            }
+            batch_records_locked( this, ring, count );
+        }
+
+        uint64_t dropped = __atomic_load_n( &ring->dropped, __ATOMIC_RELAXED );
+        if( dropped != ring->reported ) {
+            fprintf(
+                stderr,
+                "The journal's ring for loop %u filled up, losing %llu records.\n",
+                ring->loop_id,
+                (unsigned long long) ( dropped - ring->reported )
+            );
+            ring->reported = dropped;
+        }
+
+        // Nothing can push to it any more, so it's all been drained.
+        if( released ) {
+            *link = ring->next;
+            this->dropped += dropped;
+            free_ring( ring );
+        } else {
+            link = &ring->next;
+        }
+    }
+
+    flush_locked( this );
+}
+
+// The lock is dropped while the file syncs, so nothing waits on the disk but this.
+static void sync_locked( Journal this )
+{
+    if( !this->unsynced ) {
+        return;
+    }
+    this->unsynced = 0;
+
+    pthread_mutex_unlock( &this->lock );
+    uint64_t start = clock_ns();
+    int result = fdatasync( this->fd );
+    uint64_t elapsed = clock_ns() - start;
+    pthread_mutex_lock( &this->lock );
+
+    this->stats.syncs++;
+    this->stats.sync_ns += elapsed;
+    if( result != 0 ) {
+        fprintf( stderr, "Could not sync the journal.\n" );
+    }
+}
+
+Journal journal_new( const char *path, jack_nframes_t sample_rate, size_t ring_records )
+{
+    pthread_once( &crc_tables_once, build_crc_tables );
+
+    struct journal_type *this = malloc( sizeof( *this ) );
+    if( this == NULL ) {
+        return NULL;
+    }
+
+    this->fd = open( path, O_WRONLY | O_CREAT | O_APPEND, 0644 );
+    this->batch = malloc( JOURNAL_BATCH_BYTES );
+    if( this->fd < 0 || this->batch == NULL ) {
+        fprintf( stderr, "Could not open the journal %s.\n", path );
+        if( this->fd >= 0 ) {
+            close( this->fd );
+        }
+        free( this->batch );
+        free( this );
+        return NULL;
+    }
+
+    this->ring_records = ring_records;
+    this->rings = NULL;
+    this->sequence = 0;
+    this->batched = 0;
+    this->unsynced = 0;
+    this->dropped = 0;
+    memset( &this->stats, 0, sizeof( this->stats ) );
+    this->quit = 0;
+    pthread_mutex_init( &this->lock, NULL );
+    pthread_cond_init( &this->wake, NULL );
+
+    // Anything after a torn block from last time is found again by this.
+    struct JournalStart start = { JOURNAL_VERSION, sample_rate };
+    struct BlockPart part = { &start, sizeof( start ) };
+    pthread_mutex_lock( &this->lock );
+    int result = write_block_locked( this, JOURNAL_BLOCK_START, 0, &part, 1 );
+    sync_locked( this );
+    pthread_mutex_unlock( &this->lock );
+
+    if( result != 0 || pthread_create( &this->thread, NULL, journal_thread, this ) != 0 ) {
+        fprintf( stderr, "Could not start the journal.\n" );
+        pthread_cond_destroy( &this->wake );
+        pthread_mutex_destroy( &this->lock );
+        close( this->fd );
+        free( this->batch );
+        free( this );
+        return NULL;
+    }
+
+    return this;
+}
+
+void journal_free( Journal this )
+{
+    if( this == NULL ) {
+        return;
+    }
+
+    pthread_mutex_lock( &this->lock );
+    this->quit = 1;
+    pthread_cond_signal( &this->wake );
+    pthread_mutex_unlock( &this->lock );
+    pthread_join( this->thread, NULL );
+
+    // The thread drained them on its way out, so any left belong to loops that are gone.
+    while( this->rings ) {
+        struct journal_ring_type *ring = this->rings;
+        this->rings = ring->next;
+        free_ring( ring );
+    }
+
+    pthread_cond_destroy( &this->wake );
+    pthread_mutex_destroy( &this->lock );
+    close( this->fd );
+    free( this->batch );
+    free( this );
+}
+
+static void *journal_thread( void *arg )
+{
+    Journal this = arg;
+    uint64_t last_sync = clock_ns();
+
+    pthread_mutex_lock( &this->lock );
+    while( !this->quit ) {
+        struct timespec until;
+        clock_gettime( CLOCK_REALTIME, &until );
+        until.tv_nsec += JOURNAL_DRAIN_MS * 1000000L;
+        if( until.tv_nsec >= 1000000000L ) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait( &this->wake, &this->lock, &until );
+
+        drain_locked( this );
+        if( clock_ns() - last_sync >= JOURNAL_SYNC_MS * 1000000ULL ) {
+            sync_locked( this );
+            last_sync = clock_ns();
+        }
+    }
+
+    drain_locked( this );
+    sync_locked( this );
+    pthread_mutex_unlock( &this->lock );
+    return NULL;
+}
+
+JournalRing journal_ring_new( Journal this, unsigned int loop_id )
+{
+    struct journal_ring_type *ring = malloc( sizeof( *ring ) );
+    if( ring == NULL ) {
+        return NULL;
+    }
+
+    ring->capacity = 1;
+    while( ring->capacity < this->ring_records ) {
+        ring->capacity <<= 1;
+    }
+    ring->mask = ring->capacity - 1;
+    ring->records = calloc( ring->capacity, sizeof( struct JournalRecord ) );
+    if( ring->records == NULL ) {
+        free( ring );
+        return NULL;
+    }
+    mlock( ring->records, ring->capacity * sizeof( struct JournalRecord ) );
+
+    ring->journal = this;
+    ring->loop_id = loop_id;
+    ring->written = 0;
+    ring->read_seen = 0;
+    ring->read = 0;
+    ring->dropped = 0;
+    ring->reported = 0;
+    ring->released = 0;
+
+    pthread_mutex_lock( &this->lock );
+    ring->next = this->rings;
+    this->rings = ring;
+    pthread_mutex_unlock( &this->lock );
+
+    return ring;
+}
+
+void journal_ring_release( JournalRing ring )
+{
+    if( ring ) {
+        pthread_mutex_lock( &ring->journal->lock );
+        ring->released = 1;
+        pthread_mutex_unlock( &ring->journal->lock );
+    }
+}
+
+int journal_ring_push( JournalRing ring, const struct JournalRecord *record )
+{
+    // Only goes to the journal thread's side when the ring might be full.
+    if( ring->written - ring->read_seen == ring->capacity ) {
+        ring->read_seen = __atomic_load_n( &ring->read, __ATOMIC_ACQUIRE );
+        if( ring->written - ring->read_seen == ring->capacity ) {
+            __atomic_store_n( &ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED );
+            return -1;
+        }
+    }
+
+    ring->records[ring->written & ring->mask] = *record;
+    __atomic_store_n( &ring->written, ring->written + 1, __ATOMIC_RELEASE );
+    return 0;
+}
+
+// So that the block comes after everything the loops journaled before it.
+static int write_after_drain( Journal this, uint32_t type, uint32_t loop_id, const struct BlockPart *parts, int part_count )
+{
+    pthread_mutex_lock( &this->lock );
+    drain_locked( this );
+    int result = write_block_locked( this, type, loop_id, parts, part_count );
+    pthread_mutex_unlock( &this->lock );
+    return result;
+}
+
+int journal_log_loops( Journal this, Loop *loops, int loop_count )
+{
+    size_t names_size = 0;
+    for( int i = 0; i < loop_count; i++ ) {
+        names_size += strlen( loop_get_name( loops[i] ) ) + 1;
+    }
+    size_t padded_names_size = ( names_size + 7 ) & ~(size_t) 7;
+
+    struct JournalLoops header = { loop_count, 0 };
+    struct JournalLoop *records = calloc( loop_count ? loop_count : 1, sizeof( struct JournalLoop ) );
+    char *names = calloc( padded_names_size ? padded_names_size : 1, 1 );
+    if( records == NULL || names == NULL ) {
+        free( records );
+        free( names );
+        return -10;
+    }
+
+    uint32_t name_offset = 0;
+    for( int i = 0; i < loop_count; i++ ) {
+        Loop loop = loops[i];
+        Loop master = loop_get_sync_master( loop );
+        struct JournalLoop *record = &( records[i] );
+
+        record->id = loop_get_id( loop );
+        record->sync_master = master ? loop_get_id( master ) : 0;
+        record->name_offset = name_offset;
+        record->midi_through = loop_get_midi_through( loop );
+        record->playback_after_recording = loop_get_playback_after_recording( loop );
+        record->priority = loop_get_priority( loop );
+        record->quantize = loop_get_quantize( loop );
+        record->input_source = loop_get_input_source( loop );
+        record->output_target = loop_get_output_target( loop );
+
+        size_t name_size = strlen( loop_get_name( loop ) ) + 1;
+        memcpy( names + name_offset, loop_get_name( loop ), name_size );
+        name_offset += name_size;
+    }
+
+    struct BlockPart parts[3] = {
+        { &header, sizeof( header ) },
+        { records, loop_count * sizeof( struct JournalLoop ) },
+        { names, padded_names_size }
+    };
+    int result = write_after_drain( this, JOURNAL_BLOCK_LOOPS, 0, parts, 3 );
+
+    free( records );
+    free( names );
+    return result;
+}
+
+int journal_log_take(
+        Journal this,
+        unsigned int loop_id,
+        const struct PackedMidiMessage *events,
+        size_t count,
+        const struct LoopTake *take,
+        enum JournalSnapshot snapshot
+    ) {
+
+    struct JournalTake header = {
+        .snapshot = snapshot,
+        .length = take ? take->length : 0,
+        .sync_offset = take ? take->sync_offset : 0,
+        .reserved = 0,
+        .count = count
+    };
+    struct BlockPart parts[2] = {
+        { &header, sizeof( header ) },
+        { events, count * sizeof( struct PackedMidiMessage ) }
+    };
+    return write_after_drain( this, JOURNAL_BLOCK_TAKE, loop_id, parts, count ? 2 : 1 );
+}
+
+void journal_sync( Journal this )
+{
+    pthread_mutex_lock( &this->lock );
+    drain_locked( this );
+    sync_locked( this );
+    pthread_mutex_unlock( &this->lock );
+}
+
+void journal_get_stats( Journal this, struct JournalStats *stats )
+{
+    pthread_mutex_lock( &this->lock );
+    *stats = this->stats;
+    stats->dropped = this->dropped;
+    for( struct journal_ring_type *ring = this->rings; ring; ring = ring->next ) {
+        stats->dropped += __atomic_load_n( &ring->dropped, __ATOMIC_RELAXED );
+    }
+    pthread_mutex_unlock( &this->lock );
+}
+
+/* ----------------------------------------------------
+   Recovery
+   ---------------------------------------------------- */
+
+// A message in a take being rebuilt, timed from the start of the take.
+struct TakeMessage {
+    jack_nframes_t time;
+    unsigned char data[3];
+};
+
+struct Take {
+    struct TakeMessage *messages;
+    size_t count;
+    size_t capacity;
+    struct LoopTake info;
+};
+
+// A journaled message in, with what the loop was doing when it came.
+struct InputMessage {
+    uint64_t frame;
+    unsigned char data[3];
+    uint8_t state;
+};
+
+struct RecoveredLoop {
+    unsigned int id;
+    struct InputMessage *inputs;
+    size_t input_count;
+    size_t input_capacity;
+    uint8_t state; // A JournalLoopState.
+    uint64_t state_frame; // When it started.
+    struct Take take;
+    struct Take *offered; // Oldest first.
+    size_t offered_count;
+    size_t offered_capacity;
+};
+
+struct Recovery {
+    struct RecoveredLoop *loops;
+    size_t count;
+    size_t capacity;
+    size_t last_found;
+
+    // The payload of the latest JOURNAL_BLOCK_LOOPS, in the mapped file.
+    const char *loop_table;
+    size_t loop_table_size;
+};
+
+// Makes room in *array for at least needed items of size bytes, doubling as it goes.
+static int reserve( void *array, size_t *capacity, size_t needed, size_t size )
+{
+    if( needed <= *capacity ) {
+        return 0;
+    }
+
+    size_t grown = *capacity ? *capacity : 16;
+    while( grown < needed ) {
+        grown *= 2;
+    }
+    void *moved = realloc( *(void **) array, grown * size );
+    if( moved == NULL ) {
+        return -1;
+    }
+    *(void **) array = moved;
+    *capacity = grown;
+    return 0;
+}
+
+static int push_message( struct Take *take, jack_nframes_t time, const unsigned char *data )
+{
+    if( reserve( &take->messages, &take->capacity, take->count + 1, sizeof( struct TakeMessage ) ) != 0 ) {
+        return -1;
+    }
+    struct TakeMessage *message = &( take->messages[take->count++] );
+    message->time = time;
+    memcpy( message->data, data, 3 );
+    return 0;
+}
+
+static struct RecoveredLoop *find_loop( struct Recovery *recovery, unsigned int id )
+{
+    if( recovery->last_found < recovery->count && recovery->loops[recovery->last_found].id == id ) {
+        return &( recovery->loops[recovery->last_found] );
+    }
+    for( size_t i = 0; i < recovery->count; i++ ) {
+        if( recovery->loops[i].id == id ) {
+            recovery->last_found = i;
+            return &( recovery->loops[i] );
+        }
+    }
+
+    if( reserve( &recovery->loops, &recovery->capacity, recovery->count + 1, sizeof( struct RecoveredLoop ) ) != 0 ) {
+        return NULL;
+    }
+    struct RecoveredLoop *loop = &( recovery->loops[recovery->count] );
+    memset( loop, 0, sizeof( *loop ) );
+    loop->id = id;
+    loop->state = JOURNAL_STOPPED;
+    recovery->last_found = recovery->count++;
+    return loop;
+}
+
+static void free_recovery( struct Recovery *recovery )
+{
+    for( size_t i = 0; i < recovery->count; i++ ) {
+        struct RecoveredLoop *loop = &( recovery->loops[i] );
+        free( loop->inputs );
+        free( loop->take.messages );
+        for( size_t k = 0; k < loop->offered_count; k++ ) {
+            free( loop->offered[k].messages );
+        }
+        free( loop->offered );
+    }
+    free( recovery->loops );
+}
+
+// The first input at or after frame.
+static size_t find_input( const struct RecoveredLoop *loop, uint64_t frame )
+{
+    size_t low = 0, high = loop->input_count;
+    while( low < high ) {
+        size_t middle = low + ( high - low ) / 2;
+        if( loop->inputs[middle].frame < frame ) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Appends the input in [start, start + span), or just what was overdubbed, timed from start.
+static int take_span( const struct RecoveredLoop *loop, struct Take *take, uint64_t start, uint64_t span, int overdubs )
+{
+    for( size_t i = find_input( loop, start ); i < loop->input_count && loop->inputs[i].frame < start + span; i++ ) {
+        const struct InputMessage *input = &( loop->inputs[i] );
+        if( !overdubs || input->state == JOURNAL_OVERDUBBING ) {
+            if( push_message( take, input->frame - start, input->data ) != 0 ) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// What was overdubbed over [start, start + span) goes under the take, as the engine merges it.
+static int merge_span( struct RecoveredLoop *loop, uint64_t start, jack_nframes_t span )
+{
+    struct Take layer = { NULL, 0, 0, { 0, 0 } };
+    struct Take merged = { NULL, 0, 0, loop->take.info };
+    if( take_span( loop, &layer, start, span, 1 ) != 0
+        || reserve( &merged.messages, &merged.capacity, loop->take.count + layer.count, sizeof( struct TakeMessage ) ) != 0 ) {
+        free( layer.messages );
+        return -1;
+    }
+
+    // Played back in time order, the take first when they're level.
+    size_t t = 0, l = 0;
+    while( t < loop->take.count || l < layer.count ) {
+        if( l == layer.count || ( t < loop->take.count && loop->take.messages[t].time <= layer.messages[l].time ) ) {
+            merged.messages[merged.count++] = loop->take.messages[t++];
+        } else {
+            merged.messages[merged.count++] = layer.messages[l++];
+        }
+    }
+
+    free( layer.messages );
+    free( loop->take.messages );
+    loop->take = merged;
+    return 0;
+}
+
+static int apply_record( struct RecoveredLoop *loop, const struct JournalRecord *record )
+{
+    switch( record->type ) {
+        case JOURNAL_INPUT: {
+            if( reserve( &loop->inputs, &loop->input_capacity, loop->input_count + 1, sizeof( struct InputMessage ) ) != 0 ) {
+                return -1;
+            }
+            struct InputMessage *input = &( loop->inputs[loop->input_count++] );
+            input->frame = record->frame;
+            memcpy( input->data, record->data, 3 );
+            input->state = loop->state;
+            return 0;
+        }
+
+        case JOURNAL_STATE:
+            // Starting to record throws the take away, as the loop does.
+            if( record->data[0] == JOURNAL_RECORDING && loop->state != JOURNAL_RECORDING ) {
+                loop->take.count = 0;
+            }
+            loop->state = record->data[0];
+            loop->state_frame = record->frame;
+            return 0;
+
+        case JOURNAL_TAKE:
+            switch( record->data[0] ) {
+                case JOURNAL_TAKE_MERGED:
+                    return merge_span( loop, record->frame, record->length );
+
+                case JOURNAL_TAKE_OFFERED:
+                    loop->take.count = 0;
+                    if( loop->offered_count > 0 ) {
+                        free( loop->take.messages );
+                        loop->take = loop->offered[0];
+                        memmove( loop->offered, loop->offered + 1, --loop->offered_count * sizeof( struct Take ) );
+                    }
+                    return 0;
+
+                default:
+                    loop->take.count = 0;
+                    return take_span( loop, &loop->take, record->frame, record->length, 0 );
+            }
+
+        case JOURNAL_TAKE_LENGTH:
+            loop->take.info.length = record->length;
+            loop->take.info.sync_offset = record->frame;
+            return 0;
+    }
+
+    return 0;
+}
+
+static int apply_take( struct RecoveredLoop *loop, const char *payload, size_t size )
+{
+    struct JournalTake header;
+    if( size < sizeof( header ) ) {
+        return -1;
+    }
+    memcpy( &header, payload, sizeof( header ) );
+    if( header.count > ( size - sizeof( header ) ) / sizeof( struct PackedMidiMessage ) ) {
+        return -1;
+    }
+
+    if( header.snapshot == JOURNAL_SNAPSHOT_WITHDRAWN ) {
+        if( loop->offered_count > 0 ) {
+            free( loop->offered[--loop->offered_count].messages );
+        }
+        return 0;
+    }
+
+    struct Take take = { NULL, 0, 0, { header.length, header.sync_offset } };
+    jack_nframes_t time = 0;
+    for( uint64_t i = 0; i < header.count; i++ ) {
+        struct PackedMidiMessage packed;
+        memcpy( &packed, payload + sizeof( header ) + i * sizeof( packed ), sizeof( packed ) );
+        time += packed.delta;
+        unsigned char data[3] = { packed.status, packed.data[0], packed.data[1] };
+        if( push_message( &take, time, data ) != 0 ) {
+            free( take.messages );
+            return -1;
+        }
+    }
+
+    if( header.snapshot == JOURNAL_SNAPSHOT_OFFERED ) {
+        if( reserve( &loop->offered, &loop->offered_capacity, loop->offered_count + 1, sizeof( struct Take ) ) != 0 ) {
+            free( take.messages );
+            return -1;
+        }
+        loop->offered[loop->offered_count++] = take;
+    } else {
+        free( loop->take.messages );
+        loop->take = take;
+    }
+    return 0;
+}
+
+// Whether there's a good block at offset, which comes back in *block.
+static int read_block( const char *file, size_t size, size_t offset, struct JournalBlock *block )
+{
+    if( size - offset < sizeof( *block ) ) {
+        return 0;
+    }
+    memcpy( block, file + offset, sizeof( *block ) );
+    if( block->magic != JOURNAL_MAGIC || block->size % 8 != 0 || block->size > size - offset - sizeof( *block ) ) {
+        return 0;
+    }
+
+    struct JournalBlock sealed = *block;
+    struct BlockPart part = { file + offset + sizeof( *block ), block->size };
+    seal_block( &sealed, &part, 1 );
+    return sealed.checksum == block->checksum;
+}
+
+// The next run at or after offset, or size if there isn't one.  Torn blocks can leave it anywhere.
+static size_t find_run( const char *file, size_t size, size_t offset )
+{
+    for( ; offset + sizeof( struct JournalBlock ) <= size; offset++ ) {
+        struct JournalBlock block;
+        if( read_block( file, size, offset, &block ) && block.type == JOURNAL_BLOCK_START && block.sequence == 0 ) {
+            return offset;
+        }
+    }
+    return size;
+}
+
+// Where the run at offset ends, and whether that's at a bad block.
+static size_t find_run_end( const char *file, size_t size, size_t offset, int *torn )
+{
+    struct JournalBlock block;
+    uint64_t sequence = 0;
+    while( offset < size ) {
+        if( !read_block( file, size, offset, &block ) ) {
+            *torn = 1;
+            return offset;
+        }
+        if( block.sequence != sequence++ ) {
+            *torn = block.type != JOURNAL_BLOCK_START || block.sequence != 0;
+            return offset;
+        }
+        offset += sizeof( block ) + block.size;
+    }
+    *torn = 0;
+    return offset;
+}
+
+static int replay_run( struct Recovery *recovery, const char *file, size_t start, size_t end, struct JournalRecovery *report )
+{
+    size_t offset = start;
+    while( offset < end ) {
+        struct JournalBlock block;
+        memcpy( &block, file + offset, sizeof( block ) );
+        const char *payload = file + offset + sizeof( block );
+        offset += sizeof( block ) + block.size;
+        report->blocks++;
+
+        switch( block.type ) {
+            case JOURNAL_BLOCK_START: {
+                struct JournalStart run;
+                if( block.size < sizeof( run ) ) {
+                    return -20;
+                }
+                memcpy( &run, payload, sizeof( run ) );
+                if( run.version != JOURNAL_VERSION ) {
+                    return -20;
+                }
+                report->sample_rate = run.sample_rate;
+                break;
+            }
+
+            case JOURNAL_BLOCK_RECORDS: {
+                struct RecoveredLoop *loop = find_loop( recovery, block.loop_id );
+                if( loop == NULL ) {
+                    return -30;
+                }
+                size_t count = block.size / sizeof( struct JournalRecord );
+                for( size_t i = 0; i < count; i++ ) {
+                    struct JournalRecord record;
+                    memcpy( &record, payload + i * sizeof( record ), sizeof( record ) );
+                    if( apply_record( loop, &record ) != 0 ) {
+                        return -30;
+                    }
+                }
+                report->records += count;
+                break;
+            }
+
+            case JOURNAL_BLOCK_LOOPS:
+                recovery->loop_table = payload;
+                recovery->loop_table_size = block.size;
+                break;
+
+            case JOURNAL_BLOCK_TAKE: {
+                struct RecoveredLoop *loop = find_loop( recovery, block.loop_id );
+                if( loop == NULL || apply_take( loop, payload, block.size ) != 0 ) {
+                    return -30;
+                }
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void free_loops( Loop *loops, int loop_count )
+{
+    for( int i = 0; i < loop_count; i++ ) {
+        char *name = (char *) loop_get_name( loops[i] );
+        loop_free( loops[i] );
+        free( name );
+    }
+    free( loops );
+}
+
+// The take as the loop should get it, with a recording cut short kept as far as it got.
+static struct PackedMidiMessage *pack_take( struct RecoveredLoop *loop, struct LoopTake *info )
+{
+    if( loop->state == JOURNAL_RECORDING ) {
+        loop->take.count = 0;
+        loop->take.info.length = 0;
+        loop->take.info.sync_offset = 0;
+        size_t first = find_input( loop, loop->state_frame );
+        if( first < loop->input_count ) {
+            uint64_t span = loop->inputs[loop->input_count - 1].frame + 1 - loop->state_frame;
+            if( take_span( loop, &loop->take, loop->state_frame, span, 0 ) != 0 ) {
+                return NULL;
+            }
+            loop->take.info.length = span;
+        }
+    }
+
+    struct PackedMidiMessage *packed = malloc( ( loop->take.count ? loop->take.count : 1 ) * sizeof( *packed ) );
+    if( packed == NULL ) {
+        return NULL;
+    }
+    jack_nframes_t time = 0;
+    for( size_t i = 0; i < loop->take.count; i++ ) {
+        const struct TakeMessage *message = &( loop->take.messages[i] );
+        packed[i].delta = message->time - time;
+        packed[i].status = message->data[0];
+        packed[i].data[0] = message->data[1];
+        packed[i].data[1] = message->data[2];
+        packed[i].reserved = 0;
+        time = message->time;
+    }
+
+    *info = loop->take.info;
+    return packed;
+}
+
+// Creates the loops in the latest loop table, with the takes they'd got to.
+static int build_loops(
+        struct Recovery *recovery,
+        jack_client_t *jack_client,
+        SegmentPool segment_pool,
+        size_t max_segments,
+        Loop **loops_out,
+        int *loop_count_out,
+        struct JournalRecovery *report
+    ) {
+
+    // A run that never got as far as having loops.
+    static const struct JournalLoops no_loops = { 0, 0 };
+    if( recovery->loop_table == NULL ) {
+        recovery->loop_table = (const char *) &no_loops;
+        recovery->loop_table_size = sizeof( no_loops );
+    }
+
+    struct JournalLoops header;
+    if( recovery->loop_table_size < sizeof( header ) ) {
+        return -20;
+    }
+    memcpy( &header, recovery->loop_table, sizeof( header ) );
+    size_t records_size = (size_t) header.count * sizeof( struct JournalLoop );
+    if( records_size > recovery->loop_table_size - sizeof( header ) ) {
+        return -20;
+    }
+    const char *records = recovery->loop_table + sizeof( header );
+    const char *names = records + records_size;
+    size_t names_size = recovery->loop_table_size - sizeof( header ) - records_size;
+
+    struct JournalLoop *table = malloc( ( header.count ? header.count : 1 ) * sizeof( struct JournalLoop ) );
+    Loop *loops = malloc( ( header.count ? header.count : 1 ) * sizeof( Loop ) );
+    if( table == NULL || loops == NULL ) {
+        free( table );
+        free( loops );
+        return -30;
+    }
+    memcpy( table, records, records_size );
+
+    for( uint32_t i = 0; i < header.count; i++ ) {
+        const struct JournalLoop *record = &( table[i] );
+        if( record->name_offset >= names_size || memchr( names + record->name_offset, 0, names_size - record->name_offset ) == NULL ) {
+            free_loops( loops, i );
+            free( table );
+            return -20;
+        }
+
+        const char *name = names + record->name_offset;
+        char *loop_name = malloc( strlen( name ) + 1 );
+        struct RecoveredLoop *recovered = find_loop( recovery, record->id );
+        if( loop_name == NULL || recovered == NULL ) {
+            free( loop_name );
+            free_loops( loops, i );
+            free( table );
+            return -30;
+        }
+        strcpy( loop_name, name );
+
+        if(
+            loop_new(
+                &loops[i],
+                jack_client,
+                loop_name,
+                record->midi_through,
+                record->playback_after_recording,
+                segment_pool,
+                max_segments
+            ) != 0
+        ) {
+            free( loop_name );
+            free_loops( loops, i );
+            free( table );
+            return -40;
+        }
+
+        Loop loop = loops[i];
+        loop_set_priority( loop, record->priority );
+        loop_set_quantize( loop, record->quantize );
+        loop_set_input_source( loop, record->input_source );
+        loop_set_output_target( loop, record->output_target );
+
+        struct LoopTake info;
+        struct PackedMidiMessage *packed = pack_take( recovered, &info );
+        int playing = recovered->state == JOURNAL_PLAYING
+            || recovered->state == JOURNAL_OVERDUBBING
+            || recovered->state == JOURNAL_REPLACING;
+        if( packed == NULL ) {
+            free_loops( loops, i + 1 );
+            free( table );
+            return -30;
+        }
+        if( loop_restore_take( loop, packed, recovered->take.count, &info, playing ) != 0 ) {
+            fprintf( stderr, "The take for %s doesn't fit, so it was left out.\n", name );
+        } else if( info.length > 0 ) {
+            report->takes++;
+        }
+        free( packed );
+    }
+
+    for( uint32_t i = 0; i < header.count; i++ ) {
+        for( uint32_t k = 0; table[i].sync_master && k < header.count; k++ ) {
+            if( table[k].id == table[i].sync_master ) {
+                loop_set_sync_master( loops[i], loops[k] );
+            }
+        }
+    }
+
+    free( table );
+    *loops_out = loops;
+    *loop_count_out = header.count;
+    return 0;
+}
+
+int journal_recover(
+        const char *path,
+        int run,
+        jack_client_t *jack_client,
+        SegmentPool segment_pool,
+        size_t max_segments,
+        Loop **loops,
+        int *loop_count,
+        struct JournalRecovery *report
+    ) {
+
+    pthread_once( &crc_tables_once, build_crc_tables );
+    memset( report, 0, sizeof( *report ) );
+
+    int fd = open( path, O_RDONLY );
+    if( fd < 0 ) {
+        fprintf( stderr, "Could not open the journal %s.\n", path );
+        return -10;
+    }
+
+    struct stat status;
+    if( fstat( fd, &status ) != 0 || status.st_size < (off_t) sizeof( struct JournalBlock ) ) {
+        fprintf( stderr, "%s is not a journal.\n", path );
+        close( fd );
+        return -10;
+    }
+
+    size_t size = status.st_size;
+    char *file = mmap( NULL, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if( file == MAP_FAILED ) {
+        fprintf( stderr, "Could not map the journal %s.\n", path );
+        return -10;
+    }
+    posix_madvise( file, size, POSIX_MADV_SEQUENTIAL );
+
+    // Counts the runs, stopping at the one asked for.
+    size_t start = size, end = size;
+    int torn = 0;
+    for( size_t offset = find_run( file, size, 0 ); offset < size; ) {
+        int run_torn;
+        size_t run_end = find_run_end( file, size, offset, &run_torn );
+        report->runs++;
+        if( run == 0 || report->runs == run ) {
+            start = offset;
+            end = run_end;
+            torn = run_torn;
+        }
+        offset = find_run( file, size, run_torn ? run_end + 1 : run_end );
+    }
+
+    if( start == size ) {
+        fprintf( stderr, "%s has no run %d.\n", path, run );
+        munmap( file, size );
+        return -20;
+    }
+    report->run = run ? run : report->runs;
+    report->end = end;
+    report->torn = torn;
+
+    struct Recovery recovery = { NULL, 0, 0, 0, NULL, 0 };
+    int result = replay_run( &recovery, file, start, end, report );
+    if( result == 0 ) {
+        result = build_loops( &recovery, jack_client, segment_pool, max_segments, loops, loop_count, report );
+    }
+    if( result != 0 ) {
+        fprintf( stderr, "Could not recover the loops journaled in %s (code %d).\n", path, result );
+    }
+
+    free_recovery( &recovery );
+    munmap( file, size );
+    return result;
+}
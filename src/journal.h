@@ -0,0 +1,168 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <jack/jack.h>
+
+#include "loop.h"
+#include "midi_message.h"
+#include "segment_pool.h"
+
+/* A crash-safe record of what the loops are recording, from which their
+   takes can be rebuilt if the engine dies.  Each loop's process callback
+   copies every message it takes in, every change of state and every new
+   take into a lock-free ring of its own, one fixed-size record apiece, and
+   the journal's thread drains the rings into an append-only file in
+   checksummed blocks, syncing it to disk every JOURNAL_SYNC_MS.  Each run
+   appends to the file, so a journal left by a crash survives a restart.
+   Like sessions, journals are in the byte order of the machine that wrote
+   them. */
+typedef struct journal_type *Journal;
+typedef struct journal_ring_type *JournalRing;
+
+#define JOURNAL_VERSION 1
+
+// Per loop, rounded up to a power of two.  The journal's thread drains them every JOURNAL_DRAIN_MS.
+#define JOURNAL_RING_RECORDS 4096
+#define JOURNAL_DRAIN_MS 10
+#define JOURNAL_SYNC_MS 500
+
+enum JournalRecordType {
+    JOURNAL_INPUT = 1,  // data is the message.
+    JOURNAL_STATE,      // data[0] is what the loop's now doing, a JournalLoopState.
+    JOURNAL_TAKE,       // A new take, made as data[0] (a JournalTakeSource) says.
+    JOURNAL_TAKE_LENGTH // Follows every JOURNAL_TAKE: length, and frame is the sync offset.
+};
+
+enum JournalLoopState {
+    JOURNAL_STOPPED = 0,
+    JOURNAL_RECORDING,
+    JOURNAL_PLAYING,
+    JOURNAL_OVERDUBBING,
+    JOURNAL_REPLACING
+};
+
+/* Where a JOURNAL_TAKE came from.  The first three are the input journaled
+   in [frame, frame + length), and a merge is the take with whatever was
+   overdubbed in that pass on top.  An offered take is the oldest one logged
+   with journal_log_take as JOURNAL_SNAPSHOT_OFFERED and not yet swapped in. */
+enum JournalTakeSource {
+    JOURNAL_TAKE_RECORDED = 0,
+    JOURNAL_TAKE_REPLACED,
+    JOURNAL_TAKE_CAPTURED,
+    JOURNAL_TAKE_MERGED,
+    JOURNAL_TAKE_OFFERED
+};
+
+// 16 bytes, so journaling a message costs the process thread one small copy.
+struct JournalRecord {
+    uint64_t frame; // Absolute - see loop_process_callback.
+    uint32_t length;
+    uint8_t type;
+    uint8_t data[3];
+};
+
+/* Not RT.  Opens path for appending, creating it if it isn't there, and
+   starts a new run in it.  Returns NULL on failure. */
+Journal journal_new( const char *path, jack_nframes_t sample_rate, size_t ring_records );
+
+// Not RT.  Journals whatever's left in the rings, syncs, and closes the file.
+void journal_free( Journal this );
+
+/* Not RT.  A ring for the loop with loop_id, which the journal drains until
+   it's released.  Returns NULL on failure. */
+JournalRing journal_ring_new( Journal this, unsigned int loop_id );
+
+/* Not RT.  Once nothing can push to it any more; the journal frees it after
+   it's been drained.  Safe with NULL. */
+void journal_ring_release( JournalRing this );
+
+/* RT, and only ever from one thread at a time.  Returns non-zero, dropping
+   the record, if the ring's full. */
+int journal_ring_push( JournalRing this, const struct JournalRecord *record );
+
+/* Not RT.  These go straight into the file, behind everything already
+   drained, and ahead of anything the loops journal from then on. */
+
+// Every loop there is and how it's set up, superseding the last lot.
+int journal_log_loops( Journal this, Loop *loops, int loop_count );
+
+enum JournalSnapshot {
+    JOURNAL_SNAPSHOT_RESTORED = 0, // The loop's take from now on.
+    JOURNAL_SNAPSHOT_OFFERED,      // See JOURNAL_TAKE_OFFERED.
+    JOURNAL_SNAPSHOT_WITHDRAWN     // The last one offered never will be after all.
+};
+
+// A take from outside the journal, whole.
+int journal_log_take(
+    Journal this,
+    unsigned int loop_id,
+    const struct PackedMidiMessage *events,
+    size_t count,
+    const struct LoopTake *take,
+    enum JournalSnapshot snapshot
+);
+
+// Not RT.  Drains the rings and syncs the file now, rather than waiting.
+void journal_sync( Journal this );
+
+struct JournalStats {
+    uint64_t records;  // Drained from the rings.
+    uint64_t dropped;  // Lost to full rings.
+    uint64_t blocks;
+    uint64_t bytes;
+    uint64_t write_ns; // Spent writing, not counting syncs.
+    uint64_t syncs;
+    uint64_t sync_ns;
+};
+
+void journal_get_stats( Journal this, struct JournalStats *stats );
+
+struct JournalRecovery {
+    jack_nframes_t sample_rate;
+    int runs;        // In the file.
+    int run;         // The one recovered, from 1.
+    uint64_t blocks; // Read from it.
+    uint64_t records;
+    size_t takes;    // Rebuilt from the journal or snapshots.
+    size_t end;      // Where its last good block ends.
+    int torn;        // Whether it ends in a block that didn't check out.
+};
+
+/* Not RT.  Rebuilds the loops as they were at the end of a run (the last if
+   run is 0), none of them published, as session_load does: takes still
+   being recorded keep what they'd got, and overdubs are merged a pass at a
+   time.  MIDI mappings aren't journaled.  Reading stops at the first block
+   that doesn't check out, which after a crash is the one being written.
+   Returns non-zero, having created nothing, if the file can't be used. */
+int journal_recover(
+    const char *path,
+    int run,
+    jack_client_t *jack_client,
+    SegmentPool segment_pool,
+    size_t max_segments,
+    Loop **loops,
+    int *loop_count,
+    struct JournalRecovery *recovery
+);
+
+#endif
@@ -21,44 +21,86 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <string.h>
 
 #include <jack/jack.h>
-#include <jack/ringbuffer.h>
+#include <jack/midiport.h>
 
+#include "capture_ring.h"
 #include "debug.h"
+#include "journal.h"
 #include "loop_buffer.h"
 #include "midi_message.h"
-
-// Are these reasonable?
-#define MIDI_IO_BUFFER_SIZE     (1024*sizeof( struct MidiMessage ))
-#define MIDI_LOOP_BUFFER_SIZE    2048
+#include "rt_log.h"
+#include "transport_grid.h"
 
 typedef enum {
     STATE_RECORDING = 0,
     STATE_PLAYBACK = 1,
-    STATE_IDLE = 2
+    STATE_IDLE = 2,
+    STATE_OVERDUB = 3, // Playback, layering whatever comes in on top.
+    STATE_REPLACE = 4 // Playback, recording a new take to follow it.
 } LoopState;
 
 #ifdef DEBUGGING_OUTPUT
-static const char *STATE_STRINGS[3] = {
+static const char *STATE_STRINGS[5] = {
     "STATE_RECORDING",
     "STATE_PLAYBACK",
-    "STATE_IDLE"
+    "STATE_IDLE",
+    "STATE_OVERDUB",
+    "STATE_REPLACE"
 };
 #endif
 
-struct StateSchedule {
+static int is_playing( LoopState state )
+{
+    return state == STATE_PLAYBACK || state == STATE_OVERDUB || state == STATE_REPLACE;
+}
+
+// How the journal has each LoopState, since its files outlive this enum.
+static const uint8_t JOURNAL_STATES[5] = {
+    JOURNAL_RECORDING,
+    JOURNAL_PLAYING,
+    JOURNAL_STOPPED,
+    JOURNAL_OVERDUBBING,
+    JOURNAL_REPLACING
+};
+
+#define NO_CONTROL_FRAME UINT64_MAX
+
+// A state and the frame it starts on, relative to the cycle it starts in.
+struct StateSegment {
     LoopState state;
     jack_nframes_t time;
 };
 
-// I'm really not anticipating more than one or two state changes per process cycle.
-#define STATE_BUFFER_SIZE     32*sizeof( struct StateSchedule )
+// A change waiting in the schedule, which can be any number of cycles out.
+struct ScheduledState {
+    uint64_t frame; // Absolute - see loop_process_callback.
+    unsigned int sequence; // Keeps changes for the same frame in the order they were made.
+    LoopState state;
+};
+
+// How a take handed over by loop_offer_take gets to the process callback.
+enum OfferStatus {
+    OFFER_IDLE = 0, // offered_take is the caller's, and empty.
+    OFFER_READY,    // The process callback may swap it in.
+    OFFER_TAKEN     // offered_take is the caller's, holding the old take.
+};
+
+// Plenty for a handful of changes queued up per loop ahead of time.
+#define STATE_SCHEDULE_SIZE 64
 
 struct loop_type {
 
     // Injected.
     const char *name;
+    unsigned int id; // Unique for the life of the process, unlike name.
     int midi_through;
     int playback_after_recording;
+    int priority;
+    int quantize; // An enum TransportQuantize.
+    int input_source; // See loop_set_input_source.
+    int output_target; // See loop_set_output_target.
+    const struct TransportGrid *transport_grid;
+    Loop sync_master; // NULL when free running.
 
     // Internal.
     jack_client_t *jack_client;
@@ -69,41 +111,118 @@ struct loop_type {
     jack_port_t *loop_output;
     char *loop_output_name;
 
-    jack_ringbuffer_t *midi_io_buffer;
-    jack_ringbuffer_t *state_buffer;
+    // Min-heap on ( frame, sequence ), only touched from the process callback.
+    struct ScheduledState schedule[STATE_SCHEDULE_SIZE];
+    int schedule_count;
+    unsigned int schedule_sequence;
 
-    struct StateSchedule current_state;
+    struct StateSegment current_state;
     jack_nframes_t last_playback_start; // Will be absolute.
 
     jack_nframes_t recording_start;
     jack_nframes_t recording_end;
     jack_nframes_t recording_length; // Saves recomputing it once per callback invocation.
     LoopBuffer midi_loop_buffer;
+
+    /* Bumped before and after every change to the take, so it's odd while
+       one is under way, which lets loop_copy_take read it from another
+       thread without ever holding up the process callback. */
+    unsigned int take_sequence;
+
+    /* Some absolute frame that time 0 of the take lined up with, which is
+       what loops synced to this one take their phase from.  Slaves may be
+       processed on another thread, so this and recording_length are only
+       ever written, and read through a master, with __atomic builtins. */
+    uint64_t origin;
+    jack_nframes_t sync_offset; // From the master's origin to ours, modulo our length.
+
+    /* Bumped, likewise atomically, whenever a new take is lined up.  A slave
+       keeps the count of the master its length and offset were worked out
+       against, and works them out again when that changes. */
+    unsigned int take_count;
+    Loop synced_to; // NULL until the slave has first looked at a master.
+    unsigned int synced_take;
+    jack_nframes_t unrounded_length; // The take's, before syncing rounded it.
+
+    /* Overdubbing.  A pass's overdub is captured into overdub_capture, then
+       becomes the layer: it's played under the take for the next pass, and
+       everything played is copied into overdub_merge as it goes, which
+       replaces the take once the pass is over.  So the merge is one linear
+       walk spread over a whole pass, costing no more per cycle than playback
+       does.  All three buffers hold on to their segments, like the take. */
+    LoopBuffer overdub_capture;
+    LoopBuffer overdub_layer;
+    LoopBuffer overdub_merge;
+    int layer_active; // The layer is being played and merged this pass.
+    int merge_failed; // The merge ran out of room, so the layer gets dropped.
+    int take_done, layer_done; // Played through for this pass.
+    int layer_rotated; // Whether the last pass's capture became the layer.
+    LoopBuffer playback_source; // Of the last event peek_segment_playback found.
+    struct MidiMessage playback_recorded; // That event, with its take time.
+    size_t merged_this_cycle;
+    struct LoopOverdubStats overdub_stats;
+
+    /* Replacing.  The new take records into replace_buffer while the old one
+       keeps playing, and the two are exchanged when the old one next wraps.
+       It keeps its segments too, so the exchange never touches the pool. */
+    LoopBuffer replace_buffer;
+    jack_nframes_t replace_length;
+    uint64_t replace_end; // Absolute, for the journal.
+    int replace_pending; // A finished take is waiting for the wrap.
+
+    // The last few seconds of input, for taking a loop after the fact.
+    CaptureRing capture;
+
+    // A take filled on another thread, swapped in whole - see loop_offer_take.
+    LoopBuffer offered_take;
+    jack_nframes_t offered_length;
+    int offer_status;
+
+    JournalRing journal; // NULL unless the loop's being journaled.
+    uint64_t last_control_frame; // When a control was last pressed, or NO_CONTROL_FRAME.
+    uint64_t capture_frame; // When the last capture was asked for.
+
+    struct DspStats dsp_stats;
+
+    struct ControlActionListNode *mapping_list;
 };
 
 static void schedule_state_change(
     Loop this,
     LoopState state,
-    jack_nframes_t time
+    uint64_t frame
 );
 
-static int process_state_midi_input(
-    Loop this,
-    void *input_port_buffer,
-    int events,
-    int *event_index,
-    jack_nframes_t end_of_state,
-    jack_nframes_t last_frame_time
-);
+static LoopState state_at( Loop this, uint64_t frame );
+
+/* Per-cycle cursors for process_state_segment, so that each state change
+   just picks up where the last one left off.  Input comes either from the
+   port buffer or, already decoded, from the shared input bus. */
+struct SegmentInput {
+    void *port_buffer;
+    const struct MidiMessage *decoded;
+    int events;
+    int index;
+    int pending; // Whether message holds the decoded event at index.
+    struct MidiMessage message;
+};
 
-static int process_state_midi_playback(
+// Output goes to the port buffer, or if there's a stage, to the shared output bus.
+struct SegmentOutput {
+    void *port_buffer;
+    struct OutputBusStage *stage;
+    jack_nframes_t last_time;
+};
+
+static void process_state_segment(
     Loop this,
+    struct SegmentInput *input,
+    struct SegmentOutput *output,
     jack_nframes_t end_of_state,
-    jack_nframes_t last_frame_time
+    uint64_t cycle_frame,
+    int shed
 );
 
-static int process_midi_output( Loop this, jack_nframes_t nframes, jack_nframes_t last_frame_time );
-
 #undef BAIL
 #define BAIL( message, code ) \
     fprintf( stderr, message, name );\
@@ -116,7 +235,9 @@ int loop_new(
         jack_client_t *jack_client,
         const char *name,
         int midi_through,
-        int playback_after_recording
+        int playback_after_recording,
+        SegmentPool segment_pool,
+        size_t max_segments
     ) {
 
     *loop_pointer = malloc( sizeof( struct loop_type ) );
@@ -126,32 +247,43 @@ int loop_new(
     this->loop_output = NULL;
     this->loop_input_name = NULL;
     this->loop_output_name = NULL;
-    this->midi_io_buffer = NULL;
-    this->state_buffer = NULL;
+    this->overdub_capture = NULL;
+    this->overdub_layer = NULL;
+    this->overdub_merge = NULL;
+    this->replace_buffer = NULL;
+    this->capture = NULL;
+    this->offered_take = NULL;
+    this->journal = NULL;
 
     // Main loop buffer.
-    this->midi_loop_buffer = loop_buffer_init( MIDI_LOOP_BUFFER_SIZE ); 
+    this->midi_loop_buffer = loop_buffer_init( segment_pool, max_segments );
     if( !loop_buffer_is_valid( this->midi_loop_buffer ) ) {
         BAIL( "Cannot create loop buffer for %s.\n", -1 );
     }
 
-    // I/O ringbuffer.
-    this->midi_io_buffer = jack_ringbuffer_create( MIDI_IO_BUFFER_SIZE );
-
-    if ( this->midi_io_buffer == NULL) {
-        BAIL( "Cannot create JACK MIDI ringbuffer for %s.\n", -10 );
+    // Overdub buffers.
+    this->overdub_capture = loop_buffer_init( segment_pool, max_segments );
+    this->overdub_layer = loop_buffer_init( segment_pool, max_segments );
+    this->overdub_merge = loop_buffer_init( segment_pool, max_segments );
+    if(
+        !loop_buffer_is_valid( this->overdub_capture )
+        || !loop_buffer_is_valid( this->overdub_layer )
+        || !loop_buffer_is_valid( this->overdub_merge )
+    ) {
+        BAIL( "Cannot create overdub buffers for %s.\n", -2 );
     }
 
-    jack_ringbuffer_mlock( this->midi_io_buffer ); // Prevent paging of the I/O buffer.
-
-    // State change ringbuffer.
-    this->state_buffer = jack_ringbuffer_create( STATE_BUFFER_SIZE );
-
-    if( this->state_buffer == NULL ) {
-        BAIL( "Cannot create state change ringbuffer for %s.\n", -11 );
+    // Replacement take.
+    this->replace_buffer = loop_buffer_init( segment_pool, max_segments );
+    if( !loop_buffer_is_valid( this->replace_buffer ) ) {
+        BAIL( "Cannot create replacement buffer for %s.\n", -3 );
     }
 
-    jack_ringbuffer_mlock( this->state_buffer );
+    // Input history.
+    this->capture = capture_ring_new( segment_pool, max_segments );
+    if( this->capture == NULL ) {
+        BAIL( "Cannot create input history for %s.\n", -4 );
+    }
 
     // Loop ports.
     size_t length_of_name = strlen( name );
@@ -191,14 +323,49 @@ int loop_new(
     }
 
     // Set remaining members.
+    static unsigned int next_id = 1; // Leaves 0 for RT_LOG_NO_LOOP.
+    this->id = next_id++;
     this->name = name;
     this->midi_through = midi_through;
     this->playback_after_recording = playback_after_recording;
+    this->priority = 0;
+    this->quantize = QUANTIZE_OFF;
+    this->input_source = LOOP_INPUT_PORT;
+    this->output_target = LOOP_OUTPUT_PORT;
+    this->transport_grid = NULL;
+    this->sync_master = NULL;
+    this->recording_length = 0;
+    this->take_sequence = 0;
+    this->origin = 0;
+    this->sync_offset = 0;
+    this->take_count = 0;
+    this->synced_to = NULL;
+    this->synced_take = 0;
+    this->unrounded_length = 0;
+    this->layer_active = 0;
+    this->merge_failed = 0;
+    this->take_done = 0;
+    this->layer_done = 0;
+    this->layer_rotated = 0;
+    this->playback_source = this->midi_loop_buffer;
+    this->merged_this_cycle = 0;
+    memset( &this->overdub_stats, 0, sizeof( this->overdub_stats ) );
+    this->replace_length = 0;
+    this->replace_end = 0;
+    this->replace_pending = 0;
+    this->offered_length = 0;
+    this->offer_status = OFFER_IDLE;
+    this->last_control_frame = NO_CONTROL_FRAME;
+    this->capture_frame = 0;
+    dsp_stats_init( &this->dsp_stats );
+    this->mapping_list = NULL;
 
     this->jack_client = jack_client;
 
-    this->current_state.time = jack_last_frame_time( jack_client );
+    this->current_state.time = 0;
     this->current_state.state = STATE_IDLE;
+    this->schedule_count = 0;
+    this->schedule_sequence = 0;
 
     return 0;
 }
@@ -206,15 +373,6 @@ int loop_new(
 void loop_free( struct loop_type *this )
 {
     if( this ) {
-        // JACK ringbuffers.
-        if( this->midi_io_buffer ) {
-            jack_ringbuffer_free( this->midi_io_buffer );
-        }
-
-        if( this->state_buffer ) {
-            jack_ringbuffer_free( this->state_buffer );
-        }
-
         // Ports and their names.
         if( this->loop_output_name ) {
             free( this->loop_output_name );
@@ -232,8 +390,15 @@ void loop_free( struct loop_type *this )
             jack_port_unregister( this->jack_client, this->loop_input );
         }
 
-        // Our custom loop buffer.
+        // Our custom loop buffers.
         loop_buffer_free( this->midi_loop_buffer );
+        loop_buffer_free( this->overdub_capture );
+        loop_buffer_free( this->overdub_layer );
+        loop_buffer_free( this->overdub_merge );
+        loop_buffer_free( this->replace_buffer );
+        loop_buffer_free( this->offered_take );
+        capture_ring_free( this->capture );
+        journal_ring_release( this->journal );
 
         // Ourself.
         free( this );
@@ -245,6 +410,11 @@ const char *loop_get_name( Loop this )
     return this->name;
 }
 
+unsigned int loop_get_id( Loop this )
+{
+    return this->id;
+}
+
 void loop_set_midi_through( Loop this, int set )
 {
     this->midi_through = set;
@@ -265,112 +435,952 @@ int loop_get_playback_after_recording( Loop this )
     return this->playback_after_recording;
 }
 
-void loop_toggle_playback( Loop this, jack_nframes_t time )
+int loop_get_priority( Loop this )
+{
+    return this->priority;
+}
+
+void loop_set_priority( Loop this, int priority )
+{
+    this->priority = priority;
+}
+
+int loop_get_quantize( Loop this )
+{
+    return this->quantize;
+}
+
+void loop_set_quantize( Loop this, int quantize )
+{
+    this->quantize = quantize >= 0 && quantize < QUANTIZE_COUNT ? quantize : QUANTIZE_OFF;
+}
+
+int loop_get_input_source( Loop this )
+{
+    return this->input_source;
+}
+
+void loop_set_input_source( Loop this, int source )
+{
+    this->input_source = source >= INPUT_BUS_ALL_CHANNELS && source < 16 ? source : LOOP_INPUT_PORT;
+}
+
+int loop_get_output_target( Loop this )
+{
+    return this->output_target;
+}
+
+void loop_set_output_target( Loop this, int target )
+{
+    this->output_target = target >= OUTPUT_BUS_KEEP_CHANNEL && target < 16 ? target : LOOP_OUTPUT_PORT;
+}
+
+void loop_set_transport_grid( Loop this, const struct TransportGrid *grid )
+{
+    __atomic_store_n( &this->transport_grid, grid, __ATOMIC_RELAXED );
+}
+
+void loop_set_journal( Loop this, JournalRing ring )
+{
+    this->journal = ring;
+}
+
+Loop loop_get_sync_master( Loop this )
+{
+    return __atomic_load_n( &this->sync_master, __ATOMIC_RELAXED );
+}
+
+void loop_set_sync_master( Loop this, Loop master )
+{
+    __atomic_store_n( &this->sync_master, master != this ? master : NULL, __ATOMIC_RELAXED );
+}
+
+void loop_get_buffer_stats( Loop this, struct LoopBufferStats *stats )
+{
+    loop_buffer_get_stats( this->midi_loop_buffer, stats );
+}
+
+void loop_get_overdub_stats( Loop this, struct LoopOverdubStats *stats )
+{
+    *stats = this->overdub_stats;
+}
+
+// Port names made from a loop name always end in _input or _output.
+#define LOOP_PORT_ASIDE_SUFFIX ".old"
+
+static int rename_port( Loop this, jack_port_t *port, const char *name, int aside )
+{
+    char *renamed = malloc( strlen( name ) + sizeof( LOOP_PORT_ASIDE_SUFFIX ) );
+    if( renamed == NULL ) {
+        return -10;
+    }
+    sprintf( renamed, "%s%s", name, aside ? LOOP_PORT_ASIDE_SUFFIX : "" );
+    int status = jack_port_rename( this->jack_client, port, renamed );
+    free( renamed );
+    return status;
+}
+
+int loop_set_ports_aside( Loop this, int aside )
+{
+    if( rename_port( this, this->loop_output, this->loop_output_name, aside ) != 0 ) {
+        return -10;
+    }
+    if( rename_port( this, this->loop_input, this->loop_input_name, aside ) != 0 ) {
+        rename_port( this, this->loop_output, this->loop_output_name, !aside );
+        return -20;
+    }
+    return 0;
+}
+
+struct ControlActionListNode **loop_get_mapping_list( Loop this )
+{
+    return &this->mapping_list;
+}
+
+jack_port_t *loop_get_input_port( Loop this )
+{
+    return this->loop_input;
+}
+
+jack_port_t *loop_get_output_port( Loop this )
+{
+    return this->loop_output;
+}
+
+int loop_is_idle( Loop this )
+{
+    return this->current_state.state == STATE_IDLE
+        && this->schedule_count == 0
+        && !capture_ring_busy( this->capture )
+        && __atomic_load_n( &this->offer_status, __ATOMIC_ACQUIRE ) != OFFER_READY;
+}
+
+int loop_is_capturing( Loop this )
+{
+    return capture_ring_copying( this->capture );
+}
+
+struct DspStats *loop_get_dsp_stats( Loop this )
+{
+    return &this->dsp_stats;
+}
+
+int loop_is_playing( Loop this )
+{
+    return is_playing( __atomic_load_n( &this->current_state.state, __ATOMIC_RELAXED ) );
+}
+
+// Where a change asked for at frame actually lands.  Also counts as a press for loop_capture.
+static uint64_t quantized( Loop this, uint64_t frame )
+{
+    this->last_control_frame = frame;
+
+    const struct TransportGrid *grid = __atomic_load_n( &this->transport_grid, __ATOMIC_RELAXED );
+    return grid ? transport_grid_snap( grid, this->quantize, frame ) : frame;
+}
+
+void loop_toggle_playback( Loop this, uint64_t frame )
 {
     DEBUGGING_MESSAGE( "loop_toggle_playback %s", loop_get_name( this ) );
-    if( this->current_state.state == STATE_PLAYBACK ) {
-        schedule_state_change( this, STATE_IDLE, time );
+    frame = quantized( this, frame );
+    if( is_playing( state_at( this, frame ) ) ) {
+        schedule_state_change( this, STATE_IDLE, frame );
     } else {
-        schedule_state_change( this, STATE_PLAYBACK, time );
+        schedule_state_change( this, STATE_PLAYBACK, frame );
     }
 }
 
-void loop_toggle_recording( Loop this, jack_nframes_t time )
+void loop_toggle_recording( Loop this, uint64_t frame )
 {
     DEBUGGING_MESSAGE( "loop_toggle_recording %s", loop_get_name( this ) );
-    if( this->current_state.state == STATE_RECORDING ) {
-        schedule_state_change( this, STATE_PLAYBACK, time );
+    frame = quantized( this, frame );
+    if( state_at( this, frame ) == STATE_RECORDING ) {
+        schedule_state_change( this, STATE_PLAYBACK, frame );
+    } else {
+        schedule_state_change( this, STATE_RECORDING, frame );
+    }
+}
+
+// Layering keeps playing back when it's toggled off.
+void loop_toggle_overdub( Loop this, uint64_t frame )
+{
+    DEBUGGING_MESSAGE( "loop_toggle_overdub %s", loop_get_name( this ) );
+    frame = quantized( this, frame );
+    if( state_at( this, frame ) == STATE_OVERDUB ) {
+        schedule_state_change( this, STATE_PLAYBACK, frame );
     } else {
-        schedule_state_change( this, STATE_RECORDING, time );
+        schedule_state_change( this, STATE_OVERDUB, frame );
+    }
+}
+
+// The old take keeps playing until the new one's done and it next wraps.
+void loop_toggle_replace( Loop this, uint64_t frame )
+{
+    DEBUGGING_MESSAGE( "loop_toggle_replace %s", loop_get_name( this ) );
+    frame = quantized( this, frame );
+    if( state_at( this, frame ) == STATE_REPLACE ) {
+        schedule_state_change( this, STATE_PLAYBACK, frame );
+    } else {
+        schedule_state_change( this, STATE_REPLACE, frame );
+    }
+}
+
+/* With the transport rolling, the span is the last whole bar before frame,
+   and otherwise it runs from the last control pressed on this loop. */
+void loop_capture( Loop this, uint64_t frame )
+{
+    DEBUGGING_MESSAGE( "loop_capture %s", loop_get_name( this ) );
+    uint64_t start = this->last_control_frame, end = frame;
+    this->last_control_frame = frame;
+
+    const struct TransportGrid *grid = __atomic_load_n( &this->transport_grid, __ATOMIC_RELAXED );
+    if(
+        ( grid == NULL || transport_grid_last_bar( grid, frame, &start, &end ) != 0 )
+        && start == NO_CONTROL_FRAME
+    ) {
+        return;
+    }
+
+    // Nothing to take, or a bar from before the clock started.
+    if( start >= end ) {
+        return;
+    }
+
+    // Length has to fit a jack_nframes_t, like any other take.
+    if( end - start > UINT32_MAX ) {
+        start = end - UINT32_MAX;
+    }
+
+    if( capture_ring_request( this->capture, start, end ) == 0 ) {
+        this->capture_frame = frame;
+    }
+}
+
+// Ends any recording, keeping what was recorded, and stops playback.
+void loop_stop( Loop this, uint64_t frame )
+{
+    DEBUGGING_MESSAGE( "loop_stop %s", loop_get_name( this ) );
+    frame = quantized( this, frame );
+    schedule_state_change( this, STATE_IDLE, frame );
+}
+
+static int schedule_before( const struct ScheduledState *a, const struct ScheduledState *b )
+{
+    if( a->frame != b->frame ) {
+        return a->frame < b->frame;
+    }
+    return (int) ( a->sequence - b->sequence ) < 0;
+}
+
+/* What the loop will be doing at frame, given everything scheduled so far, so
+   that a toggle queued for later toggles whatever comes before it.  The
+   schedule is never more than a few entries deep, so a scan is fine. */
+static LoopState state_at( Loop this, uint64_t frame )
+{
+    const struct ScheduledState *latest = NULL;
+    for( int i = 0; i < this->schedule_count; i++ ) {
+        const struct ScheduledState *entry = &this->schedule[i];
+        if( entry->frame <= frame && ( latest == NULL || schedule_before( latest, entry ) ) ) {
+            latest = entry;
+        }
     }
+
+    return latest ? latest->state : this->current_state.state;
 }
 
 // May be invoked from the process callback (ie. it must be RT)
 static void schedule_state_change(
         Loop this,
         LoopState state,
-        jack_nframes_t time
+        uint64_t frame
     ) {
 
-    struct StateSchedule change = {
-        .state = state,
-        .time = time
+    if( this->schedule_count == STATE_SCHEDULE_SIZE ) {
+        rt_log( RT_LOG_STATE_BUFFER_FULL, this->id, 0, (int) state );
+        return;
+    }
+
+    struct ScheduledState change = {
+        .frame = frame,
+        .sequence = this->schedule_sequence++,
+        .state = state
     };
 
-    if( jack_ringbuffer_write_space( this->state_buffer ) < sizeof( change ) ) {
-        fprintf( stderr, "Not enough space in the %s state buffer, CHANGE LOST.\n", this->name );
+    // Sift up.
+    int i = this->schedule_count++;
+    while( i > 0 && schedule_before( &change, &this->schedule[( i - 1 ) / 2] ) ) {
+        this->schedule[i] = this->schedule[( i - 1 ) / 2];
+        i = ( i - 1 ) / 2;
+    }
+    this->schedule[i] = change;
+}
+
+static struct ScheduledState schedule_pop( Loop this )
+{
+    struct ScheduledState top = this->schedule[0];
+    struct ScheduledState last = this->schedule[--this->schedule_count];
+
+    // Sift down.
+    int i = 0;
+    for( ;; ) {
+        int child = 2 * i + 1;
+        if( child >= this->schedule_count ) {
+            break;
+        }
+        if( child + 1 < this->schedule_count
+            && schedule_before( &this->schedule[child + 1], &this->schedule[child] ) ) {
+            child++;
+        }
+        if( !schedule_before( &this->schedule[child], &last ) ) {
+            break;
+        }
+        this->schedule[i] = this->schedule[child];
+        i = child;
+    }
+    this->schedule[i] = last;
+
+    return top;
+}
+
+/* A slave sees its master as of this cycle or the last, depending on which
+   of the two was processed first - as it always has. */
+static jack_nframes_t master_length( Loop master )
+{
+    return __atomic_load_n( &master->recording_length, __ATOMIC_RELAXED );
+}
+
+static uint64_t master_origin( Loop master )
+{
+    return __atomic_load_n( &master->origin, __ATOMIC_RELAXED );
+}
+
+// Released after the length and origin of the take it counts.
+static unsigned int master_take_count( Loop master )
+{
+    return __atomic_load_n( &master->take_count, __ATOMIC_ACQUIRE );
+}
+
+static void count_take( Loop this )
+{
+    __atomic_store_n( &this->take_count, this->take_count + 1, __ATOMIC_RELEASE );
+}
+
+static void set_recording_length( Loop this, jack_nframes_t length )
+{
+    __atomic_store_n( &this->recording_length, length, __ATOMIC_RELAXED );
+}
+
+static void set_origin( Loop this, uint64_t origin )
+{
+    __atomic_store_n( &this->origin, origin, __ATOMIC_RELAXED );
+}
+
+/* The process callback brackets every change to the take with these - see
+   take_sequence. */
+static void begin_take_change( Loop this )
+{
+    __atomic_store_n( &this->take_sequence, this->take_sequence + 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+}
+
+static void end_take_change( Loop this )
+{
+    __atomic_store_n( &this->take_sequence, this->take_sequence + 1, __ATOMIC_RELEASE );
+}
+
+size_t loop_copy_take(
+        Loop this,
+        struct PackedMidiMessage *events,
+        size_t capacity,
+        struct LoopTake *take
+    ) {
+
+    for( ;; ) {
+        unsigned int sequence = __atomic_load_n( &this->take_sequence, __ATOMIC_ACQUIRE );
+        if( sequence & 1 ) {
+            // Being recorded, so there's no take to copy yet.
+            take->length = 0;
+            take->sync_offset = 0;
+            return 0;
+        }
+
+        size_t count = loop_buffer_copy_packed( this->midi_loop_buffer, events, capacity );
+        take->length = __atomic_load_n( &this->recording_length, __ATOMIC_RELAXED );
+        take->sync_offset = this->sync_offset;
+
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
+        if( __atomic_load_n( &this->take_sequence, __ATOMIC_RELAXED ) == sequence ) {
+            return count;
+        }
+    }
+}
+
+int loop_restore_take(
+        Loop this,
+        const struct PackedMidiMessage *events,
+        size_t count,
+        const struct LoopTake *take,
+        int playing
+    ) {
+
+    if( loop_buffer_load_packed( this->midi_loop_buffer, events, count ) != 0 ) {
+        return -10;
+    }
+
+    set_recording_length( this, take->length );
+    set_origin( this, 0 );
+    this->sync_offset = take->length ? take->sync_offset % take->length : 0;
+    this->unrounded_length = take->length;
+
+    // Already due, so it happens on the loop's first cycle.
+    if( playing && take->length ) {
+        schedule_state_change( this, STATE_PLAYBACK, 0 );
+    }
+
+    return 0;
+}
+
+int loop_offer_take( Loop this, LoopBuffer *take, jack_nframes_t length )
+{
+    if( __atomic_load_n( &this->offer_status, __ATOMIC_ACQUIRE ) == OFFER_READY ) {
+        return -1;
+    }
+
+    LoopBuffer taken = this->offered_take;
+    this->offered_take = *take;
+    this->offered_length = length;
+    __atomic_store_n( &this->offer_status, OFFER_READY, __ATOMIC_RELEASE );
+
+    *take = taken;
+    return 0;
+}
+
+// The master to take our phase from, if there's a take on both sides to line up.
+static Loop synced_master( Loop this )
+{
+    Loop master = __atomic_load_n( &this->sync_master, __ATOMIC_RELAXED );
+    if( master == NULL || master_length( master ) == 0 || this->recording_length == 0 ) {
+        return NULL;
+    }
+    return master;
+}
+
+// Musically sensible subdivisions of the master to consider for shorter takes.
+#define SYNC_MAX_DIVISOR 16
+
+/* The nearest whole multiple or exact divisor of the master's length, so
+   that our length always divides into (or is made up of) the master's and
+   the two can never drift apart. */
+static jack_nframes_t sync_length( jack_nframes_t length, jack_nframes_t master_length )
+{
+    if( length >= master_length ) {
+        return ( length / master_length + ( length % master_length >= master_length / 2 ) ) * master_length;
+    }
+
+    jack_nframes_t best = master_length;
+    for( jack_nframes_t divisor = 2; divisor <= SYNC_MAX_DIVISOR; divisor++ ) {
+        jack_nframes_t candidate = master_length / divisor;
+        if( master_length % divisor != 0 ) {
+            continue;
+        }
+        jack_nframes_t error = candidate > length ? candidate - length : length - candidate;
+        jack_nframes_t best_error = best > length ? best - length : length - best;
+        if( error < best_error ) {
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+// How far into our take frame falls when lined up with the master.  O(1).
+static jack_nframes_t sync_phase( Loop this, Loop master, uint64_t frame )
+{
+    int64_t since = (int64_t) ( frame - master_origin( master ) - this->sync_offset );
+    int64_t phase = since % this->recording_length;
+    return phase < 0 ? phase + this->recording_length : phase;
+}
+
+/* The journal gets everything it needs to rebuild the take from.  A full
+   ring drops the record, which the journal counts. */
+static void journal_input( Loop this, uint64_t frame, const struct MidiMessage *message )
+{
+    if( this->journal ) {
+        struct JournalRecord record = {
+            .frame = frame,
+            .length = 0,
+            .type = JOURNAL_INPUT,
+            .data = { message->data[0], message->data[1], message->data[2] }
+        };
+        journal_ring_push( this->journal, &record );
+    }
+}
+
+static void journal_state( Loop this, uint64_t frame, LoopState state )
+{
+    if( this->journal ) {
+        struct JournalRecord record = {
+            .frame = frame,
+            .length = 0,
+            .type = JOURNAL_STATE,
+            .data = { JOURNAL_STATES[state], 0, 0 }
+        };
+        journal_ring_push( this->journal, &record );
+    }
+}
+
+static void journal_take_length( Loop this )
+{
+    if( this->journal ) {
+        struct JournalRecord record = {
+            .frame = this->sync_offset,
+            .length = this->recording_length,
+            .type = JOURNAL_TAKE_LENGTH,
+            .data = { 0, 0, 0 }
+        };
+        journal_ring_push( this->journal, &record );
+    }
+}
+
+// The take has just changed, made from the input in [start, start + span) as source says.
+static void journal_take( Loop this, enum JournalTakeSource source, uint64_t start, jack_nframes_t span )
+{
+    if( this->journal ) {
+        struct JournalRecord record = {
+            .frame = start,
+            .length = span,
+            .type = JOURNAL_TAKE,
+            .data = { source, 0, 0 }
+        };
+        journal_ring_push( this->journal, &record );
+        journal_take_length( this );
+    }
+}
+
+// A take of recording_length frames has just ended, and lines up with origin (absolute).
+static void end_take( Loop this, uint64_t origin )
+{
+    set_origin( this, origin );
+    this->unrounded_length = this->recording_length;
+
+    Loop master = __atomic_load_n( &this->sync_master, __ATOMIC_RELAXED );
+    jack_nframes_t length = master ? master_length( master ) : 0;
+    if( length != 0 && this->recording_length != 0 ) {
+        /* Anything recorded past a rounded down length is never played back,
+           and a rounded up one just ends in silence. */
+        set_recording_length( this, sync_length( this->recording_length, length ) );
+        this->sync_offset = 0;
+        this->sync_offset = sync_phase( this, master, this->origin );
+    }
+    if( master ) {
+        this->synced_to = master;
+        this->synced_take = master_take_count( master );
+    }
+
+    count_take( this );
+}
+
+/* Whether the master has had a new take since our length and offset were
+   worked out against it.  The first look at a master only takes note, since
+   a restored or newly set offset is already in terms of its take. */
+static int master_changed( Loop this, Loop master )
+{
+    unsigned int count = master_take_count( master );
+    if( this->synced_to != master ) {
+        this->synced_to = master;
+        this->synced_take = count;
+        return 0;
+    }
+    return count != this->synced_take;
+}
+
+/* The master has a new take, which our length may no longer fit and our
+   offset means nothing to.  Rounds the take as recorded to the new one, and
+   lines it up so that it still starts at frame rather than jumping. */
+static void resync( Loop this, Loop master, uint64_t frame )
+{
+    begin_take_change( this );
+    this->synced_take = master_take_count( master );
+    set_origin( this, frame );
+    set_recording_length( this, sync_length( this->unrounded_length, master_length( master ) ) );
+    this->sync_offset = 0;
+    this->sync_offset = sync_phase( this, master, frame );
+    journal_take_length( this );
+    end_take_change( this );
+
+    // Our own slaves have to follow.
+    count_take( this );
+}
+
+static void swap_buffers( LoopBuffer *a, LoopBuffer *b )
+{
+    LoopBuffer swap = *a;
+    *a = *b;
+    *b = swap;
+}
+
+// A new take leaves nothing for any overdub in flight to go on top of.
+static void reset_overdub( Loop this )
+{
+    loop_buffer_reset_write( this->overdub_capture );
+    loop_buffer_reset_write( this->overdub_layer );
+    loop_buffer_reset_write( this->overdub_merge );
+    this->layer_active = 0;
+    this->layer_rotated = 0;
+}
+
+/* A pass over the take is starting.  The layer only goes under it from the
+   top, since otherwise the merge would be missing the start of the take. */
+static void begin_pass( Loop this, int from_top )
+{
+    this->take_done = 0;
+    this->layer_done = 0;
+    this->layer_active = from_top && loop_buffer_length( this->overdub_layer ) > 0;
+
+    if( this->layer_active ) {
+        loop_buffer_reset_read( this->overdub_layer );
+        loop_buffer_reset_write( this->overdub_merge );
+        this->merge_failed = 0;
+    }
+}
+
+/* What was captured last pass becomes the layer.  The layer is only ever
+   still taken if it missed the top of a pass, which drops the capture. */
+static void rotate_capture( Loop this )
+{
+    this->layer_rotated = loop_buffer_length( this->overdub_layer ) == 0;
+    if( this->layer_rotated ) {
+        swap_buffers( &this->overdub_layer, &this->overdub_capture );
+    } else if( loop_buffer_length( this->overdub_capture ) > 0 ) {
+        this->overdub_stats.dropped += loop_buffer_length( this->overdub_capture );
+        loop_buffer_reset_write( this->overdub_capture );
+    }
+}
+
+// Playback is starting at frame, phase frames into the take.
+static void play_from( Loop this, uint64_t frame, jack_nframes_t phase )
+{
+    set_origin( this, frame - phase );
+    this->last_playback_start = (jack_nframes_t) this->origin;
+
+    // Anything overdubbed before playback last stopped still gets merged.
+    rotate_capture( this );
+    this->layer_rotated = 0;
+    begin_pass( this, phase == 0 );
+
+    if( phase && loop_buffer_seek( this->midi_loop_buffer, phase ) ) {
+        this->last_playback_start += this->recording_length;
+    }
+}
+
+/* Playback is starting at frame.  A synced loop starts partway through its
+   take, wherever the master says it should be. */
+static void start_playback( Loop this, uint64_t frame )
+{
+    Loop master = synced_master( this );
+    if( master && master_changed( this, master ) ) {
+        resync( this, master, this->origin );
+    }
+    play_from( this, frame, master ? sync_phase( this, master, frame ) : 0 );
+}
+
+/* The take has wrapped.  A synced loop re-derives where its next pass starts
+   from the master rather than accumulating lengths, so nothing can build up. */
+static void next_pass( Loop this, uint64_t cycle_frame )
+{
+    this->last_playback_start += this->recording_length;
+
+    Loop master = synced_master( this );
+    if( master == NULL ) {
         return;
     }
 
-    size_t written = jack_ringbuffer_write( this->state_buffer, (char *) &change, sizeof( change ) );
+    uint64_t start = cycle_frame + (int32_t) ( this->last_playback_start - (jack_nframes_t) cycle_frame );
+    if( master_changed( this, master ) ) {
+        resync( this, master, start );
+        return;
+    }
 
-    if( written != sizeof( change ) ) {
-        fprintf( stderr, "jack_ringubffer_write failed for the %s state buffer, CHANGE LOST.\n", this->name );
+    jack_nframes_t phase = sync_phase( this, master, start );
+    if( phase <= this->recording_length / 2 ) {
+        this->last_playback_start -= phase;
+    } else {
+        this->last_playback_start += this->recording_length - phase;
     }
 }
 
-// Also in the process callback => also RT
-int loop_process_callback( Loop this, jack_nframes_t nframes )
+// Whether the take, and the layer if there is one, have played through.
+static int pass_complete( Loop this )
 {
-    struct StateSchedule previous_state = this->current_state;
+    int take_empty = loop_buffer_length( this->midi_loop_buffer ) == 0;
+    int layer_empty = !this->layer_active || loop_buffer_length( this->overdub_layer ) == 0;
 
-    void *input_port_buffer = jack_port_get_buffer( this->loop_input, nframes );
-    if ( input_port_buffer == NULL ) {
-        fprintf( stderr, "jack_port_get_buffer failed for %s, cannot receive anything.\n", this->name );
-        return -10;
+    return ( this->take_done || take_empty )
+        && ( this->layer_done || layer_empty )
+        && !( take_empty && layer_empty );
+}
+
+/* Exchanges the finished replacement for the take, to be played from origin.
+   Overdubs on the old take don't fit the new one, so they go with it. */
+static void replace_take( Loop this, uint64_t origin )
+{
+    begin_take_change( this );
+    swap_buffers( &this->midi_loop_buffer, &this->replace_buffer );
+    loop_buffer_reset_read( this->midi_loop_buffer );
+    set_recording_length( this, this->replace_length );
+    this->replace_pending = 0;
+    reset_overdub( this );
+
+    end_take( this, origin );
+    journal_take( this, JOURNAL_TAKE_REPLACED, this->replace_end - this->replace_length, this->replace_length );
+    end_take_change( this );
+    this->last_playback_start = (jack_nframes_t) origin;
+}
+
+/* A capture of the span starting at origin has become the take, so it
+   plays on from wherever it would be by now had it been recorded. */
+static void adopt_capture( Loop this, uint64_t origin, jack_nframes_t length, uint64_t cycle_frame )
+{
+    loop_buffer_reset_read( this->midi_loop_buffer );
+    set_recording_length( this, length );
+    this->replace_pending = 0;
+    reset_overdub( this );
+    end_take( this, origin );
+    journal_take( this, JOURNAL_TAKE_CAPTURED, origin, length );
+
+    Loop master = synced_master( this );
+    jack_nframes_t phase = master
+        ? sync_phase( this, master, cycle_frame )
+        : ( cycle_frame - this->origin ) % this->recording_length;
+    play_from( this, cycle_frame, phase );
+
+    if( !is_playing( this->current_state.state ) ) {
+        this->current_state.state = STATE_PLAYBACK;
+        journal_state( this, cycle_frame, STATE_PLAYBACK );
+    }
+}
+
+/* An offered take has been swapped in.  It lines up with cycle_frame, as
+   if it had just been recorded, and plays from there if the loop's playing. */
+static void adopt_offer( Loop this, jack_nframes_t length, uint64_t cycle_frame )
+{
+    loop_buffer_reset_read( this->midi_loop_buffer );
+    set_recording_length( this, length );
+    this->replace_pending = 0;
+    reset_overdub( this );
+    end_take( this, cycle_frame );
+    journal_take( this, JOURNAL_TAKE_OFFERED, cycle_frame, 0 );
+
+    if( is_playing( this->current_state.state ) ) {
+        start_playback( this, cycle_frame );
+    }
+}
+
+// Swaps in the merge or the replacement, if there is one, and moves on to the next pass.
+static void end_pass( Loop this, uint64_t cycle_frame )
+{
+    if( this->replace_pending ) {
+        next_pass( this, cycle_frame );
+        replace_take( this, cycle_frame + (int32_t) ( this->last_playback_start - (jack_nframes_t) cycle_frame ) );
+        begin_pass( this, 1 );
+        return;
+    }
+
+    if( this->layer_active ) {
+        if( this->merge_failed ) {
+            this->overdub_stats.failed++;
+        } else {
+            begin_take_change( this );
+            swap_buffers( &this->midi_loop_buffer, &this->overdub_merge );
+            end_take_change( this );
+
+            // The layer was overdubbed over the pass before this one.
+            uint64_t pass_start = cycle_frame + (int32_t) ( this->last_playback_start - (jack_nframes_t) cycle_frame );
+            journal_take( this, JOURNAL_TAKE_MERGED, pass_start - this->recording_length, this->recording_length );
+            this->overdub_stats.passes++;
+            this->overdub_stats.last_merge_events = loop_buffer_length( this->midi_loop_buffer );
+        }
+        loop_buffer_reset_read( this->midi_loop_buffer );
+        loop_buffer_reset_write( this->overdub_layer );
     }
 
-    jack_nframes_t last_frame_time = jack_last_frame_time( this->jack_client );
+    rotate_capture( this );
+    next_pass( this, cycle_frame );
+    begin_pass( this, 1 );
+}
+
+// RT.  message is the input as it came in this cycle, pushed is what loop_buffer_push said.
+static void log_push_failure( Loop this, const struct MidiMessage *message, int pushed )
+{
+    if( pushed == -30 ) {
+        rt_log( RT_LOG_UNPACKABLE, this->id, message->time, message->data[0] );
+    } else {
+        rt_log( RT_LOG_LOOP_BUFFER_FULL, this->id, message->time, pushed );
+    }
+}
+
+/* Files an overdubbed event under the pass it was played over, relative to
+   the start of that pass.  Playback moves on to the next pass as soon as it
+   has played the last event of the current one, so anything that comes in
+   between then and the end of the pass proper goes on the end of what has
+   just become the layer, which won't have started playing yet. */
+static void capture_overdub( Loop this, const struct MidiMessage *message, uint64_t cycle_frame )
+{
+    int64_t length = this->recording_length;
+    int64_t time = (int32_t) ( ( (jack_nframes_t) cycle_frame + message->time ) - this->last_playback_start );
+
+    // Only if there's nothing to play, so nothing ever ended the pass.
+    if( time >= length ) {
+        this->last_playback_start += ( time / length - 1 ) * length;
+        end_pass( this, cycle_frame );
+        time = (int32_t) ( ( (jack_nframes_t) cycle_frame + message->time ) - this->last_playback_start );
+    }
+
+    LoopBuffer target = this->overdub_capture;
+    if( time < 0 ) {
+        time += length;
+        target = this->overdub_layer;
+        if( time < 0 || !this->layer_rotated ) {
+            this->overdub_stats.dropped++;
+            return;
+        }
+
+        // The first overdub of the last pass; none of this pass has played yet.
+        if( !this->layer_active ) {
+            this->layer_active = 1;
+            this->layer_done = 0;
+            loop_buffer_reset_write( this->overdub_merge );
+            this->merge_failed = 0;
+        }
+    }
+
+    if( time >= length ) {
+        this->overdub_stats.dropped++;
+        return;
+    }
+
+    struct MidiMessage captured = *message;
+    captured.time = time;
+    int pushed = loop_buffer_push( target, &captured );
+    if( pushed < 0 ) {
+        this->overdub_stats.dropped++;
+        log_push_failure( this, message, pushed );
+    }
+}
+
+// Also in the process callback => also RT
+int loop_process_callback(
+        Loop this,
+        jack_nframes_t nframes,
+        uint64_t cycle_frame,
+        int shed,
+        const struct InputBusMessages *bus_input,
+        struct OutputBusStage *bus_output
+    ) {
+
+    /* A capture that's come back while recording would have nowhere to go,
+       while an offered take can wait for the recording to finish. */
+    uint64_t capture_start;
+    jack_nframes_t capture_length;
+    int recording_take =
+        this->current_state.state == STATE_RECORDING || this->current_state.state == STATE_REPLACE;
+
+    /* Never in the cycle it was asked for, however quick the copy, so that
+       which cycle it lands in doesn't depend on the capture thread. */
+    int capture_due = this->capture_frame < cycle_frame;
+    if( recording_take ) {
+        if( capture_due ) {
+            capture_ring_collect( this->capture, NULL, NULL, NULL );
+        }
+    } else if( capture_due && capture_ring_ready( this->capture ) ) {
+        begin_take_change( this );
+        capture_ring_collect( this->capture, &this->midi_loop_buffer, &capture_start, &capture_length );
+        adopt_capture( this, capture_start, capture_length, cycle_frame );
+        end_take_change( this );
+    } else if( __atomic_load_n( &this->offer_status, __ATOMIC_ACQUIRE ) == OFFER_READY ) {
+        begin_take_change( this );
+        swap_buffers( &this->midi_loop_buffer, &this->offered_take );
+        adopt_offer( this, this->offered_length, cycle_frame );
+        end_take_change( this );
+        __atomic_store_n( &this->offer_status, OFFER_TAKEN, __ATOMIC_RELEASE );
+    }
+
+    struct StateSegment previous_state = this->current_state;
+
+    struct SegmentInput input = {
+        .port_buffer = NULL,
+        .decoded = NULL,
+        .index = 0,
+        .pending = 0
+    };
+
+    if( bus_input ) {
+        input.decoded = bus_input->messages;
+        input.events = bus_input->count;
+    } else {
+        input.port_buffer = jack_port_get_buffer( this->loop_input, nframes );
+        if ( input.port_buffer == NULL ) {
+            rt_log( RT_LOG_INPUT_BUFFER, this->id, 0, 0 );
+            return -10;
+        }
+        input.events = jack_midi_get_event_count( input.port_buffer );
+    }
+
+    struct SegmentOutput output = {
+        .port_buffer = NULL,
+        .stage = bus_output,
+        .last_time = 0
+    };
+
+    if( bus_output == NULL ) {
+        output.port_buffer = jack_port_get_buffer( this->loop_output, nframes );
+        if( output.port_buffer == NULL ) {
+            rt_log( RT_LOG_OUTPUT_BUFFER, this->id, 0, 0 );
+            return -15;
+        }
+        jack_midi_clear_buffer( output.port_buffer );
+    }
 
-    int event_index = 0;
-    int events = jack_midi_get_event_count( input_port_buffer );
+    jack_nframes_t last_frame_time = (jack_nframes_t) cycle_frame;
+    this->merged_this_cycle = 0;
 
     int read_next_state;
     do {
         //DEBUGGING_MESSAGE( "%s: state %s\n", loop_get_name( this ), STATE_STRINGS[this->current_state.state] );
-        struct StateSchedule next;
-        read_next_state = jack_ringbuffer_read( this->state_buffer, (char *) &next, sizeof( next ) );
-        if( read_next_state == 0 ) {
+        struct StateSegment next;
+        read_next_state =
+            this->schedule_count > 0 && this->schedule[0].frame < cycle_frame + nframes;
+        if( read_next_state ) {
+            // Anything that should already have happened happens right away.
+            struct ScheduledState change = schedule_pop( this );
+            next.time = change.frame > cycle_frame ? change.frame - cycle_frame : 0;
+            next.state = change.state;
+        } else {
             next.time = nframes;
             next.state = this->current_state.state;
-        } else if( read_next_state != sizeof( next ) ) {
-            fprintf( stderr, "invalid state buffer read in loop %s, can't continue processing\n", this->name );
-            return -20;
-        }
-
-        int input_result = process_state_midi_input(
-            this,
-            input_port_buffer,
-            events,
-            &event_index,
-            next.time,
-            last_frame_time
-        );
-
-        if( input_result != 0 ) {
-            return -30;
         }
 
+        // Bookkeeping for the state we've just entered has to come before its input.
         switch( this->current_state.state ) {
             case STATE_PLAYBACK:
-                {
-                    if( previous_state.state != STATE_PLAYBACK ) {
-                        this->last_playback_start = this->current_state.time + last_frame_time;
-                    }
-
-                    int playback_result = process_state_midi_playback( this, next.time, last_frame_time );
-                    if( playback_result != 0 ) {
-                        return -40;
-                    }
+            case STATE_OVERDUB:
+            case STATE_REPLACE:
+                if( !is_playing( previous_state.state ) ) {
+                    start_playback( this, cycle_frame + this->current_state.time );
+                }
+                if( this->current_state.state == STATE_REPLACE && previous_state.state != STATE_REPLACE ) {
+                    this->recording_start = this->current_state.time + last_frame_time;
+                    loop_buffer_reset_write( this->replace_buffer );
+                    this->replace_pending = 0;
                 }
                 break;
 
             case STATE_RECORDING:
-                {
-                    if( previous_state.state != STATE_RECORDING ) {
-                        this->recording_start = this->current_state.time + last_frame_time;
-                        loop_buffer_reset_write( this->midi_loop_buffer );
-                    }
+                if( previous_state.state != STATE_RECORDING ) {
+                    this->recording_start = this->current_state.time + last_frame_time;
+                    begin_take_change( this ); // Ended along with the recording.
+                    loop_buffer_reset_write( this->midi_loop_buffer );
+                    reset_overdub( this );
+                    this->replace_pending = 0;
                 }
                 break;
 
@@ -379,165 +1389,269 @@ int loop_process_callback( Loop this, jack_nframes_t nframes )
                 break;
         }
 
+        process_state_segment( this, &input, &output, next.time, cycle_frame, shed );
+
         // Transition states.
-        if( next.state == STATE_PLAYBACK && this->current_state.state != STATE_PLAYBACK ) {
+        if( is_playing( next.state ) && !is_playing( this->current_state.state ) ) {
             loop_buffer_reset_read( this->midi_loop_buffer );
         }
         
         if( this->current_state.state == STATE_RECORDING && next.state != STATE_RECORDING ) {
             this->recording_end = next.time + last_frame_time;
-            this->recording_length = this->recording_end - this->recording_start;
+            set_recording_length( this, this->recording_end - this->recording_start );
+            jack_nframes_t recorded = this->recording_length;
+            uint64_t start = cycle_frame + next.time - recorded;
+            end_take( this, start );
+            journal_take( this, JOURNAL_TAKE_RECORDED, start, recorded );
+            end_take_change( this );
             DEBUGGING_MESSAGE( "end recording end start %d %d\n",
             this->recording_end, this->recording_start );
         }
 
+        if( this->current_state.state == STATE_REPLACE && next.state != STATE_REPLACE ) {
+            this->replace_length = ( next.time + last_frame_time ) - this->recording_start;
+            this->replace_pending = 1;
+
+            uint64_t frame = cycle_frame + next.time;
+            this->replace_end = frame;
+            int32_t until_wrap = (int32_t) ( this->last_playback_start - (jack_nframes_t) frame );
+
+            // Without anything playing there's no wrap to wait for.
+            if( !is_playing( next.state ) || loop_buffer_length( this->midi_loop_buffer ) == 0 ) {
+                replace_take( this, frame - this->replace_length );
+                if( is_playing( next.state ) ) {
+                    start_playback( this, frame );
+                }
+            } else if( until_wrap >= 0 ) {
+                // Playback has already moved on to a pass that hasn't started yet.
+                replace_take( this, frame + until_wrap );
+                begin_pass( this, 1 );
+            }
+        }
+
+        if( next.state != this->current_state.state ) {
+            journal_state( this, cycle_frame + next.time, next.state );
+        }
+
         previous_state = this->current_state;
         this->current_state = next;
 
     } while( read_next_state );
 
-    int output_result = process_midi_output( this, nframes, last_frame_time );
-    if( output_result != 0 ) {
-        return -50;
+    capture_ring_mark( this->capture, cycle_frame + nframes );
+
+    if( this->merged_this_cycle > this->overdub_stats.max_cycle_events ) {
+        this->overdub_stats.max_cycle_events = this->merged_this_cycle;
     }
 
     return 0;
 }
 
-/* Called once per STATE - figures out what to do with the MIDI input received
-   received while the loop is in the given state. */
-static int process_state_midi_input(
+// The next input event inside the current state, decoded at most once.
+static int peek_segment_input(
         Loop this,
-        void *input_port_buffer,
-        int events,
-        int *event_index,
-        jack_nframes_t end_of_state,
-        jack_nframes_t last_frame_time
+        struct SegmentInput *input,
+        jack_nframes_t end_of_state
     ) {
 
-    for( ; *event_index < events; ( *event_index )++ ) {
-        struct MidiMessage input_message;
-        int read_message_result = midi_message_from_port_buffer( &input_message, input_port_buffer, *event_index );
+    if( input->decoded && !input->pending && input->index < input->events ) {
+        input->message = input->decoded[input->index];
+        input->pending = 1;
+    }
 
-        if( read_message_result != 0 ) {
-            continue; // Error was already reported at this point.
-        }
+    while( !input->pending && input->index < input->events ) {
+        int read_message_result = midi_message_from_port_buffer(
+            &input->message,
+            input->port_buffer,
+            input->index
+        );
 
-        if( input_message.time >= end_of_state ) {
-            break;
+        if( read_message_result == 0 ) {
+            input->pending = 1;
+        } else {
+            rt_log(
+                read_message_result < 0 ? RT_LOG_EVENT_GET_FAILED : RT_LOG_SYSEX_IGNORED,
+                this->id,
+                0,
+                input->index
+            );
+            input->index++;
         }
+    }
 
-        if( this->midi_through ) {
-            // DEBUGGING_MESSAGE( "queuing midi through\n" );
-            int queue_result = queue_midi_message( this->midi_io_buffer, &input_message );
+    return input->pending && input->message.time < end_of_state;
+}
 
-            if( queue_result != 0 ) {
-                return -10;
-            }
-        }
+// The next event from the take or the layer for this pass, if it has any left.
+static struct MidiMessage *peek_source( Loop this, LoopBuffer source, int *done )
+{
+    if( *done ) {
+        return NULL;
+    }
 
-        if( this->current_state.state == STATE_RECORDING ) {
-            input_message.time = ( last_frame_time + input_message.time ) - this->recording_start;
-            int pushed = loop_buffer_push( this->midi_loop_buffer, &input_message );
+    /* Only returns NULL if nothing has been recorded.
+     * Peek is constant time, so the readability gain seems worth it. */
+    struct MidiMessage *recorded = loop_buffer_peek( source );
 
-            if( pushed < 0 ) {
-                fprintf( stderr, "loop buffer full in loop %s, can't continue processing\n", this->name );
-                return -20;
-            }
-        }
+    // Past the end of a take that syncing cut short.
+    if( recorded != NULL && recorded->time >= this->recording_length ) {
+        loop_buffer_reset_read( source );
+        *done = 1;
+        return NULL;
     }
 
-    return 0;
+    return recorded;
 }
 
-// Called once per PLAYBACK STATE - determines which recorded events are up for playback.
-static int process_state_midi_playback(
+// The next recorded event due inside the current state, relative to this cycle.
+static int peek_segment_playback(
         Loop this,
+        struct MidiMessage *out,
         jack_nframes_t end_of_state,
-        jack_nframes_t last_frame_time
+        uint64_t cycle_frame
     ) {
 
-    int wrapped;
-    struct MidiMessage *recorded;
+    jack_nframes_t last_frame_time = (jack_nframes_t) cycle_frame;
+    struct MidiMessage *recorded = NULL;
+
+    // At most one new pass per peek, in case nothing in the take can play.
+    for( int attempt = 0; recorded == NULL; attempt++ ) {
+        struct MidiMessage *take = peek_source( this, this->midi_loop_buffer, &this->take_done );
+        struct MidiMessage *layer =
+            this->layer_active ? peek_source( this, this->overdub_layer, &this->layer_done ) : NULL;
+
+        // The take goes first on a tie, so a merge keeps the order things were played in.
+        if( take && ( !layer || take->time <= layer->time ) ) {
+            recorded = take;
+            this->playback_source = this->midi_loop_buffer;
+        } else if( layer ) {
+            recorded = layer;
+            this->playback_source = this->overdub_layer;
+        } else if( attempt == 0 && pass_complete( this ) ) {
+            end_pass( this, cycle_frame );
+        } else {
+            return 0;
+        }
+    }
 
-    /* Only returns NULL if the loop is invalid to begin with.
-     * Peek is constant time, so the readability gain seems worth it. */
-    while( ( recorded = loop_buffer_peek( this->midi_loop_buffer ) ) ) {
-
-        jack_nframes_t playback_time = recorded->time + this->last_playback_start;
-
-        /* DEBUGGING_MESSAGE(
-            "recorded playback %d %d %d %d %d\n",
-            recorded->time,
-            this->last_playback_start,
-            playback_time,
-            end_of_state,
-            last_frame_time
-        ); */
-
-        if( playback_time < end_of_state + last_frame_time ) {
-            struct MidiMessage adjusted = *recorded;
-            adjusted.time = playback_time - last_frame_time;
-
-            queue_midi_message( this->midi_io_buffer, &adjusted );
-            wrapped = loop_buffer_read_advance( this->midi_loop_buffer );
-            if( wrapped ) {
-                this->last_playback_start += this->recording_length;
-            }
+    this->playback_recorded = *recorded;
+
+    jack_nframes_t playback_time = recorded->time + this->last_playback_start;
+    if( playback_time >= end_of_state + last_frame_time ) {
+        return 0; // The merge will almost certainly stop this way.
+    }
+
+    *out = *recorded;
+    out->time = playback_time > last_frame_time ? playback_time - last_frame_time : 0;
+    return 1;
+}
+
+// Past the event peek_segment_playback found, copying it into any merge.
+static void advance_playback( Loop this )
+{
+    if( this->layer_active && !this->merge_failed ) {
+        if( loop_buffer_push( this->overdub_merge, &this->playback_recorded ) < 0 ) {
+            this->merge_failed = 1;
         } else {
-            break; // The loop will almost certainly exit this way.
+            this->merged_this_cycle++;
         }
     }
 
-    return 0;
+    if( loop_buffer_read_advance( this->playback_source ) ) {
+        if( this->playback_source == this->midi_loop_buffer ) {
+            this->take_done = 1;
+        } else {
+            this->layer_done = 1;
+        }
+    }
 }
 
-// Called once per PROCESS CYCLE - gives all of the MIDI output for this cycle to JACK.
-static int process_midi_output( Loop this, jack_nframes_t nframes, jack_nframes_t last_frame_time )
+// Into the port buffer or the stage, both of which need the events in time order.
+static void write_output( Loop this, struct SegmentOutput *output, struct MidiMessage *message )
 {
-	int read;
-	unsigned char *buffer;
-	void *port_buffer;
-	struct MidiMessage ev;
+    jack_nframes_t time = message->time;
 
-	port_buffer = jack_port_get_buffer( this->loop_output, nframes );
-	if( port_buffer == NULL ) {
-		fprintf( stderr, "Couldn't get output buffer for loop %s\n", this->name );
-		return -10;
-	}
+    // Only after an xrun can playback run late, but JACK would refuse it outright.
+    if( time < output->last_time ) {
+        time = output->last_time;
+    }
 
-	jack_midi_clear_buffer( port_buffer );
+    int written;
+    if( output->stage ) {
+        struct MidiMessage timed = *message;
+        timed.time = time;
+        written = output_bus_stage_push( output->stage, &timed );
+    } else {
+        written = jack_midi_event_write( output->port_buffer, time, message->data, message->len );
+    }
 
-	while( jack_ringbuffer_read_space( this->midi_io_buffer ) ) {
+    if( written != 0 ) {
+        rt_log( RT_LOG_OUTPUT_WRITE, this->id, time, 0 );
+        return;
+    }
 
-		read = jack_ringbuffer_peek( this->midi_io_buffer, (char *)&ev, sizeof( ev ) );
+    output->last_time = time;
+}
 
-		if( read != sizeof( ev ) ) {
-			fprintf( stderr, "Short read from the %s output ringbuffer, possible note loss.\n", this->name );
-			jack_ringbuffer_read_advance( this->midi_io_buffer, read );
-			continue;
-		}
+/* Called once per STATE - merges the MIDI through and playback streams for
+   the state into the output in timestamp order, and records or overdubs if
+   we should.
+   Shedding still consumes the input, it just doesn't do anything with it. */
+static void process_state_segment(
+        Loop this,
+        struct SegmentInput *input,
+        struct SegmentOutput *output,
+        jack_nframes_t end_of_state,
+        uint64_t cycle_frame,
+        int shed
+    ) {
 
-		/* If the event time is too much into the future, we'll need
-		   to send it later. */
-		if( ev.time >= (int)nframes )
-			break;
+    jack_nframes_t last_frame_time = (jack_nframes_t) cycle_frame;
+    int playing = is_playing( this->current_state.state );
+    int recording = !shed
+        && ( this->current_state.state == STATE_RECORDING || this->current_state.state == STATE_REPLACE );
+    LoopBuffer take = this->current_state.state == STATE_REPLACE ? this->replace_buffer : this->midi_loop_buffer;
+    int overdubbing = !shed && this->current_state.state == STATE_OVERDUB && this->recording_length > 0;
+    int through = !shed && this->midi_through;
+
+    struct MidiMessage playback;
+    int have_playback = playing && peek_segment_playback( this, &playback, end_of_state, cycle_frame );
+    int have_input = peek_segment_input( this, input, end_of_state );
+
+    while( have_input || have_playback ) {
+        if( have_input && ( !have_playback || input->message.time <= playback.time ) ) {
+            if( through ) {
+                write_output( this, output, &input->message );
+            }
 
-		/* If the event time is < 0, we missed a cycle because of xrun. */
-		if( ev.time < 0 )
-			ev.time = 0;
+            if( recording ) {
+                struct MidiMessage recorded = input->message;
+                recorded.time = ( last_frame_time + recorded.time ) - this->recording_start;
+                int pushed = loop_buffer_push( take, &recorded );
 
-		jack_ringbuffer_read_advance( this->midi_io_buffer, sizeof( ev ) );
+                // Drops the event but keeps the take going - see loop_get_buffer_stats.
+                if( pushed < 0 ) {
+                    log_push_failure( this, &input->message, pushed );
+                }
+            }
 
-		buffer = jack_midi_event_reserve( port_buffer, ev.time, ev.len );
+            if( !shed ) {
+                capture_ring_push( this->capture, cycle_frame + input->message.time, &input->message );
+                journal_input( this, cycle_frame + input->message.time, &input->message );
+            }
 
-		if( buffer == NULL ) {
-			fprintf( stderr, "Couldn't reserve space on the output buffer for %s\n", this->name );
-			return -20;
-		}
+            if( overdubbing ) {
+                capture_overdub( this, &input->message, cycle_frame );
+            }
 
-		memcpy( buffer, ev.data, ev.len );
-	}
+            input->pending = 0;
+            input->index++;
+            have_input = peek_segment_input( this, input, end_of_state );
+        } else {
+            write_output( this, output, &playback );
+            advance_playback( this );
 
-    return 0;
+            have_playback = peek_segment_playback( this, &playback, end_of_state, cycle_frame );
+        }
+    }
 }
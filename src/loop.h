@@ -18,30 +18,194 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #ifndef LOOP_H
 #define LOOP_H
 
+#include <stdint.h>
+
 #include <jack/jack.h>
 
+#include "dsp_stats.h"
+#include "input_bus.h"
+#include "loop_buffer.h"
+#include "output_bus.h"
+#include "segment_pool.h"
+
 typedef struct loop_type *Loop;
 
+struct ControlActionListNode;
+struct journal_ring_type;
+struct TransportGrid;
+
 int loop_new(
     Loop *new_loop,
     jack_client_t *jack_client,
     const char *name,
     int midi_through,
-    int playback_after_recording
+    int playback_after_recording,
+    SegmentPool segment_pool,
+    size_t max_segments
 );
 
 void loop_free( Loop this );
 
 const char *loop_get_name( Loop this );
+unsigned int loop_get_id( Loop this );
+
+/* Not RT.  Moves the loop's ports to names no loop's ports can have, and
+   back again when aside is 0, so that a loop of the same name can be made
+   while this one is still around.  Connections go with the ports.  Returns
+   non-zero, with the names as they were, if JACK won't rename them. */
+int loop_set_ports_aside( Loop this, int aside );
 
-void loop_toggle_playback( Loop this, jack_nframes_t time );
-void loop_toggle_recording( Loop this, jack_nframes_t time );
+/* RT - these only ever run from the process callback.  frame is absolute (the
+   engine's 64-bit frame clock) and may be any number of cycles ahead; a toggle
+   flips whatever state the loop will be in at that frame.  With quantize set,
+   frame is first pushed out to the next point on the transport grid. */
+void loop_toggle_playback( Loop this, uint64_t frame );
+void loop_toggle_recording( Loop this, uint64_t frame );
+void loop_toggle_overdub( Loop this, uint64_t frame );
+void loop_toggle_replace( Loop this, uint64_t frame );
+void loop_stop( Loop this, uint64_t frame );
+
+/* Also RT, and frame isn't quantized.  Turns what was played into the loop
+   just before frame into the take, as if it had been recorded, and plays it
+   on from there.  The copy happens on another thread, so it takes over a
+   few cycles later unless the loop is recording by then. */
+void loop_capture( Loop this, uint64_t frame );
 
 int loop_get_midi_through( Loop this );
 void loop_set_midi_through( Loop this, int set );
 int loop_get_playback_after_recording( Loop this );
 void loop_set_playback_after_recording( Loop this, int set );
 
-int loop_process_callback( Loop this, jack_nframes_t nframes );
+// Higher priority loops are processed first and shed last.
+int loop_get_priority( Loop this );
+void loop_set_priority( Loop this, int priority );
+
+// An enum TransportQuantize, as an int to match the other controls.
+int loop_get_quantize( Loop this );
+void loop_set_quantize( Loop this, int quantize );
+
+/* A loop synced to a master rounds each take to the nearest whole multiple or
+   exact divisor of the master's length, and keeps its playback in phase with
+   the master's using integer frame arithmetic.  NULL to free run.  Clear it
+   before the master goes away. */
+Loop loop_get_sync_master( Loop this );
+void loop_set_sync_master( Loop this, Loop master );
+
+/* Where the loop's input comes from: LOOP_INPUT_PORT for its own port, or
+   else the engine's shared input bus, either INPUT_BUS_ALL_CHANNELS or just
+   what's on one channel (0-15).  The engine only reads this when the loop
+   is published. */
+#define LOOP_INPUT_PORT -2
+int loop_get_input_source( Loop this );
+void loop_set_input_source( Loop this, int source );
+
+/* Likewise for where its output goes: LOOP_OUTPUT_PORT for its own port, or
+   the engine's shared output bus, either OUTPUT_BUS_KEEP_CHANNEL or with
+   every channel message moved to one channel (0-15). */
+#define LOOP_OUTPUT_PORT -2
+int loop_get_output_target( Loop this );
+void loop_set_output_target( Loop this, int target );
+
+// Set by the engine the loop is published to.
+void loop_set_transport_grid( Loop this, const struct TransportGrid *grid );
+
+/* Not RT, and only before the loop is first published.  Where the process
+   callback journals the loop's input, state changes and takes - see
+   journal.h.  The loop releases the ring when it's freed. */
+void loop_set_journal( Loop this, struct journal_ring_type *ring );
+
+void loop_get_buffer_stats( Loop this, struct LoopBufferStats *stats );
+
+/* Head of the list of this loop's mappings, which belongs to the control action
+   table the loop is mapped in - see control_action_table_remove_loop_mappings. */
+struct ControlActionListNode **loop_get_mapping_list( Loop this );
+
+/* An overdub is merged into the take over the pass after it's played, one
+   event per event played back, so the cost per cycle is bounded by what's
+   being played rather than by the size of the take. */
+struct LoopOverdubStats {
+    unsigned int passes;       // Overdubs merged into the take.
+    size_t last_merge_events;  // The take after the last of them.
+    size_t max_cycle_events;   // Most events merged in any one cycle.
+    unsigned int failed;       // Merges that ran out of room, losing that overdub.
+    unsigned int dropped;      // Overdubbed events that couldn't be kept.
+};
+
+// Not RT, and may be a cycle out of date.
+void loop_get_overdub_stats( Loop this, struct LoopOverdubStats *stats );
+
+// For the engine, which looks at these to skip idle loops without touching them.
+jack_port_t *loop_get_input_port( Loop this );
+jack_port_t *loop_get_output_port( Loop this );
+
+/* RT.  Whether the loop has nothing to do until a control or some input
+   comes in: stopped, with nothing scheduled and no capture on its way. */
+int loop_is_idle( Loop this );
+
+/* Not RT, and only between cycles.  Whether a capture is being copied that
+   the next cycle could take over - an offline render waits for it, so that
+   a capture takes over on the same cycle however fast the cycles come. */
+int loop_is_capturing( Loop this );
+
+// Written by the engine from the process callback.
+struct DspStats *loop_get_dsp_stats( Loop this );
+
+// Not RT, and may be a cycle out of date.
+int loop_is_playing( Loop this );
+
+// What goes with a take's events to play it back as it was.
+struct LoopTake {
+    jack_nframes_t length;
+    jack_nframes_t sync_offset; // From the sync master's origin, modulo length.
+};
+
+/* Not RT.  Copies the take as packed messages while the process callback
+   carries on: if the take changes mid-copy, the copy starts over.  Returns
+   how many messages the take has, copying at most capacity of them, so
+   call it again with more room if that's more than capacity.  A take that's
+   still being recorded doesn't count yet, and comes back empty. */
+size_t loop_copy_take(
+    Loop this,
+    struct PackedMidiMessage *events,
+    size_t capacity,
+    struct LoopTake *take
+);
+
+/* Not RT, and only before the loop is first published.  Makes events the
+   take, starting it playing on the loop's first cycle if playing is set.
+   Returns non-zero if the take doesn't fit. */
+int loop_restore_take(
+    Loop this,
+    const struct PackedMidiMessage *events,
+    size_t count,
+    const struct LoopTake *take,
+    int playing
+);
+
+/* Not RT.  Hands take, filled away from the process thread with a buffer
+   from the loop's pool, over to the process callback, which swaps it in
+   whole at the start of a cycle (once any recording has finished) and
+   plays it from there if the loop's playing.  A synced loop rounds it like
+   a recorded take.  *take comes back holding the take it replaced last
+   time, or NULL, for the caller to free; the loop frees the one it's
+   holding if it goes first.  Returns non-zero, leaving *take alone, if
+   the last take offered hasn't been swapped in yet.  The engine may be
+   skipping the loop as idle, so publish it again afterwards. */
+int loop_offer_take( Loop this, LoopBuffer *take, jack_nframes_t length );
+
+/* cycle_frame is the absolute frame the cycle starts on, and everything
+   scheduled before the end of the cycle takes effect in it.  When shed is set,
+   the loop keeps playing back but bypasses its recording and MIDI through for
+   the cycle, since those scale with the input.  The input is bus_input if it
+   isn't NULL, and the loop's own port otherwise, and likewise the output
+   goes on to bus_output, which the loop leaves for the engine to merge. */
+int loop_process_callback(
+    Loop this,
+    jack_nframes_t nframes,
+    uint64_t cycle_frame,
+    int shed,
+    const struct InputBusMessages *bus_input,
+    struct OutputBusStage *bus_output
+);
 
 #endif
@@ -18,17 +18,35 @@
 #include "loop_buffer.h"
 
 #include "midi_message.h"
+#include "segment_pool.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 struct loop_buffer_type {
-    struct MidiMessage *buffer;
-    struct MidiMessage *buffer_end;
-    struct MidiMessage *read_pointer;
-    struct MidiMessage *write_pointer;
+    SegmentPool pool;
+    size_t max_segments;
+
+    struct LoopBufferSegment *first;
+    size_t segment_count; // Segments chained off of first, kept across takes.
+
+    struct LoopBufferSegment *write_segment;
+    size_t write_index;
+    size_t length;
+    jack_nframes_t write_time; // Of the last message pushed, for the deltas.
+
+    struct LoopBufferSegment *read_segment; // NULL until there's something to read.
+    size_t read_index;
+    size_t read_position;
+    jack_nframes_t read_time; // Of the message before the one being read.
+    struct MidiMessage peeked; // Decoded from the packed one being read.
+
+    size_t min_pool_available;
+    unsigned int dry_count;
+    unsigned int clamped_count;
 };
 
-struct loop_buffer_type *loop_buffer_init( size_t capacity ) 
+struct loop_buffer_type *loop_buffer_init( SegmentPool pool, size_t max_segments )
 {
     struct loop_buffer_type *buffer_struct = malloc(
         sizeof( struct loop_buffer_type )
@@ -38,17 +56,22 @@ struct loop_buffer_type *loop_buffer_init( size_t capacity )
         return NULL;
     }
 
-    buffer_struct->buffer = malloc(
-        sizeof( struct MidiMessage ) * capacity
-    );
+    // The first segment doesn't come out of the pool, since we're not RT here.
+    buffer_struct->first = segment_pool_allocate( pool );
 
-    if( buffer_struct->buffer == NULL ) {
+    if( buffer_struct->first == NULL ) {
         free( buffer_struct );
         return NULL;
     }
 
+    buffer_struct->pool = pool;
+    buffer_struct->max_segments = max_segments;
+    buffer_struct->segment_count = 1;
+    buffer_struct->min_pool_available = segment_pool_available( pool );
+    buffer_struct->dry_count = 0;
+    buffer_struct->clamped_count = 0;
+
     loop_buffer_reset_write( buffer_struct );
-    buffer_struct->buffer_end = buffer_struct->buffer + capacity;
 
     return buffer_struct;
 }
@@ -56,7 +79,7 @@ struct loop_buffer_type *loop_buffer_init( size_t capacity )
 int loop_buffer_is_valid( struct loop_buffer_type *loop_buffer ) 
 {
 
-    if( loop_buffer == NULL || loop_buffer->buffer == NULL ) {
+    if( loop_buffer == NULL || loop_buffer->first == NULL ) {
         return 0;
     }
 
@@ -65,56 +88,291 @@ int loop_buffer_is_valid( struct loop_buffer_type *loop_buffer )
 
 void loop_buffer_reset_read( struct loop_buffer_type *loop_buffer )
 {
-    loop_buffer->read_pointer = loop_buffer->buffer;
+    if( loop_buffer->length ) {
+        loop_buffer->read_segment = loop_buffer->first;
+        loop_buffer->read_index = 0;
+        loop_buffer->read_position = 0;
+        loop_buffer->read_time = 0;
+    }
 }
 
+// Keeps every segment we already have, so re-recording doesn't touch the pool.
 void loop_buffer_reset_write( struct loop_buffer_type *loop_buffer )
 {
-    loop_buffer->read_pointer = NULL;
-    loop_buffer->write_pointer = loop_buffer->buffer;
+    loop_buffer->read_segment = NULL;
+    loop_buffer->write_segment = loop_buffer->first;
+    loop_buffer->write_segment->start_time = 0;
+    loop_buffer->write_index = 0;
+    loop_buffer->length = 0;
+    loop_buffer->write_time = 0;
 }
 
 void loop_buffer_free( struct loop_buffer_type *loop_buffer )
 {
     if( loop_buffer ) {
-        free( loop_buffer->buffer );
+        struct LoopBufferSegment *segment = loop_buffer->first;
+        while( segment ) {
+            struct LoopBufferSegment *next = segment->next;
+            segment_pool_push( loop_buffer->pool, segment );
+            segment = next;
+        }
         free( loop_buffer );
     }
 }
 
+int loop_buffer_reserve( struct loop_buffer_type *loop_buffer, size_t events )
+{
+    size_t segments = ( events + LOOP_BUFFER_SEGMENT_EVENTS - 1 ) / LOOP_BUFFER_SEGMENT_EVENTS;
+    if( loop_buffer->max_segments && segments > loop_buffer->max_segments ) {
+        return -10;
+    }
+
+    struct LoopBufferSegment *last = loop_buffer->first;
+    while( last->next ) {
+        last = last->next;
+    }
+
+    while( loop_buffer->segment_count < segments ) {
+        // Allocated rather than popped, to keep off the lock the RT threads spin on.
+        struct LoopBufferSegment *segment = segment_pool_allocate( loop_buffer->pool );
+        if( segment == NULL ) {
+            return -20;
+        }
+
+        last->next = segment;
+        last = segment;
+        loop_buffer->segment_count++;
+    }
+
+    return 0;
+}
+
 int loop_buffer_push( struct loop_buffer_type *loop_buffer, struct MidiMessage *message )
 {
+    if( message->len != midi_message_length( message->data[0] ) ) {
+        return -30; // Can't be packed.
+    }
 
-    if( loop_buffer->write_pointer == loop_buffer->buffer_end ) {
-        return -10;
+    if( loop_buffer->write_index == LOOP_BUFFER_SEGMENT_EVENTS ) {
+        struct LoopBufferSegment *next = loop_buffer->write_segment->next;
+
+        if( next == NULL ) {
+            if(
+                loop_buffer->max_segments
+                && loop_buffer->segment_count >= loop_buffer->max_segments
+            ) {
+                return -10;
+            }
+
+            size_t remaining;
+            next = segment_pool_pop( loop_buffer->pool, &remaining );
+            if( remaining < loop_buffer->min_pool_available ) {
+                loop_buffer->min_pool_available = remaining;
+            }
+
+            if( next == NULL ) {
+                loop_buffer->dry_count++;
+                return -20;
+            }
+
+            loop_buffer->write_segment->next = next;
+            loop_buffer->segment_count++;
+        }
+
+        next->start_time = loop_buffer->write_time;
+        loop_buffer->write_segment = next;
+        loop_buffer->write_index = 0;
     }
 
-    if( loop_buffer->write_pointer == loop_buffer->buffer ) {
-        loop_buffer->read_pointer = loop_buffer->buffer;
+    if( loop_buffer->length == 0 ) {
+        loop_buffer->read_segment = loop_buffer->first;
+        loop_buffer->read_index = 0;
+        loop_buffer->read_position = 0;
+        loop_buffer->read_time = 0;
     }
 
-    *( loop_buffer->write_pointer ) = *message;
-    loop_buffer->write_pointer++;
+    // Takes are recorded in order, but don't let a stray message wrap the delta.
+    jack_nframes_t time = message->time;
+    if( time < loop_buffer->write_time ) {
+        time = loop_buffer->write_time;
+        loop_buffer->clamped_count++;
+    }
+
+    struct PackedMidiMessage *packed =
+        &( loop_buffer->write_segment->events[loop_buffer->write_index] );
+    packed->delta = time - loop_buffer->write_time;
+    packed->status = message->data[0];
+    packed->data[0] = message->len > 1 ? message->data[1] : 0;
+    packed->data[1] = message->len > 2 ? message->data[2] : 0;
+    packed->reserved = 0;
+
+    loop_buffer->write_time = time;
+    loop_buffer->write_index++;
+    loop_buffer->length++;
 
     return 0;
 }
 
 struct MidiMessage *loop_buffer_peek( struct loop_buffer_type *loop_buffer )
 {
-    return loop_buffer->read_pointer;
+    if( loop_buffer->read_segment == NULL ) {
+        return NULL;
+    }
+
+    struct PackedMidiMessage *packed =
+        &( loop_buffer->read_segment->events[loop_buffer->read_index] );
+    struct MidiMessage *peeked = &( loop_buffer->peeked );
+
+    peeked->time = loop_buffer->read_time + packed->delta;
+    peeked->len = midi_message_length( packed->status );
+    peeked->data[0] = packed->status;
+    peeked->data[1] = packed->data[0];
+    peeked->data[2] = packed->data[1];
+
+    return peeked;
 }
 
 int loop_buffer_read_advance( struct loop_buffer_type *loop_buffer )
 {
-    if( loop_buffer->read_pointer != NULL ) {
-        loop_buffer->read_pointer++;
-        if( loop_buffer->read_pointer < loop_buffer->write_pointer ) {
+    if( loop_buffer->read_segment != NULL ) {
+        loop_buffer->read_position++;
+        if( loop_buffer->read_position < loop_buffer->length ) {
+            loop_buffer->read_time += loop_buffer->read_segment->events[loop_buffer->read_index].delta;
+            loop_buffer->read_index++;
+            if( loop_buffer->read_index == LOOP_BUFFER_SEGMENT_EVENTS ) {
+                loop_buffer->read_segment = loop_buffer->read_segment->next;
+                loop_buffer->read_index = 0;
+            }
             return 0;
         } else {
-            loop_buffer->read_pointer = loop_buffer->buffer;
+            loop_buffer->read_segment = loop_buffer->first;
+            loop_buffer->read_index = 0;
+            loop_buffer->read_position = 0;
+            loop_buffer->read_time = 0;
         }
     }
     
     return 1;
 }
 
+int loop_buffer_seek( struct loop_buffer_type *loop_buffer, jack_nframes_t time )
+{
+    if( loop_buffer->length == 0 ) {
+        return 1;
+    }
+
+    // A segment starting before time only holds messages that come before it.
+    struct LoopBufferSegment *segment = loop_buffer->first;
+    size_t position = 0;
+    if( loop_buffer->read_segment && loop_buffer->read_segment->start_time < time ) {
+        segment = loop_buffer->read_segment;
+        position = loop_buffer->read_position - loop_buffer->read_index;
+    }
+
+    // Only the segments up to the write segment are part of this take.
+    while(
+        position + LOOP_BUFFER_SEGMENT_EVENTS < loop_buffer->length
+        && segment->next->start_time < time
+    ) {
+        segment = segment->next;
+        position += LOOP_BUFFER_SEGMENT_EVENTS;
+    }
+
+    loop_buffer->read_segment = segment;
+    loop_buffer->read_index = 0;
+    loop_buffer->read_position = position;
+    loop_buffer->read_time = segment->start_time;
+
+    // Walks the deltas without decoding anything.
+    while( loop_buffer->read_time + loop_buffer->read_segment->events[loop_buffer->read_index].delta < time ) {
+        if( loop_buffer_read_advance( loop_buffer ) ) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+size_t loop_buffer_copy_packed(
+        struct loop_buffer_type *loop_buffer,
+        struct PackedMidiMessage *out,
+        size_t capacity
+    ) {
+
+    size_t length = loop_buffer->length;
+    size_t copied = 0;
+    const struct LoopBufferSegment *segment = loop_buffer->first;
+
+    while( segment && copied < length && copied < capacity ) {
+        size_t count = LOOP_BUFFER_SEGMENT_EVENTS;
+        if( count > length - copied ) {
+            count = length - copied;
+        }
+        if( count > capacity - copied ) {
+            count = capacity - copied;
+        }
+
+        memcpy( out + copied, segment->events, count * sizeof( struct PackedMidiMessage ) );
+        copied += count;
+        segment = segment->next;
+    }
+
+    return length;
+}
+
+int loop_buffer_load_packed(
+        struct loop_buffer_type *loop_buffer,
+        const struct PackedMidiMessage *events,
+        size_t count
+    ) {
+
+    loop_buffer_reset_write( loop_buffer );
+    if( loop_buffer_reserve( loop_buffer, count ) != 0 ) {
+        return -10;
+    }
+
+    size_t loaded = 0;
+    jack_nframes_t time = 0;
+    struct LoopBufferSegment *segment = loop_buffer->first;
+    while( loaded < count ) {
+        size_t segment_count = count - loaded < LOOP_BUFFER_SEGMENT_EVENTS
+            ? count - loaded
+            : LOOP_BUFFER_SEGMENT_EVENTS;
+        memcpy( segment->events, events + loaded, segment_count * sizeof( struct PackedMidiMessage ) );
+        segment->start_time = time;
+        for( size_t i = 0; i < segment_count; i++ ) {
+            time += segment->events[i].delta;
+        }
+
+        loop_buffer->write_segment = segment;
+        loop_buffer->write_index = segment_count;
+        loaded += segment_count;
+        segment = segment->next;
+    }
+
+    loop_buffer->length = count;
+    loop_buffer->write_time = time;
+    loop_buffer_reset_read( loop_buffer );
+
+    return 0;
+}
+
+size_t loop_buffer_length( struct loop_buffer_type *loop_buffer )
+{
+    return loop_buffer->length;
+}
+
+void loop_buffer_get_stats( struct loop_buffer_type *loop_buffer, struct LoopBufferStats *stats )
+{
+    stats->events = loop_buffer->length;
+    stats->segments = loop_buffer->segment_count;
+    stats->max_segments = loop_buffer->max_segments;
+    stats->min_pool_available = loop_buffer->min_pool_available;
+    stats->dry_count = loop_buffer->dry_count;
+    stats->clamped_count = loop_buffer->clamped_count;
+    stats->bytes = sizeof( *loop_buffer ) + stats->segments * sizeof( struct LoopBufferSegment );
+    stats->bytes_per_event = stats->events
+        ? ( stats->bytes + stats->events - 1 ) / stats->events
+        : 0;
+}
+
@@ -19,10 +19,25 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define LOOP_BUFFER_H
 
 #include "midi_message.h"
+#include "segment_pool.h"
 
 typedef struct loop_buffer_type *LoopBuffer;
 
-LoopBuffer loop_buffer_init( size_t capacity );
+struct LoopBufferStats {
+    size_t events;
+    size_t segments;
+    size_t max_segments;        // 0 means unlimited.
+    size_t min_pool_available;  // Lowest the pool got when this buffer grew.
+    unsigned int dry_count;     // Pushes dropped for want of a segment.
+    unsigned int clamped_count; // Pushes earlier than the one before, stored at its time.
+    size_t bytes;               // Everything the buffer holds on to.
+    size_t bytes_per_event;     // bytes over events, rounded up (0 when empty).
+};
+
+/* The buffer is a chain of fixed-size segments.  Growing it pops segments
+   from the pool, so it never allocates in the process thread, and a take
+   stops growing once it holds max_segments (0 for no limit). */
+LoopBuffer loop_buffer_init( SegmentPool pool, size_t max_segments );
 
 // Hides the implementation of LoopBuffer as a struct pointer.
 int loop_buffer_is_valid( LoopBuffer buffer );
@@ -31,8 +46,35 @@ void loop_buffer_reset_read( LoopBuffer buffer );
 void loop_buffer_reset_write( LoopBuffer buffer );
 void loop_buffer_free( LoopBuffer buffer ); // Can safely be called with a loop buffer in any state (checks for NULL input).
 
+/* Returns -10 if the take is at max_segments, -20 if the pool is dry, or -30
+   if the message's length doesn't match its status, so it can't be packed. */
 int loop_buffer_push( LoopBuffer buffer, struct MidiMessage *message );
 struct MidiMessage *loop_buffer_peek( LoopBuffer buffer );
 int loop_buffer_read_advance( LoopBuffer buffer );
 
+/* Moves the read position to the first message at or after time, returning
+   non-zero (and leaving it at the start) if there isn't one.  Skips whole
+   segments by the time they start at, going on from the read position when
+   that's no later than time, so it reads a segment header per segment
+   passed and at most one segment's messages. */
+int loop_buffer_seek( LoopBuffer buffer, jack_nframes_t time );
+
+/* Not RT.  Grows the chain of segments so that events messages fit without
+   going to the pool, for filling a buffer away from the process thread. */
+int loop_buffer_reserve( LoopBuffer buffer, size_t events );
+
+/* Not RT.  The take as packed messages, a segment at a time.  Copies at
+   most capacity of them, returning how many there are in all, and leaves
+   the read position alone, so it's safe while the buffer is being played. */
+size_t loop_buffer_copy_packed( LoopBuffer buffer, struct PackedMidiMessage *out, size_t capacity );
+
+/* Not RT.  Replaces the take with count packed messages, a segment at a
+   time, as if they'd been pushed.  Returns non-zero if they don't fit. */
+int loop_buffer_load_packed( LoopBuffer buffer, const struct PackedMidiMessage *events, size_t count );
+
+// Messages in the current take.
+size_t loop_buffer_length( LoopBuffer buffer );
+
+void loop_buffer_get_stats( LoopBuffer buffer, struct LoopBufferStats *stats );
+
 #endif
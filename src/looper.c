@@ -40,11 +40,16 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "midi_message.h"
 #include "loop.h"
 #include "control_action_table.h"
+#include "capture_ring.h"
+#include "control_dispatch.h"
 #include "debug.h"
-
-#define NOTE_OFF 0x80
-#define NOTE_ON 0x90
-#define CONTROL_CHANGE 0xB0
+#include "engine.h"
+#include "journal.h"
+#include "midi_file.h"
+#include "rt_log.h"
+#include "segment_pool.h"
+#include "session.h"
+#include "trace.h"
 
 /* ----------------------------------------------------   
    Plumbing
@@ -70,109 +75,76 @@ void str_hash_destroy_key( gpointer str )
 
 // Data.
 jack_client_t *jack_client;
-jack_port_t *control_input;
+Engine engine;
 
 jack_nframes_t sample_rate;
 int rate_flag = 0;
 
+/* Serializes the OSC handlers that rebuild the engine's view of the loops and
+   mappings.  The process callback never takes it: it only sees the snapshots
+   published via engine_publish. */
 pthread_mutex_t loop_table_lock;
-pthread_mutex_t action_table_lock;
 GHashTable *loop_table;
 ControlActionTable action_table;
 
-int sample_rate_change( jack_nframes_t nframes, void *notUsed )
-{
-    if( !rate_flag ) {
-        rate_flag = 1;
-        return 0;
-    }
+// Every loop buffer grows out of this.
+SegmentPool segment_pool;
+size_t max_segments_per_loop = 0;
+size_t pool_low_watermark = 16;
+size_t pool_high_watermark = 64;
 
-    printf( "Sample rate has changed! Exiting...\n" );
-    exit( -1 );
-}
+// Loops whose input history is locked in one block at startup - see capture_ring_init.
+size_t locked_capture_loops = 64;
 
-void process_for_each_loop( gpointer key, gpointer value, gpointer data )
-{
-    Loop loop = value;
-    jack_nframes_t *nframes = data;
-    loop_process_callback( loop, *nframes );
-}
+// Seconds of input history each loop keeps for capture, at so many messages a second.
+double capture_seconds = 4.0;
+unsigned long capture_rate = 1024;
 
-void process_control_input( jack_nframes_t nframes )
-{
-    int events;
-    void *control_port_buffer;
+// Percentages of the JACK period - see engine_set_dsp_budget.
+unsigned int dsp_budget_percent = ENGINE_DEFAULT_BUDGET_PERCENT;
+unsigned int dsp_shed_percent = 0;
 
-    control_port_buffer = jack_port_get_buffer( control_input, nframes );
-    if ( control_port_buffer == NULL) {
-        fprintf( stderr, "Failed to get control input port buffer.\n" );
-        return;
-    }
+// Threads processing loops alongside the JACK process thread - see engine_set_workers.
+int engine_workers = 0;
+int engine_workers_oversubscribe = 0;
 
-    events = jack_midi_get_event_count( control_port_buffer );
+// Frames by which a timed OSC command may miss its frame before it's dropped.
+jack_nframes_t max_command_lateness = 0;
+int max_command_lateness_set = 0;
 
-    int got_loop_table_lock = !pthread_mutex_trylock( &loop_table_lock );
-    if(
-        got_loop_table_lock
-        && pthread_mutex_trylock( &action_table_lock ) == 0
-    ) {
-        int i;
-        for ( i = 0; i < events; i++ ) {
-            struct MidiMessage rev;
+// Loaded at startup if it's there, and saved on the way out - see session.h.
+const char *session_path = NULL;
 
-            if( midi_message_from_port_buffer( &rev, control_port_buffer, i ) != 0 ) {
-                fprintf( stderr, "TROUBLE\n" );
-            }
-            unsigned char midi_channel, midi_value;
-            enum MidiControlType midi_type;
-            unsigned char message_type = rev.data[0] & 0xf0;
-            if(
-                message_type == NOTE_ON
-                || message_type == NOTE_OFF
-                || message_type == CONTROL_CHANGE
-            ) {
-                midi_value = rev.data[1];
-                midi_channel = rev.data[0] & 0xf;
-
-                switch( message_type ) {
-                    case NOTE_ON: midi_type = TYPE_NOTE_ON; break;
-                    case NOTE_OFF: midi_type = TYPE_NOTE_OFF; break;
-                    case CONTROL_CHANGE: midi_type = rev.data[2] > 63 ? TYPE_CC_ON : TYPE_CC_OFF; break;
-                    default:
-                        // shut gcc up
-                        midi_type = TYPE_NOTE_ON;
-                        assert( 0 );
-                        break;
-                }
+// Everything recorded goes in here as it happens, if it's set - see journal.h.
+const char *journal_path = NULL;
+Journal journal = NULL;
 
-                DEBUGGING_MESSAGE( "control %u %d %u\n", midi_channel, midi_type, midi_value );
-                control_action_table_invoke(
-                    action_table,
-                    midi_channel,
-                    midi_type,
-                    midi_value,
-                    rev.time
-                );
-            }
-        }
+// Everything from outside reaching the engine goes in here, if it's set - see trace.h.
+const char *trace_path = NULL;
+Trace trace = NULL;
 
-        g_hash_table_foreach( loop_table, process_for_each_loop, &nframes );
-        pthread_mutex_unlock( &loop_table_lock );
-        pthread_mutex_unlock( &action_table_lock );
-    } else {
-        if( got_loop_table_lock ) {
-            pthread_mutex_unlock( &loop_table_lock );
-        }
+int save_session_locked( const char *path );
 
-        DEBUGGING_MESSAGE( "Tables locked, no output.\n" );
+int sample_rate_change( jack_nframes_t nframes, void *notUsed )
+{
+    if( !rate_flag ) {
+        rate_flag = 1;
+        return 0;
     }
 
+    printf( "Sample rate has changed! Exiting...\n" );
+
+    // Not if an OSC handler has the loops, since it may be waiting on a cycle.
+    if( session_path && pthread_mutex_trylock( &loop_table_lock ) == 0 ) {
+        save_session_locked( session_path );
+        pthread_mutex_unlock( &loop_table_lock );
+    }
+    exit( -1 );
 }
 
 int process( jack_nframes_t frames, void *notUsed )
 {
-    process_control_input( frames );
-    return 0;
+    return engine_process( engine, frames );
 }
 
 void init_jack( void )
@@ -190,18 +162,39 @@ void init_jack( void )
 
     sample_rate = jack_get_sample_rate( jack_client );
 
-    control_input = jack_port_register(
-        jack_client,
-        "control input",
-        JACK_DEFAULT_MIDI_TYPE,
-        JackPortIsInput,
-        0
-    );
-
-    if( control_input == NULL ) {
-        fprintf( stderr, "Could not register JACK control input port.\n" );
+    engine = engine_new( jack_client );
+    if( engine == NULL ) {
         exit( -1 );
     }
+    engine_set_dsp_budget( engine, dsp_budget_percent, dsp_shed_percent );
+    int workers = engine_set_workers( engine, engine_workers, engine_workers_oversubscribe );
+    if( workers < engine_workers ) {
+        fprintf(
+            stderr,
+            "Processing loops on %d engine workers rather than %d, one per CPU the process thread leaves spare.  -W starts them all anyway.\n",
+            workers,
+            engine_workers
+        );
+    }
+    if( max_command_lateness_set ) {
+        engine_set_max_command_lateness( engine, max_command_lateness );
+    }
+
+    if( journal_path ) {
+        journal = journal_new( journal_path, sample_rate, JOURNAL_RING_RECORDS );
+        if( journal == NULL ) {
+            exit( -1 );
+        }
+    }
+
+    // Before activating, so that the trace starts from the engine's first cycle.
+    if( trace_path ) {
+        trace = trace_new( trace_path, sample_rate, TRACE_RING_BYTES );
+        if( trace == NULL ) {
+            exit( -1 );
+        }
+        engine_set_trace( engine, trace );
+    }
 
     if( jack_activate( jack_client ) ) {
         fprintf( stderr, "Could not activate JACK.\n" );
@@ -212,7 +205,9 @@ void init_jack( void )
 
 void close_jack( void ) 
 {
+    engine_free( engine );
     jack_client_close( jack_client );
+    trace_free( trace );
 }
 
 /* ----------------------------------------------------   
@@ -233,6 +228,12 @@ void init_loops( void )
         return;
     }
 
+    segment_pool = segment_pool_new( pool_low_watermark, pool_high_watermark );
+    if( segment_pool == NULL ) {
+        fprintf( stderr, "Could not create the loop buffer segment pool.\n" );
+        exit( -1 );
+    }
+
     loop_table = g_hash_table_new_full(
         g_str_hash,
         g_str_equal,
@@ -241,10 +242,76 @@ void init_loops( void )
     );
 }
 
+// Must be called with the loop table lock held.
+void publish_engine_state( void )
+{
+    int loop_count = g_hash_table_size( loop_table );
+    Loop *loops = malloc( ( loop_count ? loop_count : 1 ) * sizeof( Loop ) );
+
+    GHashTableIter iter;
+    gpointer value;
+    int i = 0;
+    g_hash_table_iter_init( &iter, loop_table );
+    while( g_hash_table_iter_next( &iter, NULL, &value ) ) {
+        loops[i++] = value;
+    }
+
+    // In the order they're handed over, since that's what the engine breaks ties by.
+    if( journal ) {
+        journal_log_loops( journal, loops, loop_count );
+    }
+    if( trace ) {
+        trace_log_loops( trace, loops, loop_count, action_table );
+    }
+    engine_publish( engine, loops, loop_count, control_dispatch_build( action_table ) );
+}
+
+/* Must be called with the loop table lock held, after changing anything
+   about a loop that the engine doesn't need republishing for. */
+void log_loops_locked( void )
+{
+    if( journal == NULL && trace == NULL ) {
+        return;
+    }
+
+    int loop_count = g_hash_table_size( loop_table );
+    Loop *loops = malloc( ( loop_count ? loop_count : 1 ) * sizeof( Loop ) );
+
+    GHashTableIter iter;
+    gpointer value;
+    int i = 0;
+    g_hash_table_iter_init( &iter, loop_table );
+    while( g_hash_table_iter_next( &iter, NULL, &value ) ) {
+        loops[i++] = value;
+    }
+
+    if( journal ) {
+        journal_log_loops( journal, loops, loop_count );
+    }
+    if( trace ) {
+        trace_log_loops( trace, loops, loop_count, action_table );
+    }
+    free( loops );
+}
+
+// Before the loop's first published.  The loop lets go of the ring when it's freed.
+void journal_loop( Loop loop )
+{
+    if( journal ) {
+        loop_set_journal( loop, journal_ring_new( journal, loop_get_id( loop ) ) );
+    }
+}
+
 void close_loops( void )
 {
+    // The process callback has to let go of the loops before they're freed.
+    engine_publish( engine, NULL, 0, NULL );
     pthread_mutex_destroy( &loop_table_lock );
     g_hash_table_destroy( loop_table );
+    segment_pool_free( segment_pool );
+
+    // Only once the loops have released their rings.
+    journal_free( journal );
 }
 
 /* ----------------------------------------------------   
@@ -260,6 +327,10 @@ void close_loops( void )
 // Data.
 GHashTable *update_table; // This table does NOT own its keys.
 
+/* The OSC thread isn't the only one sending updates: the RT log drain thread
+   publishes errors.  This covers the update table and every send. */
+pthread_mutex_t update_lock;
+
 pthread_mutex_t done_lock;
 int done = 0, shutting_down = 0;
 
@@ -299,7 +370,8 @@ struct where_to {
     const char *retpath;
 };
 
-void send_update_data(
+// Must be called with the update lock held.
+void send_update_data_locked(
         const char *action,
         const char *data,
         struct where_to *where
@@ -323,6 +395,17 @@ void send_update_data(
     }
 }
 
+void send_update_data(
+        const char *action,
+        const char *data,
+        struct where_to *where
+    ) {
+
+    pthread_mutex_lock( &update_lock );
+    send_update_data_locked( action, data, where );
+    pthread_mutex_unlock( &update_lock );
+}
+
 gint compare_auto_update( gconstpointer a, gconstpointer b )
 {
     const struct where_to *x = a, *y = b;
@@ -347,6 +430,10 @@ void generic_register_auto_update(
         const char *retpath
     ) {
 
+    lo_address addr = find_or_cache_addr( returl );
+
+    pthread_mutex_lock( &update_lock );
+
     gpointer value;
     gboolean valid_update
         = g_hash_table_lookup_extended( update_table, key, NULL, &value );
@@ -355,11 +442,13 @@ void generic_register_auto_update(
         GList *list = value;
         struct where_to *new_subscriber;
         new_subscriber = malloc( sizeof( *new_subscriber ) );
-        new_subscriber->addr = find_or_cache_addr( returl );
+        new_subscriber->addr = addr;
         new_subscriber->retpath = homebrew_strdup( retpath );
         list = g_list_prepend( list, new_subscriber );
         g_hash_table_insert( update_table, (gpointer)key, list );
     }
+
+    pthread_mutex_unlock( &update_lock );
 }
 
 void generic_unregister_auto_update(
@@ -368,6 +457,10 @@ void generic_unregister_auto_update(
         const char *retpath
     ) {
     
+    lo_address addr = find_or_cache_addr( returl );
+
+    pthread_mutex_lock( &update_lock );
+
     gpointer value;
     gboolean valid_update
         = g_hash_table_lookup_extended( update_table, key, NULL, &value );
@@ -375,7 +468,7 @@ void generic_unregister_auto_update(
     if( valid_update ) {
         GList *list = value;
         struct where_to ref = {
-            .addr = find_or_cache_addr( returl ),
+            .addr = addr,
             .retpath = retpath
         };
         GList *subscriber;
@@ -385,6 +478,8 @@ void generic_unregister_auto_update(
         }
         g_hash_table_insert( update_table, (gpointer)key, list );
     }
+
+    pthread_mutex_unlock( &update_lock );
 }
 
 int global_register_auto_update_handler(
@@ -420,6 +515,8 @@ int global_unregister_auto_update_handler(
 void auto_update( const char *type, const char *change, const char *data )
 {
     DEBUGGING_MESSAGE( "auto_update %s %s %s\n", type, change, data );
+    pthread_mutex_lock( &update_lock );
+
     gpointer value;
     gboolean valid_update
         = g_hash_table_lookup_extended( update_table, type, NULL, &value );
@@ -429,13 +526,15 @@ void auto_update( const char *type, const char *change, const char *data )
         while( subscribers != NULL ) {
             struct where_to *update_data = subscribers->data;
             DEBUGGING_MESSAGE( "    %p %s\n", update_data->addr, update_data->retpath );
-            send_update_data( change, data, update_data );
+            send_update_data_locked( change, data, update_data );
 
             subscribers = subscribers->next;
         }
     } else {
         DEBUGGING_MESSAGE( "INVALID UPDATE %s\n", type );
     }
+
+    pthread_mutex_unlock( &update_lock );
 }
 
 int loop_register_auto_update_handler(
@@ -513,6 +612,7 @@ int ping_handler(
     lo_address addr = find_or_cache_addr( returl );
     if( addr ) {
         char *server_url;
+        pthread_mutex_lock( &update_lock );
         int send = lo_send(
             addr,
             retpath,
@@ -521,6 +621,7 @@ int ping_handler(
             PACKAGE_VERSION,
             g_hash_table_size( loop_table )
         );
+        pthread_mutex_unlock( &update_lock );
         free( server_url );
 
         if ( send < 0) {
@@ -567,13 +668,81 @@ int loop_list_handler(
     return 0;
 }
 
+void send_loop_dsp_stats( gpointer key, gpointer value, gpointer data )
+{
+    struct where_to *send_data = data;
+    struct DspSummary summary;
+    dsp_stats_summarize( loop_get_dsp_stats( value ), &summary );
+
+    char serialization[200];
+    sprintf(
+        serialization,
+        "%s %u %u %u %u %u %d",
+        (const char *) key,
+        summary.min,
+        summary.mean,
+        summary.p99,
+        summary.overruns,
+        summary.shed,
+        loop_get_priority( value )
+    );
+    send_update_data( "loop", serialization, send_data );
+}
+
+// Nanosecond costs over the last DSP_STATS_WINDOW cycles, the whole cycle first.
+int dsp_stats_handler(
+        const char *path,
+        const char *types,
+        lo_arg **argv,
+        int argc,
+        void *data,
+        void *user_data
+    ) {
+
+    const char *returl = &argv[0]->s, *retpath = &argv[1]->s;
+    DEBUGGING_MESSAGE( "dsp_stats_handler %s %s\n", returl, retpath );
+    lo_address addr = find_or_cache_addr( returl );
+    if( addr ) {
+        struct where_to send_data = {
+            .addr = addr,
+            .retpath = retpath
+        };
+
+        struct EngineDspSummary summary;
+        engine_get_dsp_summary( engine, &summary );
+
+        char serialization[200];
+        sprintf(
+            serialization,
+            "%u %u %u %u %u %llu %u %u",
+            summary.cycle.min,
+            summary.cycle.mean,
+            summary.cycle.p99,
+            summary.cycle.overruns,
+            summary.cycle.shed,
+            (unsigned long long) summary.period_ns,
+            summary.budget_percent,
+            summary.shed_percent
+        );
+        send_update_data( "engine", serialization, &send_data );
+
+        pthread_mutex_lock( &loop_table_lock );
+        g_hash_table_foreach( loop_table, send_loop_dsp_stats, &send_data );
+        pthread_mutex_unlock( &loop_table_lock );
+    }
+
+    return 0;
+}
+
 void serialize_loop_controls( char *out, Loop loop )
 {
     sprintf(
         out,
-        "%d %d",
+        "%d %d %d %d",
         loop_get_midi_through( loop ),
-        loop_get_playback_after_recording( loop )
+        loop_get_playback_after_recording( loop ),
+        loop_get_priority( loop ),
+        loop_get_quantize( loop )
     );
 }
 
@@ -628,13 +797,17 @@ int loop_set_controls_handler(
         strcpy( controltemp, new_controls );
 
         // Declare an array of loop control setters.
-        void (*loop_set_functions[2])( Loop, int ) = {
+        void (*loop_set_functions[4])( Loop, int ) = {
             loop_set_midi_through,
-            loop_set_playback_after_recording
+            loop_set_playback_after_recording,
+            loop_set_priority,
+            loop_set_quantize
         };
 
+        int old_priority = loop_get_priority( loop );
+
         char *control = strtok( controltemp, " " );
-        for( int i = 0; control != NULL; i++ ) { // The weirdness is deliberate.
+        for( int i = 0; control != NULL && i < 4; i++ ) { // The weirdness is deliberate.
             if( strcmp( control, "same" ) ) {
                 int new_control_value = atoi( control );
                 loop_set_functions[i]( loop, new_control_value );
@@ -642,6 +815,15 @@ int loop_set_controls_handler(
             control = strtok( NULL, " " );
         }
 
+        // The engine only orders its loops by priority when they're published.
+        pthread_mutex_lock( &loop_table_lock );
+        if( loop_get_priority( loop ) != old_priority ) {
+            publish_engine_state();
+        } else {
+            log_loops_locked();
+        }
+        pthread_mutex_unlock( &loop_table_lock );
+
         // Update subscribers.
         char serialization[100];
         serialize_loop_controls( serialization, loop );
@@ -651,7 +833,7 @@ int loop_set_controls_handler(
     return 0;
 }
 
-int loop_add_handler(
+int loop_sync_handler(
         const char *path,
         const char *types,
         lo_arg **argv,
@@ -660,69 +842,40 @@ int loop_add_handler(
         void *user_data
     ) {
 
-    const char *name = &argv[0]->s;
-    DEBUGGING_MESSAGE( "loop_add_handler %s\n", name );
-
-    pthread_mutex_lock( &loop_table_lock );
+    const char *master_name = &argv[0]->s;
 
-    // Checks the update table to prohibit the use of special names.
-    if(
-        strstr( name, "/" ) == NULL
-        && strstr( name, " " ) == NULL
-        && strlen( name ) < 50
-        && !g_hash_table_contains( update_table, name )
-    ) {
-        Loop new_loop;
-        char *dup_name = homebrew_strdup( name );
-        loop_new( &new_loop, jack_client, dup_name, 1, 1 ); // Discards status code.
-        g_hash_table_insert( loop_table, dup_name, new_loop );
-        auto_update( "loops", "add", dup_name );
+    char pathtemp[100];
+    strcpy( pathtemp, path );
+    char *name = extract_loop_name_from_path( pathtemp );
+    DEBUGGING_MESSAGE( "loop_sync_handler %s %s\n", name, master_name );
 
-        char ctrl_get_url[100];
-        char ctrl_set_url[100];
-        char register_url[100];
-        char unregister_url[100];
-        sprintf( ctrl_get_url, "/jml/%s/get", name );
-        sprintf( ctrl_set_url, "/jml/%s/set", name );
-        sprintf( register_url, "/jml/%s/register_auto_update", name );
-        sprintf( unregister_url, "/jml/%s/register_auto_update", name );
-        lo_server_thread_add_method(
-            server_thread,
-            ctrl_get_url,
-            "ss",
-            loop_get_controls_handler,
-            NULL
-        );
-        lo_server_thread_add_method(
-            server_thread,
-            ctrl_set_url,
-            "s",
-            loop_set_controls_handler,
-            NULL
-        );
-        lo_server_thread_add_method(
-            server_thread,
-            register_url,
-            "ss",
-            loop_register_auto_update_handler,
-            NULL
-        );
-        lo_server_thread_add_method(
-            server_thread,
-            unregister_url,
-            "ss",
-            loop_unregister_auto_update_handler,
-            NULL
-        );
-        // Creates an entry in the subscriptions table for the loop.
-        g_hash_table_insert( update_table, dup_name, NULL );
+    pthread_mutex_lock( &loop_table_lock );
+    Loop loop = g_hash_table_lookup( loop_table, name );
+    if( loop ) {
+        // An unknown name (or an empty one) goes back to free running.
+        Loop master = g_hash_table_lookup( loop_table, master_name );
+        loop_set_sync_master( loop, master );
+        publish_engine_state(); // Slaves are processed after their masters.
+        auto_update( name, "sync", master ? loop_get_name( master ) : "" );
     }
-
     pthread_mutex_unlock( &loop_table_lock );
+
     return 0;
 }
 
-int loop_del_handler(
+// "port", "bus", or "bus <channel>" - see loop_set_input_source.
+void serialize_input_source( char *out, int source )
+{
+    if( source == LOOP_INPUT_PORT ) {
+        strcpy( out, "port" );
+    } else if( source == INPUT_BUS_ALL_CHANNELS ) {
+        strcpy( out, "bus" );
+    } else {
+        sprintf( out, "bus %d", source );
+    }
+}
+
+int loop_input_handler(
         const char *path,
         const char *types,
         lo_arg **argv,
@@ -731,93 +884,676 @@ int loop_del_handler(
         void *user_data
     ) {
 
-    const char *name = &argv[0]->s;
-    DEBUGGING_MESSAGE( "loop_del_handler %s\n", name );
+    const char *source_name = &argv[0]->s;
+
+    char pathtemp[100];
+    strcpy( pathtemp, path );
+    char *name = extract_loop_name_from_path( pathtemp );
+    DEBUGGING_MESSAGE( "loop_input_handler %s %s\n", name, source_name );
+
+    // Anything unrecognized goes back to the loop's own port.
+    int source = LOOP_INPUT_PORT, channel;
+    if( strcmp( source_name, "bus" ) == 0 ) {
+        source = INPUT_BUS_ALL_CHANNELS;
+    } else if( sscanf( source_name, "bus %d", &channel ) == 1 ) {
+        source = channel;
+    }
 
     pthread_mutex_lock( &loop_table_lock );
+    Loop loop = g_hash_table_lookup( loop_table, name );
+    if( loop ) {
+        loop_set_input_source( loop, source );
 
-    Loop to_be_removed = g_hash_table_lookup( loop_table, name );
-    if( to_be_removed ) {
-        control_action_table_remove_loop_mappings( action_table, to_be_removed );
-        g_hash_table_remove( loop_table, name );
-        auto_update( "loops", "remove", name );
+        // The engine only looks at it when the loops are published.
+        publish_engine_state();
 
-        char ctrl_get_url[100];
-        char ctrl_set_url[100];
-        char register_url[100];
-        char unregister_url[100];
-        sprintf( ctrl_get_url, "/jml/%s/get", name );
-        sprintf( ctrl_set_url, "/jml/%s/set", name );
-        sprintf( register_url, "/jml/%s/register_auto_update", name );
-        sprintf( unregister_url, "/jml/%s/register_auto_update", name );
-        lo_server_thread_del_method( server_thread, ctrl_get_url, "ss" );
-        lo_server_thread_del_method( server_thread, ctrl_set_url, "ss" );
-        lo_server_thread_del_method( server_thread, register_url, "ss" );
-        lo_server_thread_del_method( server_thread, unregister_url, "ss" );
-        g_hash_table_remove( update_table, name );
+        char serialization[20];
+        serialize_input_source( serialization, loop_get_input_source( loop ) );
+        auto_update( name, "input", serialization );
     }
-
     pthread_mutex_unlock( &loop_table_lock );
-    return 0;
-}
-
-void serialize_mapping( 
-        char *out,
-        unsigned char midi_channel,
-        enum MidiControlType midi_type,
-        unsigned char midi_value,
-        Loop loop,
-        LoopControlFunc control_func
-    ) {
-    static const char *type_serializations[4] = { "on", "off", "cc_on", "cc_off" };
-    sprintf(
-        out,
-        "%u %s %u %s %s",
-        midi_channel,
-        type_serializations[midi_type],
-        midi_value,
-        control_func == LOOP_CONTROL_FUNC_TOGGLE_PLAYBACK
-            ? "toggle_playback"
-            : "toggle_recording",
-        loop_get_name( loop )
-    );
-}
 
-enum MidiControlType control_type_from_string( const char *in )
-{
-    if( !strcmp( in, "on" ) ) {
-        return TYPE_NOTE_ON;
-    } else if( !strcmp( in, "off" ) ) {
-        return TYPE_NOTE_OFF;
-    } else if( !strcmp( in, "cc_on" ) ) {
-        return TYPE_CC_ON;
-    } else if( !strcmp( in, "cc_off" ) ) {
-        return TYPE_CC_OFF;
-    }
-    assert( 0 );
+    return 0;
 }
 
-LoopControlFunc control_func_from_string( const char *in )
+// "port", "bus", or "bus <channel>" - see loop_set_output_target.
+void serialize_output_target( char *out, int target )
 {
-    if( !strcmp( in, "toggle_playback" ) ) {
-        return LOOP_CONTROL_FUNC_TOGGLE_PLAYBACK;
-    } else if( !strcmp( in, "toggle_recording" ) ) {
-        return LOOP_CONTROL_FUNC_TOGGLE_RECORDING;
+    if( target == LOOP_OUTPUT_PORT ) {
+        strcpy( out, "port" );
+    } else if( target == OUTPUT_BUS_KEEP_CHANNEL ) {
+        strcpy( out, "bus" );
+    } else {
+        sprintf( out, "bus %d", target );
     }
-    assert( 0 );
 }
 
-// GROSS
-void deserialize_mapping(
-        const char *in,
-        unsigned char *midi_channel,
-        enum MidiControlType *midi_type,
-        unsigned char *midi_value,
-        Loop *loop,
-        LoopControlFunc *control_func
+int loop_output_handler(
+        const char *path,
+        const char *types,
+        lo_arg **argv,
+        int argc,
+        void *data,
+        void *user_data
     ) {
 
-    char mappingtemp[100];
+    const char *target_name = &argv[0]->s;
+
+    char pathtemp[100];
+    strcpy( pathtemp, path );
+    char *name = extract_loop_name_from_path( pathtemp );
+    DEBUGGING_MESSAGE( "loop_output_handler %s %s\n", name, target_name );
+
+    // Anything unrecognized goes back to the loop's own port.
+    int target = LOOP_OUTPUT_PORT, channel;
+    if( strcmp( target_name, "bus" ) == 0 ) {
+        target = OUTPUT_BUS_KEEP_CHANNEL;
+    } else if( sscanf( target_name, "bus %d", &channel ) == 1 ) {
+        target = channel;
+    }
+
+    pthread_mutex_lock( &loop_table_lock );
+    Loop loop = g_hash_table_lookup( loop_table, name );
+    if( loop ) {
+        loop_set_output_target( loop, target );
+
+        // Likewise only looked at when the loops are published.
+        publish_engine_state();
+
+        char serialization[20];
+        serialize_output_target( serialization, loop_get_output_target( loop ) );
+        auto_update( name, "output", serialization );
+    }
+    pthread_mutex_unlock( &loop_table_lock );
+
+    return 0;
+}
+
+int loop_get_buffer_stats_handler(
+        const char *path,
+        const char *types,
+        lo_arg **argv,
+        int argc,
+        void *data,
+        void *user_data
+    ) {
+
+    const char *returl = &argv[0]->s, *retpath = &argv[1]->s;
+
+    char pathtemp[100];
+    strcpy( pathtemp, path );
+    char *name = extract_loop_name_from_path( pathtemp ); 
+    DEBUGGING_MESSAGE( "loop_get_buffer_stats_handler %s %s %s\n", name, returl, retpath );
+    // Copied under the lock, so the loop can't be removed under us.
+    struct LoopBufferStats stats;
+    pthread_mutex_lock( &loop_table_lock );
+    Loop loop = g_hash_table_lookup( loop_table, name );
+    if( loop ) {
+        loop_get_buffer_stats( loop, &stats );
+    }
+    pthread_mutex_unlock( &loop_table_lock );
+
+    if( loop ) {
+
+        char serialization[200];
+        sprintf(
+            serialization,
+            "%zu %zu %zu %zu %u %zu %zu %u %zu",
+            stats.events,
+            stats.segments,
+            stats.max_segments,
+            stats.min_pool_available,
+            stats.dry_count,
+            stats.bytes,
+            stats.bytes_per_event,
+            stats.clamped_count,
+            capture_ring_capacity()
+        );
+
+        struct where_to return_address = {
+            .addr = find_or_cache_addr( returl ),
+            .retpath = retpath
+        };
+        send_update_data( "buffer_stats", serialization, &return_address );
+    }
+
+    return 0;
+}
+
+int loop_get_overdub_stats_handler(
+        const char *path,
+        const char *types,
+        lo_arg **argv,
+        int argc,
+        void *data,
+        void *user_data
+    ) {
+
+    const char *returl = &argv[0]->s, *retpath = &argv[1]->s;
+
+    char pathtemp[100];
+    strcpy( pathtemp, path );
+    char *name = extract_loop_name_from_path( pathtemp ); 
+    DEBUGGING_MESSAGE( "loop_get_overdub_stats_handler %s %s %s\n", name, returl, retpath );
+    // Copied under the lock, so the loop can't be removed under us.
+    struct LoopOverdubStats stats;
+    pthread_mutex_lock( &loop_table_lock );
+    Loop loop = g_hash_table_lookup( loop_table, name );
+    if( loop ) {
+        loop_get_overdub_stats( loop, &stats );
+    }
+    pthread_mutex_unlock( &loop_table_lock );
+
+    if( loop ) {
+
+        char serialization[200];
+        sprintf(
+            serialization,
+            "%u %zu %zu %u %u",
+            stats.passes,
+            stats.last_merge_events,
+            stats.max_cycle_events,
+            stats.failed,
+            stats.dropped
+        );
+
+        struct where_to return_address = {
+            .addr = find_or_cache_addr( returl ),
+            .retpath = retpath
+        };
+        send_update_data( "overdub_stats", serialization, &return_address );
+    }
+
+    return 0;
+}
+
+/* Copies the loop's take into a malloced array, with however much room it
+   turns out to need.  Returns NULL on failure. */
+struct PackedMidiMessage *copy_loop_take( Loop loop, size_t *count, struct LoopTake *take )
+{
+    struct LoopBufferStats stats;
+    loop_get_buffer_stats( loop, &stats );
+
+    size_t capacity = stats.events + LOOP_BUFFER_SEGMENT_EVENTS;
+    for( ;; ) {
+        struct PackedMidiMessage *events = malloc( capacity * sizeof( struct PackedMidiMessage ) );
+        if( events == NULL ) {
+            return NULL;
+        }
+
+        *count = loop_copy_take( loop, events, capacity, take );
+        if( *count <= capacity ) {
+            return events;
+        }
+
+        free( events );
+        capacity = *count + LOOP_BUFFER_SEGMENT_EVENTS;
+    }
+}
+
+int loop_export_handler(
+        const char *path,
+        const char *types,
+        lo_arg **argv,
+        int argc,
+        void *data,
+        void *user_data
+    ) {
+
+    const char *file_path = &argv[0]->s;
+
+    char pathtemp[100];
+    strcpy( pathtemp, path );
+    char *name = extract_loop_name_from_path( pathtemp );
+    DEBUGGING_MESSAGE( "loop_export_handler %s %s\n", name, file_path );
+
+    struct PackedMidiMessage *events = NULL;
+    size_t count = 0;
+    struct LoopTake take;
+
+    pthread_mutex_lock( &loop_table_lock );
+    Loop loop = g_hash_table_lookup( loop_table, name );
+    if( loop ) {
+        events = copy_loop_take( loop, &count, &take );
+    }
+    pthread_mutex_unlock( &loop_table_lock );
+
+    if( events ) {
+        // At the transport's tempo, if it has one.
+        jack_position_t position;
+        jack_transport_query( jack_client, &position );
+        double beats_per_minute = ( position.valid & JackPositionBBT ) && position.beats_per_minute > 0
+            ? position.beats_per_minute
+            : MIDI_FILE_DEFAULT_BPM;
+
+        int result = midi_file_write( file_path, events, count, take.length, sample_rate, beats_per_minute );
+        if( result != 0 ) {
+            fprintf( stderr, "Could not export %s to %s (code %d).\n", name, file_path, result );
+        }
+        free( events );
+    }
+
+    return 0;
+}
+
+MidiFileImporter importer;
+
+// On the importer's thread.
+void take_imported(
+        const char *loop_name,
+        const char *path,
+        LoopBuffer take,
+        jack_nframes_t length,
+        int result,
+        void *user_data
+    ) {
+
+    if( take == NULL ) {
+        fprintf( stderr, "Could not import %s into %s (code %d).\n", path, loop_name, result );
+        return;
+    }
+
+    pthread_mutex_lock( &loop_table_lock );
+    Loop loop = g_hash_table_lookup( loop_table, loop_name );
+    if( loop ) {
+        // Journaled first, so that it's in the file before the loop can swap it in.
+        if( journal || trace ) {
+            size_t count = loop_buffer_length( take );
+            struct PackedMidiMessage *events = malloc( ( count ? count : 1 ) * sizeof( struct PackedMidiMessage ) );
+            if( events ) {
+                struct LoopTake info = { length, 0 };
+                loop_buffer_copy_packed( take, events, count );
+                if( journal ) {
+                    journal_log_take( journal, loop_get_id( loop ), events, count, &info, JOURNAL_SNAPSHOT_OFFERED );
+                }
+                if( trace ) {
+                    trace_log_take( trace, loop_get_id( loop ), events, count, &info, TRACE_TAKE_OFFERED );
+                }
+                free( events );
+            }
+        }
+
+        if( loop_offer_take( loop, &take, length ) == 0 ) {
+            // A new snapshot has nothing marked idle, so the loop swaps the take in next cycle.
+            publish_engine_state();
+        } else {
+            fprintf( stderr, "%s hasn't taken its last import yet, so %s was dropped.\n", loop_name, path );
+            if( journal ) {
+                journal_log_take( journal, loop_get_id( loop ), NULL, 0, NULL, JOURNAL_SNAPSHOT_WITHDRAWN );
+            }
+            if( trace ) {
+                trace_log_take( trace, loop_get_id( loop ), NULL, 0, NULL, TRACE_TAKE_WITHDRAWN );
+            }
+        }
+    }
+    pthread_mutex_unlock( &loop_table_lock );
+
+    // Whichever take is left over.
+    loop_buffer_free( take );
+}
+
+int loop_import_handler(
+        const char *path,
+        const char *types,
+        lo_arg **argv,
+        int argc,
+        void *data,
+        void *user_data
+    ) {
+
+    const char *file_path = &argv[0]->s;
+
+    char pathtemp[100];
+    strcpy( pathtemp, path );
+    char *name = extract_loop_name_from_path( pathtemp );
+    DEBUGGING_MESSAGE( "loop_import_handler %s %s\n", name, file_path );
+
+    if( midi_file_importer_queue( importer, name, file_path ) != 0 ) {
+        fprintf( stderr, "Could not queue %s for import into %s.\n", file_path, name );
+    }
+
+    return 0;
+}
+
+/* Translates an OSC bundle's timetag into JACK time, so that the command can
+   land on the frame it was meant for.  Unbundled messages run immediately. */
+jack_time_t jack_time_for_message( lo_message message )
+{
+    lo_timetag timetag = lo_message_get_timestamp( message );
+    if( timetag.sec == LO_TT_IMMEDIATE.sec && timetag.frac == LO_TT_IMMEDIATE.frac ) {
+        return ENGINE_COMMAND_NOW;
+    }
+
+    lo_timetag now;
+    lo_timetag_now( &now );
+    double from_now = lo_timetag_diff( timetag, now );
+
+    // A timetag far enough in the past just counts as late.
+    jack_time_t jack_now = jack_get_time();
+    long long when = (long long) jack_now + (long long) ( from_now * 1000000.0 );
+    return when > 0 ? (jack_time_t) when : 1;
+}
+
+void queue_loop_command( const char *path, lo_message message, enum EngineCommandType type )
+{
+    char pathtemp[100];
+    strcpy( pathtemp, path );
+    char *name = extract_loop_name_from_path( pathtemp );
+    DEBUGGING_MESSAGE( "queue_loop_command %s %d\n", name, type );
+
+    pthread_mutex_lock( &loop_table_lock );
+    Loop loop = g_hash_table_lookup( loop_table, name );
+    if( loop ) {
+        if( engine_queue_command( engine, loop_get_id( loop ), type, jack_time_for_message( message ) ) != 0 ) {
+            fprintf( stderr, "Engine command queue full, %s command dropped.\n", name );
+        }
+    }
+    pthread_mutex_unlock( &loop_table_lock );
+}
+
+int loop_toggle_playback_handler(
+        const char *path,
+        const char *types,
+        lo_arg **argv,
+        int argc,
+        void *data,
+        void *user_data
+    ) {
+
+    queue_loop_command( path, data, ENGINE_COMMAND_TOGGLE_PLAYBACK );
+    return 0;
+}
+
+int loop_record_handler(
+        const char *path,
+        const char *types,
+        lo_arg **argv,
+        int argc,
+        void *data,
+        void *user_data
+    ) {
+
+    queue_loop_command( path, data, ENGINE_COMMAND_TOGGLE_RECORDING );
+    return 0;
+}
+
+int loop_overdub_handler(
+        const char *path,
+        const char *types,
+        lo_arg **argv,
+        int argc,
+        void *data,
+        void *user_data
+    ) {
+
+    queue_loop_command( path, data, ENGINE_COMMAND_TOGGLE_OVERDUB );
+    return 0;
+}
+
+int loop_replace_handler(
+        const char *path,
+        const char *types,
+        lo_arg **argv,
+        int argc,
+        void *data,
+        void *user_data
+    ) {
+
+    queue_loop_command( path, data, ENGINE_COMMAND_TOGGLE_REPLACE );
+    return 0;
+}
+
+int loop_capture_handler(
+        const char *path,
+        const char *types,
+        lo_arg **argv,
+        int argc,
+        void *data,
+        void *user_data
+    ) {
+
+    queue_loop_command( path, data, ENGINE_COMMAND_CAPTURE );
+    return 0;
+}
+
+int loop_stop_handler(
+        const char *path,
+        const char *types,
+        lo_arg **argv,
+        int argc,
+        void *data,
+        void *user_data
+    ) {
+
+    queue_loop_command( path, data, ENGINE_COMMAND_STOP );
+    return 0;
+}
+
+// The methods registered under /jml/<name>/ for every loop.
+static const struct {
+    const char *method;
+    const char *types;
+    lo_method_handler handler;
+} loop_methods[] = {
+    { "get", "ss", loop_get_controls_handler },
+    { "set", "s", loop_set_controls_handler },
+    { "register_auto_update", "ss", loop_register_auto_update_handler },
+    { "unregister_auto_update", "ss", loop_unregister_auto_update_handler },
+    { "buffer_stats", "ss", loop_get_buffer_stats_handler },
+    { "sync", "s", loop_sync_handler },
+    { "input", "s", loop_input_handler },
+    { "output", "s", loop_output_handler },
+    { "toggle_playback", "", loop_toggle_playback_handler },
+    { "record", "", loop_record_handler },
+    { "overdub", "", loop_overdub_handler },
+    { "overdub_stats", "ss", loop_get_overdub_stats_handler },
+    { "replace", "", loop_replace_handler },
+    { "capture", "", loop_capture_handler },
+    { "export", "s", loop_export_handler },
+    { "import", "s", loop_import_handler },
+    { "stop", "", loop_stop_handler }
+};
+
+#define LOOP_METHOD_COUNT ( sizeof( loop_methods ) / sizeof( loop_methods[0] ) )
+
+void add_loop_methods( const char *name )
+{
+    char url[100];
+    for( int i = 0; i < LOOP_METHOD_COUNT; i++ ) {
+        sprintf( url, "/jml/%s/%s", name, loop_methods[i].method );
+        lo_server_thread_add_method(
+            server_thread,
+            url,
+            loop_methods[i].types,
+            loop_methods[i].handler,
+            NULL
+        );
+    }
+}
+
+void del_loop_methods( const char *name )
+{
+    char url[100];
+    for( int i = 0; i < LOOP_METHOD_COUNT; i++ ) {
+        sprintf( url, "/jml/%s/%s", name, loop_methods[i].method );
+        lo_server_thread_del_method( server_thread, url, loop_methods[i].types );
+    }
+}
+
+int loop_add_handler(
+        const char *path,
+        const char *types,
+        lo_arg **argv,
+        int argc,
+        void *data,
+        void *user_data
+    ) {
+
+    const char *name = &argv[0]->s;
+    DEBUGGING_MESSAGE( "loop_add_handler %s\n", name );
+
+    pthread_mutex_lock( &loop_table_lock );
+
+    // Checks the update table to prohibit the use of special names.
+    if(
+        strstr( name, "/" ) == NULL
+        && strstr( name, " " ) == NULL
+        && strlen( name ) < 50
+        && !g_hash_table_contains( update_table, name )
+    ) {
+        Loop new_loop;
+        char *dup_name = homebrew_strdup( name );
+        int status = loop_new(
+            &new_loop,
+            jack_client,
+            dup_name,
+            1,
+            1,
+            segment_pool,
+            max_segments_per_loop
+        );
+
+        if( status != 0 ) {
+            free( dup_name );
+            pthread_mutex_unlock( &loop_table_lock );
+            return 0;
+        }
+        journal_loop( new_loop );
+        g_hash_table_insert( loop_table, dup_name, new_loop );
+        publish_engine_state();
+        auto_update( "loops", "add", dup_name );
+
+        add_loop_methods( name );
+        // Creates an entry in the subscriptions table for the loop.
+        pthread_mutex_lock( &update_lock );
+        g_hash_table_insert( update_table, dup_name, NULL );
+        pthread_mutex_unlock( &update_lock );
+    }
+
+    pthread_mutex_unlock( &loop_table_lock );
+    return 0;
+}
+
+int loop_del_handler(
+        const char *path,
+        const char *types,
+        lo_arg **argv,
+        int argc,
+        void *data,
+        void *user_data
+    ) {
+
+    const char *name = &argv[0]->s;
+    DEBUGGING_MESSAGE( "loop_del_handler %s\n", name );
+
+    pthread_mutex_lock( &loop_table_lock );
+
+    gpointer loop_name, value;
+    if( g_hash_table_lookup_extended( loop_table, name, &loop_name, &value ) ) {
+        Loop to_be_removed = value;
+        control_action_table_remove_loop_mappings( action_table, to_be_removed );
+
+        // Anything synced to it free runs from here on.
+        GHashTableIter iter;
+        gpointer other;
+        g_hash_table_iter_init( &iter, loop_table );
+        while( g_hash_table_iter_next( &iter, NULL, &other ) ) {
+            if( loop_get_sync_master( other ) == to_be_removed ) {
+                loop_set_sync_master( other, NULL );
+                auto_update( loop_get_name( other ), "sync", "" );
+            }
+        }
+
+        /* Take the loop out of the table without freeing it, and only free it
+           once the process callback has moved on to a snapshot without it. */
+        g_hash_table_steal( loop_table, name );
+        publish_engine_state();
+        auto_update( "loops", "remove", name );
+
+        del_loop_methods( name );
+        pthread_mutex_lock( &update_lock );
+        g_hash_table_remove( update_table, name );
+        pthread_mutex_unlock( &update_lock );
+
+        loop_free( to_be_removed );
+        free( loop_name );
+    }
+
+    pthread_mutex_unlock( &loop_table_lock );
+    return 0;
+}
+
+void serialize_mapping( 
+        char *out,
+        unsigned char midi_channel,
+        enum MidiControlType midi_type,
+        unsigned char midi_value,
+        Loop loop,
+        LoopControlFunc control_func
+    ) {
+    static const char *type_serializations[4] = { "on", "off", "cc_on", "cc_off" };
+    const char *func_serialization = "toggle_recording";
+    if( control_func == LOOP_CONTROL_FUNC_TOGGLE_PLAYBACK ) {
+        func_serialization = "toggle_playback";
+    } else if( control_func == LOOP_CONTROL_FUNC_TOGGLE_OVERDUB ) {
+        func_serialization = "toggle_overdub";
+    } else if( control_func == LOOP_CONTROL_FUNC_TOGGLE_REPLACE ) {
+        func_serialization = "toggle_replace";
+    } else if( control_func == LOOP_CONTROL_FUNC_CAPTURE ) {
+        func_serialization = "capture";
+    }
+    sprintf(
+        out,
+        "%u %s %u %s %s",
+        midi_channel,
+        type_serializations[midi_type],
+        midi_value,
+        func_serialization,
+        loop_get_name( loop )
+    );
+}
+
+enum MidiControlType control_type_from_string( const char *in )
+{
+    if( !strcmp( in, "on" ) ) {
+        return TYPE_NOTE_ON;
+    } else if( !strcmp( in, "off" ) ) {
+        return TYPE_NOTE_OFF;
+    } else if( !strcmp( in, "cc_on" ) ) {
+        return TYPE_CC_ON;
+    } else if( !strcmp( in, "cc_off" ) ) {
+        return TYPE_CC_OFF;
+    }
+    assert( 0 );
+}
+
+LoopControlFunc control_func_from_string( const char *in )
+{
+    if( !strcmp( in, "toggle_playback" ) ) {
+        return LOOP_CONTROL_FUNC_TOGGLE_PLAYBACK;
+    } else if( !strcmp( in, "toggle_recording" ) ) {
+        return LOOP_CONTROL_FUNC_TOGGLE_RECORDING;
+    } else if( !strcmp( in, "toggle_overdub" ) ) {
+        return LOOP_CONTROL_FUNC_TOGGLE_OVERDUB;
+    } else if( !strcmp( in, "toggle_replace" ) ) {
+        return LOOP_CONTROL_FUNC_TOGGLE_REPLACE;
+    } else if( !strcmp( in, "capture" ) ) {
+        return LOOP_CONTROL_FUNC_CAPTURE;
+    }
+    assert( 0 );
+}
+
+// GROSS
+void deserialize_mapping(
+        const char *in,
+        unsigned char *midi_channel,
+        enum MidiControlType *midi_type,
+        unsigned char *midi_value,
+        Loop *loop,
+        LoopControlFunc *control_func
+    ) {
+
+    char mappingtemp[100];
     strcpy( mappingtemp, in );
     char *current = strtok( mappingtemp, " " );
     *midi_channel = (unsigned char)atoi( current );
@@ -914,7 +1650,10 @@ int clear_midi_bindings_handler(
     ) {
 
     DEBUGGING_MESSAGE( "clear_midi_bindings_handler\n" );
+    pthread_mutex_lock( &loop_table_lock );
     control_action_table_clear_mappings( action_table );
+    publish_engine_state();
+    pthread_mutex_unlock( &loop_table_lock );
     return 0;
 }
 
@@ -944,7 +1683,6 @@ int add_mapping_handler(
     );
 
     pthread_mutex_lock( &loop_table_lock );
-    pthread_mutex_lock( &action_table_lock );
 
     control_action_table_insert(
         action_table,
@@ -954,8 +1692,8 @@ int add_mapping_handler(
         loop,
         control_func
     );
+    publish_engine_state();
 
-    pthread_mutex_unlock( &action_table_lock );
     pthread_mutex_unlock( &loop_table_lock );
 
     return 0;
@@ -987,7 +1725,6 @@ int remove_mapping_handler(
     );
 
     pthread_mutex_lock( &loop_table_lock );
-    pthread_mutex_lock( &action_table_lock );
 
     control_action_table_remove(
         action_table,
@@ -997,13 +1734,259 @@ int remove_mapping_handler(
         loop,
         control_func
     );
+    publish_engine_state();
+
+    pthread_mutex_unlock( &loop_table_lock );
+
+    return 0;
+}
+
+// Must be called with the loop table lock held.
+int save_session_locked( const char *path )
+{
+    int loop_count = g_hash_table_size( loop_table );
+    Loop *loops = malloc( ( loop_count ? loop_count : 1 ) * sizeof( Loop ) );
+
+    GHashTableIter iter;
+    gpointer value;
+    int i = 0;
+    g_hash_table_iter_init( &iter, loop_table );
+    while( g_hash_table_iter_next( &iter, NULL, &value ) ) {
+        loops[i++] = value;
+    }
+
+    int result = session_save( path, loops, loop_count, action_table, sample_rate );
+    free( loops );
+    return result;
+}
+
+/* Must be called with the loop table lock held.  Removes every loop and
+   mapping, publishing once for the lot. */
+void remove_all_loops_locked( void )
+{
+    control_action_table_clear_mappings( action_table );
+
+    int loop_count = g_hash_table_size( loop_table );
+    char **names = malloc( ( loop_count ? loop_count : 1 ) * sizeof( char * ) );
+    Loop *loops = malloc( ( loop_count ? loop_count : 1 ) * sizeof( Loop ) );
+
+    GHashTableIter iter;
+    gpointer key, value;
+    int i = 0;
+    g_hash_table_iter_init( &iter, loop_table );
+    while( g_hash_table_iter_next( &iter, &key, &value ) ) {
+        names[i] = key;
+        loops[i++] = value;
+    }
+
+    // Freed only once the process callback has moved on, as in loop_del_handler.
+    g_hash_table_steal_all( loop_table );
+    publish_engine_state();
+
+    for( i = 0; i < loop_count; i++ ) {
+        auto_update( "loops", "remove", names[i] );
+        del_loop_methods( names[i] );
+        pthread_mutex_lock( &update_lock );
+        g_hash_table_remove( update_table, names[i] );
+        pthread_mutex_unlock( &update_lock );
+
+        loop_free( loops[i] );
+        free( names[i] );
+    }
+
+    free( names );
+    free( loops );
+}
+
+/* Must be called with the loop table lock held, before the loop's first
+   published.  A take that didn't come from the loop's input, for the journal
+   and trace to start from. */
+void log_take_locked( Loop loop )
+{
+    if( journal == NULL && trace == NULL ) {
+        return;
+    }
+
+    size_t count;
+    struct LoopTake take;
+    struct PackedMidiMessage *events = copy_loop_take( loop, &count, &take );
+    if( events ) {
+        if( journal ) {
+            journal_log_take( journal, loop_get_id( loop ), events, count, &take, JOURNAL_SNAPSHOT_RESTORED );
+        }
+        if( trace ) {
+            // Anything it's been told to do yet is starting playback.
+            enum TraceTakeKind kind = loop_is_idle( loop ) ? TRACE_TAKE_RESTORED : TRACE_TAKE_RESTORED_PLAYING;
+            trace_log_take( trace, loop_get_id( loop ), events, count, &take, kind );
+        }
+        free( events );
+    }
+}
+
+// Puts the ports of the first count loops back, after a load that didn't happen.
+static void restore_ports_locked( Loop *loops, int count )
+{
+    for( int i = 0; i < count; i++ ) {
+        loop_set_ports_aside( loops[i], 0 );
+    }
+}
+
+static void move_mapping(
+        unsigned char midi_channel,
+        enum MidiControlType midi_type,
+        unsigned char midi_value,
+        Loop loop,
+        LoopControlFunc loop_action,
+        void *user_data
+    ) {
+
+    control_action_table_insert( action_table, midi_channel, midi_type, midi_value, loop, loop_action );
+}
+
+/* Must be called with the loop table lock held.  Replaces every loop and
+   mapping with the ones saved at path, unless it can't be loaded.  The new
+   loops are all made before any of the old ones go, so a load that fails
+   leaves everything as it was. */
+int load_session_locked( const char *path )
+{
+    if( session_check( path ) != 0 ) {
+        return -10;
+    }
+
+    // The new loops may have the old ones' names, and so their ports' too.
+    int old_count = g_hash_table_size( loop_table );
+    Loop *old_loops = malloc( ( old_count ? old_count : 1 ) * sizeof( Loop ) );
+    GHashTableIter iter;
+    gpointer value;
+    int i = 0;
+    g_hash_table_iter_init( &iter, loop_table );
+    while( g_hash_table_iter_next( &iter, NULL, &value ) ) {
+        old_loops[i++] = value;
+    }
+    for( i = 0; i < old_count; i++ ) {
+        if( loop_set_ports_aside( old_loops[i], 1 ) != 0 ) {
+            fprintf( stderr, "Could not move the ports of %s aside to load %s.\n", loop_get_name( old_loops[i] ), path );
+            restore_ports_locked( old_loops, i );
+            free( old_loops );
+            return -20;
+        }
+    }
+
+    // Mapped in a table of their own until the old mappings are gone.
+    ControlActionTable staged = control_action_table_new( NULL );
+    Loop *loops;
+    int loop_count;
+    int status = session_load(
+        path,
+        jack_client,
+        segment_pool,
+        max_segments_per_loop,
+        staged,
+        sample_rate,
+        &loops,
+        &loop_count
+    );
+    if( status != 0 ) {
+        control_action_table_free( staged );
+        restore_ports_locked( old_loops, old_count );
+        free( old_loops );
+        return -30;
+    }
+    free( old_loops );
+
+    remove_all_loops_locked();
+
+    // Each staged mapping is unlinked from its loop as the staged table goes.
+    control_action_table_foreach_mapping( staged, move_mapping, NULL );
+    control_action_table_free( staged );
+
+    // The names were malloced for us, and the table takes them over.
+    for( i = 0; i < loop_count; i++ ) {
+        journal_loop( loops[i] );
+        log_take_locked( loops[i] );
+        g_hash_table_insert( loop_table, (char *) loop_get_name( loops[i] ), loops[i] );
+    }
+    publish_engine_state();
+
+    for( i = 0; i < loop_count; i++ ) {
+        const char *name = loop_get_name( loops[i] );
+        auto_update( "loops", "add", name );
+        add_loop_methods( name );
+        pthread_mutex_lock( &update_lock );
+        g_hash_table_insert( update_table, (char *) name, NULL );
+        pthread_mutex_unlock( &update_lock );
+    }
+
+    free( loops );
+    return 0;
+}
+
+int session_save_handler(
+        const char *path,
+        const char *types,
+        lo_arg **argv,
+        int argc,
+        void *data,
+        void *user_data
+    ) {
+
+    const char *session = &argv[0]->s;
+    DEBUGGING_MESSAGE( "session_save_handler %s\n", session );
+
+    pthread_mutex_lock( &loop_table_lock );
+    save_session_locked( session );
+    pthread_mutex_unlock( &loop_table_lock );
+
+    return 0;
+}
+
+int session_load_handler(
+        const char *path,
+        const char *types,
+        lo_arg **argv,
+        int argc,
+        void *data,
+        void *user_data
+    ) {
 
-    pthread_mutex_unlock( &action_table_lock );
+    const char *session = &argv[0]->s;
+    DEBUGGING_MESSAGE( "session_load_handler %s\n", session );
+
+    pthread_mutex_lock( &loop_table_lock );
+    load_session_locked( session );
     pthread_mutex_unlock( &loop_table_lock );
 
     return 0;
 }
 
+int name_loop_for_rt_log( unsigned int loop_id, char *name_out, size_t size, void *user_data )
+{
+    int result = -10;
+
+    pthread_mutex_lock( &loop_table_lock );
+
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init( &iter, loop_table );
+    while( g_hash_table_iter_next( &iter, NULL, &value ) ) {
+        if( loop_get_id( value ) == loop_id ) {
+            snprintf( name_out, size, "%s", loop_get_name( value ) );
+            result = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock( &loop_table_lock );
+    return result;
+}
+
+void publish_rt_log_error( const char *message, void *user_data )
+{
+    if( !shutting_down ) {
+        auto_update( "errors", "error", message );
+    }
+}
+
 void osc_error( int num, const char *msg, const char *path )
 {
     fprintf( stderr, "liblo server error %d in path %s: %s\n", num, path, msg );
@@ -1018,6 +2001,12 @@ void init_liblo( const char *osc_port )
         exit( -1 );
     }
 
+    if( pthread_mutex_init( &update_lock, NULL ) != 0 )
+    {
+        fprintf( stderr, "Update table mutex init failed.\n" );
+        exit( -1 );
+    }
+
     lo_address_table = g_hash_table_new_full(
         g_str_hash,
         g_str_equal,
@@ -1026,17 +2015,28 @@ void init_liblo( const char *osc_port )
     );
 
     server_thread = lo_server_thread_new( osc_port, osc_error );
+
+    /* Hand bundles over as soon as they arrive rather than when they're due,
+       so that the engine can schedule them to the frame. */
+    lo_server_enable_queue( lo_server_thread_get_server( server_thread ), 0, 1 );
     fprintf(
         stderr,
         "Looper engine serving via OSC on port %d\n",
         lo_server_thread_get_port( server_thread )
     );
 
+    importer = midi_file_importer_new( segment_pool, max_segments_per_loop, sample_rate, take_imported, NULL );
+    if( importer == NULL ) {
+        fprintf( stderr, "Could not start the MIDI file import thread.\n" );
+        exit( -1 );
+    }
+
     lo_server_thread_add_method( server_thread, "/quit", "", quit_handler, NULL );
     lo_server_thread_add_method( server_thread, "/ping", "ss", ping_handler, NULL );
     lo_server_thread_add_method( server_thread, "/loop_list", "ss", loop_list_handler, NULL );
     lo_server_thread_add_method( server_thread, "/loop_add", "s", loop_add_handler, NULL );
     lo_server_thread_add_method( server_thread, "/loop_del", "s", loop_del_handler, NULL );
+    lo_server_thread_add_method( server_thread, "/dsp_stats", "ss", dsp_stats_handler, NULL );
 
     update_table = g_hash_table_new( g_str_hash, g_str_equal );
     g_hash_table_insert( update_table, "loops", NULL /* the empty GList */ );
@@ -1050,17 +2050,34 @@ void init_liblo( const char *osc_port )
     lo_server_thread_add_method( server_thread, "/clear_midi_bindings", "", clear_midi_bindings_handler, NULL );
     lo_server_thread_add_method( server_thread, "/add_midi_binding", "s", add_mapping_handler, NULL );
     lo_server_thread_add_method( server_thread, "/remove_midi_binding", "s", remove_mapping_handler, NULL );
-    
+    lo_server_thread_add_method( server_thread, "/session_save", "s", session_save_handler, NULL );
+    lo_server_thread_add_method( server_thread, "/session_load", "s", session_load_handler, NULL );
+}
+
+/* Only once every method the main thread adds is in: from here on, only the
+   server thread may add or remove them. */
+void start_liblo( void )
+{
     lo_server_thread_start( server_thread );
+
+    // Only now is there anywhere to send the process thread's errors.
+    if( rt_log_start_drain( name_loop_for_rt_log, publish_rt_log_error, NULL ) != 0 ) {
+        fprintf( stderr, "Could not start the RT error log drain thread.\n" );
+    }
 }
 
 void close_liblo( void )
 {
+    rt_log_stop_drain();
     pthread_mutex_destroy( &done_lock );    
+    pthread_mutex_destroy( &update_lock );
     g_hash_table_destroy( lo_address_table );
     g_hash_table_foreach( update_table, free_update_list, NULL );
     g_hash_table_destroy( update_table );
     lo_server_thread_free( server_thread );
+
+    // Only once nothing can queue any more.
+    midi_file_importer_free( importer );
 }
 
 /* ----------------------------------------------------   
@@ -1075,13 +2092,46 @@ int main( int argc, char *argv[] )
     int opt;
     const char *osc_port = NULL;
 
-    while( ( opt = getopt( argc, argv, "p:" ) ) != -1 ) {
+    while( ( opt = getopt( argc, argv, "p:m:l:u:b:s:L:w:Wc:H:R:S:J:T:" ) ) != -1 ) {
         switch( opt ) {
             case 'p': osc_port = optarg; break;
+            // Loop buffer segments, LOOP_BUFFER_SEGMENT_EVENTS events apiece.
+            case 'm': max_segments_per_loop = strtoul( optarg, NULL, 10 ); break;
+            case 'l': pool_low_watermark = strtoul( optarg, NULL, 10 ); break;
+            case 'u': pool_high_watermark = strtoul( optarg, NULL, 10 ); break;
+            // Percent of the period: cycles over -b count as overruns, past -s we shed.
+            case 'b': dsp_budget_percent = strtoul( optarg, NULL, 10 ); break;
+            case 's': dsp_shed_percent = strtoul( optarg, NULL, 10 ); break;
+            // Frames, defaulting to one period.
+            case 'L':
+                max_command_lateness = strtoul( optarg, NULL, 10 );
+                max_command_lateness_set = 1;
+                break;
+            case 'w': engine_workers = atoi( optarg ); break;
+            // More workers than spare CPUs, which only ever slows the cycle down, but shows up races.
+            case 'W': engine_workers_oversubscribe = 1; break;
+            case 'c': locked_capture_loops = strtoul( optarg, NULL, 10 ); break;
+            case 'H': capture_seconds = atof( optarg ); break;
+            case 'R': capture_rate = strtoul( optarg, NULL, 10 ); break;
+            case 'S': session_path = optarg; break;
+            case 'J': journal_path = optarg; break;
+            case 'T': trace_path = optarg; break;
         }
     }
 
+    if( rt_log_init() != 0 ) {
+        fprintf( stderr, "Could not create the RT error log.\n" );
+        return 1;
+    }
+
+    size_t capture_messages = capture_seconds > 0 ? capture_seconds * capture_rate : 1;
+    if( capture_ring_init( capture_messages, locked_capture_loops ) != 0 ) {
+        fprintf( stderr, "Could not start capturing the loops' input history.\n" );
+        return 1;
+    }
+
     init_loops();
+    action_table = control_action_table_new( mapping_table_change_handler );
 
     // Fire up JACK.
     init_jack();
@@ -1089,13 +2139,16 @@ int main( int argc, char *argv[] )
     // OSC next.
     init_liblo( osc_port );
 
-    action_table = control_action_table_new( mapping_table_change_handler );
-    if( pthread_mutex_init( &action_table_lock, NULL ) != 0 )
-    {
-        fprintf( stderr, "Action table mutex init failed.\n" );
-        return 1;
+    // Only a session that's already there - it's created on the way out.
+    if( session_path && access( session_path, F_OK ) == 0 ) {
+        pthread_mutex_lock( &loop_table_lock );
+        load_session_locked( session_path );
+        pthread_mutex_unlock( &loop_table_lock );
     }
 
+    // The session's loops have their methods, so the server can start.
+    start_liblo();
+
     int quit = 0;
     while( !quit ) {
         sleep( 1 );
@@ -1104,12 +2157,19 @@ int main( int argc, char *argv[] )
         pthread_mutex_unlock( &done_lock );
     }
 
+    if( session_path ) {
+        pthread_mutex_lock( &loop_table_lock );
+        save_session_locked( session_path );
+        pthread_mutex_unlock( &loop_table_lock );
+    }
+
     // At this point, the engine has been terminated.
     close_liblo();
+    control_action_table_free( action_table ); // Unlinks itself from the loops, so first.
     close_loops();
-    control_action_table_free( action_table );
     close_jack();
-    pthread_mutex_destroy( &action_table_lock );
+    capture_ring_close();
+    rt_log_close();
 
     return 0;
 }
@@ -0,0 +1,686 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "midi_file.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// 120 BPM, in microseconds per beat.
+#define DEFAULT_TEMPO 500000
+
+// Largest delta a variable-length quantity can hold.
+#define MAX_DELTA 0x0fffffff
+
+/* ----------------------------------------------------
+   Writing
+   ---------------------------------------------------- */
+
+struct TrackWriter {
+    FILE *file;
+    uint32_t bytes; // Written to the track so far.
+};
+
+static void put_bytes( struct TrackWriter *writer, const unsigned char *bytes, size_t count )
+{
+    fwrite( bytes, 1, count, writer->file );
+    writer->bytes += count;
+}
+
+static void put_delta( struct TrackWriter *writer, uint32_t delta )
+{
+    unsigned char bytes[4];
+    int count = 0;
+    do {
+        bytes[count++] = delta & 0x7f;
+        delta >>= 7;
+    } while( delta );
+
+    // Most significant group first, with the continuation bit on all but the last.
+    unsigned char out[4];
+    for( int i = 0; i < count; i++ ) {
+        out[i] = bytes[count - 1 - i] | ( i < count - 1 ? 0x80 : 0 );
+    }
+    put_bytes( writer, out, count );
+}
+
+static void put_u32( unsigned char *out, uint32_t value )
+{
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+int midi_file_write(
+        const char *path,
+        const struct PackedMidiMessage *events,
+        size_t count,
+        jack_nframes_t length,
+        jack_nframes_t sample_rate,
+        double beats_per_minute
+    ) {
+
+    if( beats_per_minute <= 0 ) {
+        beats_per_minute = MIDI_FILE_DEFAULT_BPM;
+    }
+    uint32_t tempo = 60000000.0 / beats_per_minute + 0.5;
+    if( tempo > 0xffffff ) {
+        tempo = 0xffffff;
+    } else if( tempo == 0 ) {
+        tempo = 1;
+    }
+    // From the tempo as written, so that reading the file back lands on the same frames.
+    double ticks_per_frame = 1000000.0 * MIDI_FILE_TICKS_PER_BEAT / ( (double) tempo * sample_rate );
+
+    struct TrackWriter writer = { .file = fopen( path, "wb" ), .bytes = 0 };
+    if( writer.file == NULL ) {
+        return -10;
+    }
+
+    unsigned char header[22] = {
+        'M', 'T', 'h', 'd', 0, 0, 0, 6,
+        0, 0, // Type 0.
+        0, 1, // One track.
+        MIDI_FILE_TICKS_PER_BEAT >> 8, MIDI_FILE_TICKS_PER_BEAT & 0xff,
+        'M', 'T', 'r', 'k', 0, 0, 0, 0 // Length filled in at the end.
+    };
+    fwrite( header, 1, sizeof( header ), writer.file );
+
+    unsigned char set_tempo[6] = { 0xff, 0x51, 3, tempo >> 16, tempo >> 8, tempo };
+    put_delta( &writer, 0 );
+    put_bytes( &writer, set_tempo, sizeof( set_tempo ) );
+
+    int result = 0;
+    uint64_t frame = 0, last_tick = 0;
+    for( size_t i = 0; i < count && result == 0; i++ ) {
+        frame += events[i].delta;
+        int len = midi_message_length( events[i].status );
+        if( events[i].status >= 0xf0 || len == 0 ) {
+            continue;
+        }
+
+        uint64_t tick = frame * ticks_per_frame + 0.5;
+        if( tick - last_tick > MAX_DELTA ) {
+            result = -20;
+            break;
+        }
+        put_delta( &writer, tick - last_tick );
+        last_tick = tick;
+
+        unsigned char message[3] = { events[i].status, events[i].data[0], events[i].data[1] };
+        put_bytes( &writer, message, len );
+    }
+
+    if( result == 0 ) {
+        uint64_t end_tick = length * ticks_per_frame + 0.5;
+        if( end_tick < last_tick ) {
+            end_tick = last_tick;
+        }
+        if( end_tick - last_tick > MAX_DELTA ) {
+            result = -20;
+        } else {
+            unsigned char end_of_track[3] = { 0xff, 0x2f, 0 };
+            put_delta( &writer, end_tick - last_tick );
+            put_bytes( &writer, end_of_track, sizeof( end_of_track ) );
+        }
+    }
+
+    unsigned char track_length[4];
+    put_u32( track_length, writer.bytes );
+    if(
+        result == 0
+        && (
+            fseek( writer.file, 18, SEEK_SET ) != 0
+            || fwrite( track_length, 1, 4, writer.file ) != 4
+        )
+    ) {
+        result = -30;
+    }
+
+    if( ferror( writer.file ) ) {
+        result = -30;
+    }
+    if( fclose( writer.file ) != 0 && result == 0 ) {
+        result = -30;
+    }
+
+    return result;
+}
+
+/* ----------------------------------------------------
+   Reading
+   ---------------------------------------------------- */
+
+enum TrackEventType {
+    TRACK_MESSAGE = 0,
+    TRACK_TEMPO,
+    TRACK_END
+};
+
+// One track's place in the file, read a chunk at a time.
+struct TrackReader {
+    off_t offset; // Of the next chunk.
+    off_t end;    // Of the track.
+    unsigned char *chunk;
+    size_t position;
+    size_t size;
+
+    uint64_t tick;
+    unsigned char running_status;
+    int ended; // Its end has been merged, so there's nothing more to read.
+
+    // The track's next event, at tick.
+    enum TrackEventType type;
+    struct MidiMessage message;
+    uint32_t tempo;
+};
+
+// Returns non-zero at the end of the track, or if the file can't be read.
+static int next_byte( int fd, struct TrackReader *track, unsigned char *byte )
+{
+    if( track->position == track->size ) {
+        if( track->offset >= track->end ) {
+            return -1;
+        }
+
+        size_t size = track->end - track->offset < MIDI_FILE_CHUNK_BYTES
+            ? track->end - track->offset
+            : MIDI_FILE_CHUNK_BYTES;
+        if( pread( fd, track->chunk, size, track->offset ) != (ssize_t) size ) {
+            return -2;
+        }
+        track->offset += size;
+        track->position = 0;
+        track->size = size;
+    }
+
+    *byte = track->chunk[track->position++];
+    return 0;
+}
+
+static int skip_bytes( struct TrackReader *track, uint32_t count )
+{
+    size_t buffered = track->size - track->position;
+    if( count <= buffered ) {
+        track->position += count;
+        return 0;
+    }
+
+    track->position = track->size;
+    track->offset += count - buffered;
+    return track->offset > track->end ? -1 : 0;
+}
+
+static int read_quantity( int fd, struct TrackReader *track, uint32_t *value )
+{
+    *value = 0;
+    for( int i = 0; i < 4; i++ ) {
+        unsigned char byte;
+        if( next_byte( fd, track, &byte ) != 0 ) {
+            return -1;
+        }
+        *value = ( *value << 7 ) | ( byte & 0x7f );
+        if( !( byte & 0x80 ) ) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Reads up to the track's next message, tempo change or end.
+static int read_event( int fd, struct TrackReader *track )
+{
+    for( ;; ) {
+        // A track that just runs out ends there.
+        if( track->position == track->size && track->offset >= track->end ) {
+            track->type = TRACK_END;
+            return 0;
+        }
+
+        uint32_t delta;
+        unsigned char status;
+        if( read_quantity( fd, track, &delta ) != 0 || next_byte( fd, track, &status ) != 0 ) {
+            return -1;
+        }
+        track->tick += delta;
+
+        if( status == 0xff ) {
+            unsigned char type;
+            uint32_t length;
+            if( next_byte( fd, track, &type ) != 0 || read_quantity( fd, track, &length ) != 0 ) {
+                return -1;
+            }
+            track->running_status = 0;
+
+            if( type == 0x2f ) {
+                track->type = TRACK_END;
+                return 0;
+            }
+
+            if( type == 0x51 && length == 3 ) {
+                unsigned char tempo[3];
+                for( int i = 0; i < 3; i++ ) {
+                    if( next_byte( fd, track, &tempo[i] ) != 0 ) {
+                        return -1;
+                    }
+                }
+                track->tempo = ( tempo[0] << 16 ) | ( tempo[1] << 8 ) | tempo[2];
+                track->type = TRACK_TEMPO;
+                return 0;
+            }
+
+            if( skip_bytes( track, length ) != 0 ) {
+                return -1;
+            }
+            continue;
+        }
+
+        if( status == 0xf0 || status == 0xf7 ) {
+            uint32_t length;
+            if( read_quantity( fd, track, &length ) != 0 || skip_bytes( track, length ) != 0 ) {
+                return -1;
+            }
+            track->running_status = 0;
+            continue;
+        }
+
+        // Running status: that was the first data byte.
+        int data_read = 0;
+        unsigned char data[2];
+        if( status < 0x80 ) {
+            if( track->running_status == 0 ) {
+                return -2;
+            }
+            data[0] = status;
+            data_read = 1;
+            status = track->running_status;
+        } else if( status >= 0xf0 ) {
+            return -2; // Nothing else belongs in a file.
+        }
+        track->running_status = status;
+
+        int len = midi_message_length( status );
+        for( int i = data_read; i < len - 1; i++ ) {
+            if( next_byte( fd, track, &data[i] ) != 0 ) {
+                return -1;
+            }
+        }
+        for( int i = 0; i < len - 1; i++ ) {
+            if( data[i] & 0x80 ) {
+                return -2;
+            }
+        }
+
+        track->message.len = len;
+        track->message.data[0] = status;
+        track->message.data[1] = len > 1 ? data[0] : 0;
+        track->message.data[2] = len > 2 ? data[1] : 0;
+        track->type = TRACK_MESSAGE;
+        return 0;
+    }
+}
+
+static uint16_t get_u16( const unsigned char *bytes )
+{
+    return ( bytes[0] << 8 ) | bytes[1];
+}
+
+static uint32_t get_u32( const unsigned char *bytes )
+{
+    return ( (uint32_t) bytes[0] << 24 ) | ( bytes[1] << 16 ) | ( bytes[2] << 8 ) | bytes[3];
+}
+
+// Finds every track in the file, returning non-zero if they aren't all there.
+static int find_tracks( int fd, uint32_t header_length, struct TrackReader *tracks, int track_count )
+{
+    off_t offset = 8 + (off_t) header_length;
+    int found = 0;
+    while( found < track_count ) {
+        unsigned char chunk_header[8];
+        if( pread( fd, chunk_header, 8, offset ) != 8 ) {
+            return -1;
+        }
+        uint32_t length = get_u32( chunk_header + 4 );
+
+        // Anything but a track is there to be skipped.
+        if( memcmp( chunk_header, "MTrk", 4 ) == 0 ) {
+            tracks[found].offset = offset + 8;
+            tracks[found].end = offset + 8 + length;
+            found++;
+        }
+        offset += 8 + (off_t) length;
+    }
+    return 0;
+}
+
+/* Merges the tracks into take in time order, keeping to the file's order
+   for events on the same tick, so that a tempo change in the first track
+   applies to everything else on its tick. */
+static int merge_tracks(
+        int fd,
+        struct TrackReader *tracks,
+        int track_count,
+        uint16_t division,
+        jack_nframes_t sample_rate,
+        LoopBuffer take,
+        jack_nframes_t *length
+    ) {
+
+    // Timecode divisions are in ticks per frame, at a frame rate that ignores the tempo.
+    int timecode = division & 0x8000;
+    double ticks_per_second = 0;
+    if( timecode ) {
+        int frames_per_second = -(int8_t) ( division >> 8 );
+        ticks_per_second = ( frames_per_second == 29 ? 29.97 : frames_per_second ) * ( division & 0xff );
+        if( ticks_per_second <= 0 ) {
+            return -20;
+        }
+    } else if( division == 0 ) {
+        return -20;
+    }
+
+    double frames_per_tick = timecode
+        ? sample_rate / ticks_per_second
+        : (double) DEFAULT_TEMPO * sample_rate / ( 1000000.0 * division );
+    uint64_t tempo_tick = 0;
+    double tempo_frame = 0;
+
+    loop_buffer_reset_write( take );
+    size_t pushed = 0;
+    double end_frame = 0, last_frame = -1;
+
+    for( ;; ) {
+        struct TrackReader *next = NULL;
+        for( int i = 0; i < track_count; i++ ) {
+            if( !tracks[i].ended && ( next == NULL || tracks[i].tick < next->tick ) ) {
+                next = &tracks[i];
+            }
+        }
+        if( next == NULL ) {
+            break;
+        }
+
+        double frame = tempo_frame + ( next->tick - tempo_tick ) * frames_per_tick;
+        if( frame > UINT32_MAX - 1 ) {
+            return -60;
+        }
+
+        if( next->type == TRACK_END ) {
+            if( frame > end_frame ) {
+                end_frame = frame;
+            }
+            next->ended = 1;
+            continue;
+        }
+
+        if( next->type == TRACK_TEMPO ) {
+            if( !timecode && next->tempo ) {
+                tempo_frame = frame;
+                tempo_tick = next->tick;
+                frames_per_tick = (double) next->tempo * sample_rate / ( 1000000.0 * division );
+            }
+        } else {
+            // The take only ever grows a segment at a time as it fills, never from the pool.
+            if( pushed % LOOP_BUFFER_SEGMENT_EVENTS == 0 && loop_buffer_reserve( take, pushed + 1 ) != 0 ) {
+                return -50;
+            }
+
+            next->message.time = frame + 0.5;
+            if( loop_buffer_push( take, &( next->message ) ) != 0 ) {
+                return -50;
+            }
+            pushed++;
+            last_frame = next->message.time;
+        }
+
+        if( read_event( fd, next ) != 0 ) {
+            return -40;
+        }
+    }
+
+    *length = end_frame + 0.5;
+    if( last_frame >= *length ) {
+        *length = last_frame + 1;
+    }
+
+    return 0;
+}
+
+int midi_file_read(
+        const char *path,
+        jack_nframes_t sample_rate,
+        LoopBuffer take,
+        jack_nframes_t *length
+    ) {
+
+    int fd = open( path, O_RDONLY );
+    if( fd < 0 ) {
+        return -10;
+    }
+
+    unsigned char header[14];
+    if(
+        pread( fd, header, sizeof( header ), 0 ) != sizeof( header )
+        || memcmp( header, "MThd", 4 ) != 0
+        || get_u32( header + 4 ) < 6
+    ) {
+        close( fd );
+        return -20;
+    }
+
+    uint16_t format = get_u16( header + 8 );
+    uint16_t track_count = get_u16( header + 10 );
+    if(
+        format > 1
+        || track_count == 0
+        || track_count > MIDI_FILE_MAX_TRACKS
+        || ( format == 0 && track_count != 1 )
+    ) {
+        close( fd );
+        return -20;
+    }
+
+    struct TrackReader *tracks = calloc( track_count, sizeof( struct TrackReader ) );
+    unsigned char *chunks = malloc( (size_t) track_count * MIDI_FILE_CHUNK_BYTES );
+    int result = 0;
+    if( tracks == NULL || chunks == NULL ) {
+        result = -30;
+    } else if( find_tracks( fd, get_u32( header + 4 ), tracks, track_count ) != 0 ) {
+        result = -40;
+    }
+
+    for( int i = 0; i < track_count && result == 0; i++ ) {
+        tracks[i].chunk = chunks + (size_t) i * MIDI_FILE_CHUNK_BYTES;
+        if( read_event( fd, &tracks[i] ) != 0 ) {
+            result = -40;
+        }
+    }
+
+    if( result == 0 ) {
+        result = merge_tracks( fd, tracks, track_count, get_u16( header + 12 ), sample_rate, take, length );
+    }
+
+    free( chunks );
+    free( tracks );
+    close( fd );
+    return result;
+}
+
+/* ----------------------------------------------------
+   Importing
+   ---------------------------------------------------- */
+
+struct ImportRequest {
+    char *loop_name;
+    char *path;
+    struct ImportRequest *next;
+};
+
+struct midi_file_importer_type {
+    SegmentPool pool;
+    size_t max_segments;
+    jack_nframes_t sample_rate;
+    MidiFileImported done;
+    void *user_data;
+
+    // First in, first out.
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    struct ImportRequest *first;
+    struct ImportRequest *last;
+    int quit;
+
+    pthread_t thread;
+};
+
+static void free_request( struct ImportRequest *request )
+{
+    free( request->loop_name );
+    free( request->path );
+    free( request );
+}
+
+static void *import_thread( void *arg )
+{
+    struct midi_file_importer_type *this = arg;
+
+    pthread_mutex_lock( &this->lock );
+    for( ;; ) {
+        while( this->first == NULL && !this->quit ) {
+            pthread_cond_wait( &this->queued, &this->lock );
+        }
+        if( this->quit ) {
+            break;
+        }
+
+        struct ImportRequest *request = this->first;
+        this->first = request->next;
+        if( this->first == NULL ) {
+            this->last = NULL;
+        }
+        pthread_mutex_unlock( &this->lock );
+
+        jack_nframes_t length = 0;
+        LoopBuffer take = loop_buffer_init( this->pool, this->max_segments );
+        int result = loop_buffer_is_valid( take )
+            ? midi_file_read( request->path, this->sample_rate, take, &length )
+            : -70;
+        if( result != 0 ) {
+            loop_buffer_free( take );
+            take = NULL;
+        }
+
+        this->done( request->loop_name, request->path, take, length, result, this->user_data );
+        free_request( request );
+
+        pthread_mutex_lock( &this->lock );
+    }
+    pthread_mutex_unlock( &this->lock );
+
+    return NULL;
+}
+
+struct midi_file_importer_type *midi_file_importer_new(
+        SegmentPool pool,
+        size_t max_segments,
+        jack_nframes_t sample_rate,
+        MidiFileImported done,
+        void *user_data
+    ) {
+
+    struct midi_file_importer_type *this = malloc( sizeof( *this ) );
+    if( this == NULL ) {
+        return NULL;
+    }
+
+    this->pool = pool;
+    this->max_segments = max_segments;
+    this->sample_rate = sample_rate;
+    this->done = done;
+    this->user_data = user_data;
+    this->first = NULL;
+    this->last = NULL;
+    this->quit = 0;
+
+    pthread_mutex_init( &this->lock, NULL );
+    pthread_cond_init( &this->queued, NULL );
+    if( pthread_create( &this->thread, NULL, import_thread, this ) != 0 ) {
+        pthread_cond_destroy( &this->queued );
+        pthread_mutex_destroy( &this->lock );
+        free( this );
+        return NULL;
+    }
+
+    return this;
+}
+
+void midi_file_importer_free( struct midi_file_importer_type *this )
+{
+    if( this ) {
+        pthread_mutex_lock( &this->lock );
+        this->quit = 1;
+        pthread_cond_signal( &this->queued );
+        pthread_mutex_unlock( &this->lock );
+        pthread_join( this->thread, NULL );
+
+        while( this->first ) {
+            struct ImportRequest *request = this->first;
+            this->first = request->next;
+            free_request( request );
+        }
+
+        pthread_cond_destroy( &this->queued );
+        pthread_mutex_destroy( &this->lock );
+        free( this );
+    }
+}
+
+int midi_file_importer_queue( struct midi_file_importer_type *this, const char *loop_name, const char *path )
+{
+    struct ImportRequest *request = malloc( sizeof( *request ) );
+    if( request == NULL ) {
+        return -10;
+    }
+
+    request->loop_name = strdup( loop_name );
+    request->path = strdup( path );
+    request->next = NULL;
+    if( request->loop_name == NULL || request->path == NULL ) {
+        free_request( request );
+        return -10;
+    }
+
+    pthread_mutex_lock( &this->lock );
+    if( this->last ) {
+        this->last->next = request;
+    } else {
+        this->first = request;
+    }
+    this->last = request;
+    pthread_cond_signal( &this->queued );
+    pthread_mutex_unlock( &this->lock );
+
+    return 0;
+}
@@ -0,0 +1,98 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#ifndef MIDI_FILE_H
+#define MIDI_FILE_H
+
+#include <stddef.h>
+
+#include <jack/jack.h>
+
+#include "loop_buffer.h"
+#include "midi_message.h"
+#include "segment_pool.h"
+
+/* Standard MIDI Files to and from takes.  Frames and ticks are converted at
+   the sample rate and a tempo: the file's own tempo changes on the way in
+   (120 BPM until the first), and a single tempo on the way out. */
+#define MIDI_FILE_TICKS_PER_BEAT 960
+#define MIDI_FILE_DEFAULT_BPM 120.0
+
+// Each track is read through a buffer this size, so a file is never read whole.
+#define MIDI_FILE_CHUNK_BYTES 4096
+
+// More tracks than this and a type 1 file is refused.
+#define MIDI_FILE_MAX_TRACKS 256
+
+/* Not RT.  Writes the take as a type 0 file: its tempo, its channel messages
+   (the rest mean nothing in a file), and the end of the track at length,
+   each rounded to the nearest tick.  Returns non-zero on failure. */
+int midi_file_write(
+    const char *path,
+    const struct PackedMidiMessage *events,
+    size_t count,
+    jack_nframes_t length,
+    jack_nframes_t sample_rate,
+    double beats_per_minute
+);
+
+/* Not RT.  Reads a type 0 or type 1 file into take, whose write position is
+   reset first, merging the tracks in time order.  SysEx and meta events
+   other than tempo changes are skipped.  The take grows from its pool a
+   chunk at a time, as loop_buffer_reserve does, so the file's read away from
+   the process thread.  *length is where the last track ends, or just after
+   the last message if that's later.  Returns non-zero if the file can't be
+   read or the take doesn't fit. */
+int midi_file_read(
+    const char *path,
+    jack_nframes_t sample_rate,
+    LoopBuffer take,
+    jack_nframes_t *length
+);
+
+/* Reads files into fresh takes, one at a time on a thread of its own, so
+   that neither the OSC thread nor the process thread ever waits on one. */
+typedef struct midi_file_importer_type *MidiFileImporter;
+
+/* On the importer's thread, with the take read for loop_name, which then
+   belongs to the callback.  take is NULL, and result the error from
+   midi_file_read, if the file couldn't be read. */
+typedef void (*MidiFileImported)(
+    const char *loop_name,
+    const char *path,
+    LoopBuffer take,
+    jack_nframes_t length,
+    int result,
+    void *user_data
+);
+
+// Takes come from pool, limited to max_segments (0 for no limit).
+MidiFileImporter midi_file_importer_new(
+    SegmentPool pool,
+    size_t max_segments,
+    jack_nframes_t sample_rate,
+    MidiFileImported done,
+    void *user_data
+);
+
+// Waits for the file being read, if there is one, and drops any still queued.
+void midi_file_importer_free( MidiFileImporter this );
+
+// Not RT.  Queues path to be read for loop_name, returning non-zero on failure.
+int midi_file_importer_queue( MidiFileImporter this, const char *loop_name, const char *path );
+
+#endif
@@ -18,11 +18,9 @@
 #include "midi_message.h"
 
 #include <assert.h>
-#include <stdio.h>
 #include <string.h>
 
 #include <jack/midiport.h>
-#include <jack/ringbuffer.h>
 
 static void midi_message_from_midi_event( struct MidiMessage *message, jack_midi_event_t event );
 
@@ -34,15 +32,14 @@ int midi_message_from_port_buffer(
 
     jack_midi_event_t event;
 
+    // No reporting here, since we're RT - callers rt_log what they care about.
     int read = jack_midi_event_get( &event, port_buffer, event_index );
     if( read ) {
-        fprintf( stderr, "Control JACK MIDI event get failed.\n" );
         return -10;
     }
 
     if( event.size > 3 ) {
-        fprintf( stderr, "Ignoring MIDI message longer than three bytes, probably a SysEx.\n" );
-        return 10; // This is probably not an error from the caller's perspective.
+        return 10; // Probably a SysEx, and probably not an error from the caller's perspective.
     }
 
     midi_message_from_midi_event( message, event );
@@ -60,22 +57,32 @@ static void midi_message_from_midi_event( struct MidiMessage *message, jack_midi
     memcpy( message->data, event.buffer, message->len );
 }
 
-int queue_midi_message( jack_ringbuffer_t *ringbuffer, struct MidiMessage *ev )
+int midi_message_length( unsigned char status )
 {
-    int written;
-
-    if( jack_ringbuffer_write_space( ringbuffer ) < sizeof( *ev ) ) {
-        fprintf( stderr, "Not enough space to queue midi message, NOTE LOST\n" );
-        return -10;
+    if( status < 0x80 ) {
+        return 0; // Running status never makes it this far.
     }
 
-    written = jack_ringbuffer_write( ringbuffer, (char *)ev, sizeof( *ev ) );
-
-    if( written != sizeof( *ev ) ) {
-        fprintf( stderr, "jack_ringbuffer_write failed, NOTE LOST.\n" );
-        return -20;
+    switch( status & 0xf0 ) {
+        case 0xc0: // Program change.
+        case 0xd0: // Channel pressure.
+            return 2;
+        case 0xf0:
+            break;
+        default:
+            return 3;
     }
 
-    return 0;
+    switch( status ) {
+        case 0xf0: // SysEx.
+            return 0;
+        case 0xf1: // MTC quarter frame.
+        case 0xf3: // Song select.
+            return 2;
+        case 0xf2: // Song position.
+            return 3;
+        default:
+            return 1;
+    }
 }
 
@@ -18,8 +18,9 @@
 #ifndef MIDI_MESSAGE_H
 #define MIDI_MESSAGE_H
 
+#include <stdint.h>
+
 #include <jack/midiport.h>
-#include <jack/ringbuffer.h>
 
 // The only difference between this struct and jack_midi_event_t is that
 // the raw data storage is actually contained within the struct
@@ -30,15 +31,22 @@ struct MidiMessage {
     unsigned char data[3];
 };
 
+/* How loop buffers store messages: 8 bytes instead of 12.  Times are deltas
+   from the previous message, and the length comes from the status byte. */
+struct PackedMidiMessage {
+    uint32_t delta;
+    unsigned char status;
+    unsigned char data[2];
+    unsigned char reserved;
+};
+
+// The length implied by a status byte, or 0 if it can't be packed (SysEx, data bytes).
+int midi_message_length( unsigned char status );
+
 int midi_message_from_port_buffer(
     struct MidiMessage *message,
     void *port_buffer,
     int event_index
 );
 
-int queue_midi_message(
-    jack_ringbuffer_t *ringbuffer,
-    struct MidiMessage *ev
-);
-
 #endif
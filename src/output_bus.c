@@ -0,0 +1,165 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#include "output_bus.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <jack/midiport.h>
+
+#include "rt_log.h"
+
+struct output_bus_type {
+    jack_client_t *jack_client;
+    jack_port_t *port;
+};
+
+OutputBus output_bus_new( jack_client_t *jack_client, const char *port_name )
+{
+    struct output_bus_type *this = malloc( sizeof( *this ) );
+    if( this == NULL ) {
+        return NULL;
+    }
+
+    this->jack_client = jack_client;
+    this->port = jack_port_register(
+        jack_client,
+        port_name,
+        JACK_DEFAULT_MIDI_TYPE,
+        JackPortIsOutput,
+        0
+    );
+    if( this->port == NULL ) {
+        fprintf( stderr, "Could not register JACK %s port.\n", port_name );
+        free( this );
+        return NULL;
+    }
+
+    return this;
+}
+
+void output_bus_free( OutputBus this )
+{
+    if( this ) {
+        jack_port_unregister( this->jack_client, this->port );
+        free( this );
+    }
+}
+
+jack_port_t *output_bus_get_port( OutputBus this )
+{
+    return this->port;
+}
+
+int output_bus_stage_push( struct OutputBusStage *stage, const struct MidiMessage *message )
+{
+    if( stage->count == OUTPUT_BUS_STAGE_MESSAGES ) {
+        return -10;
+    }
+
+    stage->messages[stage->count++] = *message;
+    return 0;
+}
+
+/* The heap holds the time of each stage's next message above its stage
+   number, so one compare orders them, ties included, without going back to
+   the stages. */
+static uint64_t merge_key( const struct OutputBusStage *stages, int stage )
+{
+    return (uint64_t) stages[stage].messages[stages[stage].next].time << 32 | (uint32_t) stage;
+}
+
+static void sift_down( uint64_t *heap, int size, int i )
+{
+    uint64_t key = heap[i];
+    for( ;; ) {
+        int child = 2 * i + 1;
+        if( child >= size ) {
+            break;
+        }
+        if( child + 1 < size && heap[child + 1] < heap[child] ) {
+            child++;
+        }
+        if( heap[child] >= key ) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = key;
+}
+
+void output_bus_merge(
+        OutputBus this,
+        struct OutputBusStage *stages,
+        int stage_count,
+        uint64_t *heap,
+        jack_nframes_t nframes,
+        unsigned int log_id
+    ) {
+
+    void *port_buffer = jack_port_get_buffer( this->port, nframes );
+    if( port_buffer == NULL ) {
+        rt_log( RT_LOG_OUTPUT_BUFFER, log_id, 0, 0 );
+        for( int i = 0; i < stage_count; i++ ) {
+            stages[i].count = 0;
+        }
+        return;
+    }
+    jack_midi_clear_buffer( port_buffer );
+
+    // Empty stages, usually most of them, are left out of the heap.
+    int size = 0;
+    for( int i = 0; i < stage_count; i++ ) {
+        if( stages[i].count > 0 ) {
+            stages[i].next = 0;
+            heap[size++] = merge_key( stages, i );
+        }
+    }
+    for( int i = size / 2 - 1; i >= 0; i-- ) {
+        sift_down( heap, size, i );
+    }
+
+    jack_nframes_t last_time = 0;
+    while( size > 0 ) {
+        int stage_number = (uint32_t) heap[0];
+        struct OutputBusStage *stage = &( stages[stage_number] );
+        const struct MidiMessage *message = &( stage->messages[stage->next++] );
+
+        jack_midi_data_t data[3] = { message->data[0], message->data[1], message->data[2] };
+        if( stage->channel != OUTPUT_BUS_KEEP_CHANNEL && data[0] < 0xf0 ) {
+            data[0] = ( data[0] & 0xf0 ) | stage->channel;
+        }
+
+        // Each stage is in order already, so this is only a guard, as in the loop's own write.
+        jack_nframes_t time = message->time > last_time ? message->time : last_time;
+        if( jack_midi_event_write( port_buffer, time, data, message->len ) != 0 ) {
+            rt_log( RT_LOG_OUTPUT_WRITE, log_id, time, 0 );
+        } else {
+            last_time = time;
+        }
+
+        if( stage->next == stage->count ) {
+            stage->count = 0;
+            heap[0] = heap[--size];
+        } else {
+            heap[0] = merge_key( stages, stage_number );
+        }
+        sift_down( heap, size, 0 );
+    }
+}
@@ -0,0 +1,69 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#ifndef OUTPUT_BUS_H
+#define OUTPUT_BUS_H
+
+#include <stdint.h>
+
+#include <jack/jack.h>
+
+#include "midi_message.h"
+
+// Leaves each message on whatever channel it was played on.
+#define OUTPUT_BUS_KEEP_CHANNEL -1
+
+// Most messages a loop can put on the bus in a cycle.  Any more are lost.
+#define OUTPUT_BUS_STAGE_MESSAGES 512
+
+/* A shared output port that any number of loops can play into instead of
+   their own ports.  Each loop fills its own stage as it's processed, in time
+   order, and once they all have the engine merges the stages into the port,
+   so the loops can be processed in any order, or on any thread. */
+typedef struct output_bus_type *OutputBus;
+
+struct OutputBusStage {
+    struct MidiMessage *messages; // OUTPUT_BUS_STAGE_MESSAGES of them.
+    int count;
+    int next; // Merge cursor.
+    int channel; // Everything's moved to this channel, unless it's OUTPUT_BUS_KEEP_CHANNEL.
+};
+
+// Registers the port, so the same rules as for any other port apply.
+OutputBus output_bus_new( jack_client_t *jack_client, const char *port_name );
+void output_bus_free( OutputBus this );
+
+jack_port_t *output_bus_get_port( OutputBus this );
+
+/* RT, from the thread filling the stage.  Returns non-zero if it's full.
+   Messages must come in time order. */
+int output_bus_stage_push( struct OutputBusStage *stage, const struct MidiMessage *message );
+
+/* RT.  Writes every stage's messages into the port in time order, with a
+   heap over the stages, so O(messages * log stages).  Ties go to the lowest
+   numbered stage.  heap must have room for one key per stage.  Leaves the
+   stages empty, ready for the next cycle. */
+void output_bus_merge(
+    OutputBus this,
+    struct OutputBusStage *stages,
+    int stage_count,
+    uint64_t *heap,
+    jack_nframes_t nframes,
+    unsigned int log_id
+);
+
+#endif
@@ -0,0 +1,102 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+/* Rebuilds the loops from a journal left by a crash (see journal.h) and
+   saves them as a session the looper can load.  Runs against stub_jack.c,
+   since the loops never play, so it needs no JACK server. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <jack/jack.h>
+
+#include "capture_ring.h"
+#include "control_action_table.h"
+#include "journal.h"
+#include "loop.h"
+#include "segment_pool.h"
+#include "session.h"
+#include "stub_jack.h"
+
+static void usage( const char *program )
+{
+    fprintf( stderr, "Usage: %s [-r run, from 1, defaulting to the last] journal session\n", program );
+}
+
+int main( int argc, char *argv[] )
+{
+    int run = 0;
+
+    int opt;
+    while( ( opt = getopt( argc, argv, "r:" ) ) != -1 ) {
+        switch( opt ) {
+            case 'r': run = atoi( optarg ); break;
+            default: usage( argv[0] ); return 1;
+        }
+    }
+    if( argc - optind != 2 || run < 0 ) {
+        usage( argv[0] );
+        return 1;
+    }
+    const char *journal_path = argv[optind];
+    const char *session_path = argv[optind + 1];
+
+    // Ports for the loops to register, at a rate that doesn't matter.
+    jack_client_t *client = stub_jack_client_new( 48000, 256 );
+    SegmentPool segment_pool = segment_pool_new( 16, 64 );
+    ControlActionTable table = control_action_table_new( NULL );
+    if( client == NULL || segment_pool == NULL || table == NULL || capture_ring_init( CAPTURE_RING_DEFAULT_MESSAGES, 0 ) != 0 ) {
+        fprintf( stderr, "Could not set up to recover the loops.\n" );
+        return 1;
+    }
+
+    Loop *loops;
+    int loop_count;
+    struct JournalRecovery recovery;
+    int result = journal_recover( journal_path, run, client, segment_pool, 0, &loops, &loop_count, &recovery );
+    if( result == 0 ) {
+        printf(
+            "Run %d of %d: %llu records in %llu blocks, ending %s.\n",
+            recovery.run,
+            recovery.runs,
+            (unsigned long long) recovery.records,
+            (unsigned long long) recovery.blocks,
+            recovery.torn ? "in a torn block, which was left out" : "cleanly"
+        );
+
+        result = session_save( session_path, loops, loop_count, table, recovery.sample_rate );
+        if( result == 0 ) {
+            printf( "Saved %d loops, %zu with takes, to %s.\n", loop_count, recovery.takes, session_path );
+        }
+
+        for( int i = 0; i < loop_count; i++ ) {
+            char *name = (char *) loop_get_name( loops[i] );
+            loop_free( loops[i] );
+            free( name );
+        }
+        free( loops );
+    }
+
+    control_action_table_free( table );
+    capture_ring_close();
+    segment_pool_free( segment_pool );
+    stub_jack_client_free( client );
+    return result != 0;
+}
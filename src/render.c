@@ -0,0 +1,686 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+/* Bounces a scripted performance to Standard MIDI Files offline.  The engine
+   runs against stub_jack.c on a frame clock of its own, a cycle straight
+   after another, so nothing waits on a JACK server or on real time. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <jack/jack.h>
+#include <jack/midiport.h>
+
+#include "capture_ring.h"
+#include "control_action_table.h"
+#include "control_dispatch.h"
+#include "engine.h"
+#include "loop.h"
+#include "midi_file.h"
+#include "midi_message.h"
+#include "output_bus.h"
+#include "rt_log.h"
+#include "segment_pool.h"
+#include "session.h"
+#include "stub_jack.h"
+
+#define RENDER_DEFAULT_SAMPLE_RATE 48000
+#define RENDER_DEFAULT_PERIOD 1024
+#define RENDER_MAX_LOOPS 1024
+
+/* The pool is topped up to this between cycles, so that however fast the
+   cycles come a loop never finds it dry. */
+#define RENDER_POOL_SEGMENTS 64
+
+// How often to look again while a loop's capture is being copied.
+#define RENDER_CAPTURE_WAIT_NS 100000
+
+enum RenderEventType {
+    RENDER_COMMAND = 0  // A transport command for a loop, queued with the engine.
+    , RENDER_MIDI       // A message on a loop's input port.
+    , RENDER_CONTROL    // A message on the control input, for the mappings.
+};
+
+struct RenderEvent {
+    uint64_t frame;
+    size_t line;        // Keeps events on the same frame in script order.
+    enum RenderEventType type;
+    int loop;
+    enum EngineCommandType command;
+    jack_midi_data_t data[3];
+    size_t size;
+};
+
+// What one output port played, as a take to write out.
+struct RenderTrack {
+    jack_port_t *port;
+    const char *name;
+    struct PackedMidiMessage *events;
+    size_t count;
+    size_t capacity;
+    uint64_t last_frame;
+};
+
+struct Render {
+    jack_client_t *client;
+    Engine engine;
+    SegmentPool segment_pool;
+    ControlActionTable table;
+
+    Loop loops[RENDER_MAX_LOOPS];
+    int loop_count;
+
+    struct RenderEvent *events;
+    size_t event_count;
+    size_t event_capacity;
+    uint64_t end_frame;
+    int end_set;
+
+    struct RenderTrack *tracks;
+    int track_count;
+    size_t skipped;
+};
+
+static const struct {
+    const char *name;
+    enum EngineCommandType command;
+    LoopControlFunc func; // NULL if it can't be mapped.
+} RENDER_COMMANDS[] = {
+    { "toggle_playback", ENGINE_COMMAND_TOGGLE_PLAYBACK, LOOP_CONTROL_FUNC_TOGGLE_PLAYBACK }
+    , { "toggle_recording", ENGINE_COMMAND_TOGGLE_RECORDING, LOOP_CONTROL_FUNC_TOGGLE_RECORDING }
+    , { "toggle_overdub", ENGINE_COMMAND_TOGGLE_OVERDUB, LOOP_CONTROL_FUNC_TOGGLE_OVERDUB }
+    , { "toggle_replace", ENGINE_COMMAND_TOGGLE_REPLACE, LOOP_CONTROL_FUNC_TOGGLE_REPLACE }
+    , { "capture", ENGINE_COMMAND_CAPTURE, LOOP_CONTROL_FUNC_CAPTURE }
+    , { "stop", ENGINE_COMMAND_STOP, NULL }
+};
+
+#define RENDER_COMMAND_COUNT ( (int) ( sizeof( RENDER_COMMANDS ) / sizeof( RENDER_COMMANDS[0] ) ) )
+
+static void usage( const char *program )
+{
+    fprintf(
+        stderr,
+        "Usage: %s [options] script output\n"
+        "  -s path  start from the loops, takes and mappings in a session file\n"
+        "  -r rate  sample rate (default %d)\n"
+        "  -p n     frames per cycle (default %d)\n"
+        "  -t bpm   tempo the files are written at (default %.0f)\n"
+        "  -m       merge every loop into the one file output, instead of\n"
+        "           writing each to output/<loop>.mid\n"
+        "\n"
+        "The script has one line per event, and # starts a comment:\n"
+        "  loop <name> [sync master]                 adds a loop, before anything plays\n"
+        "  map <channel> <on|off|cc_on|cc_off> <value> <command> <loop>\n"
+        "  <frame> <command> <loop>                  toggle_playback, toggle_recording,\n"
+        "                                            toggle_overdub, toggle_replace,\n"
+        "                                            capture or stop\n"
+        "  <frame> midi <loop> <byte>...             into the loop's input\n"
+        "  <frame> control <byte>...                 into the control input, for the mappings\n"
+        "  <frame> end                               where the render stops, by default\n"
+        "                                            the last event's frame\n",
+        program,
+        RENDER_DEFAULT_SAMPLE_RATE,
+        RENDER_DEFAULT_PERIOD,
+        MIDI_FILE_DEFAULT_BPM
+    );
+}
+
+static uint64_t clock_ns( void )
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* ----------------------------------------------------
+   Script
+   ---------------------------------------------------- */
+
+static int find_loop( struct Render *render, const char *name )
+{
+    for( int i = 0; i < render->loop_count; i++ ) {
+        if( !strcmp( loop_get_name( render->loops[i] ), name ) ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int find_command( const char *name )
+{
+    for( int i = 0; i < RENDER_COMMAND_COUNT; i++ ) {
+        if( !strcmp( RENDER_COMMANDS[i].name, name ) ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int parse_number( const char *token, unsigned long long max, unsigned long long *value )
+{
+    if( token == NULL ) {
+        return -1;
+    }
+    char *end;
+    *value = strtoull( token, &end, 0 );
+    return *end != '\0' || *value > max ? -1 : 0;
+}
+
+// The rest of the line as a message, which has to be one a loop can hold.
+static int parse_message( char **save, struct RenderEvent *event )
+{
+    event->size = 0;
+    char *token;
+    while( ( token = strtok_r( NULL, " \t", save ) ) != NULL ) {
+        unsigned long long byte;
+        if( event->size == 3 || parse_number( token, 0xff, &byte ) != 0 ) {
+            return -1;
+        }
+        event->data[event->size++] = (jack_midi_data_t) byte;
+    }
+    if( event->size == 0 || midi_message_length( event->data[0] ) != (int) event->size ) {
+        return -1;
+    }
+    return 0;
+}
+
+static int add_loop( struct Render *render, const char *name, const char *master_name )
+{
+    if( render->loop_count == RENDER_MAX_LOOPS || find_loop( render, name ) >= 0 ) {
+        return -1;
+    }
+
+    int master = -1;
+    if( master_name && ( master = find_loop( render, master_name ) ) < 0 ) {
+        return -1;
+    }
+
+    // As the looper adds them: through and playback after recording on.
+    Loop loop;
+    char *dup_name = strdup( name );
+    if( dup_name == NULL || loop_new( &loop, render->client, dup_name, 1, 1, render->segment_pool, 0 ) != 0 ) {
+        free( dup_name );
+        return -1;
+    }
+    if( master >= 0 ) {
+        loop_set_sync_master( loop, render->loops[master] );
+    }
+    render->loops[render->loop_count++] = loop;
+    return 0;
+}
+
+static int add_mapping( struct Render *render, char **save )
+{
+    static const char *types[4] = { "on", "off", "cc_on", "cc_off" };
+
+    unsigned long long channel, value;
+    if( parse_number( strtok_r( NULL, " \t", save ), 15, &channel ) != 0 ) {
+        return -1;
+    }
+
+    const char *type_name = strtok_r( NULL, " \t", save );
+    int type = -1;
+    for( int i = 0; type_name && i < 4; i++ ) {
+        if( !strcmp( types[i], type_name ) ) {
+            type = i;
+        }
+    }
+    if( type < 0 || parse_number( strtok_r( NULL, " \t", save ), 127, &value ) != 0 ) {
+        return -1;
+    }
+
+    const char *command_name = strtok_r( NULL, " \t", save );
+    const char *loop_name = strtok_r( NULL, " \t", save );
+    int command = command_name ? find_command( command_name ) : -1;
+    int loop = loop_name ? find_loop( render, loop_name ) : -1;
+    if( command < 0 || RENDER_COMMANDS[command].func == NULL || loop < 0 ) {
+        return -1;
+    }
+
+    control_action_table_insert(
+        render->table,
+        channel,
+        type,
+        value,
+        render->loops[loop],
+        RENDER_COMMANDS[command].func
+    );
+    return 0;
+}
+
+static int add_event( struct Render *render, uint64_t frame, size_t line, char **save )
+{
+    struct RenderEvent event = { .frame = frame, .line = line, .loop = -1 };
+
+    const char *verb = strtok_r( NULL, " \t", save );
+    if( verb == NULL ) {
+        return -1;
+    }
+
+    if( !strcmp( verb, "end" ) ) {
+        render->end_frame = frame;
+        render->end_set = 1;
+        return 0;
+    } else if( !strcmp( verb, "control" ) ) {
+        event.type = RENDER_CONTROL;
+        if( parse_message( save, &event ) != 0 ) {
+            return -1;
+        }
+    } else {
+        const char *loop_name = strtok_r( NULL, " \t", save );
+        if( loop_name == NULL || ( event.loop = find_loop( render, loop_name ) ) < 0 ) {
+            return -1;
+        }
+
+        if( !strcmp( verb, "midi" ) ) {
+            event.type = RENDER_MIDI;
+            if( parse_message( save, &event ) != 0 ) {
+                return -1;
+            }
+        } else {
+            int command = find_command( verb );
+            if( command < 0 || strtok_r( NULL, " \t", save ) != NULL ) {
+                return -1;
+            }
+            event.type = RENDER_COMMAND;
+            event.command = RENDER_COMMANDS[command].command;
+        }
+    }
+
+    if( render->event_count == render->event_capacity ) {
+        size_t capacity = render->event_capacity ? render->event_capacity * 2 : 1024;
+        struct RenderEvent *events = realloc( render->events, capacity * sizeof( struct RenderEvent ) );
+        if( events == NULL ) {
+            return -1;
+        }
+        render->events = events;
+        render->event_capacity = capacity;
+    }
+    render->events[render->event_count++] = event;
+    return 0;
+}
+
+static int compare_events( const void *a, const void *b )
+{
+    const struct RenderEvent *x = a, *y = b;
+    if( x->frame != y->frame ) {
+        return x->frame < y->frame ? -1 : 1;
+    }
+    return x->line < y->line ? -1 : x->line > y->line;
+}
+
+static int read_script( struct Render *render, const char *path )
+{
+    FILE *file = fopen( path, "r" );
+    if( file == NULL ) {
+        fprintf( stderr, "Could not open %s.\n", path );
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    size_t number = 0;
+    int result = 0;
+    while( result == 0 && getline( &line, &size, file ) != -1 ) {
+        number++;
+        line[strcspn( line, "#\r\n" )] = '\0';
+
+        char *save;
+        const char *first = strtok_r( line, " \t", &save );
+        if( first == NULL ) {
+            continue;
+        }
+
+        unsigned long long frame;
+        if( !strcmp( first, "loop" ) ) {
+            const char *name = strtok_r( NULL, " \t", &save );
+            const char *master = strtok_r( NULL, " \t", &save );
+            result = name && strtok_r( NULL, " \t", &save ) == NULL ? add_loop( render, name, master ) : -1;
+        } else if( !strcmp( first, "map" ) ) {
+            result = add_mapping( render, &save );
+        } else if( parse_number( first, UINT32_MAX, &frame ) == 0 ) {
+            // The stub's frame clock, and so the engine's commands, are 32 bits.
+            result = add_event( render, frame, number, &save );
+        } else {
+            result = -1;
+        }
+    }
+
+    if( result != 0 ) {
+        fprintf( stderr, "%s:%zu: can't make sense of that.\n", path, number );
+    }
+    free( line );
+    fclose( file );
+    if( result != 0 ) {
+        return result;
+    }
+
+    qsort( render->events, render->event_count, sizeof( struct RenderEvent ), compare_events );
+    if( !render->end_set ) {
+        render->end_frame = render->event_count ? render->events[render->event_count - 1].frame : 0;
+    }
+    return 0;
+}
+
+/* ----------------------------------------------------
+   Rendering
+   ---------------------------------------------------- */
+
+static int name_loop( unsigned int loop_id, char *name_out, size_t size, void *user_data )
+{
+    struct Render *render = user_data;
+    for( int i = 0; i < render->loop_count; i++ ) {
+        if( loop_get_id( render->loops[i] ) == loop_id ) {
+            snprintf( name_out, size, "%s", loop_get_name( render->loops[i] ) );
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void print_rt_error( const char *message, void *user_data )
+{
+    fprintf( stderr, "%s\n", message );
+}
+
+static int process( jack_nframes_t nframes, void *arg )
+{
+    return engine_process( arg, nframes );
+}
+
+static void collect_track( struct Render *render, struct RenderTrack *track, uint64_t cycle_frame )
+{
+    uint32_t count = jack_midi_get_event_count( track->port );
+    for( uint32_t i = 0; i < count; i++ ) {
+        jack_midi_event_t event;
+        jack_midi_event_get( &event, track->port, i );
+
+        uint64_t frame = cycle_frame + event.time;
+        if( frame >= render->end_frame ) {
+            break;
+        }
+        if( event.size == 0 || midi_message_length( event.buffer[0] ) != (int) event.size ) {
+            render->skipped++;
+            continue;
+        }
+
+        if( track->count == track->capacity ) {
+            size_t capacity = track->capacity ? track->capacity * 2 : 4096;
+            struct PackedMidiMessage *events = realloc( track->events, capacity * sizeof( struct PackedMidiMessage ) );
+            if( events == NULL ) {
+                render->skipped++;
+                continue;
+            }
+            track->events = events;
+            track->capacity = capacity;
+        }
+
+        struct PackedMidiMessage *packed = &track->events[track->count++];
+        packed->delta = (uint32_t) ( frame - track->last_frame );
+        packed->status = event.buffer[0];
+        packed->data[0] = event.size > 1 ? event.buffer[1] : 0;
+        packed->data[1] = event.size > 2 ? event.buffer[2] : 0;
+        packed->reserved = 0;
+        track->last_frame = frame;
+    }
+}
+
+// Runs every cycle up to the end frame, returning non-zero if a command couldn't be queued.
+static int run_cycles( struct Render *render, jack_nframes_t period )
+{
+    jack_port_t *control_input = stub_jack_port_by_name( render->client, "control input" );
+    size_t next = 0;
+
+    for( uint64_t cycle_frame = 0; cycle_frame < render->end_frame; cycle_frame += period ) {
+        stub_jack_begin_cycle( render->client );
+
+        for( ; next < render->event_count && render->events[next].frame < cycle_frame + period; next++ ) {
+            const struct RenderEvent *event = &render->events[next];
+            jack_nframes_t offset = event->frame - cycle_frame;
+
+            if( event->type == RENDER_COMMAND ) {
+                // The stub's clock converts back to exactly this frame.
+                jack_time_t when = jack_frames_to_time( render->client, (jack_nframes_t) event->frame );
+                if( engine_queue_command( render->engine, loop_get_id( render->loops[event->loop] ), event->command, when ) != 0 ) {
+                    fprintf( stderr, "Too many commands in the cycle at frame %llu.\n", (unsigned long long) cycle_frame );
+                    return -1;
+                }
+            } else {
+                jack_port_t *port = event->type == RENDER_CONTROL
+                    ? control_input
+                    : loop_get_input_port( render->loops[event->loop] );
+                stub_jack_port_push_event( port, offset, event->data, event->size );
+            }
+        }
+
+        while( segment_pool_available( render->segment_pool ) < RENDER_POOL_SEGMENTS ) {
+            struct LoopBufferSegment *segment = segment_pool_allocate( render->segment_pool );
+            if( segment == NULL ) {
+                break;
+            }
+            segment_pool_push( render->segment_pool, segment );
+        }
+
+        stub_jack_run_cycle( render->client );
+
+        for( int i = 0; i < render->loop_count; i++ ) {
+            while( loop_is_capturing( render->loops[i] ) ) {
+                struct timespec wait = { 0, RENDER_CAPTURE_WAIT_NS };
+                nanosleep( &wait, NULL );
+            }
+        }
+
+        for( int i = 0; i < render->track_count; i++ ) {
+            collect_track( render, &render->tracks[i], cycle_frame );
+        }
+    }
+    return 0;
+}
+
+static int write_tracks(
+    struct Render *render,
+    const char *output,
+    int merge,
+    jack_nframes_t sample_rate,
+    double beats_per_minute
+)
+{
+    for( int i = 0; i < render->track_count; i++ ) {
+        const struct RenderTrack *track = &render->tracks[i];
+
+        char *path = (char *) output;
+        if( !merge ) {
+            path = malloc( strlen( output ) + strlen( track->name ) + 6 );
+            if( path == NULL ) {
+                return -1;
+            }
+            sprintf( path, "%s/%s.mid", output, track->name );
+        }
+
+        int result = midi_file_write(
+            path,
+            track->events,
+            track->count,
+            (jack_nframes_t) render->end_frame,
+            sample_rate,
+            beats_per_minute
+        );
+        if( result != 0 ) {
+            fprintf( stderr, "Could not write %s.\n", path );
+        }
+        if( !merge ) {
+            free( path );
+        }
+        if( result != 0 ) {
+            return result;
+        }
+    }
+    return 0;
+}
+
+int main( int argc, char *argv[] )
+{
+    const char *session_path = NULL;
+    unsigned long sample_rate = RENDER_DEFAULT_SAMPLE_RATE;
+    unsigned long period = RENDER_DEFAULT_PERIOD;
+    double beats_per_minute = MIDI_FILE_DEFAULT_BPM;
+    int merge = 0;
+
+    int opt;
+    while( ( opt = getopt( argc, argv, "s:r:p:t:m" ) ) != -1 ) {
+        switch( opt ) {
+            case 's': session_path = optarg; break;
+            case 'r': sample_rate = strtoul( optarg, NULL, 10 ); break;
+            case 'p': period = strtoul( optarg, NULL, 10 ); break;
+            case 't': beats_per_minute = atof( optarg ); break;
+            case 'm': merge = 1; break;
+            default: usage( argv[0] ); return 1;
+        }
+    }
+    if( argc - optind != 2 || sample_rate == 0 || period == 0 || beats_per_minute <= 0 ) {
+        usage( argv[0] );
+        return 1;
+    }
+    const char *script_path = argv[optind];
+    const char *output = argv[optind + 1];
+
+    if( rt_log_init() != 0 ) {
+        fprintf( stderr, "Could not create the RT error log.\n" );
+        return 1;
+    }
+
+    // Offline, so there's no call to lock the input history.
+    if( capture_ring_init( CAPTURE_RING_DEFAULT_MESSAGES, 0 ) != 0 ) {
+        fprintf( stderr, "Could not start the capture thread.\n" );
+        return 1;
+    }
+
+    struct Render render = { 0 };
+    render.client = stub_jack_client_new( sample_rate, period );
+    render.engine = render.client ? engine_new( render.client ) : NULL;
+    render.segment_pool = segment_pool_new( RENDER_POOL_SEGMENTS / 4, RENDER_POOL_SEGMENTS );
+    render.table = control_action_table_new( NULL );
+    if( render.engine == NULL || render.segment_pool == NULL || render.table == NULL ) {
+        fprintf( stderr, "Could not set up the engine.\n" );
+        return 1;
+    }
+    jack_set_process_callback( render.client, process, render.engine );
+
+    int result = 0;
+    if( session_path ) {
+        Loop *loops;
+        int loop_count;
+        result = session_load(
+            session_path,
+            render.client,
+            render.segment_pool,
+            0,
+            render.table,
+            sample_rate,
+            &loops,
+            &loop_count
+        );
+        if( result != 0 || loop_count > RENDER_MAX_LOOPS ) {
+            fprintf( stderr, "Could not load %s.\n", session_path );
+            return 1;
+        }
+        memcpy( render.loops, loops, loop_count * sizeof( Loop ) );
+        render.loop_count = loop_count;
+        free( loops );
+    }
+
+    if( read_script( &render, script_path ) != 0 ) {
+        return 1;
+    }
+
+    // Merged, every loop plays onto the shared output, and the engine does the merging.
+    render.track_count = merge ? 1 : render.loop_count;
+    render.tracks = calloc( render.track_count ? render.track_count : 1, sizeof( struct RenderTrack ) );
+    if( merge ) {
+        render.tracks[0].port = stub_jack_port_by_name( render.client, "shared output" );
+        render.tracks[0].name = output;
+        for( int i = 0; i < render.loop_count; i++ ) {
+            loop_set_output_target( render.loops[i], OUTPUT_BUS_KEEP_CHANNEL );
+        }
+    } else {
+        for( int i = 0; i < render.loop_count; i++ ) {
+            render.tracks[i].port = loop_get_output_port( render.loops[i] );
+            render.tracks[i].name = loop_get_name( render.loops[i] );
+        }
+    }
+
+    // The engine owns what it's given.
+    Loop *published = malloc( ( render.loop_count ? render.loop_count : 1 ) * sizeof( Loop ) );
+    memcpy( published, render.loops, render.loop_count * sizeof( Loop ) );
+    engine_publish( render.engine, published, render.loop_count, control_dispatch_build( render.table ) );
+    rt_log_start_drain( name_loop, print_rt_error, &render );
+
+    uint64_t start = clock_ns();
+    result = run_cycles( &render, period );
+    uint64_t elapsed = clock_ns() - start;
+
+    rt_log_stop_drain();
+
+    if( result == 0 ) {
+        result = write_tracks( &render, output, merge, sample_rate, beats_per_minute );
+    }
+    if( result == 0 ) {
+        size_t written = 0;
+        for( int i = 0; i < render.track_count; i++ ) {
+            written += render.tracks[i].count;
+        }
+        double seconds = (double) render.end_frame / sample_rate;
+        printf(
+            "Rendered %.1f s of %d loops in %.3f s (%.0fx real time): %zu events to %d files, %zu left out.\n",
+            seconds,
+            render.loop_count,
+            elapsed / 1e9,
+            elapsed ? seconds * 1e9 / elapsed : 0.0,
+            written,
+            render.track_count,
+            render.skipped
+        );
+    }
+
+    engine_free( render.engine );
+
+    // Unlinks itself from the loops, so it has to go first.
+    control_action_table_free( render.table );
+
+    for( int i = 0; i < render.loop_count; i++ ) {
+        char *name = (char *) loop_get_name( render.loops[i] );
+        loop_free( render.loops[i] );
+        free( name );
+    }
+    for( int i = 0; i < render.track_count; i++ ) {
+        free( render.tracks[i].events );
+    }
+    free( render.tracks );
+    free( render.events );
+
+    segment_pool_free( render.segment_pool );
+    stub_jack_client_free( render.client );
+    capture_ring_close();
+    rt_log_close();
+    return result != 0;
+}
@@ -0,0 +1,769 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+/* Feeds a trace (see trace.h) back through the engine against stub_jack.c,
+   cycle by cycle on the traced frame clock, checking that every cycle plays
+   what it played live and timing each one.  Shedding is left off, since it
+   depends on timing, so cycles that shed live are only flagged. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <jack/jack.h>
+#include <jack/midiport.h>
+
+#include "capture_ring.h"
+#include "control_action_table.h"
+#include "control_dispatch.h"
+#include "engine.h"
+#include "loop.h"
+#include "loop_buffer.h"
+#include "rt_log.h"
+#include "segment_pool.h"
+#include "stub_jack.h"
+#include "trace.h"
+
+// As for rendering, topped up between cycles so that the loops never find it dry.
+#define REPLAY_POOL_SEGMENTS 64
+
+#define REPLAY_CAPTURE_WAIT_NS 100000
+
+// Cycles that didn't match that are worth a line each.
+#define REPLAY_REPORTED_MISMATCHES 10
+
+#define REPLAY_SLOWEST_CYCLES 5
+
+struct ReplayLoop {
+    unsigned int traced_id;
+    Loop loop;
+    int keep; // Scratch, while publishing.
+};
+
+// A take from the trace, waiting on its loop or on the next cycle.
+struct ReplayTake {
+    unsigned int traced_id;
+    enum TraceTakeKind kind;
+    const struct TraceTake *take;
+};
+
+struct ReplayCycle {
+    uint64_t frame;
+    uint32_t live_ns;
+    uint32_t replay_ns;
+    int matched;
+    int shed;
+};
+
+struct Replay {
+    jack_client_t *client;
+    jack_nframes_t period;
+    Engine engine;
+    SegmentPool segment_pool;
+    ControlActionTable table;
+    jack_port_t *control_input;
+    jack_port_t *shared_input;
+    jack_port_t *shared_output;
+
+    struct ReplayLoop *loops;
+    int loop_count;
+    size_t loop_capacity;
+
+    const struct TraceLoops *latest;    // Published at the next snapshot marker.
+    const struct TraceLoops *published;
+
+    struct ReplayTake *restored;        // Until their loops turn up.
+    size_t restored_count;
+    size_t restored_capacity;
+    struct ReplayTake *offered;         // Until the next cycle.
+    size_t offered_count;
+    size_t offered_capacity;
+
+    struct ReplayCycle *cycles;
+    size_t cycle_count;
+    size_t cycle_capacity;
+    size_t mismatches;
+    int in_cycle;
+};
+
+static void usage( const char *program )
+{
+    fprintf(
+        stderr,
+        "Usage: %s [options] trace\n"
+        "  -w n     engine workers, however many CPUs there are (default 0)\n"
+        "  -o path  write \"frame live_ns replay_ns matched shed\" for every cycle to path\n",
+        program
+    );
+}
+
+static uint64_t clock_ns( void )
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int grow( void **array, size_t count, size_t *capacity, size_t size )
+{
+    if( count < *capacity ) {
+        return 0;
+    }
+    size_t new_capacity = *capacity ? *capacity * 2 : 64;
+    void *grown = realloc( *array, new_capacity * size );
+    if( grown == NULL ) {
+        return -1;
+    }
+    *array = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+/* ----------------------------------------------------
+   Loops
+   ---------------------------------------------------- */
+
+static struct ReplayLoop *find_loop( struct Replay *replay, unsigned int traced_id )
+{
+    for( int i = 0; i < replay->loop_count; i++ ) {
+        if( replay->loops[i].traced_id == traced_id ) {
+            return &replay->loops[i];
+        }
+    }
+    return NULL;
+}
+
+static const struct TraceLoop *block_loops( const struct TraceLoops *block )
+{
+    return (const struct TraceLoop *) ( block + 1 );
+}
+
+static const struct TraceMapping *block_mappings( const struct TraceLoops *block )
+{
+    return (const struct TraceMapping *) ( block_loops( block ) + block->count );
+}
+
+static const char *block_names( const struct TraceLoops *block )
+{
+    return (const char *) ( block_mappings( block ) + block->mapping_count );
+}
+
+static void free_loop( struct ReplayLoop *loop )
+{
+    char *name = (char *) loop_get_name( loop->loop );
+    loop_free( loop->loop );
+    free( name );
+}
+
+// Restored before it's published, as the looper does when loading a session.
+static void restore_take( struct Replay *replay, struct ReplayLoop *loop )
+{
+    for( size_t i = 0; i < replay->restored_count; i++ ) {
+        const struct ReplayTake *restored = &replay->restored[i];
+        if( restored->traced_id != loop->traced_id ) {
+            continue;
+        }
+
+        const struct TraceTake *take = restored->take;
+        struct LoopTake info = { take->length, take->sync_offset };
+        int playing = restored->kind == TRACE_TAKE_RESTORED_PLAYING;
+        if( loop_restore_take( loop->loop, (const struct PackedMidiMessage *) ( take + 1 ), take->count, &info, playing ) != 0 ) {
+            fprintf( stderr, "Could not restore the take of %s.\n", loop_get_name( loop->loop ) );
+        }
+
+        replay->restored[i] = replay->restored[--replay->restored_count];
+        return;
+    }
+}
+
+// Brings the loops into line with a block from the trace, short of publishing them.
+static int apply_loops( struct Replay *replay, const struct TraceLoops *block, size_t size )
+{
+    if(
+        size < sizeof( *block )
+        || ( size - sizeof( *block ) ) / sizeof( struct TraceLoop ) < block->count
+        || ( size - sizeof( *block ) - block->count * sizeof( struct TraceLoop ) ) / sizeof( struct TraceMapping )
+            < block->mapping_count
+    ) {
+        return -1;
+    }
+    size_t names_size = size - ( block_names( block ) - (const char *) block );
+
+    const struct TraceLoop *entries = block_loops( block );
+    for( uint32_t i = 0; i < block->count; i++ ) {
+        const struct TraceLoop *entry = &entries[i];
+        if( entry->name_offset >= names_size || memchr( block_names( block ) + entry->name_offset, '\0', names_size - entry->name_offset ) == NULL ) {
+            return -1;
+        }
+
+        struct ReplayLoop *loop = find_loop( replay, entry->id );
+        if( loop == NULL ) {
+            if( grow( (void **) &replay->loops, replay->loop_count, &replay->loop_capacity, sizeof( struct ReplayLoop ) ) != 0 ) {
+                return -1;
+            }
+
+            loop = &replay->loops[replay->loop_count];
+            char *name = strdup( block_names( block ) + entry->name_offset );
+            if(
+                name == NULL
+                || loop_new(
+                    &loop->loop,
+                    replay->client,
+                    name,
+                    entry->midi_through,
+                    entry->playback_after_recording,
+                    replay->segment_pool,
+                    0
+                ) != 0
+            ) {
+                free( name );
+                return -1;
+            }
+            loop->traced_id = entry->id;
+            replay->loop_count++;
+            restore_take( replay, loop );
+        }
+
+        loop_set_midi_through( loop->loop, entry->midi_through );
+        loop_set_playback_after_recording( loop->loop, entry->playback_after_recording );
+        loop_set_priority( loop->loop, entry->priority );
+        loop_set_quantize( loop->loop, entry->quantize );
+        loop_set_input_source( loop->loop, entry->input_source );
+        loop_set_output_target( loop->loop, entry->output_target );
+    }
+
+    // Once they're all there.
+    for( uint32_t i = 0; i < block->count; i++ ) {
+        struct ReplayLoop *master = entries[i].sync_master ? find_loop( replay, entries[i].sync_master ) : NULL;
+        loop_set_sync_master( find_loop( replay, entries[i].id )->loop, master ? master->loop : NULL );
+    }
+
+    replay->latest = block;
+    return 0;
+}
+
+/* Publishes the latest loops and their mappings, in the order the looper
+   published them, then frees whatever loops the looper had let go of. */
+static void publish( struct Replay *replay, unsigned int generation )
+{
+    const struct TraceLoops *block = generation ? replay->latest : NULL;
+
+    for( int i = 0; i < replay->loop_count; i++ ) {
+        replay->loops[i].keep = 0;
+    }
+
+    control_action_table_clear_mappings( replay->table );
+    if( block == NULL ) {
+        engine_publish( replay->engine, NULL, 0, NULL );
+    } else {
+        const struct TraceLoop *entries = block_loops( block );
+        Loop *loops = malloc( ( block->count ? block->count : 1 ) * sizeof( Loop ) );
+        for( uint32_t i = 0; i < block->count; i++ ) {
+            struct ReplayLoop *loop = find_loop( replay, entries[i].id );
+            loop->keep = 1;
+            loops[i] = loop->loop;
+        }
+
+        const struct TraceMapping *mappings = block_mappings( block );
+        for( uint32_t i = 0; i < block->mapping_count; i++ ) {
+            struct ReplayLoop *loop = find_loop( replay, mappings[i].loop_id );
+            if( loop == NULL || !loop->keep || mappings[i].action >= TRACE_ACTION_COUNT ) {
+                continue;
+            }
+            control_action_table_insert(
+                replay->table,
+                mappings[i].channel,
+                mappings[i].type,
+                mappings[i].value,
+                loop->loop,
+                TRACE_ACTIONS[mappings[i].action]
+            );
+        }
+
+        engine_publish( replay->engine, loops, block->count, control_dispatch_build( replay->table ) );
+    }
+    replay->published = block;
+
+    // The engine's done with them now.
+    for( int i = 0; i < replay->loop_count; ) {
+        if( replay->loops[i].keep ) {
+            i++;
+            continue;
+        }
+        free_loop( &replay->loops[i] );
+        replay->loops[i] = replay->loops[--replay->loop_count];
+    }
+}
+
+/* ----------------------------------------------------
+   Takes
+   ---------------------------------------------------- */
+
+static int apply_take( struct Replay *replay, const struct TraceRecord *record, const struct TraceTake *take )
+{
+    if(
+        record->value < sizeof( *take )
+        || ( record->value - sizeof( *take ) ) / sizeof( struct PackedMidiMessage ) < take->count
+    ) {
+        return -1;
+    }
+
+    struct ReplayTake entry = { record->id, record->arg, take };
+    switch( record->arg ) {
+        case TRACE_TAKE_RESTORED:
+        case TRACE_TAKE_RESTORED_PLAYING:
+            if( grow( (void **) &replay->restored, replay->restored_count, &replay->restored_capacity, sizeof( entry ) ) != 0 ) {
+                return -1;
+            }
+            replay->restored[replay->restored_count++] = entry;
+            break;
+        case TRACE_TAKE_OFFERED:
+            if( grow( (void **) &replay->offered, replay->offered_count, &replay->offered_capacity, sizeof( entry ) ) != 0 ) {
+                return -1;
+            }
+            replay->offered[replay->offered_count++] = entry;
+            break;
+        case TRACE_TAKE_WITHDRAWN:
+            // Turned away before a cycle came round, so it never reached the loop.
+            for( size_t i = replay->offered_count; i > 0; i-- ) {
+                if( replay->offered[i - 1].traced_id == record->id ) {
+                    memmove( &replay->offered[i - 1], &replay->offered[i], ( replay->offered_count - i ) * sizeof( entry ) );
+                    replay->offered_count--;
+                    break;
+                }
+            }
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+// Offers made since the last cycle, as the looper made them.
+static void offer_takes( struct Replay *replay )
+{
+    for( size_t i = 0; i < replay->offered_count; i++ ) {
+        const struct TraceTake *take = replay->offered[i].take;
+        struct ReplayLoop *loop = find_loop( replay, replay->offered[i].traced_id );
+        if( loop == NULL ) {
+            continue;
+        }
+
+        LoopBuffer buffer = loop_buffer_init( replay->segment_pool, 0 );
+        if(
+            loop_buffer_is_valid( buffer )
+            && loop_buffer_load_packed( buffer, (const struct PackedMidiMessage *) ( take + 1 ), take->count ) == 0
+        ) {
+            loop_offer_take( loop->loop, &buffer, take->length );
+        } else {
+            fprintf( stderr, "Could not offer a take to %s.\n", loop_get_name( loop->loop ) );
+        }
+
+        // Whichever take is left over.
+        loop_buffer_free( buffer );
+    }
+    replay->offered_count = 0;
+}
+
+/* ----------------------------------------------------
+   Cycles
+   ---------------------------------------------------- */
+
+static int begin_cycle( struct Replay *replay, const struct TraceRecord *record )
+{
+    if( record->id != replay->period ) {
+        fprintf(
+            stderr,
+            "The period changed to %u frames at frame %llu, which a replay can't follow.\n",
+            (unsigned int) record->id,
+            (unsigned long long) record->value
+        );
+        return -1;
+    }
+
+    offer_takes( replay );
+
+    stub_jack_begin_cycle( replay->client );
+    stub_jack_set_frame_time( replay->client, (jack_nframes_t) record->value );
+
+    if( grow( (void **) &replay->cycles, replay->cycle_count, &replay->cycle_capacity, sizeof( struct ReplayCycle ) ) != 0 ) {
+        return -1;
+    }
+    struct ReplayCycle *cycle = &replay->cycles[replay->cycle_count];
+    memset( cycle, 0, sizeof( *cycle ) );
+    cycle->frame = record->value;
+    replay->in_cycle = 1;
+    return 0;
+}
+
+static void push_event( struct Replay *replay, const struct TraceRecord *record, const void *data )
+{
+    const struct TraceEvent *event = (const struct TraceEvent *) record;
+    jack_port_t *port = NULL;
+    switch( record->type ) {
+        case TRACE_CONTROL_INPUT: port = replay->control_input; break;
+        case TRACE_SHARED_INPUT: port = replay->shared_input; break;
+        default: {
+            struct ReplayLoop *loop = find_loop( replay, record->id );
+            port = loop ? loop_get_input_port( loop->loop ) : NULL;
+            break;
+        }
+    }
+
+    if( port ) {
+        stub_jack_port_push_event( port, event->time, data, event->size );
+    }
+}
+
+static void queue_command( struct Replay *replay, const struct TraceRecord *record )
+{
+    struct ReplayLoop *loop = find_loop( replay, record->id );
+    if( loop == NULL ) {
+        return; // So never ran live either.
+    }
+
+    // The stub's clock converts back to exactly this frame.
+    jack_time_t when = jack_frames_to_time( replay->client, (jack_nframes_t) record->value );
+    if( engine_queue_command( replay->engine, loop_get_id( loop->loop ), record->arg, when ) != 0 ) {
+        fprintf( stderr, "Too many commands in the cycle at frame %llu.\n", (unsigned long long) record->value );
+    }
+}
+
+static void run_cycle( struct Replay *replay, const struct TraceRecord *end )
+{
+    while( segment_pool_available( replay->segment_pool ) < REPLAY_POOL_SEGMENTS ) {
+        struct LoopBufferSegment *segment = segment_pool_allocate( replay->segment_pool );
+        if( segment == NULL ) {
+            break;
+        }
+        segment_pool_push( replay->segment_pool, segment );
+    }
+
+    uint64_t start = clock_ns();
+    stub_jack_run_cycle( replay->client );
+    uint64_t elapsed = clock_ns() - start;
+
+    // Live, the capture thread is all but certain to have finished by the next cycle.
+    for( int i = 0; i < replay->loop_count; i++ ) {
+        while( loop_is_capturing( replay->loops[i].loop ) ) {
+            struct timespec wait = { 0, REPLAY_CAPTURE_WAIT_NS };
+            nanosleep( &wait, NULL );
+        }
+    }
+
+    uint64_t hash = trace_hash_port( 0, 0, replay->shared_output );
+    const struct TraceLoops *block = replay->published;
+    for( uint32_t i = 0; block && i < block->count; i++ ) {
+        unsigned int traced_id = block_loops( block )[i].id;
+        hash = trace_hash_port( hash, traced_id, loop_get_output_port( find_loop( replay, traced_id )->loop ) );
+    }
+
+    struct ReplayCycle *cycle = &replay->cycles[replay->cycle_count++];
+    cycle->live_ns = end->id;
+    cycle->replay_ns = elapsed > UINT32_MAX ? UINT32_MAX : elapsed;
+    cycle->matched = hash == end->value;
+    cycle->shed = end->arg;
+
+    if( !cycle->matched && replay->mismatches++ < REPLAY_REPORTED_MISMATCHES ) {
+        fprintf(
+            stderr,
+            "The cycle at frame %llu played something else%s.\n",
+            (unsigned long long) cycle->frame,
+            cycle->shed ? ", but it shed live" : ""
+        );
+    }
+    replay->in_cycle = 0;
+}
+
+// Returns non-zero if the trace couldn't be replayed to the end.
+static int replay_trace( struct Replay *replay, TraceReader reader )
+{
+    const struct TraceRecord *record;
+    const void *data;
+    while( ( record = trace_reader_next( reader, &data ) ) != NULL ) {
+        int result = 0;
+        switch( record->type ) {
+            case TRACE_LOOPS: result = apply_loops( replay, data, record->value ); break;
+            case TRACE_TAKE: result = apply_take( replay, record, data ); break;
+            case TRACE_CYCLE: result = begin_cycle( replay, record ); break;
+            case TRACE_GAP:
+                fprintf( stderr, "The trace lost %u cycles here, so the replay stops.\n", (unsigned int) record->id );
+                return -1;
+            default:
+                if( !replay->in_cycle ) {
+                    result = -1;
+                    break;
+                }
+                switch( record->type ) {
+                    case TRACE_SNAPSHOT: publish( replay, record->id ); break;
+                    case TRACE_TRANSPORT: stub_jack_put_transport( replay->client, record->id, data ); break;
+                    case TRACE_COMMAND: queue_command( replay, record ); break;
+                    case TRACE_CYCLE_END: run_cycle( replay, record ); break;
+                    default: push_event( replay, record, data ); break;
+                }
+                break;
+        }
+        if( result != 0 ) {
+            fprintf( stderr, "The trace doesn't make sense after %zu cycles.\n", replay->cycle_count );
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* ----------------------------------------------------
+   Report
+   ---------------------------------------------------- */
+
+struct ReplayTimes {
+    double mean;
+    uint32_t p99;
+    uint32_t max;
+};
+
+static int compare_ns( const void *a, const void *b )
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return ( x > y ) - ( x < y );
+}
+
+static void summarize( const struct ReplayCycle *cycles, size_t count, int live, uint32_t *scratch, struct ReplayTimes *times )
+{
+    double total = 0;
+    for( size_t i = 0; i < count; i++ ) {
+        scratch[i] = live ? cycles[i].live_ns : cycles[i].replay_ns;
+        total += scratch[i];
+    }
+    qsort( scratch, count, sizeof( uint32_t ), compare_ns );
+    times->mean = count ? total / count : 0;
+    times->p99 = count ? scratch[count * 99 / 100] : 0;
+    times->max = count ? scratch[count - 1] : 0;
+}
+
+static int compare_replay_ns( const void *a, const void *b )
+{
+    const struct ReplayCycle *x = a, *y = b;
+    return ( x->replay_ns < y->replay_ns ) - ( x->replay_ns > y->replay_ns );
+}
+
+static void report( struct Replay *replay, jack_nframes_t sample_rate, uint64_t elapsed )
+{
+    size_t count = replay->cycle_count, shed = 0;
+    for( size_t i = 0; i < count; i++ ) {
+        shed += replay->cycles[i].shed;
+    }
+
+    printf(
+        "Replayed %zu cycles (%.1f s) in %.3f s: %zu matched, %zu didn't.\n",
+        count,
+        (double) count * replay->period / sample_rate,
+        elapsed / 1e9,
+        count - replay->mismatches,
+        replay->mismatches
+    );
+    if( shed ) {
+        printf( "%zu cycles shed live, and never do in a replay.\n", shed );
+    }
+
+    uint32_t *scratch = malloc( ( count ? count : 1 ) * sizeof( uint32_t ) );
+    if( scratch == NULL || count == 0 ) {
+        free( scratch );
+        return;
+    }
+
+    struct ReplayTimes live, replayed;
+    summarize( replay->cycles, count, 1, scratch, &live );
+    summarize( replay->cycles, count, 0, scratch, &replayed );
+    free( scratch );
+    printf( "Per cycle (us):  mean      p99      max\n" );
+    printf( "  live      %8.1f %8.1f %8.1f\n", live.mean / 1e3, live.p99 / 1e3, live.max / 1e3 );
+    printf( "  replayed  %8.1f %8.1f %8.1f\n", replayed.mean / 1e3, replayed.p99 / 1e3, replayed.max / 1e3 );
+
+    // Sorted last, since the timings file is in frame order.
+    qsort( replay->cycles, count, sizeof( struct ReplayCycle ), compare_replay_ns );
+    printf( "Slowest replayed cycles:\n" );
+    for( size_t i = 0; i < count && i < REPLAY_SLOWEST_CYCLES; i++ ) {
+        const struct ReplayCycle *cycle = &replay->cycles[i];
+        printf(
+            "  frame %llu: %.1f us, %.1f us live%s\n",
+            (unsigned long long) cycle->frame,
+            cycle->replay_ns / 1e3,
+            cycle->live_ns / 1e3,
+            cycle->matched ? "" : ", didn't match"
+        );
+    }
+}
+
+static int write_timings( struct Replay *replay, const char *path )
+{
+    FILE *file = fopen( path, "w" );
+    if( file == NULL ) {
+        fprintf( stderr, "Could not open %s.\n", path );
+        return -1;
+    }
+    for( size_t i = 0; i < replay->cycle_count; i++ ) {
+        const struct ReplayCycle *cycle = &replay->cycles[i];
+        fprintf(
+            file,
+            "%llu %u %u %d %d\n",
+            (unsigned long long) cycle->frame,
+            cycle->live_ns,
+            cycle->replay_ns,
+            cycle->matched,
+            cycle->shed
+        );
+    }
+    return fclose( file ) == 0 ? 0 : -1;
+}
+
+/* ----------------------------------------------------
+   Main
+   ---------------------------------------------------- */
+
+static int name_loop( unsigned int loop_id, char *name_out, size_t size, void *user_data )
+{
+    struct Replay *replay = user_data;
+    for( int i = 0; i < replay->loop_count; i++ ) {
+        if( loop_get_id( replay->loops[i].loop ) == loop_id ) {
+            snprintf( name_out, size, "%s", loop_get_name( replay->loops[i].loop ) );
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void print_rt_error( const char *message, void *user_data )
+{
+    fprintf( stderr, "%s\n", message );
+}
+
+static int process( jack_nframes_t nframes, void *arg )
+{
+    return engine_process( arg, nframes );
+}
+
+// The stub client has to have the trace's period before there are any loops to register.
+static int first_period( const char *path, jack_nframes_t *period )
+{
+    jack_nframes_t sample_rate;
+    TraceReader reader = trace_reader_open( path, &sample_rate );
+    if( reader == NULL ) {
+        return -1;
+    }
+
+    const struct TraceRecord *record;
+    const void *data;
+    while( ( record = trace_reader_next( reader, &data ) ) != NULL && record->type != TRACE_CYCLE ) {
+    }
+    if( record ) {
+        *period = record->id;
+    }
+    trace_reader_close( reader );
+    return record ? 0 : -1;
+}
+
+int main( int argc, char *argv[] )
+{
+    int workers = 0;
+    const char *timings_path = NULL;
+
+    int opt;
+    while( ( opt = getopt( argc, argv, "w:o:" ) ) != -1 ) {
+        switch( opt ) {
+            case 'w': workers = atoi( optarg ); break;
+            case 'o': timings_path = optarg; break;
+            default: usage( argv[0] ); return 1;
+        }
+    }
+    if( argc - optind != 1 ) {
+        usage( argv[0] );
+        return 1;
+    }
+    const char *trace_path = argv[optind];
+
+    struct Replay replay = { 0 };
+    jack_nframes_t sample_rate;
+    TraceReader reader = trace_reader_open( trace_path, &sample_rate );
+    if( reader == NULL || sample_rate == 0 || first_period( trace_path, &replay.period ) != 0 || replay.period == 0 ) {
+        fprintf( stderr, "%s isn't a trace with any cycles in it.\n", trace_path );
+        return 1;
+    }
+
+    if( rt_log_init() != 0 ) {
+        fprintf( stderr, "Could not create the RT error log.\n" );
+        return 1;
+    }
+
+    // Offline, so there's no call to lock the input history.
+    if( capture_ring_init( CAPTURE_RING_DEFAULT_MESSAGES, 0 ) != 0 ) {
+        fprintf( stderr, "Could not start the capture thread.\n" );
+        return 1;
+    }
+
+    // Shedding's off by default, which is what makes the replay repeatable.
+    replay.client = stub_jack_client_new( sample_rate, replay.period );
+    replay.engine = replay.client ? engine_new( replay.client ) : NULL;
+    replay.segment_pool = segment_pool_new( REPLAY_POOL_SEGMENTS / 4, REPLAY_POOL_SEGMENTS );
+    replay.table = control_action_table_new( NULL );
+    if( replay.engine == NULL || replay.segment_pool == NULL || replay.table == NULL ) {
+        fprintf( stderr, "Could not set up the engine.\n" );
+        return 1;
+    }
+    jack_set_process_callback( replay.client, process, replay.engine );
+    if( engine_set_workers( replay.engine, workers, 1 ) < workers ) {
+        fprintf( stderr, "Replaying on fewer than %d engine workers.\n", workers );
+    }
+    replay.control_input = stub_jack_port_by_name( replay.client, "control input" );
+    replay.shared_input = stub_jack_port_by_name( replay.client, "shared input" );
+    replay.shared_output = stub_jack_port_by_name( replay.client, "shared output" );
+    rt_log_start_drain( name_loop, print_rt_error, &replay );
+
+    uint64_t start = clock_ns();
+    int result = replay_trace( &replay, reader );
+    uint64_t elapsed = clock_ns() - start;
+
+    rt_log_stop_drain();
+
+    if( timings_path && write_timings( &replay, timings_path ) != 0 ) {
+        result = -1;
+    }
+    report( &replay, sample_rate, elapsed );
+
+    engine_free( replay.engine );
+
+    // Unlinks itself from the loops, so it has to go first.
+    control_action_table_free( replay.table );
+    for( int i = 0; i < replay.loop_count; i++ ) {
+        free_loop( &replay.loops[i] );
+    }
+    free( replay.loops );
+    free( replay.restored );
+    free( replay.offered );
+    free( replay.cycles );
+    trace_reader_close( reader );
+
+    segment_pool_free( replay.segment_pool );
+    stub_jack_client_free( replay.client );
+    capture_ring_close();
+    rt_log_close();
+    return result != 0 || replay.mismatches != 0;
+}
@@ -0,0 +1,270 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "rt_log.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <jack/ringbuffer.h>
+
+#define RT_LOG_RING_RECORDS         256
+#define RT_LOG_DRAIN_INTERVAL_NS    50000000
+#define RT_LOG_REPEAT_WINDOW_NS     1000000000LL
+#define RT_LOG_RECENT_COUNT         32
+
+static const char *messages[RT_LOG_CODE_COUNT] = {
+    "JACK MIDI event get failed on %s (event %d)",
+    "Ignoring MIDI message longer than three bytes on %s, probably a SysEx (event %d)",
+    "Failed to get %s port buffer",
+    "jack_port_get_buffer failed for %s, cannot receive anything",
+    "Couldn't get output buffer for loop %s",
+    "Couldn't write to the output buffer for %s, NOTE LOST",
+    "Not enough space in the %s state schedule, CHANGE LOST",
+    "Loop buffer full in loop %s, event dropped (code %d)",
+    "Command for loop %s arrived %d frames late, dropped",
+    "Too many events on %s this cycle, %d dropped",
+    "Message on %s doesn't match the length of its status %d, event dropped"
+};
+
+// Repeats of these get held back rather than published.
+struct RecentMessage {
+    enum RtLogCode code;
+    unsigned int loop_id;
+    long long published_at;
+    unsigned int held_back;
+};
+
+static jack_ringbuffer_t *ring = NULL;
+static char ring_writer = 0; // Spun on, since loops may log from several threads at once.
+static jack_nframes_t current_cycle_time = 0;
+static unsigned int dropped = 0;
+
+static pthread_t drain_thread;
+static int draining = 0, quit = 0;
+static RtLogLoopNamer drain_namer;
+static RtLogPublisher drain_publisher;
+static void *drain_user_data;
+
+static struct RecentMessage recent[RT_LOG_RECENT_COUNT];
+static int recent_next = 0;
+
+int rt_log_init( void )
+{
+    ring = jack_ringbuffer_create( RT_LOG_RING_RECORDS * sizeof( struct RtLogRecord ) );
+    if( ring == NULL ) {
+        return -10;
+    }
+
+    jack_ringbuffer_mlock( ring );
+    return 0;
+}
+
+void rt_log_close( void )
+{
+    rt_log_stop_drain();
+    jack_ringbuffer_free( ring );
+    ring = NULL;
+}
+
+void rt_log_begin_cycle( jack_nframes_t cycle_time )
+{
+    current_cycle_time = cycle_time;
+}
+
+void rt_log( enum RtLogCode code, unsigned int loop_id, jack_nframes_t time, int arg )
+{
+    struct RtLogRecord record = {
+        .code = code,
+        .loop_id = loop_id,
+        .cycle_time = current_cycle_time,
+        .time = time,
+        .arg = arg
+    };
+
+    if( ring == NULL ) {
+        __atomic_add_fetch( &dropped, 1, __ATOMIC_RELAXED );
+        return;
+    }
+
+    while( __atomic_test_and_set( &ring_writer, __ATOMIC_ACQUIRE ) ) {
+    }
+
+    if( jack_ringbuffer_write_space( ring ) < sizeof( record ) ) {
+        __atomic_add_fetch( &dropped, 1, __ATOMIC_RELAXED );
+    } else {
+        jack_ringbuffer_write( ring, (char *) &record, sizeof( record ) );
+    }
+
+    __atomic_clear( &ring_writer, __ATOMIC_RELEASE );
+}
+
+void rt_log_format(
+        const struct RtLogRecord *record,
+        const char *loop_name,
+        char *out,
+        size_t size
+    ) {
+
+    int written = snprintf(
+        out,
+        size,
+        "[frame %u] ",
+        record->cycle_time + record->time
+    );
+
+    if( written < 0 || (size_t) written >= size ) {
+        return;
+    }
+
+    if( record->code < RT_LOG_CODE_COUNT ) {
+        snprintf( out + written, size - written, messages[record->code], loop_name, record->arg );
+    } else {
+        snprintf( out + written, size - written, "Unknown error %d", record->code );
+    }
+}
+
+static long long monotonic_ns( void )
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Returns how many repeats were held back since the last one published, or -1 to hold this one back.
+static int check_repeat( const struct RtLogRecord *record, long long now )
+{
+    for( int i = 0; i < RT_LOG_RECENT_COUNT; i++ ) {
+        struct RecentMessage *message = &recent[i];
+        if(
+            message->published_at
+            && message->code == record->code
+            && message->loop_id == record->loop_id
+        ) {
+            if( now - message->published_at < RT_LOG_REPEAT_WINDOW_NS ) {
+                message->held_back++;
+                return -1;
+            }
+
+            int held_back = message->held_back;
+            message->published_at = now;
+            message->held_back = 0;
+            return held_back;
+        }
+    }
+
+    // Not seen recently, so it takes the oldest slot.
+    struct RecentMessage *slot = &recent[recent_next];
+    recent_next = ( recent_next + 1 ) % RT_LOG_RECENT_COUNT;
+    slot->code = record->code;
+    slot->loop_id = record->loop_id;
+    slot->published_at = now;
+    slot->held_back = 0;
+    return 0;
+}
+
+static void publish( const char *message )
+{
+    fprintf( stderr, "%s\n", message );
+    drain_publisher( message, drain_user_data );
+}
+
+static void drain( void )
+{
+    struct RtLogRecord record;
+    char loop_name[64];
+    char message[256];
+    long long now = monotonic_ns();
+
+    while(
+        jack_ringbuffer_read_space( ring ) >= sizeof( record )
+        && jack_ringbuffer_read( ring, (char *) &record, sizeof( record ) ) == sizeof( record )
+    ) {
+        int held_back = check_repeat( &record, now );
+        if( held_back < 0 ) {
+            continue;
+        }
+
+        if( record.loop_id == RT_LOG_NO_LOOP ) {
+            strcpy( loop_name, "control input" );
+        } else if( record.loop_id == RT_LOG_SHARED_INPUT ) {
+            strcpy( loop_name, "shared input" );
+        } else if( record.loop_id == RT_LOG_SHARED_OUTPUT ) {
+            strcpy( loop_name, "shared output" );
+        } else if( drain_namer( record.loop_id, loop_name, sizeof( loop_name ), drain_user_data ) != 0 ) {
+            snprintf( loop_name, sizeof( loop_name ), "(deleted loop %u)", record.loop_id );
+        }
+
+        rt_log_format( &record, loop_name, message, sizeof( message ) );
+        if( held_back > 0 ) {
+            size_t length = strlen( message );
+            snprintf( message + length, sizeof( message ) - length, " (repeated %d times)", held_back );
+        }
+
+        publish( message );
+    }
+
+    unsigned int lost = __atomic_exchange_n( &dropped, 0, __ATOMIC_RELAXED );
+    if( lost ) {
+        snprintf( message, sizeof( message ), "Error log overflowed, %u records lost", lost );
+        publish( message );
+    }
+}
+
+static void *drain_thread_main( void *arg )
+{
+    struct timespec interval = { 0, RT_LOG_DRAIN_INTERVAL_NS };
+
+    while( !__atomic_load_n( &quit, __ATOMIC_ACQUIRE ) ) {
+        nanosleep( &interval, NULL );
+        drain();
+    }
+
+    return NULL;
+}
+
+int rt_log_start_drain( RtLogLoopNamer namer, RtLogPublisher publisher, void *user_data )
+{
+    if( ring == NULL || draining ) {
+        return -10;
+    }
+
+    drain_namer = namer;
+    drain_publisher = publisher;
+    drain_user_data = user_data;
+    quit = 0;
+
+    if( pthread_create( &drain_thread, NULL, drain_thread_main, NULL ) != 0 ) {
+        return -20;
+    }
+
+    draining = 1;
+    return 0;
+}
+
+void rt_log_stop_drain( void )
+{
+    if( draining ) {
+        __atomic_store_n( &quit, 1, __ATOMIC_RELEASE );
+        pthread_join( drain_thread, NULL );
+        draining = 0;
+    }
+}
@@ -0,0 +1,85 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#ifndef RT_LOG_H
+#define RT_LOG_H
+
+#include <stddef.h>
+
+#include <jack/jack.h>
+
+/* Error reporting for the process thread, which mustn't go anywhere near
+   stdio.  rt_log only copies a fixed-size record into a ring, under a spin
+   lock held for just that copy so that engine workers can log too; a drain
+   thread does all of the formatting later. */
+
+enum RtLogCode {
+    RT_LOG_EVENT_GET_FAILED = 0
+    , RT_LOG_SYSEX_IGNORED
+    , RT_LOG_CONTROL_BUFFER
+    , RT_LOG_INPUT_BUFFER
+    , RT_LOG_OUTPUT_BUFFER
+    , RT_LOG_OUTPUT_WRITE
+    , RT_LOG_STATE_BUFFER_FULL
+    , RT_LOG_LOOP_BUFFER_FULL
+    , RT_LOG_COMMAND_LATE
+    , RT_LOG_INPUT_DROPPED
+    , RT_LOG_UNPACKABLE
+    , RT_LOG_CODE_COUNT
+};
+
+// For records that aren't about any particular loop.
+#define RT_LOG_NO_LOOP 0
+
+// For records about the engine's shared input and output buses, which no loop can have as its id.
+#define RT_LOG_SHARED_INPUT ( (unsigned int) -1 )
+#define RT_LOG_SHARED_OUTPUT ( (unsigned int) -2 )
+
+struct RtLogRecord {
+    enum RtLogCode code;
+    unsigned int loop_id;
+    jack_nframes_t cycle_time; // jack_last_frame_time for the cycle.
+    jack_nframes_t time;       // Offset into the cycle.
+    int arg;
+};
+
+// Given a loop id, writes its name into name_out, returning 0 if it was found.
+typedef int (*RtLogLoopNamer)( unsigned int loop_id, char *name_out, size_t size, void *user_data );
+typedef void (*RtLogPublisher)( const char *message, void *user_data );
+
+// Not RT.  Without these, rt_log just counts records as dropped.
+int rt_log_init( void );
+void rt_log_close( void );
+
+// RT.
+void rt_log_begin_cycle( jack_nframes_t cycle_time );
+void rt_log( enum RtLogCode code, unsigned int loop_id, jack_nframes_t time, int arg );
+
+/* Not RT.  Starts a thread that drains the ring, formats each record and hands
+   it to the publisher, holding back repeats of the same code for the same loop
+   that arrive within a second of each other. */
+int rt_log_start_drain( RtLogLoopNamer namer, RtLogPublisher publisher, void *user_data );
+void rt_log_stop_drain( void );
+
+void rt_log_format(
+    const struct RtLogRecord *record,
+    const char *loop_name,
+    char *out,
+    size_t size
+);
+
+#endif
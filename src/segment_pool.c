@@ -0,0 +1,319 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "segment_pool.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <jack/ringbuffer.h>
+
+/* Segments are carved out of slabs: blocks aligned to their own size, so a
+   segment can find its slab, and locked in memory as a whole.  mlock doesn't
+   nest, so a slab is only unlocked once none of its segments are in use,
+   and no other memory ever shares its pages. */
+#define SEGMENT_POOL_SLAB_BYTES 65536
+
+struct SegmentSlab {
+    struct SegmentSlab *next; // Among the slabs with free segments.
+    struct SegmentSlab **prev;
+    struct LoopBufferSegment *free_segments;
+    size_t in_use;
+};
+
+#define SEGMENT_POOL_SLAB_SEGMENTS \
+    ( ( SEGMENT_POOL_SLAB_BYTES - sizeof( struct SegmentSlab ) ) / sizeof( struct LoopBufferSegment ) )
+
+struct segment_pool_type {
+    size_t low_watermark;
+    size_t high_watermark;
+
+    /* Holds segment pointers.  Every writer (the allocator thread,
+       segment_pool_push) takes the mutex; readers are RT, so they spin on
+       consumer_lock instead, which is only ever held for one pop. */
+    jack_ringbuffer_t *segments;
+    pthread_mutex_t producer_lock;
+    char consumer_lock;
+
+    // Posted by the process thread when the pool drops below the low watermark.
+    sem_t refill;
+    int refill_requested;
+
+    pthread_t allocator;
+    int quit;
+
+    // Not RT, so a plain mutex.
+    pthread_mutex_t slab_lock;
+    struct SegmentSlab *slabs;
+};
+
+static void *allocator_thread( void *arg );
+static void refill( struct segment_pool_type *this );
+static void release_segment( struct segment_pool_type *this, struct LoopBufferSegment *segment );
+
+struct segment_pool_type *segment_pool_new( size_t low_watermark, size_t high_watermark )
+{
+    struct segment_pool_type *this = malloc( sizeof( *this ) );
+    if( this == NULL ) {
+        return NULL;
+    }
+
+    if( high_watermark < low_watermark ) {
+        high_watermark = low_watermark;
+    }
+
+    this->low_watermark = low_watermark;
+    this->high_watermark = high_watermark;
+    this->refill_requested = 0;
+    this->quit = 0;
+    this->consumer_lock = 0;
+
+    this->segments = jack_ringbuffer_create(
+        ( high_watermark + 1 ) * sizeof( struct LoopBufferSegment * )
+    );
+    if( this->segments == NULL ) {
+        free( this );
+        return NULL;
+    }
+    jack_ringbuffer_mlock( this->segments );
+
+    pthread_mutex_init( &this->producer_lock, NULL );
+    pthread_mutex_init( &this->slab_lock, NULL );
+    this->slabs = NULL;
+    sem_init( &this->refill, 0, 0 );
+
+    // Start out full, so nobody has to wait for the allocator thread.
+    refill( this );
+
+    if( pthread_create( &this->allocator, NULL, allocator_thread, this ) != 0 ) {
+        fprintf( stderr, "Could not start the segment allocator thread.\n" );
+        this->quit = 1; // Nothing to join.
+        segment_pool_free( this );
+        return NULL;
+    }
+
+    return this;
+}
+
+void segment_pool_free( struct segment_pool_type *this )
+{
+    if( this ) {
+        if( !this->quit ) {
+            __atomic_store_n( &this->quit, 1, __ATOMIC_RELEASE );
+            sem_post( &this->refill );
+            pthread_join( this->allocator, NULL );
+        }
+
+        struct LoopBufferSegment *segment;
+        while(
+            jack_ringbuffer_read( this->segments, (char *) &segment, sizeof( segment ) )
+            == sizeof( segment )
+        ) {
+            release_segment( this, segment );
+        }
+
+        // Any slab still left holds segments that were never handed back.
+        jack_ringbuffer_free( this->segments );
+        sem_destroy( &this->refill );
+        pthread_mutex_destroy( &this->producer_lock );
+        pthread_mutex_destroy( &this->slab_lock );
+        free( this );
+    }
+}
+
+static void link_slab( struct segment_pool_type *this, struct SegmentSlab *slab )
+{
+    slab->next = this->slabs;
+    slab->prev = &this->slabs;
+    if( this->slabs ) {
+        this->slabs->prev = &slab->next;
+    }
+    this->slabs = slab;
+}
+
+static void unlink_slab( struct SegmentSlab *slab )
+{
+    *( slab->prev ) = slab->next;
+    if( slab->next ) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+static struct SegmentSlab *new_slab( void )
+{
+    void *block;
+    if( posix_memalign( &block, SEGMENT_POOL_SLAB_BYTES, SEGMENT_POOL_SLAB_BYTES ) != 0 ) {
+        return NULL;
+    }
+    // The whole point is for the process thread never to page fault on these.
+    mlock( block, SEGMENT_POOL_SLAB_BYTES );
+
+    struct SegmentSlab *slab = block;
+    struct LoopBufferSegment *segments = (struct LoopBufferSegment *) ( slab + 1 );
+    slab->free_segments = NULL;
+    slab->in_use = 0;
+    for( size_t i = SEGMENT_POOL_SLAB_SEGMENTS; i > 0; i-- ) {
+        segments[i - 1].next = slab->free_segments;
+        slab->free_segments = &( segments[i - 1] );
+    }
+    return slab;
+}
+
+struct LoopBufferSegment *segment_pool_allocate( struct segment_pool_type *this )
+{
+    pthread_mutex_lock( &this->slab_lock );
+
+    struct SegmentSlab *slab = this->slabs;
+    if( slab == NULL ) {
+        slab = new_slab();
+        if( slab == NULL ) {
+            pthread_mutex_unlock( &this->slab_lock );
+            return NULL;
+        }
+        link_slab( this, slab );
+    }
+
+    struct LoopBufferSegment *segment = slab->free_segments;
+    slab->free_segments = segment->next;
+    slab->in_use++;
+    if( slab->free_segments == NULL ) {
+        unlink_slab( slab );
+    }
+
+    pthread_mutex_unlock( &this->slab_lock );
+
+    memset( segment, 0, sizeof( *segment ) );
+    return segment;
+}
+
+// Back to its slab, which goes altogether once nothing in it is in use.
+static void release_segment( struct segment_pool_type *this, struct LoopBufferSegment *segment )
+{
+    struct SegmentSlab *slab = (struct SegmentSlab *) ( (uintptr_t) segment & ~(uintptr_t) ( SEGMENT_POOL_SLAB_BYTES - 1 ) );
+
+    pthread_mutex_lock( &this->slab_lock );
+
+    if( slab->free_segments == NULL ) {
+        link_slab( this, slab );
+    }
+    segment->next = slab->free_segments;
+    slab->free_segments = segment;
+    slab->in_use--;
+
+    if( slab->in_use == 0 ) {
+        unlink_slab( slab );
+        munlock( slab, SEGMENT_POOL_SLAB_BYTES );
+        free( slab );
+    }
+
+    pthread_mutex_unlock( &this->slab_lock );
+}
+
+struct LoopBufferSegment *segment_pool_pop( struct segment_pool_type *this, size_t *remaining )
+{
+    struct LoopBufferSegment *segment = NULL;
+
+    while( __atomic_test_and_set( &this->consumer_lock, __ATOMIC_ACQUIRE ) ) {
+    }
+
+    size_t read = jack_ringbuffer_read( this->segments, (char *) &segment, sizeof( segment ) );
+    if( read != sizeof( segment ) ) {
+        segment = NULL;
+    }
+
+    size_t available = jack_ringbuffer_read_space( this->segments ) / sizeof( segment );
+    __atomic_clear( &this->consumer_lock, __ATOMIC_RELEASE );
+    if( remaining ) {
+        *remaining = available;
+    }
+
+    if(
+        available < this->low_watermark
+        && !__atomic_load_n( &this->refill_requested, __ATOMIC_ACQUIRE )
+    ) {
+        __atomic_store_n( &this->refill_requested, 1, __ATOMIC_RELEASE );
+        sem_post( &this->refill ); // Async-signal-safe, so fine for RT.
+    }
+
+    if( segment ) {
+        segment->next = NULL;
+    }
+    return segment;
+}
+
+void segment_pool_push( struct segment_pool_type *this, struct LoopBufferSegment *segment )
+{
+    pthread_mutex_lock( &this->producer_lock );
+
+    size_t written = 0;
+    if( jack_ringbuffer_write_space( this->segments ) >= sizeof( segment ) ) {
+        written = jack_ringbuffer_write( this->segments, (char *) &segment, sizeof( segment ) );
+    }
+
+    pthread_mutex_unlock( &this->producer_lock );
+
+    if( written != sizeof( segment ) ) {
+        release_segment( this, segment );
+    }
+}
+
+size_t segment_pool_available( struct segment_pool_type *this )
+{
+    return jack_ringbuffer_read_space( this->segments ) / sizeof( struct LoopBufferSegment * );
+}
+
+static void refill( struct segment_pool_type *this )
+{
+    pthread_mutex_lock( &this->producer_lock );
+
+    while( segment_pool_available( this ) < this->high_watermark ) {
+        struct LoopBufferSegment *segment = segment_pool_allocate( this );
+        if( segment == NULL ) {
+            fprintf( stderr, "Segment allocation failed, pool left at %zu.\n", segment_pool_available( this ) );
+            break;
+        }
+
+        jack_ringbuffer_write( this->segments, (char *) &segment, sizeof( segment ) );
+    }
+
+    pthread_mutex_unlock( &this->producer_lock );
+}
+
+static void *allocator_thread( void *arg )
+{
+    struct segment_pool_type *this = arg;
+
+    for( ;; ) {
+        sem_wait( &this->refill );
+        if( __atomic_load_n( &this->quit, __ATOMIC_ACQUIRE ) ) {
+            break;
+        }
+
+        // Clear the request first, so a pop racing with the refill re-posts.
+        __atomic_store_n( &this->refill_requested, 0, __ATOMIC_RELEASE );
+        refill( this );
+    }
+
+    return NULL;
+}
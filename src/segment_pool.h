@@ -0,0 +1,52 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+   
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#ifndef SEGMENT_POOL_H
+#define SEGMENT_POOL_H
+
+#include <stddef.h>
+
+#include "midi_message.h"
+
+#define LOOP_BUFFER_SEGMENT_EVENTS 256
+
+struct LoopBufferSegment {
+    struct LoopBufferSegment *next;
+    jack_nframes_t start_time; // Of the message before events[0] in the take, for seeking.
+    struct PackedMidiMessage events[LOOP_BUFFER_SEGMENT_EVENTS];
+};
+
+/* A pool of ready-to-use loop buffer segments.  An allocator thread keeps it
+   topped up to the high watermark whenever it drops below the low one, so the
+   process thread only ever pops segments that already exist. */
+typedef struct segment_pool_type *SegmentPool;
+
+SegmentPool segment_pool_new( size_t low_watermark, size_t high_watermark );
+void segment_pool_free( SegmentPool this );
+
+// RT, from any number of threads.  Returns NULL if the pool has run dry, and the number of segments left.
+struct LoopBufferSegment *segment_pool_pop( SegmentPool this, size_t *remaining );
+
+// Not RT.  Hands a segment back, freeing it if the pool is already full.
+void segment_pool_push( SegmentPool this, struct LoopBufferSegment *segment );
+
+// Not RT.  Allocates a segment outside of the pool, for initializing buffers.
+struct LoopBufferSegment *segment_pool_allocate( SegmentPool this );
+
+size_t segment_pool_available( SegmentPool this );
+
+#endif
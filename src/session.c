@@ -0,0 +1,707 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "session.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "midi_message.h"
+
+static const char SESSION_MAGIC[8] = "JMLSESS";
+
+// Each table, and each take, starts on a cache line.
+#define SESSION_ALIGN 64
+
+struct SessionHeader {
+    char magic[8];
+    uint32_t version;
+
+    // A file laid out by some other build won't match these.
+    uint32_t header_size;
+    uint32_t loop_size;
+    uint32_t mapping_size;
+
+    uint32_t sample_rate; // That the takes were recorded at.
+    uint32_t loop_count;
+    uint32_t mapping_count;
+    uint32_t reserved;
+
+    // From the start of the file.
+    uint64_t loops_offset;
+    uint64_t mappings_offset;
+    uint64_t names_offset;
+    uint64_t names_size;
+    uint64_t file_size;
+};
+
+struct SessionLoop {
+    uint64_t events_offset; // The take's packed messages, from the start of the file.
+    uint64_t event_count;
+    uint32_t name_offset; // Into the names, each of which ends in a NUL.
+    int32_t sync_master; // Index into the loop table, or -1.
+    uint32_t length;
+    uint32_t sync_offset;
+    int32_t midi_through;
+    int32_t playback_after_recording;
+    int32_t priority;
+    int32_t quantize;
+    int32_t input_source;
+    int32_t output_target;
+    int32_t playing;
+    int32_t reserved;
+};
+
+struct SessionMapping {
+    uint32_t loop; // Index into the loop table.
+    uint8_t channel;
+    uint8_t type;
+    uint8_t value;
+    uint8_t action; // Index into SESSION_ACTIONS.
+};
+
+// The file stores actions by their place in here, so only ever add to the end.
+static const LoopControlFunc SESSION_ACTIONS[] = {
+    LOOP_CONTROL_FUNC_TOGGLE_PLAYBACK,
+    LOOP_CONTROL_FUNC_TOGGLE_RECORDING,
+    LOOP_CONTROL_FUNC_TOGGLE_OVERDUB,
+    LOOP_CONTROL_FUNC_TOGGLE_REPLACE,
+    LOOP_CONTROL_FUNC_CAPTURE
+};
+
+#define SESSION_ACTION_COUNT ( sizeof( SESSION_ACTIONS ) / sizeof( SESSION_ACTIONS[0] ) )
+
+static uint64_t align( uint64_t offset )
+{
+    return ( offset + SESSION_ALIGN - 1 ) & ~(uint64_t) ( SESSION_ALIGN - 1 );
+}
+
+/* ----------------------------------------------------
+   Saving
+   ---------------------------------------------------- */
+
+// One loop as it was when its take was copied.
+struct SavedLoop {
+    Loop loop;
+    struct PackedMidiMessage *events;
+    size_t event_count;
+    struct LoopTake take;
+    int playing;
+};
+
+// For finding a loop's index in the table from the loop.
+struct LoopIndex {
+    Loop loop;
+    int index;
+};
+
+static int compare_loop_index( const void *a, const void *b )
+{
+    const struct LoopIndex *x = a, *y = b;
+    return ( x->loop > y->loop ) - ( x->loop < y->loop );
+}
+
+static int find_loop_index( const struct LoopIndex *index, int loop_count, Loop loop )
+{
+    struct LoopIndex key = { .loop = loop };
+    const struct LoopIndex *found =
+        bsearch( &key, index, loop_count, sizeof( struct LoopIndex ), compare_loop_index );
+    return found ? found->index : -1;
+}
+
+struct PendingMappings {
+    const struct LoopIndex *index;
+    int loop_count;
+    struct SessionMapping *mappings; // NULL while counting.
+    int count;
+};
+
+static void collect_mapping(
+        unsigned char midi_channel,
+        enum MidiControlType midi_type,
+        unsigned char midi_value,
+        Loop loop,
+        LoopControlFunc action,
+        void *user_data
+    ) {
+
+    struct PendingMappings *pending = user_data;
+
+    int loop_index = find_loop_index( pending->index, pending->loop_count, loop );
+    unsigned int action_index = 0;
+    while( action_index < SESSION_ACTION_COUNT && SESSION_ACTIONS[action_index] != action ) {
+        action_index++;
+    }
+    if( loop_index < 0 || action_index == SESSION_ACTION_COUNT ) {
+        return;
+    }
+
+    if( pending->mappings ) {
+        struct SessionMapping *mapping = &( pending->mappings[pending->count] );
+        mapping->loop = loop_index;
+        mapping->channel = midi_channel;
+        mapping->type = midi_type;
+        mapping->value = midi_value;
+        mapping->action = action_index;
+    }
+    pending->count++;
+}
+
+// Copies the take, with however much room it turns out to need.
+static int copy_take( struct SavedLoop *saved )
+{
+    struct LoopBufferStats stats;
+    loop_get_buffer_stats( saved->loop, &stats );
+
+    size_t capacity = stats.events + LOOP_BUFFER_SEGMENT_EVENTS;
+    for( ;; ) {
+        saved->events = malloc( capacity * sizeof( struct PackedMidiMessage ) );
+        if( saved->events == NULL ) {
+            return -10;
+        }
+
+        saved->event_count = loop_copy_take( saved->loop, saved->events, capacity, &saved->take );
+        if( saved->event_count <= capacity ) {
+            return 0;
+        }
+
+        free( saved->events );
+        capacity = saved->event_count + LOOP_BUFFER_SEGMENT_EVENTS;
+    }
+}
+
+static void free_saved_loops( struct SavedLoop *saved, int loop_count )
+{
+    if( saved ) {
+        for( int i = 0; i < loop_count; i++ ) {
+            free( saved[i].events );
+        }
+        free( saved );
+    }
+}
+
+int session_save(
+        const char *path,
+        Loop *loops,
+        int loop_count,
+        ControlActionTable table,
+        jack_nframes_t sample_rate
+    ) {
+
+    struct SavedLoop *saved = calloc( loop_count + 1, sizeof( struct SavedLoop ) );
+    struct LoopIndex *index = malloc( ( loop_count + 1 ) * sizeof( struct LoopIndex ) );
+    if( saved == NULL || index == NULL ) {
+        free( saved );
+        free( index );
+        return -10;
+    }
+
+    // Everything about each loop that's to be saved, as of now.
+    uint64_t names_size = 0;
+    for( int i = 0; i < loop_count; i++ ) {
+        saved[i].loop = loops[i];
+        saved[i].playing = loop_is_playing( loops[i] );
+        if( copy_take( &saved[i] ) != 0 ) {
+            free_saved_loops( saved, loop_count );
+            free( index );
+            return -20;
+        }
+
+        index[i].loop = loops[i];
+        index[i].index = i;
+        names_size += strlen( loop_get_name( loops[i] ) ) + 1;
+    }
+    qsort( index, loop_count, sizeof( struct LoopIndex ), compare_loop_index );
+
+    struct PendingMappings pending = {
+        .index = index,
+        .loop_count = loop_count,
+        .mappings = NULL,
+        .count = 0
+    };
+    control_action_table_foreach_mapping( table, collect_mapping, &pending );
+    pending.mappings = malloc( ( pending.count + 1 ) * sizeof( struct SessionMapping ) );
+    if( pending.mappings == NULL ) {
+        free_saved_loops( saved, loop_count );
+        free( index );
+        return -30;
+    }
+    pending.count = 0;
+    control_action_table_foreach_mapping( table, collect_mapping, &pending );
+
+    // Lays the file out.
+    struct SessionHeader header;
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, SESSION_MAGIC, sizeof( header.magic ) );
+    header.version = SESSION_VERSION;
+    header.header_size = sizeof( struct SessionHeader );
+    header.loop_size = sizeof( struct SessionLoop );
+    header.mapping_size = sizeof( struct SessionMapping );
+    header.sample_rate = sample_rate;
+    header.loop_count = loop_count;
+    header.mapping_count = pending.count;
+    header.loops_offset = align( sizeof( struct SessionHeader ) );
+    header.mappings_offset = align( header.loops_offset + loop_count * sizeof( struct SessionLoop ) );
+    header.names_offset = align( header.mappings_offset + pending.count * sizeof( struct SessionMapping ) );
+    header.names_size = names_size;
+
+    uint64_t offset = align( header.names_offset + names_size );
+    for( int i = 0; i < loop_count; i++ ) {
+        offset = align( offset + saved[i].event_count * sizeof( struct PackedMidiMessage ) );
+    }
+    header.file_size = offset;
+
+    // Written beside the old file, so that it's either replaced whole or not at all.
+    char *temporary_path = malloc( strlen( path ) + 5 );
+    sprintf( temporary_path, "%s.tmp", path );
+
+    int result = 0;
+    char *file = MAP_FAILED;
+    int fd = open( temporary_path, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    if( fd < 0 || ftruncate( fd, header.file_size ) != 0 ) {
+        result = -40;
+    } else {
+        file = mmap( NULL, header.file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+        if( file == MAP_FAILED ) {
+            result = -50;
+        }
+    }
+
+    if( result == 0 ) {
+        memcpy( file, &header, sizeof( header ) );
+        memcpy( file + header.mappings_offset, pending.mappings, pending.count * sizeof( struct SessionMapping ) );
+
+        struct SessionLoop *records = (struct SessionLoop *) ( file + header.loops_offset );
+        char *names = file + header.names_offset;
+        uint32_t name_offset = 0;
+        offset = align( header.names_offset + names_size );
+
+        for( int i = 0; i < loop_count; i++ ) {
+            Loop loop = saved[i].loop;
+            Loop master = loop_get_sync_master( loop );
+            struct SessionLoop *record = &( records[i] );
+
+            record->events_offset = offset;
+            record->event_count = saved[i].event_count;
+            record->name_offset = name_offset;
+            record->sync_master = master ? find_loop_index( index, loop_count, master ) : -1;
+            record->length = saved[i].take.length;
+            record->sync_offset = saved[i].take.sync_offset;
+            record->midi_through = loop_get_midi_through( loop );
+            record->playback_after_recording = loop_get_playback_after_recording( loop );
+            record->priority = loop_get_priority( loop );
+            record->quantize = loop_get_quantize( loop );
+            record->input_source = loop_get_input_source( loop );
+            record->output_target = loop_get_output_target( loop );
+            record->playing = saved[i].playing;
+
+            size_t name_size = strlen( loop_get_name( loop ) ) + 1;
+            memcpy( names + name_offset, loop_get_name( loop ), name_size );
+            name_offset += name_size;
+
+            size_t events_size = saved[i].event_count * sizeof( struct PackedMidiMessage );
+            memcpy( file + offset, saved[i].events, events_size );
+            offset = align( offset + events_size );
+        }
+
+        if( msync( file, header.file_size, MS_SYNC ) != 0 ) {
+            result = -60;
+        }
+    }
+
+    if( file != MAP_FAILED ) {
+        munmap( file, header.file_size );
+    }
+    if( fd >= 0 ) {
+        close( fd );
+    }
+
+    if( result == 0 && rename( temporary_path, path ) != 0 ) {
+        result = -70;
+    }
+    if( result != 0 ) {
+        fprintf( stderr, "Could not save the session to %s.\n", path );
+        unlink( temporary_path );
+    }
+
+    free( temporary_path );
+    free( pending.mappings );
+    free_saved_loops( saved, loop_count );
+    free( index );
+    return result;
+}
+
+/* ----------------------------------------------------
+   Loading
+   ---------------------------------------------------- */
+
+// Whether [offset, offset + count * size) is inside the file.
+static int in_file( const struct SessionHeader *header, uint64_t offset, uint64_t count, uint64_t size )
+{
+    return offset <= header->file_size
+        && count <= ( header->file_size - offset ) / size;
+}
+
+static int compare_names( const void *a, const void *b )
+{
+    return strcmp( *(const char * const *) a, *(const char * const *) b );
+}
+
+/* Loops are looked up by name, and a second one would replace the first
+   under its mappings and slaves.  Returns non-zero if two share a name, or
+   there wasn't the memory to find out. */
+static int has_duplicate_name( const struct SessionLoop *records, const char *names, uint32_t loop_count )
+{
+    const char **sorted = malloc( ( loop_count ? loop_count : 1 ) * sizeof( const char * ) );
+    if( sorted == NULL ) {
+        return 1;
+    }
+    for( uint32_t i = 0; i < loop_count; i++ ) {
+        sorted[i] = names + records[i].name_offset;
+    }
+    qsort( sorted, loop_count, sizeof( const char * ), compare_names );
+
+    int duplicate = 0;
+    for( uint32_t i = 1; i < loop_count && !duplicate; i++ ) {
+        duplicate = strcmp( sorted[i - 1], sorted[i] ) == 0;
+    }
+    free( sorted );
+    return duplicate;
+}
+
+// Everything that could send loading off the end of the map, or into a loop that won't work.
+static int check_file( const char *file, uint64_t file_size )
+{
+    const struct SessionHeader *header = (const struct SessionHeader *) file;
+    if(
+        file_size < sizeof( struct SessionHeader )
+        || memcmp( header->magic, SESSION_MAGIC, sizeof( header->magic ) ) != 0
+    ) {
+        return -10;
+    }
+
+    if(
+        header->version != SESSION_VERSION
+        || header->header_size != sizeof( struct SessionHeader )
+        || header->loop_size != sizeof( struct SessionLoop )
+        || header->mapping_size != sizeof( struct SessionMapping )
+    ) {
+        return -20;
+    }
+
+    if(
+        header->file_size != file_size
+        || header->sample_rate == 0
+        || !in_file( header, header->loops_offset, header->loop_count, sizeof( struct SessionLoop ) )
+        || !in_file( header, header->mappings_offset, header->mapping_count, sizeof( struct SessionMapping ) )
+        || !in_file( header, header->names_offset, header->names_size, 1 )
+        || header->loops_offset % SESSION_ALIGN != 0
+        || header->mappings_offset % SESSION_ALIGN != 0
+    ) {
+        return -30;
+    }
+
+    const struct SessionLoop *records = (const struct SessionLoop *) ( file + header->loops_offset );
+    const char *names = file + header->names_offset;
+    for( uint32_t i = 0; i < header->loop_count; i++ ) {
+        const struct SessionLoop *record = &( records[i] );
+        const char *name = names + record->name_offset;
+
+        // Names go into OSC paths and port names, so the same rules as for a new loop.
+        if(
+            record->name_offset >= header->names_size
+            || memchr( name, '\0', header->names_size - record->name_offset ) == NULL
+            || name[0] == '\0'
+            || strlen( name ) >= 50
+            || strpbrk( name, "/ " ) != NULL
+            || record->sync_master < -1
+            || record->sync_master >= (int64_t) header->loop_count
+            || record->sync_master == (int64_t) i
+            || record->events_offset % sizeof( struct PackedMidiMessage ) != 0
+            || !in_file( header, record->events_offset, record->event_count, sizeof( struct PackedMidiMessage ) )
+        ) {
+            return -40;
+        }
+
+        // Loop buffers take the length of every message from its status.
+        const struct PackedMidiMessage *events =
+            (const struct PackedMidiMessage *) ( file + record->events_offset );
+        for( uint64_t k = 0; k < record->event_count; k++ ) {
+            if( midi_message_length( events[k].status ) == 0 ) {
+                return -50;
+            }
+        }
+    }
+
+    const struct SessionMapping *mappings = (const struct SessionMapping *) ( file + header->mappings_offset );
+    for( uint32_t i = 0; i < header->mapping_count; i++ ) {
+        const struct SessionMapping *mapping = &( mappings[i] );
+        if(
+            mapping->loop >= header->loop_count
+            || mapping->channel > 15
+            || mapping->type > TYPE_CC_OFF
+            || mapping->value > 127
+            || mapping->action >= SESSION_ACTION_COUNT
+        ) {
+            return -60;
+        }
+    }
+
+    if( has_duplicate_name( records, names, header->loop_count ) ) {
+        return -70;
+    }
+
+    return 0;
+}
+
+static jack_nframes_t stretch( uint64_t time, jack_nframes_t from_rate, jack_nframes_t to_rate )
+{
+    return ( time * to_rate + from_rate / 2 ) / from_rate;
+}
+
+/* A copy of the take with its times moved to another sample rate.  The
+   deltas are stretched as absolute times, so rounding can't build up. */
+static struct PackedMidiMessage *stretch_take(
+        const struct PackedMidiMessage *events,
+        uint64_t count,
+        jack_nframes_t from_rate,
+        jack_nframes_t to_rate
+    ) {
+
+    struct PackedMidiMessage *stretched = malloc( ( count + 1 ) * sizeof( struct PackedMidiMessage ) );
+    if( stretched == NULL ) {
+        return NULL;
+    }
+
+    uint64_t time = 0;
+    jack_nframes_t last = 0;
+    for( uint64_t i = 0; i < count; i++ ) {
+        time += events[i].delta;
+        jack_nframes_t now = stretch( time, from_rate, to_rate );
+        stretched[i] = events[i];
+        stretched[i].delta = now - last;
+        last = now;
+    }
+
+    return stretched;
+}
+
+static int restore_take(
+        Loop loop,
+        const char *file,
+        const struct SessionLoop *record,
+        jack_nframes_t from_rate,
+        jack_nframes_t to_rate
+    ) {
+
+    const struct PackedMidiMessage *events =
+        (const struct PackedMidiMessage *) ( file + record->events_offset );
+    struct LoopTake take = {
+        .length = record->length,
+        .sync_offset = record->sync_offset
+    };
+
+    if( from_rate == to_rate ) {
+        return loop_restore_take( loop, events, record->event_count, &take, record->playing );
+    }
+
+    struct PackedMidiMessage *stretched = stretch_take( events, record->event_count, from_rate, to_rate );
+    if( stretched == NULL ) {
+        return -10;
+    }
+    take.length = stretch( take.length, from_rate, to_rate );
+    take.sync_offset = stretch( take.sync_offset, from_rate, to_rate );
+
+    int result = loop_restore_take( loop, stretched, record->event_count, &take, record->playing );
+    free( stretched );
+    return result;
+}
+
+static void free_loops( Loop *loops, int loop_count )
+{
+    for( int i = 0; i < loop_count; i++ ) {
+        char *name = (char *) loop_get_name( loops[i] );
+        loop_free( loops[i] );
+        free( name );
+    }
+    free( loops );
+}
+
+static int load_loops(
+        const char *file,
+        jack_client_t *jack_client,
+        SegmentPool segment_pool,
+        size_t max_segments,
+        ControlActionTable table,
+        jack_nframes_t sample_rate,
+        Loop **loops_out,
+        int *loop_count_out
+    ) {
+
+    const struct SessionHeader *header = (const struct SessionHeader *) file;
+    const struct SessionLoop *records = (const struct SessionLoop *) ( file + header->loops_offset );
+    const struct SessionMapping *mappings = (const struct SessionMapping *) ( file + header->mappings_offset );
+    const char *names = file + header->names_offset;
+
+    Loop *loops = malloc( ( header->loop_count + 1 ) * sizeof( Loop ) );
+    if( loops == NULL ) {
+        return -10;
+    }
+
+    for( uint32_t i = 0; i < header->loop_count; i++ ) {
+        const struct SessionLoop *record = &( records[i] );
+        const char *name = names + record->name_offset;
+
+        char *loop_name = malloc( strlen( name ) + 1 );
+        if( loop_name == NULL ) {
+            free_loops( loops, i );
+            return -20;
+        }
+        strcpy( loop_name, name );
+
+        if(
+            loop_new(
+                &loops[i],
+                jack_client,
+                loop_name,
+                record->midi_through,
+                record->playback_after_recording,
+                segment_pool,
+                max_segments
+            ) != 0
+        ) {
+            free( loop_name );
+            free_loops( loops, i );
+            return -30;
+        }
+
+        Loop loop = loops[i];
+        loop_set_priority( loop, record->priority );
+        loop_set_quantize( loop, record->quantize );
+        loop_set_input_source( loop, record->input_source );
+        loop_set_output_target( loop, record->output_target );
+
+        // Keeps the loop, like a take that stopped growing when it was recorded.
+        if( restore_take( loop, file, record, header->sample_rate, sample_rate ) != 0 ) {
+            fprintf( stderr, "The take for %s doesn't fit, so it was left out.\n", name );
+        }
+    }
+
+    for( uint32_t i = 0; i < header->loop_count; i++ ) {
+        if( records[i].sync_master >= 0 ) {
+            loop_set_sync_master( loops[i], loops[records[i].sync_master] );
+        }
+    }
+
+    for( uint32_t i = 0; i < header->mapping_count; i++ ) {
+        const struct SessionMapping *mapping = &( mappings[i] );
+        control_action_table_insert(
+            table,
+            mapping->channel,
+            mapping->type,
+            mapping->value,
+            loops[mapping->loop],
+            SESSION_ACTIONS[mapping->action]
+        );
+    }
+
+    *loops_out = loops;
+    *loop_count_out = header->loop_count;
+    return 0;
+}
+
+// Maps the whole file and checks it, returning NULL if it's no good.
+static char *map_session( const char *path, size_t *file_size )
+{
+    int fd = open( path, O_RDONLY );
+    if( fd < 0 ) {
+        fprintf( stderr, "Could not open the session %s.\n", path );
+        return NULL;
+    }
+
+    struct stat status;
+    if( fstat( fd, &status ) != 0 || status.st_size < (off_t) sizeof( struct SessionHeader ) ) {
+        fprintf( stderr, "%s is not a session.\n", path );
+        close( fd );
+        return NULL;
+    }
+
+    *file_size = status.st_size;
+    char *file = mmap( NULL, *file_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if( file == MAP_FAILED ) {
+        fprintf( stderr, "Could not map the session %s.\n", path );
+        return NULL;
+    }
+    // Every page gets read, so have them all read ahead at once.
+    posix_madvise( file, *file_size, POSIX_MADV_WILLNEED );
+
+    int checked = check_file( file, *file_size );
+    if( checked != 0 ) {
+        fprintf( stderr, "%s is not a session this version can load (code %d).\n", path, checked );
+        munmap( file, *file_size );
+        return NULL;
+    }
+
+    return file;
+}
+
+int session_check( const char *path )
+{
+    size_t file_size;
+    char *file = map_session( path, &file_size );
+    if( file == NULL ) {
+        return -10;
+    }
+
+    munmap( file, file_size );
+    return 0;
+}
+
+int session_load(
+        const char *path,
+        jack_client_t *jack_client,
+        SegmentPool segment_pool,
+        size_t max_segments,
+        ControlActionTable table,
+        jack_nframes_t sample_rate,
+        Loop **loops,
+        int *loop_count
+    ) {
+
+    size_t file_size;
+    char *file = map_session( path, &file_size );
+    if( file == NULL ) {
+        return -10;
+    }
+
+    int result = load_loops( file, jack_client, segment_pool, max_segments, table, sample_rate, loops, loop_count );
+    if( result != 0 ) {
+        fprintf( stderr, "Could not create the loops saved in %s.\n", path );
+    }
+
+    munmap( file, file_size );
+    return result;
+}
@@ -0,0 +1,66 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <jack/jack.h>
+
+#include "control_action_table.h"
+#include "loop.h"
+#include "segment_pool.h"
+
+/* A whole set of loops in one binary file: a header, the loop table, the
+   mapping table and the loop names, then every take's messages, packed just
+   as loop buffers hold them.  Loading maps the file and works straight out
+   of it, so nothing is parsed, and each take goes into its buffer a segment
+   at a time.  Files are in the byte order of the machine that wrote them,
+   and one written by any other version is refused. */
+#define SESSION_VERSION 1
+
+/* Not RT.  Saves the loops, and every mapping in table on any of them, to
+   path.  Each take is copied while the process callback carries on - see
+   loop_copy_take.  The file is written beside path and renamed over it, so
+   a failed save leaves whatever was there.  Returns non-zero on failure. */
+int session_save(
+    const char *path,
+    Loop *loops,
+    int loop_count,
+    ControlActionTable table,
+    jack_nframes_t sample_rate
+);
+
+// Not RT.  Returns 0 if path holds a session this version can load.
+int session_check( const char *path );
+
+/* Not RT.  Creates the loops saved at path, none of them published yet, and
+   adds their mappings to table.  The loops come back in *loops, which is
+   malloced, and so is each loop's name; all of them belong to the caller.
+   Takes saved at another sample rate are stretched to this one.  Returns
+   non-zero, having created nothing, if the file can't be used. */
+int session_load(
+    const char *path,
+    jack_client_t *jack_client,
+    SegmentPool segment_pool,
+    size_t max_segments,
+    ControlActionTable table,
+    jack_nframes_t sample_rate,
+    Loop **loops,
+    int *loop_count
+);
+
+#endif
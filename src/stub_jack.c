@@ -0,0 +1,648 @@
+/* JACK MIDI LOOPER
+Copyright (C) 2014  Joshua Otto
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+/* A small in-process stand-in for the parts of libjack the engine uses, so
+   that the engine can be driven deterministically without a server.  It's
+   compiled against the real JACK headers and linked instead of libjack.
+   Port buffers are just the ports themselves, and there's no thread: the
+   process callback runs whenever the driver calls stub_jack_run_cycle. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "stub_jack.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <jack/jack.h>
+#include <jack/midiport.h>
+#include <jack/ringbuffer.h>
+
+#define STUB_PORT_EVENT_CAPACITY    4096
+#define STUB_PORT_DATA_CAPACITY     (4*STUB_PORT_EVENT_CAPACITY)
+#define STUB_MAX_PORTS              2048
+#define STUB_MAX_CLIENT_THREADS     64
+
+struct _jack_port {
+    char name[128];
+    unsigned long flags;
+    uint32_t event_count;
+    size_t data_used;
+    jack_midi_event_t events[STUB_PORT_EVENT_CAPACITY];
+    jack_midi_data_t data[STUB_PORT_DATA_CAPACITY];
+};
+
+struct _jack_client {
+    jack_nframes_t sample_rate;
+    jack_nframes_t buffer_size;
+    jack_nframes_t last_frame_time;
+    int started;
+
+    JackProcessCallback process;
+    void *process_arg;
+
+    jack_transport_state_t transport_state;
+    jack_position_t position;
+
+    jack_port_t *ports[STUB_MAX_PORTS];
+    int port_count;
+};
+
+/* ----------------------------------------------------
+   Driver side
+   ---------------------------------------------------- */
+
+/* The stub's microsecond clock is derived from the frame counter of the
+   latest client, so time only moves when cycles do. */
+static jack_client_t *clock_client = NULL;
+
+jack_client_t *stub_jack_client_new( jack_nframes_t sample_rate, jack_nframes_t buffer_size )
+{
+    jack_client_t *client = calloc( 1, sizeof( *client ) );
+    if( client == NULL ) {
+        return NULL;
+    }
+
+    client->sample_rate = sample_rate;
+    client->buffer_size = buffer_size;
+    client->transport_state = JackTransportStopped;
+    client->position.frame_rate = sample_rate;
+
+    clock_client = client;
+    return client;
+}
+
+void stub_jack_client_free( jack_client_t *client )
+{
+    if( client ) {
+        if( clock_client == client ) {
+            clock_client = NULL;
+        }
+        for( int i = 0; i < client->port_count; i++ ) {
+            free( client->ports[i] );
+        }
+        free( client );
+    }
+}
+
+jack_port_t *stub_jack_port_by_name( jack_client_t *client, const char *name )
+{
+    for( int i = 0; i < client->port_count; i++ ) {
+        if( client->ports[i] && !strcmp( client->ports[i]->name, name ) ) {
+            return client->ports[i];
+        }
+    }
+    return NULL;
+}
+
+// Counted from bar 1, beat 1 at transport frame 0.
+static void update_bbt( jack_position_t *position )
+{
+    if( !( position->valid & JackPositionBBT ) || position->beats_per_minute <= 0 ) {
+        return;
+    }
+
+    double beats = position->frame * position->beats_per_minute / ( 60.0 * position->frame_rate );
+    int64_t whole_beats = (int64_t) beats;
+    int32_t beats_per_bar = position->beats_per_bar > 0 ? (int32_t) position->beats_per_bar : 4;
+
+    position->bar = whole_beats / beats_per_bar + 1;
+    position->beat = whole_beats % beats_per_bar + 1;
+    position->tick = (int32_t) ( ( beats - whole_beats ) * position->ticks_per_beat );
+    position->bar_start_tick = (double) ( position->bar - 1 ) * beats_per_bar * position->ticks_per_beat;
+}
+
+void stub_jack_begin_cycle( jack_client_t *client )
+{
+    if( client->started ) {
+        client->last_frame_time += client->buffer_size;
+        if( client->transport_state == JackTransportRolling ) {
+            client->position.frame += client->buffer_size;
+            update_bbt( &client->position );
+        }
+    }
+    client->started = 1;
+
+    for( int i = 0; i < client->port_count; i++ ) {
+        jack_port_t *port = client->ports[i];
+        if( port && ( port->flags & JackPortIsInput ) ) {
+            jack_midi_clear_buffer( port );
+        }
+    }
+}
+
+void stub_jack_set_frame_time( jack_client_t *client, jack_nframes_t frame )
+{
+    client->last_frame_time = frame;
+}
+
+int stub_jack_run_cycle( jack_client_t *client )
+{
+    if( client->process == NULL ) {
+        return 0;
+    }
+    return client->process( client->buffer_size, client->process_arg );
+}
+
+int stub_jack_port_push_event(
+        jack_port_t *port,
+        jack_nframes_t time,
+        const jack_midi_data_t *data,
+        size_t size
+    ) {
+    return jack_midi_event_write( port, time, data, size );
+}
+
+void stub_jack_set_transport(
+        jack_client_t *client,
+        jack_transport_state_t state,
+        const jack_position_t *position
+    ) {
+    client->transport_state = state;
+    client->position = *position;
+    client->position.frame_rate = client->sample_rate;
+    update_bbt( &client->position );
+}
+
+void stub_jack_put_transport(
+        jack_client_t *client,
+        jack_transport_state_t state,
+        const jack_position_t *position
+    ) {
+    client->transport_state = state;
+    client->position = *position;
+}
+
+/* ----------------------------------------------------
+   Client API
+   ---------------------------------------------------- */
+
+jack_client_t *jack_client_open( const char *client_name, jack_options_t options, jack_status_t *status, ... )
+{
+    return stub_jack_client_new( 48000, 256 );
+}
+
+int jack_client_close( jack_client_t *client )
+{
+    stub_jack_client_free( client );
+    return 0;
+}
+
+int jack_activate( jack_client_t *client )
+{
+    return 0;
+}
+
+int jack_deactivate( jack_client_t *client )
+{
+    return 0;
+}
+
+int jack_set_process_callback( jack_client_t *client, JackProcessCallback cb, void *arg )
+{
+    client->process = cb;
+    client->process_arg = arg;
+    return 0;
+}
+
+int jack_set_sample_rate_callback( jack_client_t *client, JackSampleRateCallback cb, void *arg )
+{
+    return 0;
+}
+
+int jack_set_buffer_size_callback( jack_client_t *client, JackBufferSizeCallback cb, void *arg )
+{
+    return 0;
+}
+
+int jack_set_freewheel_callback( jack_client_t *client, JackFreewheelCallback cb, void *arg )
+{
+    return 0;
+}
+
+int jack_set_freewheel( jack_client_t *client, int onoff )
+{
+    return 0;
+}
+
+jack_nframes_t jack_get_sample_rate( jack_client_t *client )
+{
+    return client->sample_rate;
+}
+
+jack_nframes_t jack_get_buffer_size( jack_client_t *client )
+{
+    return client->buffer_size;
+}
+
+jack_port_t *jack_port_register(
+        jack_client_t *client,
+        const char *port_name,
+        const char *port_type,
+        unsigned long flags,
+        unsigned long buffer_size
+    ) {
+
+    // JACK won't have two ports of the same name on a client either.
+    if( strlen( port_name ) >= sizeof( client->ports[0]->name ) || stub_jack_port_by_name( client, port_name ) ) {
+        return NULL;
+    }
+
+    int slot;
+    for( slot = 0; slot < client->port_count; slot++ ) {
+        if( client->ports[slot] == NULL ) {
+            break;
+        }
+    }
+
+    if( slot == STUB_MAX_PORTS ) {
+        return NULL;
+    }
+
+    jack_port_t *port = calloc( 1, sizeof( *port ) );
+    if( port == NULL ) {
+        return NULL;
+    }
+
+    snprintf( port->name, sizeof( port->name ), "%s", port_name );
+    port->flags = flags;
+
+    client->ports[slot] = port;
+    if( slot == client->port_count ) {
+        client->port_count++;
+    }
+
+    return port;
+}
+
+int jack_port_rename( jack_client_t *client, jack_port_t *port, const char *port_name )
+{
+    if( strlen( port_name ) >= sizeof( port->name ) || stub_jack_port_by_name( client, port_name ) ) {
+        return -1;
+    }
+    snprintf( port->name, sizeof( port->name ), "%s", port_name );
+    return 0;
+}
+
+int jack_port_unregister( jack_client_t *client, jack_port_t *port )
+{
+    for( int i = 0; i < client->port_count; i++ ) {
+        if( client->ports[i] == port ) {
+            client->ports[i] = NULL;
+            free( port );
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void *jack_port_get_buffer( jack_port_t *port, jack_nframes_t nframes )
+{
+    return port;
+}
+
+jack_nframes_t jack_last_frame_time( const jack_client_t *client )
+{
+    return client->last_frame_time;
+}
+
+jack_nframes_t jack_frame_time( const jack_client_t *client )
+{
+    return client->last_frame_time;
+}
+
+// Rounds up, so that converting back gives the same frame.
+jack_time_t jack_frames_to_time( const jack_client_t *client, jack_nframes_t frames )
+{
+    return ( (jack_time_t) frames * 1000000 + client->sample_rate - 1 ) / client->sample_rate;
+}
+
+jack_nframes_t jack_time_to_frames( const jack_client_t *client, jack_time_t usecs )
+{
+    return usecs * client->sample_rate / 1000000;
+}
+
+jack_time_t jack_get_time( void )
+{
+    if( clock_client ) {
+        return jack_frames_to_time( clock_client, clock_client->last_frame_time );
+    }
+
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (jack_time_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+jack_transport_state_t jack_transport_query( const jack_client_t *client, jack_position_t *pos )
+{
+    if( pos ) {
+        *pos = client->position;
+    }
+    return client->transport_state;
+}
+
+int jack_client_real_time_priority( jack_client_t *client )
+{
+    return 0;
+}
+
+int jack_is_realtime( jack_client_t *client )
+{
+    return 0;
+}
+
+// Threads started through jack_client_create_thread and not yet stopped, for stub_jack_is_client_thread.
+static pthread_mutex_t client_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static jack_native_thread_t client_threads[STUB_MAX_CLIENT_THREADS];
+static int client_thread_count = 0;
+
+int jack_client_create_thread(
+        jack_client_t *client,
+        jack_native_thread_t *thread,
+        int priority,
+        int realtime,
+        void *(*start_routine)( void * ),
+        void *arg
+    ) {
+
+    pthread_mutex_lock( &client_threads_lock );
+
+    int status = -1;
+    if( client_thread_count < STUB_MAX_CLIENT_THREADS ) {
+        status = pthread_create( thread, NULL, start_routine, arg );
+        if( status == 0 ) {
+            client_threads[client_thread_count++] = *thread;
+        }
+    }
+
+    pthread_mutex_unlock( &client_threads_lock );
+    return status;
+}
+
+int jack_client_stop_thread( jack_client_t *client, jack_native_thread_t thread )
+{
+    int status = pthread_join( thread, NULL );
+
+    pthread_mutex_lock( &client_threads_lock );
+    for( int i = 0; i < client_thread_count; i++ ) {
+        if( pthread_equal( client_threads[i], thread ) ) {
+            client_threads[i] = client_threads[--client_thread_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock( &client_threads_lock );
+
+    return status;
+}
+
+int stub_jack_is_client_thread( void )
+{
+    pthread_mutex_lock( &client_threads_lock );
+
+    int found = 0;
+    for( int i = 0; i < client_thread_count && !found; i++ ) {
+        found = pthread_equal( client_threads[i], pthread_self() );
+    }
+
+    pthread_mutex_unlock( &client_threads_lock );
+    return found;
+}
+
+/* ----------------------------------------------------
+   MIDI port buffers
+   ---------------------------------------------------- */
+
+uint32_t jack_midi_get_event_count( void *port_buffer )
+{
+    jack_port_t *port = port_buffer;
+    return port->event_count;
+}
+
+int jack_midi_event_get( jack_midi_event_t *event, void *port_buffer, uint32_t event_index )
+{
+    jack_port_t *port = port_buffer;
+    if( event_index >= port->event_count ) {
+        return -1;
+    }
+    *event = port->events[event_index];
+    return 0;
+}
+
+void jack_midi_clear_buffer( void *port_buffer )
+{
+    jack_port_t *port = port_buffer;
+    port->event_count = 0;
+    port->data_used = 0;
+}
+
+jack_midi_data_t *jack_midi_event_reserve( void *port_buffer, jack_nframes_t time, size_t data_size )
+{
+    jack_port_t *port = port_buffer;
+
+    // Same rules as the real thing: no room or out of order means no event.
+    if(
+        port->event_count == STUB_PORT_EVENT_CAPACITY
+        || port->data_used + data_size > STUB_PORT_DATA_CAPACITY
+        || ( port->event_count && port->events[port->event_count - 1].time > time )
+    ) {
+        return NULL;
+    }
+
+    jack_midi_event_t *event = &( port->events[port->event_count++] );
+    event->time = time;
+    event->size = data_size;
+    event->buffer = port->data + port->data_used;
+    port->data_used += data_size;
+
+    return event->buffer;
+}
+
+int jack_midi_event_write( void *port_buffer, jack_nframes_t time, const jack_midi_data_t *data, size_t data_size )
+{
+    jack_midi_data_t *reserved = jack_midi_event_reserve( port_buffer, time, data_size );
+    if( reserved == NULL ) {
+        return -1;
+    }
+    memcpy( reserved, data, data_size );
+    return 0;
+}
+
+uint32_t jack_midi_get_lost_event_count( void *port_buffer )
+{
+    return 0;
+}
+
+/* ----------------------------------------------------
+   Ringbuffers
+   ---------------------------------------------------- */
+
+jack_ringbuffer_t *jack_ringbuffer_create( size_t sz )
+{
+    jack_ringbuffer_t *rb = malloc( sizeof( *rb ) );
+    if( rb == NULL ) {
+        return NULL;
+    }
+
+    size_t power_of_two = 1;
+    while( power_of_two < sz ) {
+        power_of_two <<= 1;
+    }
+
+    rb->size = power_of_two;
+    rb->size_mask = power_of_two - 1;
+    rb->write_ptr = 0;
+    rb->read_ptr = 0;
+    rb->mlocked = 0;
+    rb->buf = malloc( power_of_two );
+    if( rb->buf == NULL ) {
+        free( rb );
+        return NULL;
+    }
+
+    return rb;
+}
+
+void jack_ringbuffer_free( jack_ringbuffer_t *rb )
+{
+    if( rb ) {
+        free( rb->buf );
+        free( rb );
+    }
+}
+
+int jack_ringbuffer_mlock( jack_ringbuffer_t *rb )
+{
+    rb->mlocked = 1;
+    return 0;
+}
+
+void jack_ringbuffer_reset( jack_ringbuffer_t *rb )
+{
+    rb->read_ptr = 0;
+    rb->write_ptr = 0;
+}
+
+size_t jack_ringbuffer_read_space( const jack_ringbuffer_t *rb )
+{
+    size_t w = __atomic_load_n( &rb->write_ptr, __ATOMIC_ACQUIRE );
+    size_t r = rb->read_ptr;
+    return ( w - r ) & rb->size_mask;
+}
+
+size_t jack_ringbuffer_write_space( const jack_ringbuffer_t *rb )
+{
+    size_t w = rb->write_ptr;
+    size_t r = __atomic_load_n( &rb->read_ptr, __ATOMIC_ACQUIRE );
+    return ( ( r - w - 1 ) & rb->size_mask );
+}
+
+void jack_ringbuffer_get_read_vector( const jack_ringbuffer_t *rb, jack_ringbuffer_data_t *vec )
+{
+    size_t free_cnt = jack_ringbuffer_read_space( rb );
+    size_t r = rb->read_ptr;
+    size_t cnt2 = r + free_cnt;
+
+    if( cnt2 > rb->size ) {
+        vec[0].buf = &( rb->buf[r] );
+        vec[0].len = rb->size - r;
+        vec[1].buf = rb->buf;
+        vec[1].len = cnt2 & rb->size_mask;
+    } else {
+        vec[0].buf = &( rb->buf[r] );
+        vec[0].len = free_cnt;
+        vec[1].len = 0;
+    }
+}
+
+void jack_ringbuffer_get_write_vector( const jack_ringbuffer_t *rb, jack_ringbuffer_data_t *vec )
+{
+    size_t free_cnt = jack_ringbuffer_write_space( rb );
+    size_t w = rb->write_ptr;
+    size_t cnt2 = w + free_cnt;
+
+    if( cnt2 > rb->size ) {
+        vec[0].buf = &( rb->buf[w] );
+        vec[0].len = rb->size - w;
+        vec[1].buf = rb->buf;
+        vec[1].len = cnt2 & rb->size_mask;
+    } else {
+        vec[0].buf = &( rb->buf[w] );
+        vec[0].len = free_cnt;
+        vec[1].len = 0;
+    }
+}
+
+size_t jack_ringbuffer_peek( jack_ringbuffer_t *rb, char *dest, size_t cnt )
+{
+    size_t free_cnt = jack_ringbuffer_read_space( rb );
+    if( free_cnt == 0 ) {
+        return 0;
+    }
+
+    size_t to_read = cnt > free_cnt ? free_cnt : cnt;
+    size_t r = rb->read_ptr;
+    size_t first = rb->size - r;
+    if( first > to_read ) {
+        first = to_read;
+    }
+
+    memcpy( dest, &( rb->buf[r] ), first );
+    memcpy( dest + first, rb->buf, to_read - first );
+
+    return to_read;
+}
+
+void jack_ringbuffer_read_advance( jack_ringbuffer_t *rb, size_t cnt )
+{
+    __atomic_store_n( &rb->read_ptr, ( rb->read_ptr + cnt ) & rb->size_mask, __ATOMIC_RELEASE );
+}
+
+size_t jack_ringbuffer_read( jack_ringbuffer_t *rb, char *dest, size_t cnt )
+{
+    size_t read = jack_ringbuffer_peek( rb, dest, cnt );
+    jack_ringbuffer_read_advance( rb, read );
+    return read;
+}
+
+void jack_ringbuffer_write_advance( jack_ringbuffer_t *rb, size_t cnt )
+{
+    __atomic_store_n( &rb->write_ptr, ( rb->write_ptr + cnt ) & rb->size_mask, __ATOMIC_RELEASE );
+}
+
+size_t jack_ringbuffer_write( jack_ringbuffer_t *rb, const char *src, size_t cnt )
+{
+    size_t free_cnt = jack_ringbuffer_write_space( rb );
+    if( free_cnt == 0 ) {
+        return 0;
+    }
+
+    size_t to_write = cnt > free_cnt ? free_cnt : cnt;
+    size_t w = rb->write_ptr;
+    size_t first = rb->size - w;
+    if( first > to_write ) {
+        first = to_write;
+    }
+
+    memcpy( &( rb->buf[w] ), src, first );
+    memcpy( rb->buf, src + first, to_write - first );
+    jack_ringbuffer_write_advance( rb, to_write );
+
+    return to_write;
+}
@@ -0,0 +1,71 @@
+/* JACK MIDI LOOPER
+Copyright (C) 2014  Joshua Otto
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#ifndef STUB_JACK_H
+#define STUB_JACK_H
+
+/* Driver-side interface to the in-process libjack stand-in.  The engine code
+   only ever sees the regular JACK headers; these are the knobs the harness
+   uses to play the part of the JACK server. */
+
+#include <jack/jack.h>
+#include <jack/midiport.h>
+
+jack_client_t *stub_jack_client_new( jack_nframes_t sample_rate, jack_nframes_t buffer_size );
+void stub_jack_client_free( jack_client_t *client );
+
+// Finds a port previously registered by the engine, or NULL.
+jack_port_t *stub_jack_port_by_name( jack_client_t *client, const char *name );
+
+// Starts a new cycle: clears every input port and advances the frame clock.
+void stub_jack_begin_cycle( jack_client_t *client );
+
+/* Moves the frame clock to frame, for a driver that already knows which
+   frame the cycle's on.  Call it after stub_jack_begin_cycle. */
+void stub_jack_set_frame_time( jack_client_t *client, jack_nframes_t frame );
+
+// Runs the process callback for the current cycle.
+int stub_jack_run_cycle( jack_client_t *client );
+
+int stub_jack_port_push_event(
+    jack_port_t *port,
+    jack_nframes_t time,
+    const jack_midi_data_t *data,
+    size_t size
+);
+
+/* While rolling, the transport frame follows the frame clock.  If position
+   has BBT, the stub also acts as a constant-tempo timebase master, deriving
+   bar, beat and tick from the transport frame every cycle. */
+void stub_jack_set_transport(
+    jack_client_t *client,
+    jack_transport_state_t state,
+    const jack_position_t *position
+);
+
+/* The transport exactly as given, as some other timebase master left it:
+   frame_rate and BBT are only touched once a cycle moves the frame on. */
+void stub_jack_put_transport(
+    jack_client_t *client,
+    jack_transport_state_t state,
+    const jack_position_t *position
+);
+
+// Whether the caller was started with jack_client_create_thread, as RT helper threads are.
+int stub_jack_is_client_thread( void );
+
+#endif
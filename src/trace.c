@@ -0,0 +1,603 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <jack/midiport.h>
+#include <jack/ringbuffer.h>
+
+#define TRACE_MAGIC 0x45435254U // "TRCE", little-endian.
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// The file stores actions by their place in here, so only ever add to the end.
+const LoopControlFunc TRACE_ACTIONS[TRACE_ACTION_COUNT] = {
+    LOOP_CONTROL_FUNC_TOGGLE_PLAYBACK,
+    LOOP_CONTROL_FUNC_TOGGLE_RECORDING,
+    LOOP_CONTROL_FUNC_TOGGLE_OVERDUB,
+    LOOP_CONTROL_FUNC_TOGGLE_REPLACE,
+    LOOP_CONTROL_FUNC_CAPTURE
+};
+
+struct trace_type {
+    int fd;
+
+    /* mlocked.  Only the process thread writes, and a cycle's records only
+       go in once it's over, so whoever reads only ever sees whole cycles. */
+    jack_ringbuffer_t *ring;
+
+    // The process thread's: where the cycle's records are going, and how far they've got.
+    jack_ringbuffer_data_t cycle[2];
+    size_t cycle_bytes;
+    uint32_t gap;
+    uint64_t cycles;
+    uint64_t dropped;
+
+    // Covers the file, reading the ring and bytes.
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    uint64_t bytes;
+
+    pthread_t thread;
+    int quit;
+};
+
+static void *trace_thread( void *arg );
+
+static size_t padded( size_t size )
+{
+    return ( size + 7 ) & ~(size_t) 7;
+}
+
+static int write_all( int fd, const void *data, size_t size )
+{
+    const char *bytes = data;
+    while( size > 0 ) {
+        ssize_t written = write( fd, bytes, size );
+        if( written < 0 ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return 0;
+}
+
+/* ----------------------------------------------------
+   Writing
+   ---------------------------------------------------- */
+
+Trace trace_new( const char *path, jack_nframes_t sample_rate, size_t ring_bytes )
+{
+    struct trace_type *this = calloc( 1, sizeof( *this ) );
+    if( this == NULL ) {
+        return NULL;
+    }
+
+    struct TraceHeader header = { TRACE_MAGIC, TRACE_VERSION, sample_rate, 0 };
+    this->fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    this->ring = jack_ringbuffer_create( ring_bytes );
+    if( this->fd < 0 || this->ring == NULL || write_all( this->fd, &header, sizeof( header ) ) != 0 ) {
+        fprintf( stderr, "Could not start the trace %s.\n", path );
+        if( this->fd >= 0 ) {
+            close( this->fd );
+        }
+        if( this->ring ) {
+            jack_ringbuffer_free( this->ring );
+        }
+        free( this );
+        return NULL;
+    }
+    jack_ringbuffer_mlock( this->ring );
+    this->bytes = sizeof( header );
+
+    pthread_mutex_init( &this->lock, NULL );
+    pthread_cond_init( &this->wake, NULL );
+    if( pthread_create( &this->thread, NULL, trace_thread, this ) != 0 ) {
+        fprintf( stderr, "Could not start the trace thread.\n" );
+        pthread_cond_destroy( &this->wake );
+        pthread_mutex_destroy( &this->lock );
+        close( this->fd );
+        jack_ringbuffer_free( this->ring );
+        free( this );
+        return NULL;
+    }
+
+    return this;
+}
+
+// Writes out every whole cycle in the ring.
+static void drain_locked( Trace this )
+{
+    jack_ringbuffer_data_t vector[2];
+    jack_ringbuffer_get_read_vector( this->ring, vector );
+
+    size_t drained = 0;
+    for( int i = 0; i < 2; i++ ) {
+        if( vector[i].len && write_all( this->fd, vector[i].buf, vector[i].len ) != 0 ) {
+            fprintf( stderr, "Could not write the trace.\n" );
+            break;
+        }
+        drained += vector[i].len;
+    }
+
+    jack_ringbuffer_read_advance( this->ring, drained );
+    this->bytes += drained;
+}
+
+static void *trace_thread( void *arg )
+{
+    Trace this = arg;
+
+    pthread_mutex_lock( &this->lock );
+    while( !this->quit ) {
+        struct timespec until;
+        clock_gettime( CLOCK_REALTIME, &until );
+        until.tv_nsec += TRACE_DRAIN_MS * 1000000L;
+        if( until.tv_nsec >= 1000000000L ) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait( &this->wake, &this->lock, &until );
+        drain_locked( this );
+    }
+
+    drain_locked( this );
+    pthread_mutex_unlock( &this->lock );
+    return NULL;
+}
+
+void trace_free( Trace this )
+{
+    if( this == NULL ) {
+        return;
+    }
+
+    pthread_mutex_lock( &this->lock );
+    this->quit = 1;
+    pthread_cond_signal( &this->wake );
+    pthread_mutex_unlock( &this->lock );
+    pthread_join( this->thread, NULL );
+
+    if( this->dropped ) {
+        fprintf(
+            stderr,
+            "The trace lost %llu of %llu cycles to a full ring.\n",
+            (unsigned long long) this->dropped,
+            (unsigned long long) ( this->cycles + this->dropped )
+        );
+    }
+
+    pthread_cond_destroy( &this->wake );
+    pthread_mutex_destroy( &this->lock );
+    close( this->fd );
+    jack_ringbuffer_free( this->ring );
+    free( this );
+}
+
+size_t trace_cycle_bytes( size_t commands )
+{
+    // Start, gap, snapshot, transport, commands and end.
+    return ( 5 + commands ) * sizeof( struct TraceRecord ) + padded( sizeof( jack_position_t ) );
+}
+
+size_t trace_port_bytes( void *port_buffer )
+{
+    if( port_buffer == NULL ) {
+        return 0;
+    }
+
+    size_t bytes = 0;
+    uint32_t count = jack_midi_get_event_count( port_buffer );
+    for( uint32_t i = 0; i < count; i++ ) {
+        jack_midi_event_t event;
+        if( jack_midi_event_get( &event, port_buffer, i ) != 0 || event.size > UINT16_MAX ) {
+            continue;
+        }
+        bytes += sizeof( struct TraceEvent );
+        if( event.size > TRACE_INLINE_BYTES ) {
+            bytes += padded( event.size );
+        }
+    }
+    return bytes;
+}
+
+// Into the cycle's space, which trace_begin_cycle has made sure is there.
+static void put( Trace this, const void *data, size_t size )
+{
+    const char *from = data;
+    size_t offset = this->cycle_bytes;
+    this->cycle_bytes += size;
+
+    for( int i = 0; i < 2 && size > 0; i++ ) {
+        if( offset >= this->cycle[i].len ) {
+            offset -= this->cycle[i].len;
+            continue;
+        }
+        size_t part = this->cycle[i].len - offset < size ? this->cycle[i].len - offset : size;
+        memcpy( this->cycle[i].buf + offset, from, part );
+        from += part;
+        size -= part;
+        offset = 0;
+    }
+}
+
+static void put_padding( Trace this, size_t size )
+{
+    static const char zeros[8] = { 0 };
+    put( this, zeros, padded( size ) - size );
+}
+
+static void put_record( Trace this, uint8_t type, uint8_t arg, uint32_t id, uint64_t value )
+{
+    struct TraceRecord record = { type, arg, 0, id, value };
+    put( this, &record, sizeof( record ) );
+}
+
+int trace_begin_cycle( Trace this, uint64_t frame, jack_nframes_t nframes, size_t bytes )
+{
+    if( jack_ringbuffer_write_space( this->ring ) < bytes ) {
+        this->gap++;
+        __atomic_store_n( &this->dropped, this->dropped + 1, __ATOMIC_RELAXED );
+        return -1;
+    }
+
+    jack_ringbuffer_get_write_vector( this->ring, this->cycle );
+    this->cycle_bytes = 0;
+
+    if( this->gap ) {
+        put_record( this, TRACE_GAP, 0, this->gap, 0 );
+        this->gap = 0;
+    }
+    put_record( this, TRACE_CYCLE, 0, nframes, frame );
+    return 0;
+}
+
+void trace_snapshot( Trace this, unsigned int generation )
+{
+    put_record( this, TRACE_SNAPSHOT, 0, generation, 0 );
+}
+
+void trace_transport( Trace this, jack_transport_state_t state, const jack_position_t *position )
+{
+    put_record( this, TRACE_TRANSPORT, 0, state, 0 );
+    put( this, position, sizeof( *position ) );
+    put_padding( this, sizeof( *position ) );
+}
+
+void trace_port( Trace this, enum TraceRecordType type, unsigned int id, void *port_buffer )
+{
+    if( port_buffer == NULL ) {
+        return;
+    }
+
+    uint32_t count = jack_midi_get_event_count( port_buffer );
+    for( uint32_t i = 0; i < count; i++ ) {
+        jack_midi_event_t event;
+        if( jack_midi_event_get( &event, port_buffer, i ) != 0 || event.size > UINT16_MAX ) {
+            continue;
+        }
+
+        struct TraceEvent record = { type, 0, event.size, id, event.time, { 0 } };
+        if( event.size <= TRACE_INLINE_BYTES ) {
+            memcpy( record.data, event.buffer, event.size );
+            put( this, &record, sizeof( record ) );
+        } else {
+            put( this, &record, sizeof( record ) );
+            put( this, event.buffer, event.size );
+            put_padding( this, event.size );
+        }
+    }
+}
+
+void trace_command( Trace this, unsigned int loop_id, int type, uint64_t frame )
+{
+    put_record( this, TRACE_COMMAND, type, loop_id, frame );
+}
+
+void trace_end_cycle( Trace this, uint64_t ns, uint64_t output_hash, int shed )
+{
+    put_record( this, TRACE_CYCLE_END, shed != 0, ns > UINT32_MAX ? UINT32_MAX : ns, output_hash );
+    jack_ringbuffer_write_advance( this->ring, this->cycle_bytes );
+    __atomic_store_n( &this->cycles, this->cycles + 1, __ATOMIC_RELAXED );
+}
+
+static uint64_t fnv( uint64_t hash, const void *data, size_t size )
+{
+    const unsigned char *bytes = data;
+    for( size_t i = 0; i < size; i++ ) {
+        hash = ( hash ^ bytes[i] ) * FNV_PRIME;
+    }
+    return hash;
+}
+
+uint64_t trace_hash_port( uint64_t hash, unsigned int id, void *port_buffer )
+{
+    uint32_t seed = id;
+    uint64_t port_hash = fnv( FNV_OFFSET, &seed, sizeof( seed ) );
+
+    uint32_t count = port_buffer ? jack_midi_get_event_count( port_buffer ) : 0;
+    for( uint32_t i = 0; i < count; i++ ) {
+        jack_midi_event_t event;
+        if( jack_midi_event_get( &event, port_buffer, i ) != 0 ) {
+            continue;
+        }
+        uint32_t time = event.time, size = event.size;
+        port_hash = fnv( port_hash, &time, sizeof( time ) );
+        port_hash = fnv( port_hash, &size, sizeof( size ) );
+        port_hash = fnv( port_hash, event.buffer, event.size );
+    }
+    return hash + port_hash;
+}
+
+// A block from the looper, after every cycle drained so far.
+static void write_block( Trace this, uint8_t type, uint8_t arg, uint32_t id, const void *data, size_t size )
+{
+    struct TraceRecord record = { type, arg, 0, id, size };
+
+    pthread_mutex_lock( &this->lock );
+    drain_locked( this );
+    if( write_all( this->fd, &record, sizeof( record ) ) != 0 || write_all( this->fd, data, size ) != 0 ) {
+        fprintf( stderr, "Could not write the trace.\n" );
+    }
+    this->bytes += sizeof( record ) + size;
+    pthread_mutex_unlock( &this->lock );
+}
+
+struct MappingList {
+    struct TraceMapping *mappings; // NULL while counting.
+    uint32_t count;
+};
+
+static void collect_mapping(
+        unsigned char midi_channel,
+        enum MidiControlType midi_type,
+        unsigned char midi_value,
+        Loop loop,
+        LoopControlFunc action,
+        void *user_data
+    ) {
+
+    struct MappingList *list = user_data;
+
+    unsigned int action_index = 0;
+    while( action_index < TRACE_ACTION_COUNT && TRACE_ACTIONS[action_index] != action ) {
+        action_index++;
+    }
+    if( action_index == TRACE_ACTION_COUNT ) {
+        return;
+    }
+
+    if( list->mappings ) {
+        struct TraceMapping *mapping = &( list->mappings[list->count] );
+        mapping->loop_id = loop_get_id( loop );
+        mapping->channel = midi_channel;
+        mapping->type = midi_type;
+        mapping->value = midi_value;
+        mapping->action = action_index;
+    }
+    list->count++;
+}
+
+void trace_log_loops( Trace this, Loop *loops, int count, ControlActionTable table )
+{
+    struct MappingList list = { NULL, 0 };
+    control_action_table_foreach_mapping( table, collect_mapping, &list );
+
+    size_t names_size = 0;
+    for( int i = 0; i < count; i++ ) {
+        names_size += strlen( loop_get_name( loops[i] ) ) + 1;
+    }
+
+    size_t loops_offset = sizeof( struct TraceLoops );
+    size_t mappings_offset = loops_offset + count * sizeof( struct TraceLoop );
+    size_t names_offset = mappings_offset + list.count * sizeof( struct TraceMapping );
+    size_t size = padded( names_offset + names_size );
+
+    char *block = calloc( 1, size );
+    if( block == NULL ) {
+        fprintf( stderr, "Could not trace the loops.\n" );
+        return;
+    }
+
+    list.mappings = (struct TraceMapping *) ( block + mappings_offset );
+    uint32_t mapping_count = list.count;
+    list.count = 0;
+    control_action_table_foreach_mapping( table, collect_mapping, &list );
+
+    struct TraceLoops *header = (struct TraceLoops *) block;
+    header->count = count;
+    header->mapping_count = list.count < mapping_count ? list.count : mapping_count;
+
+    struct TraceLoop *entries = (struct TraceLoop *) ( block + loops_offset );
+    char *names = block + names_offset;
+    size_t name_offset = 0;
+    for( int i = 0; i < count; i++ ) {
+        Loop master = loop_get_sync_master( loops[i] );
+        entries[i].id = loop_get_id( loops[i] );
+        entries[i].sync_master = master ? loop_get_id( master ) : 0;
+        entries[i].name_offset = name_offset;
+        entries[i].priority = loop_get_priority( loops[i] );
+        entries[i].input_source = loop_get_input_source( loops[i] );
+        entries[i].output_target = loop_get_output_target( loops[i] );
+        entries[i].midi_through = loop_get_midi_through( loops[i] ) != 0;
+        entries[i].playback_after_recording = loop_get_playback_after_recording( loops[i] ) != 0;
+        entries[i].quantize = loop_get_quantize( loops[i] );
+
+        const char *name = loop_get_name( loops[i] );
+        strcpy( names + name_offset, name );
+        name_offset += strlen( name ) + 1;
+    }
+
+    write_block( this, TRACE_LOOPS, 0, count, block, size );
+    free( block );
+}
+
+void trace_log_take(
+        Trace this,
+        unsigned int loop_id,
+        const struct PackedMidiMessage *events,
+        size_t count,
+        const struct LoopTake *take,
+        enum TraceTakeKind kind
+    ) {
+
+    if( kind == TRACE_TAKE_WITHDRAWN ) {
+        count = 0;
+    }
+
+    size_t size = sizeof( struct TraceTake ) + count * sizeof( struct PackedMidiMessage );
+    char *block = malloc( size );
+    if( block == NULL ) {
+        fprintf( stderr, "Could not trace a take.\n" );
+        return;
+    }
+
+    struct TraceTake *header = (struct TraceTake *) block;
+    header->length = take ? take->length : 0;
+    header->sync_offset = take ? take->sync_offset : 0;
+    header->count = count;
+    if( count ) {
+        memcpy( block + sizeof( struct TraceTake ), events, count * sizeof( struct PackedMidiMessage ) );
+    }
+
+    write_block( this, TRACE_TAKE, kind, loop_id, block, size );
+    free( block );
+}
+
+void trace_get_stats( Trace this, struct TraceStats *stats )
+{
+    stats->cycles = __atomic_load_n( &this->cycles, __ATOMIC_RELAXED );
+    stats->dropped = __atomic_load_n( &this->dropped, __ATOMIC_RELAXED );
+    pthread_mutex_lock( &this->lock );
+    stats->bytes = this->bytes;
+    pthread_mutex_unlock( &this->lock );
+}
+
+/* ----------------------------------------------------
+   Reading
+   ---------------------------------------------------- */
+
+struct trace_reader_type {
+    const unsigned char *map;
+    size_t size;
+    size_t offset;
+};
+
+TraceReader trace_reader_open( const char *path, jack_nframes_t *sample_rate )
+{
+    int fd = open( path, O_RDONLY );
+    if( fd < 0 ) {
+        return NULL;
+    }
+
+    struct stat info;
+    if( fstat( fd, &info ) != 0 || (size_t) info.st_size < sizeof( struct TraceHeader ) ) {
+        close( fd );
+        return NULL;
+    }
+
+    void *map = mmap( NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if( map == MAP_FAILED ) {
+        return NULL;
+    }
+
+    const struct TraceHeader *header = map;
+    struct trace_reader_type *this = malloc( sizeof( *this ) );
+    if( this == NULL || header->magic != TRACE_MAGIC || header->version != TRACE_VERSION ) {
+        free( this );
+        munmap( map, info.st_size );
+        return NULL;
+    }
+
+    posix_madvise( map, info.st_size, POSIX_MADV_SEQUENTIAL );
+    this->map = map;
+    this->size = info.st_size;
+    this->offset = sizeof( struct TraceHeader );
+    *sample_rate = header->sample_rate;
+    return this;
+}
+
+void trace_reader_close( TraceReader this )
+{
+    if( this ) {
+        munmap( (void *) this->map, this->size );
+        free( this );
+    }
+}
+
+const struct TraceRecord *trace_reader_next( TraceReader this, const void **data )
+{
+    if( this->size - this->offset < sizeof( struct TraceRecord ) ) {
+        return NULL;
+    }
+
+    const struct TraceRecord *record = (const struct TraceRecord *) ( this->map + this->offset );
+    size_t follows = 0;
+    *data = record + 1;
+
+    switch( record->type ) {
+        case TRACE_CYCLE:
+        case TRACE_SNAPSHOT:
+        case TRACE_COMMAND:
+        case TRACE_CYCLE_END:
+        case TRACE_GAP:
+            break;
+        case TRACE_TRANSPORT:
+            follows = padded( sizeof( jack_position_t ) );
+            break;
+        case TRACE_CONTROL_INPUT:
+        case TRACE_SHARED_INPUT:
+        case TRACE_LOOP_INPUT:
+            if( record->size <= TRACE_INLINE_BYTES ) {
+                *data = ( (const struct TraceEvent *) record )->data;
+            } else {
+                follows = padded( record->size );
+            }
+            break;
+        case TRACE_LOOPS:
+        case TRACE_TAKE:
+            follows = record->value;
+            break;
+        default:
+            return NULL;
+    }
+
+    if( follows > this->size - this->offset - sizeof( struct TraceRecord ) ) {
+        return NULL;
+    }
+    this->offset += sizeof( struct TraceRecord ) + padded( follows );
+    return record;
+}
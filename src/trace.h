@@ -0,0 +1,213 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <jack/jack.h>
+
+#include "control_action_table.h"
+#include "loop.h"
+#include "midi_message.h"
+
+/* Everything that reaches the engine from outside, cycle by cycle, so that a
+   run can be fed back through the engine without JACK (see replay.c).  The
+   process thread records each cycle's raw MIDI from the control input, the
+   shared input and every loop's input, the commands it ran and when, the
+   transport whenever the quantize grid moved, and what the cycle cost and
+   played, into a ring that a thread of the trace's own appends to the file.
+   The looper adds the loops and mappings whenever they change, and the takes
+   loops were handed rather than recorded.  Files are in the byte order of
+   the machine that wrote them. */
+#define TRACE_VERSION 1
+
+#define TRACE_RING_BYTES ( 4 * 1024 * 1024 )
+
+// How often the trace's thread empties the ring.
+#define TRACE_DRAIN_MS 10
+
+typedef struct trace_type *Trace;
+
+/* ----------------------------------------------------
+   File format
+   ---------------------------------------------------- */
+
+struct TraceHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sample_rate;
+    uint32_t reserved;
+};
+
+enum TraceRecordType {
+    TRACE_CYCLE = 1,        // value is the cycle's frame, id its length.
+    TRACE_SNAPSHOT,         // The cycle has newly published loops, generation id (0 for none).
+    TRACE_TRANSPORT,        // id is the state, and a jack_position_t follows.
+    TRACE_COMMAND,          // arg is an enum EngineCommandType for loop id, to run at frame value.
+    TRACE_CONTROL_INPUT,    // A struct TraceEvent.
+    TRACE_SHARED_INPUT,
+    TRACE_LOOP_INPUT,       // On the input of loop id.
+    TRACE_CYCLE_END,        // id is what it cost in ns, value its output hash, arg set if it shed.
+    TRACE_GAP,              // id cycles were lost to a full ring before the next one.
+    TRACE_LOOPS,            // A struct TraceLoops of value bytes follows.
+    TRACE_TAKE              // A struct TraceTake of value bytes for loop id follows, arg its kind.
+};
+
+/* Every record starts with one of these, and whatever follows is padded out
+   to a multiple of 8 bytes. */
+struct TraceRecord {
+    uint8_t type;
+    uint8_t arg;
+    uint16_t size;
+    uint32_t id;
+    uint64_t value;
+};
+
+// Events this short are carried in the record rather than following it.
+#define TRACE_INLINE_BYTES 4
+
+// An input event's record, the same size as any other.
+struct TraceEvent {
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t size;
+    uint32_t id;
+    uint32_t time; // Into the cycle.
+    uint8_t data[TRACE_INLINE_BYTES];
+};
+
+// Then count TraceLoops and mapping_count TraceMappings, then the names.
+struct TraceLoops {
+    uint32_t count;
+    uint32_t mapping_count;
+};
+
+// In the order they were published in, which is what ties are broken by.
+struct TraceLoop {
+    uint32_t id;
+    uint32_t sync_master; // 0 for none.
+    uint32_t name_offset; // From the start of the names, NUL terminated.
+    int32_t priority;
+    int32_t input_source;
+    int32_t output_target;
+    uint8_t midi_through;
+    uint8_t playback_after_recording;
+    uint8_t quantize;
+    uint8_t reserved[5];
+};
+
+// action is an index into TRACE_ACTIONS.
+struct TraceMapping {
+    uint32_t loop_id;
+    uint8_t channel;
+    uint8_t type;
+    uint8_t value;
+    uint8_t action;
+};
+
+#define TRACE_ACTION_COUNT 5
+
+extern const LoopControlFunc TRACE_ACTIONS[TRACE_ACTION_COUNT];
+
+enum TraceTakeKind {
+    TRACE_TAKE_RESTORED = 0,    // Before the loop was published.
+    TRACE_TAKE_RESTORED_PLAYING,
+    TRACE_TAKE_OFFERED,         // See loop_offer_take.
+    TRACE_TAKE_WITHDRAWN        // The offer before it was turned away.
+};
+
+// Then count packed events.
+struct TraceTake {
+    uint32_t length;
+    uint32_t sync_offset;
+    uint64_t count;
+};
+
+/* ----------------------------------------------------
+   Writing
+   ---------------------------------------------------- */
+
+/* Not RT.  Starts a new trace at path, replacing whatever was there.  The
+   ring is ring_bytes, mlocked; a cycle that doesn't fit is left out whole.
+   Returns NULL on failure. */
+Trace trace_new( const char *path, jack_nframes_t sample_rate, size_t ring_bytes );
+
+// Not RT.  Writes out what's left in the ring and closes the file.
+void trace_free( Trace this );
+
+// The bytes a cycle's records take at most, besides its events.
+size_t trace_cycle_bytes( size_t commands );
+
+// RT.  The bytes the events on a port buffer take.
+size_t trace_port_bytes( void *port_buffer );
+
+/* RT, and only from the process thread.  Starts a cycle, given how many
+   bytes its records take at most.  Returns non-zero, leaving the cycle out,
+   if the ring hasn't room, in which case nothing else may be recorded until
+   the next cycle. */
+int trace_begin_cycle( Trace this, uint64_t frame, jack_nframes_t nframes, size_t bytes );
+void trace_snapshot( Trace this, unsigned int generation );
+void trace_transport( Trace this, jack_transport_state_t state, const jack_position_t *position );
+void trace_port( Trace this, enum TraceRecordType type, unsigned int id, void *port_buffer );
+void trace_command( Trace this, unsigned int loop_id, int type, uint64_t frame );
+void trace_end_cycle( Trace this, uint64_t ns, uint64_t output_hash, int shed );
+
+/* RT.  Adds what's on the port to a cycle's output hash, the sum over every
+   port of an FNV-1a hash seeded with id, so the order the ports are hashed
+   in doesn't matter but the order of the events on each does. */
+uint64_t trace_hash_port( uint64_t hash, unsigned int id, void *port_buffer );
+
+// Not RT.  The loops, in the order they're published in, and their mappings in table.
+void trace_log_loops( Trace this, Loop *loops, int count, ControlActionTable table );
+
+// Not RT.  A take the loop was handed.  events is ignored for TRACE_TAKE_WITHDRAWN.
+void trace_log_take(
+    Trace this,
+    unsigned int loop_id,
+    const struct PackedMidiMessage *events,
+    size_t count,
+    const struct LoopTake *take,
+    enum TraceTakeKind kind
+);
+
+struct TraceStats {
+    uint64_t cycles;
+    uint64_t dropped; // Cycles left out.
+    uint64_t bytes;
+};
+
+void trace_get_stats( Trace this, struct TraceStats *stats );
+
+/* ----------------------------------------------------
+   Reading
+   ---------------------------------------------------- */
+
+typedef struct trace_reader_type *TraceReader;
+
+// Not RT.  Maps the trace at path.  Returns NULL if it can't be read.
+TraceReader trace_reader_open( const char *path, jack_nframes_t *sample_rate );
+void trace_reader_close( TraceReader this );
+
+/* The next record, with *data pointing at whatever follows it (or at the
+   event inside it, for a short one), or NULL at the end of the trace or
+   where it was cut short. */
+const struct TraceRecord *trace_reader_next( TraceReader this, const void **data );
+
+#endif
@@ -0,0 +1,155 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#include "transport_grid.h"
+
+#include <jack/jack.h>
+
+void transport_grid_init( struct TransportGrid *grid )
+{
+    grid->valid = 0;
+    grid->bar_frame = 0;
+    grid->frames_per_beat = 0;
+    grid->beats_per_bar = 0;
+    grid->ticks_per_beat = 0;
+    grid->next_transport_frame = 0;
+    grid->beats_per_minute = 0;
+}
+
+// Nearest whole frame, without pulling in libm.
+static int64_t round_frames( double frames )
+{
+    return frames < 0 ? -(int64_t) ( -frames + 0.5 ) : (int64_t) ( frames + 0.5 );
+}
+
+int transport_grid_update(
+        struct TransportGrid *grid,
+        jack_client_t *jack_client,
+        jack_nframes_t nframes,
+        uint64_t cycle_frame
+    ) {
+
+    jack_position_t position;
+    jack_transport_state_t state = jack_transport_query( jack_client, &position );
+
+    if(
+        state != JackTransportRolling
+        || !( position.valid & JackPositionBBT )
+        || position.beats_per_minute <= 0
+        || position.beats_per_bar <= 0
+        || position.ticks_per_beat <= 0
+        || position.frame_rate == 0
+    ) {
+        int lost = grid->valid;
+        grid->valid = 0;
+        return lost;
+    }
+
+    int unchanged =
+        grid->valid
+        && position.frame == grid->next_transport_frame
+        && position.beats_per_minute == grid->beats_per_minute
+        && position.beats_per_bar == grid->beats_per_bar
+        && position.ticks_per_beat == grid->ticks_per_beat;
+
+    grid->next_transport_frame = position.frame + nframes;
+    if( unchanged ) {
+        return 0;
+    }
+
+    // The BBT fields may describe a frame a little way into the cycle.
+    jack_nframes_t bbt_offset = ( position.valid & JackBBTFrameOffset ) ? position.bbt_offset : 0;
+
+    grid->frames_per_beat = position.frame_rate * 60.0 / position.beats_per_minute;
+    grid->beats_per_bar = position.beats_per_bar;
+    grid->ticks_per_beat = position.ticks_per_beat;
+    grid->beats_per_minute = position.beats_per_minute;
+
+    double beats_into_bar = ( position.beat - 1 ) + position.tick / position.ticks_per_beat;
+    grid->bar_frame = cycle_frame + bbt_offset - round_frames( beats_into_bar * grid->frames_per_beat );
+    grid->valid = 1;
+    return 1;
+}
+
+uint64_t transport_grid_snap(
+        const struct TransportGrid *grid,
+        enum TransportQuantize quantize,
+        uint64_t frame
+    ) {
+
+    double unit;
+    switch( quantize ) {
+        case QUANTIZE_BAR: unit = grid->frames_per_beat * grid->beats_per_bar; break;
+        case QUANTIZE_BEAT: unit = grid->frames_per_beat; break;
+        case QUANTIZE_TICK: unit = grid->frames_per_beat / grid->ticks_per_beat; break;
+        default: return frame;
+    }
+
+    if( !grid->valid || unit < 1.0 ) {
+        return frame;
+    }
+
+    // Signed, since the bar line can be after frame (or before frame 0).
+    int64_t since = (int64_t) ( frame - grid->bar_frame );
+
+    double points = since / unit;
+    int64_t point = (int64_t) points;
+    if( point < points ) {
+        point++;
+    }
+
+    // Each point is rounded on its own, so make sure it's the first one at or after frame.
+    if( round_frames( ( point - 1 ) * unit ) >= since ) {
+        point--;
+    } else if( round_frames( point * unit ) < since ) {
+        point++;
+    }
+
+    return grid->bar_frame + round_frames( point * unit );
+}
+
+int transport_grid_last_bar(
+        const struct TransportGrid *grid,
+        uint64_t frame,
+        uint64_t *start,
+        uint64_t *end
+    ) {
+
+    double unit = grid->frames_per_beat * grid->beats_per_bar;
+    if( !grid->valid || unit < 1.0 ) {
+        return -1;
+    }
+
+    int64_t since = (int64_t) ( frame - grid->bar_frame );
+
+    double bars = since / unit;
+    int64_t bar = (int64_t) bars;
+    if( bar > bars ) {
+        bar--;
+    }
+
+    // Each bar line is rounded on its own, so make sure it's the last one at or before frame.
+    if( round_frames( ( bar + 1 ) * unit ) <= since ) {
+        bar++;
+    } else if( round_frames( bar * unit ) > since ) {
+        bar--;
+    }
+
+    *start = grid->bar_frame + round_frames( ( bar - 1 ) * unit );
+    *end = grid->bar_frame + round_frames( bar * unit );
+    return 0;
+}
@@ -0,0 +1,79 @@
+/* JACK MIDI LOOPER
+   Copyright (C) 2014  Joshua Otto
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA. */
+
+#ifndef TRANSPORT_GRID_H
+#define TRANSPORT_GRID_H
+
+#include <stdint.h>
+
+#include <jack/jack.h>
+
+// What a loop's state changes get snapped to.
+enum TransportQuantize {
+    QUANTIZE_OFF = 0,
+    QUANTIZE_BAR,
+    QUANTIZE_BEAT,
+    QUANTIZE_TICK,
+    QUANTIZE_COUNT
+};
+
+/* Bar lines in terms of the engine's 64-bit frame clock, taken from the JACK
+   transport's BBT.  Ticks are only whole numbers, so rather than re-reading
+   the phase every cycle (which jitters), the grid is latched and only moves
+   when the transport relocates or the tempo or meter changes.  Grid points
+   are then all rounded from the same bar line, so they never drift. */
+struct TransportGrid {
+    int valid; // Only while the transport is rolling and has BBT.
+    uint64_t bar_frame; // Some bar line, possibly in the past.
+    double frames_per_beat;
+    double beats_per_bar;
+    double ticks_per_beat;
+
+    // Where the transport should be next cycle if nothing has changed.
+    jack_nframes_t next_transport_frame;
+    double beats_per_minute;
+};
+
+void transport_grid_init( struct TransportGrid *grid );
+
+/* RT, once per cycle.  Returns non-zero if the grid was read afresh from
+   the transport, or lost, rather than carrying on as it was. */
+int transport_grid_update(
+    struct TransportGrid *grid,
+    jack_client_t *jack_client,
+    jack_nframes_t nframes,
+    uint64_t cycle_frame
+);
+
+/* RT.  The first grid point at or after frame, or frame itself when the grid
+   isn't valid or quantize is QUANTIZE_OFF. */
+uint64_t transport_grid_snap(
+    const struct TransportGrid *grid,
+    enum TransportQuantize quantize,
+    uint64_t frame
+);
+
+/* RT.  The last whole bar to end at or before frame, as [*start, *end).
+   Returns non-zero, leaving them alone, when the grid isn't valid. */
+int transport_grid_last_bar(
+    const struct TransportGrid *grid,
+    uint64_t frame,
+    uint64_t *start,
+    uint64_t *end
+);
+
+#endif